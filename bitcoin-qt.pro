@@ -102,6 +102,8 @@ HEADERS += src/qt/bitcoingui.h \
     src/qt/editaddressdialog.h \
     src/qt/bitcoinaddressvalidator.h \
     src/addrman.h \
+    src/banlist.h \
+    src/bloom.h \
     src/base58.h \
     src/bignum.h \
     src/checkpoints.h \
@@ -115,6 +117,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/key.h \
     src/db.h \
     src/script.h \
+    src/secp256k1.h \
     src/noui.h \
     src/init.h \
     src/headers.h \
@@ -171,12 +174,15 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/netbase.cpp \
     src/key.cpp \
     src/script.cpp \
+    src/secp256k1.cpp \
     src/main.cpp \
     src/init.cpp \
     src/net.cpp \
     src/irc.cpp \
     src/checkpoints.cpp \
     src/addrman.cpp \
+    src/banlist.cpp \
+    src/bloom.cpp \
     src/db.cpp \
     src/json/json_spirit_writer.cpp \
     src/json/json_spirit_value.cpp \
@@ -0,0 +1,250 @@
+#!/usr/bin/python
+#
+# Copyright (c) 2012 The Bitcoin developers
+# Distributed under the MIT/X11 software license, see the accompanying
+# file license.txt or http://www.opensource.org/licenses/mit-license.php.
+#
+# Relay simulation: starts several -regtest bitcoind processes connected over
+# loopback, injects transactions and blocks, and measures how long they take
+# to reach every node and how many bytes the nodes sent doing it.
+#
+
+import base64
+import json
+import optparse
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+try:
+	import httplib
+except ImportError:
+	import http.client as httplib
+
+RPCUSER = 'relaysim'
+RPCPASS = 'relaysim'
+POLL_INTERVAL = 0.005
+TIMEOUT = 60
+
+# Blocks 1..121 fund node 0: coinbases mature 120 blocks deep
+SETUP_BLOCKS = 121
+
+class RPCError(Exception):
+	pass
+
+class BitcoinRPC:
+	OBJID = 1
+
+	def __init__(self, port):
+		self.port = port
+		self.authhdr = "Basic %s" % base64.b64encode(("%s:%s" % (RPCUSER, RPCPASS)).encode()).decode()
+		self.conn = None
+
+	def rpc(self, method, params=[]):
+		self.OBJID += 1
+		obj = { 'version' : '1.1',
+			'method' : method,
+			'params' : params,
+			'id' : self.OBJID }
+		if self.conn is None:
+			self.conn = httplib.HTTPConnection('127.0.0.1', self.port, timeout=TIMEOUT)
+		try:
+			self.conn.request('POST', '/', json.dumps(obj),
+				{ 'Authorization' : self.authhdr,
+				  'Content-type' : 'application/json' })
+			resp_obj = json.loads(self.conn.getresponse().read())
+		except Exception:
+			self.conn.close()
+			self.conn = None
+			raise
+		if resp_obj.get('error') is not None:
+			raise RPCError("%s: %s" % (method, resp_obj['error']))
+		return resp_obj['result']
+
+class Node:
+	def __init__(self, n, options):
+		self.n = n
+		self.port = options.port + n
+		self.rpcport = options.port + 1000 + n
+		self.datadir = os.path.join(options.basedir, "node%d" % n)
+		self.process = None
+		self.rpc = BitcoinRPC(self.rpcport)
+
+	def start(self, options, vConnect):
+		os.makedirs(self.datadir)
+		args = [options.bitcoind, '-regtest', '-datadir=' + self.datadir,
+			'-port=%d' % self.port, '-rpcport=%d' % self.rpcport,
+			'-rpcuser=' + RPCUSER, '-rpcpassword=' + RPCPASS, '-keypool=10']
+		for node in vConnect:
+			args.append('-connect=127.0.0.1:%d' % node.port)
+		devnull = open(os.devnull, 'w')
+		self.process = subprocess.Popen(args, stdout=devnull, stderr=devnull)
+
+	def wait_for_rpc(self):
+		deadline = time.time() + TIMEOUT
+		while True:
+			try:
+				return self.rpc.rpc('getblockcount')
+			except (RPCError, IOError, OSError, httplib.HTTPException):
+				if time.time() > deadline:
+					raise
+				time.sleep(0.1)
+
+	def stop(self):
+		if self.process is None:
+			return
+		try:
+			self.rpc.rpc('stop')
+		except Exception:
+			pass
+		deadline = time.time() + TIMEOUT
+		while self.process.poll() is None and time.time() < deadline:
+			time.sleep(0.1)
+		if self.process.poll() is None:
+			self.process.kill()
+		self.process = None
+
+	# Total bytes this node has sent, by message command
+	def bytes_sent(self):
+		total = {}
+		for peer in self.rpc.rpc('getpeerinfo'):
+			for (command, n) in peer['bytessent_per_msg'].items():
+				total[command] = total.get(command, 0) + n
+		return total
+
+# Outbound connections for each node: node i connects to the nodes it lists
+def topology(name, n):
+	if name == 'ring' and n > 2:
+		return [[(i - 1) % n] for i in range(n)]
+	if name in ('line', 'ring'):
+		return [[i - 1] if i > 0 else [] for i in range(n)]
+	if name == 'star':
+		return [[0] if i > 0 else [] for i in range(n)]
+	if name == 'mesh':
+		return [list(range(i)) for i in range(n)]
+	raise ValueError("unknown topology %s" % name)
+
+def wait_until(f):
+	deadline = time.time() + TIMEOUT
+	while not f():
+		if time.time() > deadline:
+			raise RuntimeError("timed out")
+		time.sleep(POLL_INTERVAL)
+
+# Polls every node until has(node) is true for all of them and returns each
+# node's delay in milliseconds after tStart
+def propagation(nodes, tStart, has):
+	latency = {}
+	deadline = tStart + TIMEOUT
+	while len(latency) < len(nodes):
+		for node in nodes:
+			if node.n not in latency and has(node):
+				latency[node.n] = (time.time() - tStart) * 1000
+		if time.time() > deadline:
+			raise RuntimeError("propagation timed out, reached %d of %d nodes" % (len(latency), len(nodes)))
+		time.sleep(POLL_INTERVAL)
+	return [latency[node.n] for node in nodes]
+
+def summarize(values):
+	values = sorted(values)
+	if not values:
+		return {}
+	mid = len(values) // 2
+	median = values[mid] if len(values) % 2 else (values[mid - 1] + values[mid]) / 2.0
+	return { 'min' : round(values[0], 1), 'median' : round(median, 1), 'max' : round(values[-1], 1) }
+
+def bytes_delta(nodes, before):
+	delta = {}
+	for node in nodes:
+		for (command, n) in node.bytes_sent().items():
+			d = n - before[node.n].get(command, 0)
+			if d:
+				delta[command] = delta.get(command, 0) + d
+	delta['total'] = sum(delta.values())
+	return delta
+
+def run(options):
+	rng = random.Random(options.seed)
+	nodes = [Node(i, options) for i in range(options.nodes)]
+	vvConnect = topology(options.topology, options.nodes)
+	try:
+		for node in nodes:
+			node.start(options, [nodes[j] for j in vvConnect[node.n]])
+		for node in nodes:
+			node.wait_for_rpc()
+
+		# Every link is counted by the nodes at both ends
+		nLinks = sum(len(v) for v in vvConnect)
+		wait_until(lambda: sum(node.rpc.rpc('getconnectioncount') for node in nodes) >= 2 * nLinks)
+
+		nodes[0].rpc.rpc('generate', [SETUP_BLOCKS])
+		wait_until(lambda: all(node.rpc.rpc('getblockcount') >= SETUP_BLOCKS for node in nodes))
+		addresses = [node.rpc.rpc('getnewaddress') for node in nodes]
+
+		result = { 'nodes' : options.nodes, 'topology' : options.topology, 'seed' : options.seed }
+
+		# Transactions are sent from node 0, the only one with coins, one at
+		# a time to a random node's address
+		before = dict((node.n, node.bytes_sent()) for node in nodes)
+		vLatency = []
+		for i in range(options.txs):
+			address = addresses[rng.randrange(options.nodes)]
+			txid = nodes[0].rpc.rpc('sendtoaddress', [address, 0.01 * rng.randint(1, 100)])
+			vNode = propagation(nodes, time.time(), lambda node: txid in node.rpc.rpc('getrawmempool'))
+			vLatency.append(max(vNode))
+		result['tx'] = { 'count' : options.txs, 'latency_ms' : summarize(vLatency),
+			'bytes_sent' : bytes_delta(nodes, before) }
+
+		# Blocks are mined one at a time by a random node.  The first one
+		# carries the transactions sent above.
+		before = dict((node.n, node.bytes_sent()) for node in nodes)
+		vLatency = []
+		for i in range(options.blocks):
+			miner = nodes[rng.randrange(options.nodes)]
+			hash = miner.rpc.rpc('generate', [1])[0]
+			height = SETUP_BLOCKS + i + 1
+			def has(node):
+				return node.rpc.rpc('getblockcount') >= height and node.rpc.rpc('getblockhash', [height]) == hash
+			vNode = propagation(nodes, time.time(), has)
+			vLatency.append(max(vNode))
+		result['block'] = { 'count' : options.blocks, 'latency_ms' : summarize(vLatency),
+			'bytes_sent' : bytes_delta(nodes, before) }
+		return result
+	finally:
+		for node in nodes:
+			node.stop()
+
+def main():
+	parser = optparse.OptionParser(usage="%prog [options]")
+	parser.add_option('--bitcoind', default=os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', '..', 'src', 'bitcoind'),
+		help="bitcoind binary (default: src/bitcoind)")
+	parser.add_option('--nodes', type='int', default=5, help="number of nodes (default: 5)")
+	parser.add_option('--topology', default='line', choices=['line', 'ring', 'star', 'mesh'],
+		help="line, ring, star or mesh (default: line)")
+	parser.add_option('--txs', type='int', default=20, help="transactions to relay (default: 20)")
+	parser.add_option('--blocks', type='int', default=10, help="blocks to relay (default: 10)")
+	parser.add_option('--seed', type='int', default=1, help="seed for choosing senders and miners (default: 1)")
+	parser.add_option('--port', type='int', default=19400,
+		help="first P2P port, RPC ports start 1000 higher (default: 19400)")
+	parser.add_option('--basedir', help="directory for the nodes' data directories (default: a temporary one)")
+	parser.add_option('--keep', action='store_true', help="keep the data directories")
+	(options, args) = parser.parse_args()
+	if options.nodes < 2:
+		parser.error("need at least 2 nodes")
+
+	if options.basedir is None:
+		options.basedir = tempfile.mkdtemp(prefix='relaysim')
+	try:
+		result = run(options)
+	finally:
+		if not options.keep:
+			shutil.rmtree(options.basedir, True)
+	json.dump(result, sys.stdout, indent=4, sort_keys=True)
+	sys.stdout.write("\n")
+
+if __name__ == '__main__':
+	main()
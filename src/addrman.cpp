@@ -74,6 +74,12 @@ double CAddrInfo::GetChance(int64 nNow) const
     for (int n=0; n<nAttempts; n++)
         fChance /= 1.5;
 
+    // deprioritize nodes known to be slow, down to 25% at one second;
+    // unmeasured ones are treated like fast ones
+    int nLatency = GetLatency();
+    if (nLatency > 250)
+        fChance *= std::max(0.25, 250.0 / nLatency);
+
     return fChance;
 }
 
@@ -504,3 +510,24 @@ void CAddrMan::Connected_(const CService &addr, int64 nTime)
     if (nTime - info.nTime > nUpdateInterval)
         info.nTime = nTime;
 }
+
+void CAddrMan::UpdateLatency_(const CService &addr, int nConnectTime, int nPingTime)
+{
+    CAddrInfo *pinfo = Find(addr);
+
+    // if not found, bail out
+    if (!pinfo)
+        return;
+
+    CAddrInfo &info = *pinfo;
+
+    // check whether we are talking about the exact same CService (including same port)
+    if (info != addr)
+        return;
+
+    // exponential moving average, so one slow sample doesn't condemn a node
+    if (nConnectTime > 0)
+        info.nConnectTime = info.nConnectTime ? (3 * info.nConnectTime + nConnectTime) / 4 : nConnectTime;
+    if (nPingTime > 0)
+        info.nPingTime = info.nPingTime ? (3 * info.nPingTime + nPingTime) / 4 : nPingTime;
+}
@@ -31,6 +31,10 @@ private:
     // connection attempts since last succesful attempt
     int nAttempts;
 
+    // smoothed TCP connect time and ping round trip, in milliseconds (0 = never measured)
+    int nConnectTime;
+    int nPingTime;
+
     // reference count in new sets (memory only)
     int nRefCount;
 
@@ -44,12 +48,18 @@ private:
 
 public:
 
+    // nVersion is the CAddrMan format version here, see CAddrMan's serialization
     IMPLEMENT_SERIALIZE(
         CAddress* pthis = (CAddress*)(this);
         READWRITE(*pthis);
         READWRITE(source);
         READWRITE(nLastSuccess);
         READWRITE(nAttempts);
+        if (nVersion >= 1)
+        {
+            READWRITE(nConnectTime);
+            READWRITE(nPingTime);
+        }
     )
 
     void Init()
@@ -57,6 +67,8 @@ public:
         nLastSuccess = 0;
         nLastTry = 0;
         nAttempts = 0;
+        nConnectTime = 0;
+        nPingTime = 0;
         nRefCount = 0;
         fInTried = false;
         nRandomPos = -1;
@@ -87,6 +99,12 @@ public:
     // Determine whether the statistics about this entry are bad enough so that it can just be deleted
     bool IsTerrible(int64 nNow = GetAdjustedTime()) const;
 
+    // Best estimate of the round trip time to this node in milliseconds, 0 if unknown
+    int GetLatency() const
+    {
+        return nPingTime ? nPingTime : nConnectTime;
+    }
+
     // Calculate the relative chance this entry should be given when selecting nodes to connect to
     double GetChance(int64 nNow = GetAdjustedTime()) const;
 
@@ -95,8 +113,8 @@ public:
 // Stochastic address manager
 //
 // Design goals:
-//  * Only keep a limited number of addresses around, so that addr.dat and memory requirements do not grow without bound.
-//  * Keep the address tables in-memory, and asynchronously dump the entire to able in addr.dat.
+//  * Only keep a limited number of addresses around, so that peers.dat and memory requirements do not grow without bound.
+//  * Keep the address tables in-memory, and asynchronously dump the entire to able in peers.dat.
 //  * Make sure no (localized) attacker can fill the entire table with his nodes/addresses.
 //
 // To that end:
@@ -117,6 +135,8 @@ public:
 //      be observable by adversaries.
 //    * Several indexes are kept for high performance. Defining DEBUG_ADDRMAN will introduce frequent (and expensive)
 //      consistency checks for the entire datastructure.
+//  * Measured latency only ever lowers an entry's chance (to at most a quarter, for very slow nodes) after
+//    its bucket has been picked, so fast nodes can't be used to crowd out others beyond what the buckets allow.
 
 // total number of buckets for tried addresses
 #define ADDRMAN_TRIED_BUCKET_COUNT 64
@@ -242,12 +262,15 @@ protected:
     // Mark an entry as currently-connected-to.
     void Connected_(const CService &addr, int64 nTime);
 
+    // Fold in a latency measurement.
+    void UpdateLatency_(const CService &addr, int nConnectTime, int nPingTime);
+
 public:
 
     IMPLEMENT_SERIALIZE
     (({
         // serialized format:
-        // * version byte (currently 0)
+        // * version byte (currently 1, 0 lacks the latency fields in each addrinfo)
         // * nKey
         // * nNew
         // * nTried
@@ -268,7 +291,7 @@ public:
         // changes to the ADDRMAN_ parameters without breaking the on-disk structure.
         CRITICAL_BLOCK(cs)
         {
-            unsigned char nVersion = 0;
+            unsigned char nVersion = 1;
             READWRITE(nVersion);
             READWRITE(nKey);
             READWRITE(nNew);
@@ -495,6 +518,17 @@ public:
             Check();
         }
     }
+
+    // Record a TCP connect time and/or ping round trip in milliseconds (0 = no sample).
+    void UpdateLatency(const CService &addr, int nConnectTime, int nPingTime)
+    {
+        CRITICAL_BLOCK(cs)
+        {
+            Check();
+            UpdateLatency_(addr, nConnectTime, nPingTime);
+            Check();
+        }
+    }
 };
 
 #endif
@@ -0,0 +1,128 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+#include "banlist.h"
+
+using namespace std;
+
+CBanList::CBanList() : vTrie(1)
+{
+    fDirty = false;
+}
+
+void CBanList::Insert_(const CSubNet& subnet, int64 nBanUntil)
+{
+    int nNode = 0;
+    for (int n = 0; n < subnet.GetPrefixLength(); n++)
+    {
+        int nBit = subnet.GetBit(n);
+        if (vTrie[nNode].vChild[nBit] == 0)
+        {
+            vTrie[nNode].vChild[nBit] = vTrie.size();
+            vTrie.push_back(CTrieNode());
+        }
+        nNode = vTrie[nNode].vChild[nBit];
+    }
+    vTrie[nNode].nBanUntil = max(vTrie[nNode].nBanUntil, nBanUntil);
+}
+
+void CBanList::Rebuild_()
+{
+    vTrie.assign(1, CTrieNode());
+    for (map<CSubNet, CBanEntry>::iterator mi = mapBanned.begin(); mi != mapBanned.end(); ++mi)
+        Insert_((*mi).first, (*mi).second.nBanUntil);
+}
+
+void CBanList::Ban(const CSubNet& subnet, int64 nBanUntil, int64 nNow)
+{
+    if (!subnet.IsValid())
+        return;
+    CRITICAL_BLOCK(cs)
+    {
+        CBanEntry& entry = mapBanned[subnet];
+        if (entry.nCreateTime == 0)
+            entry.nCreateTime = nNow;
+        if (entry.nBanUntil < nBanUntil)
+        {
+            entry.nBanUntil = nBanUntil;
+            Insert_(subnet, nBanUntil);
+            fDirty = true;
+        }
+    }
+}
+
+bool CBanList::Unban(const CSubNet& subnet)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        if (!mapBanned.erase(subnet))
+            return false;
+        Rebuild_();
+        fDirty = true;
+    }
+    return true;
+}
+
+bool CBanList::IsBanned(const CNetAddr& addr, int64 nNow) const
+{
+    if (!addr.IsValid())
+        return false;
+    CSubNet subnetAddr(addr);
+    CRITICAL_BLOCK(cs)
+    {
+        int nNode = 0;
+        for (int n = 0; ; n++)
+        {
+            if (vTrie[nNode].nBanUntil > nNow)
+                return true;
+            if (n == 128)
+                break;
+            nNode = vTrie[nNode].vChild[subnetAddr.GetBit(n)];
+            if (nNode == 0)
+                break;
+        }
+    }
+    return false;
+}
+
+void CBanList::GetBanned(map<CSubNet, CBanEntry>& mapRet) const
+{
+    CRITICAL_BLOCK(cs)
+        mapRet = mapBanned;
+}
+
+void CBanList::Clear()
+{
+    CRITICAL_BLOCK(cs)
+    {
+        mapBanned.clear();
+        vTrie.assign(1, CTrieNode());
+        fDirty = true;
+    }
+}
+
+int CBanList::SweepExpired(int64 nNow)
+{
+    int nErased = 0;
+    CRITICAL_BLOCK(cs)
+    {
+        map<CSubNet, CBanEntry>::iterator mi = mapBanned.begin();
+        while (mi != mapBanned.end())
+        {
+            if ((*mi).second.nBanUntil <= nNow)
+            {
+                mapBanned.erase(mi++);
+                nErased++;
+            }
+            else
+                mi++;
+        }
+        if (nErased > 0)
+        {
+            Rebuild_();
+            fDirty = true;
+        }
+    }
+    return nErased;
+}
@@ -0,0 +1,101 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BANLIST_H
+#define BITCOIN_BANLIST_H
+
+#include <map>
+#include <vector>
+
+#include "netbase.h"
+#include "serialize.h"
+#include "util.h"
+
+/** One banned subnet */
+class CBanEntry
+{
+public:
+    int64 nCreateTime;
+    int64 nBanUntil;
+
+    CBanEntry()
+    {
+        nCreateTime = 0;
+        nBanUntil = 0;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nCreateTime);
+        READWRITE(nBanUntil);
+    )
+};
+
+/** The set of banned subnets.
+ *
+ * Besides the map used for listing and saving, the bans are kept in a binary
+ * trie on the address bits, where the node at the end of each banned prefix
+ * holds its ban time.  Checking an address walks at most one node per bit of
+ * the longest banned prefix, however many ranges are banned.  Unbanning is
+ * rare, so it just rebuilds the trie.
+ */
+class CBanList
+{
+private:
+    class CTrieNode
+    {
+    public:
+        int vChild[2]; // indexes into vTrie, 0 for none
+        int64 nBanUntil; // 0 if no banned prefix ends here
+
+        CTrieNode()
+        {
+            vChild[0] = vChild[1] = 0;
+            nBanUntil = 0;
+        }
+    };
+
+    std::map<CSubNet, CBanEntry> mapBanned;
+    std::vector<CTrieNode> vTrie; // vTrie[0] is the root
+    bool fDirty; // changed since the last save
+    mutable CCriticalSection cs;
+
+    void Insert_(const CSubNet& subnet, int64 nBanUntil);
+    void Rebuild_();
+
+public:
+    CBanList();
+
+    // Ban until nBanUntil, or longer if it's already banned for longer
+    void Ban(const CSubNet& subnet, int64 nBanUntil, int64 nNow);
+    bool Unban(const CSubNet& subnet);
+    bool IsBanned(const CNetAddr& addr, int64 nNow) const;
+    void GetBanned(std::map<CSubNet, CBanEntry>& mapRet) const;
+    void Clear();
+
+    // Forget bans that have run out, returns how many
+    int SweepExpired(int64 nNow);
+
+    int size() const
+    {
+        int nSize = 0;
+        CRITICAL_BLOCK(cs)
+            nSize = mapBanned.size();
+        return nSize;
+    }
+
+    bool IsDirty() const { return fDirty; }
+    void SetDirty(bool fDirtyIn) { fDirty = fDirtyIn; }
+
+    IMPLEMENT_SERIALIZE
+    (
+        CRITICAL_BLOCK(cs)
+        {
+            READWRITE(mapBanned);
+            if (fRead)
+                const_cast<CBanList*>(this)->Rebuild_();
+        }
+    )
+};
+
+#endif
@@ -0,0 +1,74 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+#include <algorithm>
+#include <map>
+
+#include "bench.h"
+
+using namespace std;
+
+// Function-local so registrars in other files can run first
+static map<string, BenchFunction>& Benchmarks()
+{
+    static map<string, BenchFunction> mapBenchmarks;
+    return mapBenchmarks;
+}
+
+CBenchRegistrar::CBenchRegistrar(const char* pszName, BenchFunction fn)
+{
+    Benchmarks()[pszName] = fn;
+}
+
+CBenchState::CBenchState(int nSamplesIn, int64 nSampleUsecIn)
+{
+    nSamples = nSamplesIn;
+    nSampleUsec = nSampleUsecIn;
+    nIterations = 1;
+    nLeft = 0;
+    nSampleStart = 0;
+    fCalibrated = false;
+}
+
+bool CBenchState::NextSample()
+{
+    int64 nNow = GetTimeMicros();
+    if (nSampleStart != 0)
+    {
+        int64 nElapsed = nNow - nSampleStart;
+        if (!fCalibrated && nElapsed < nSampleUsec && nIterations < (1 << 30))
+            nIterations *= 2;
+        else
+        {
+            fCalibrated = true;
+            vSamples.push_back((double)nElapsed / nIterations);
+            if (vSamples.size() >= nSamples)
+                return false;
+        }
+    }
+    nLeft = nIterations - 1;
+    nSampleStart = GetTimeMicros();
+    return true;
+}
+
+void RunBenchmarks(const string& strFilter, int nSamples, int64 nSampleUsec)
+{
+    fprintf(stdout, "%-32s %12s %12s %12s %12s\n", "# benchmark", "iterations", "min(us)", "median(us)", "max(us)");
+    for (map<string, BenchFunction>::iterator mi = Benchmarks().begin(); mi != Benchmarks().end(); ++mi)
+    {
+        if ((*mi).first.find(strFilter) == string::npos)
+            continue;
+
+        CBenchState state(nSamples, nSampleUsec);
+        (*mi).second(state);
+        if (state.vSamples.empty())
+            continue;
+
+        vector<double>& v = state.vSamples;
+        sort(v.begin(), v.end());
+        double dMedian = v.size() % 2 ? v[v.size() / 2] : (v[v.size() / 2 - 1] + v[v.size() / 2]) / 2;
+        fprintf(stdout, "%-32s %12"PRI64d" %12.3f %12.3f %12.3f\n", (*mi).first.c_str(),
+                state.GetIterations() * (int64)v.size(), v.front(), dMedian, v.back());
+        fflush(stdout);
+    }
+}
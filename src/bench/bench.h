@@ -0,0 +1,71 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BENCH_H
+#define BITCOIN_BENCH_H
+
+#include <string>
+#include <vector>
+
+#include "util.h"
+
+/** Timing state handed to a benchmark function, which runs its body while
+ * KeepRunning() returns true:
+ *
+ *     static void Bench_Hash(CBenchState& state)
+ *     {
+ *         ... setup, not timed ...
+ *         while (state.KeepRunning())
+ *             Hash(vch.begin(), vch.end());
+ *     }
+ *     BENCHMARK(Bench_Hash);
+ *
+ * The body runs in samples of a fixed number of iterations.  The number is
+ * doubled until a sample takes at least nSampleUsec, then nSamples samples
+ * are taken, so the clock is only read once per sample.
+ */
+class CBenchState
+{
+private:
+    int nSamples;
+    int64 nSampleUsec;
+    int64 nIterations; // per sample
+    int64 nLeft;       // left in the current sample
+    int64 nSampleStart;
+    bool fCalibrated;
+
+public:
+    std::vector<double> vSamples; // microseconds per iteration
+
+    CBenchState(int nSamplesIn, int64 nSampleUsecIn);
+
+    bool KeepRunning()
+    {
+        if (nLeft > 0)
+        {
+            nLeft--;
+            return true;
+        }
+        return NextSample();
+    }
+
+    bool NextSample();
+    int64 GetIterations() const { return nIterations; }
+};
+
+typedef void (*BenchFunction)(CBenchState&);
+
+/** Registers a benchmark at static initialization time */
+class CBenchRegistrar
+{
+public:
+    CBenchRegistrar(const char* pszName, BenchFunction fn);
+};
+
+#define BENCHMARK(fn) static CBenchRegistrar registrar_##fn(#fn, fn)
+
+// Runs each registered benchmark whose name contains strFilter and prints
+// the min, median and max time per iteration
+void RunBenchmarks(const std::string& strFilter, int nSamples, int64 nSampleUsec);
+
+#endif
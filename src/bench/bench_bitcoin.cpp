@@ -0,0 +1,36 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Microbenchmarks of the hot primitives.
+//
+// bench_bitcoin [-filter=<substring>] [-samples=<n>] [-sampletime=<ms>]
+//
+#include "headers.h"
+#include "bench.h"
+
+using namespace std;
+
+CWallet* pwalletMain = NULL;
+
+void Shutdown(void* parg)
+{
+    exit(0);
+}
+
+int main(int argc, char* argv[])
+{
+    ParseParameters(argc, argv);
+    if (mapArgs.count("-?") || mapArgs.count("--help"))
+    {
+        fprintf(stderr, "Usage: bench_bitcoin [-filter=<substring>] [-samples=<n>] [-sampletime=<ms>]\n");
+        return 1;
+    }
+    fPrintToConsole = GetBoolArg("-printtoconsole");
+
+    int nSamples = max((int)GetArg("-samples", 10), 1);
+    int64 nSampleUsec = max(GetArg("-sampletime", 20), (int64)1) * 1000;
+    RunBenchmarks(GetArg("-filter", ""), nSamples, nSampleUsec);
+    return 0;
+}
@@ -0,0 +1,68 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+#include "headers.h"
+#include "bench.h"
+
+using namespace std;
+
+// A wallet holding nCoins coins of assorted values, each received in its own
+// transaction with six confirmations.  The coins claim to be in a block
+// that is linked into a fake two block chain, which is taken down again at
+// the end of the benchmark.
+static void SelectCoinsFromWallet(CBenchState& state, int nCoins)
+{
+    uint256 hashCoinsBlock(0xc0175);
+    CBlockIndex indexCoins;
+    CBlockIndex indexTip;
+    indexCoins.phashBlock = &hashCoinsBlock;
+    indexCoins.nHeight = 0;
+    indexCoins.pnext = &indexTip;
+    indexTip.pprev = &indexCoins;
+    indexTip.nHeight = 5;
+    CBlockIndex* pindexBestSave = pindexBest;
+    mapBlockIndex[hashCoinsBlock] = &indexCoins;
+    pindexBest = &indexTip;
+
+    CWallet wallet;
+    vector<CScript> vScripts(10);
+    for (int i = 0; i < vScripts.size(); i++)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        wallet.AddKey(key);
+        vScripts[i].SetBitcoinAddress(key.GetPubKey());
+    }
+
+    for (int i = 0; i < nCoins; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(uint256(i + 1), 0);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = (i % 50 + 1) * CENT + (i % 7) * COIN;
+        tx.vout[0].scriptPubKey = vScripts[i % vScripts.size()];
+
+        CWalletTx wtx(&wallet, tx);
+        wtx.hashBlock = hashCoinsBlock;
+        wtx.nIndex = 0;
+        wtx.fMerkleVerified = true;
+        wallet.mapWallet[wtx.GetHash()] = wtx;
+    }
+
+    // Small enough to need several coins, not an exact match for any one
+    int64 nTarget = 7 * COIN + 3 * CENT + 1;
+    set<pair<const CWalletTx*,unsigned int> > setCoins;
+    int64 nValue;
+    while (state.KeepRunning())
+        if (!wallet.SelectCoinsMinConf(nTarget, 1, 6, setCoins, nValue))
+            throw runtime_error("SelectCoinsFromWallet() : SelectCoinsMinConf failed");
+
+    mapBlockIndex.erase(hashCoinsBlock);
+    pindexBest = pindexBestSave;
+}
+
+static void CWallet_SelectCoins_100(CBenchState& state) { SelectCoinsFromWallet(state, 100); }
+static void CWallet_SelectCoins_1000(CBenchState& state) { SelectCoinsFromWallet(state, 1000); }
+BENCHMARK(CWallet_SelectCoins_100);
+BENCHMARK(CWallet_SelectCoins_1000);
@@ -0,0 +1,80 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+#include "headers.h"
+#include "addrman.h"
+#include "bloom.h"
+#include "mruset.h"
+#include "bench.h"
+
+using namespace std;
+
+// Inserting into a full set, so every insert also evicts the oldest entry
+static void mruset_Insert(CBenchState& state)
+{
+    mruset<CInv> setKnown(10000);
+    int n = 0;
+    for (; n < 10000; n++)
+        setKnown.insert(CInv(MSG_TX, uint256(n)));
+    while (state.KeepRunning())
+        setKnown.insert(CInv(MSG_TX, uint256(n++)));
+}
+BENCHMARK(mruset_Insert);
+
+static void mruset_Count(CBenchState& state)
+{
+    mruset<CInv> setKnown(10000);
+    for (int n = 0; n < 10000; n++)
+        setKnown.insert(CInv(MSG_TX, uint256(n)));
+    int n = 0;
+    while (state.KeepRunning())
+        setKnown.count(CInv(MSG_TX, uint256(n++ % 20000)));
+}
+BENCHMARK(mruset_Count);
+
+// The same workloads for the filter that replaced the mruset as
+// setInventoryKnown, sized the way CNode sizes it.  It needs
+// GetMemoryUsage() bytes where the mruset needed about
+// 10000 * (2 * sizeof(CInv) + 4 * sizeof(void*)).
+static void CRollingBloomFilter_Insert(CBenchState& state)
+{
+    CRollingBloomFilter filterKnown(10000, 0.000001);
+    int n = 0;
+    for (; n < 10000; n++)
+        filterKnown.insert(uint256(n));
+    while (state.KeepRunning())
+        filterKnown.insert(uint256(n++));
+}
+BENCHMARK(CRollingBloomFilter_Insert);
+
+static void CRollingBloomFilter_Contains(CBenchState& state)
+{
+    CRollingBloomFilter filterKnown(10000, 0.000001);
+    for (int n = 0; n < 10000; n++)
+        filterKnown.insert(uint256(n));
+    int n = 0;
+    while (state.KeepRunning())
+        filterKnown.contains(uint256(n++ % 20000));
+}
+BENCHMARK(CRollingBloomFilter_Contains);
+
+// 10000 addresses from 100 sources, 1000 of them tried
+static void CAddrMan_Select(CBenchState& state)
+{
+    CAddrMan addrman;
+    int64 nNow = GetAdjustedTime();
+    for (int i = 0; i < 10000; i++)
+    {
+        struct in_addr s;
+        s.s_addr = htonl(0x05000000 + i * 0x10101); // spread over many /16s
+        CAddress addr(CService(CNetAddr(s), GetDefaultPort()));
+        addr.nTime = nNow - 3600;
+        CNetAddr source(strprintf("6.%d.0.1", i % 100));
+        addrman.Add(addr, source);
+        if (i % 10 == 0)
+            addrman.Good(addr, nNow);
+    }
+    while (state.KeepRunning())
+        addrman.Select();
+}
+BENCHMARK(CAddrMan_Select);
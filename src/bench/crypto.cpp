@@ -0,0 +1,102 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+#include "headers.h"
+#include "bench.h"
+
+using namespace std;
+
+static void Hash_32Bytes(CBenchState& state)
+{
+    vector<unsigned char> vch(32, 0x5a);
+    while (state.KeepRunning())
+        Hash(vch.begin(), vch.end());
+}
+BENCHMARK(Hash_32Bytes);
+
+static void Hash_1MB(CBenchState& state)
+{
+    vector<unsigned char> vch(1000000, 0x5a);
+    while (state.KeepRunning())
+        Hash(vch.begin(), vch.end());
+}
+BENCHMARK(Hash_1MB);
+
+// The size of a compressed public key
+static void Hash160_33Bytes(CBenchState& state)
+{
+    vector<unsigned char> vch(33, 0x02);
+    while (state.KeepRunning())
+        Hash160(vch);
+}
+BENCHMARK(Hash160_33Bytes);
+
+static void CKey_Sign(CBenchState& state)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    uint256 hash = Hash(BEGIN(COIN), END(COIN));
+    vector<unsigned char> vchSig;
+    while (state.KeepRunning())
+        key.Sign(hash, vchSig);
+}
+BENCHMARK(CKey_Sign);
+
+static void CKey_Verify(CBenchState& state)
+{
+    CKey keySign;
+    keySign.MakeNewKey(true);
+    uint256 hash = Hash(BEGIN(COIN), END(COIN));
+    vector<unsigned char> vchSig;
+    if (!keySign.Sign(hash, vchSig))
+        throw runtime_error("CKey_Verify() : Sign failed");
+
+    // Verify with a key that only has the public half, as CheckSig does
+    CKey key;
+    key.SetPubKey(keySign.GetPubKey());
+    while (state.KeepRunning())
+        if (!key.Verify(hash, vchSig))
+            throw runtime_error("CKey_Verify() : Verify failed");
+}
+BENCHMARK(CKey_Verify);
+
+// The same, through OpenSSL's generic curve code
+static void CKey_VerifyOpenSSL(CBenchState& state)
+{
+    CKey keySign;
+    keySign.MakeNewKey(true);
+    uint256 hash = Hash(BEGIN(COIN), END(COIN));
+    vector<unsigned char> vchSig;
+    if (!keySign.Sign(hash, vchSig))
+        throw runtime_error("CKey_VerifyOpenSSL() : Sign failed");
+
+    CKey key;
+    key.SetPubKey(keySign.GetPubKey());
+    while (state.KeepRunning())
+        if (!key.VerifyOpenSSL(hash, &vchSig[0], vchSig.size()))
+            throw runtime_error("CKey_VerifyOpenSSL() : Verify failed");
+}
+BENCHMARK(CKey_VerifyOpenSSL);
+
+// 64 signatures from different keys, checked together as ConnectBlock does;
+// compare with 64 times CKey_Verify
+static void Secp256k1_VerifyBatch64(CBenchState& state)
+{
+    vector<CSecp256k1BatchEntry> vEntries(64);
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        uint256 hash = Hash(BEGIN(i), END(i));
+        if (!key.Sign(hash, vEntries[i].vchSig))
+            throw runtime_error("Secp256k1_VerifyBatch64() : Sign failed");
+        memcpy(vEntries[i].pchHash, &hash, sizeof(vEntries[i].pchHash));
+        vector<unsigned char> vchPubKey = key.GetPubKey();
+        vEntries[i].pubkey.SetPubKey(&vchPubKey[0], vchPubKey.size());
+    }
+
+    while (state.KeepRunning())
+        if (!Secp256k1VerifyBatch(vEntries))
+            throw runtime_error("Secp256k1_VerifyBatch64() : Verify failed");
+}
+BENCHMARK(Secp256k1_VerifyBatch64);
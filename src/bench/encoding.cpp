@@ -0,0 +1,46 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+#include "headers.h"
+#include "bench.h"
+
+using namespace std;
+
+// A version byte, a 160-bit hash and a checksum, the size of an address
+static void EncodeBase58_25Bytes(CBenchState& state)
+{
+    vector<unsigned char> vch(25);
+    for (int i = 0; i < vch.size(); i++)
+        vch[i] = i * 37 + 1;
+    while (state.KeepRunning())
+        EncodeBase58(vch);
+}
+BENCHMARK(EncodeBase58_25Bytes);
+
+static void DecodeBase58_25Bytes(CBenchState& state)
+{
+    vector<unsigned char> vch(25);
+    for (int i = 0; i < vch.size(); i++)
+        vch[i] = i * 37 + 1;
+    string str = EncodeBase58(vch);
+    while (state.KeepRunning())
+        DecodeBase58(str, vch);
+}
+BENCHMARK(DecodeBase58_25Bytes);
+
+static void uint256_GetHex(CBenchState& state)
+{
+    uint256 hash = Hash(BEGIN(COIN), END(COIN));
+    while (state.KeepRunning())
+        hash.GetHex();
+}
+BENCHMARK(uint256_GetHex);
+
+static void uint256_SetHex(CBenchState& state)
+{
+    uint256 hash = Hash(BEGIN(COIN), END(COIN));
+    string str = hash.GetHex();
+    while (state.KeepRunning())
+        hash.SetHex(str);
+}
+BENCHMARK(uint256_SetHex);
@@ -0,0 +1,198 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Block replay benchmark: imports blocks from existing blk000N.dat files into
+// a fresh data directory through ProcessBlock and reports how fast they
+// connected, so we have an IBD throughput number that doesn't depend on peers.
+//
+// Blocks below the last checkpoint connect without signature checks, as
+// they do during a real IBD; -checkallsigs verifies them too.
+//
+// bench_replay -datadir=<empty dir> [-testnet|-regtest] [-maxblocks=<n>] [-checkallsigs] [-json] <blk0001.dat> [blk0002.dat ...]
+//
+#include "headers.h"
+#include "checkpoints.h"
+#include "strlcpy.h"
+#include <boost/filesystem.hpp>
+#include "json/json_spirit_writer_template.h"
+
+using namespace std;
+using namespace json_spirit;
+
+CWallet* pwalletMain = NULL;
+
+void Shutdown(void* parg)
+{
+    exit(0);
+}
+
+static bool ReplayFile(const char* pszFile, int nMaxBlocks, int& nRead, int& nRejected, int64& nElapsed)
+{
+    CAutoFile filein = fopen(pszFile, "rb");
+    if (!filein)
+        return error("ReplayFile() : can't open %s", pszFile);
+
+    while (nMaxBlocks == 0 || nRead < nMaxBlocks)
+    {
+        unsigned char pchMessage[4];
+        if (fread(pchMessage, 1, sizeof(pchMessage), filein) != sizeof(pchMessage))
+            break; // end of file
+        // A file that was being written when the node stopped may end in
+        // zero padding
+        if (memcmp(pchMessage, pchMessageStart, sizeof(pchMessage)) != 0)
+        {
+            if (pchMessage[0] == 0)
+                break;
+            return error("ReplayFile() : bad message start in %s", pszFile);
+        }
+
+        CBlock block;
+        try
+        {
+            unsigned int nSize;
+            filein >> nSize;
+            if (nSize > MAX_BLOCK_SIZE)
+                return error("ReplayFile() : block size %u out of range in %s", nSize, pszFile);
+            filein >> block;
+        }
+        catch (std::exception &e)
+        {
+            return error("ReplayFile() : deserialize failed in %s", pszFile);
+        }
+        nRead++;
+
+        CRITICAL_BLOCK(cs_main)
+        {
+            int64 nStart = GetTimeMicros();
+            if (!ProcessBlock(NULL, &block))
+                nRejected++; // the genesis block lands here as a duplicate
+            nElapsed += GetTimeMicros() - nStart;
+        }
+    }
+    return true;
+}
+
+static double PerSecond(int64 nCount, int64 nMicros)
+{
+    return nMicros > 0 ? (double)nCount * 1000000.0 / nMicros : 0.0;
+}
+
+int main(int argc, char* argv[])
+{
+    ParseParameters(argc, argv);
+    fTestNet = GetBoolArg("-testnet");
+    fRegTest = GetBoolArg("-regtest");
+    if (fRegTest)
+        fTestNet = true;
+    fPrintToConsole = GetBoolArg("-printtoconsole");
+    bool fJSON = GetBoolArg("-json");
+    int nMaxBlocks = (int)GetArg("-maxblocks", 0);
+    fSkipSigsBeforeCheckpoint = !GetBoolArg("-checkallsigs");
+
+    // ParseParameters stops at the first argument that isn't an option
+    vector<const char*> vFiles;
+    for (int i = 1; i < argc; i++)
+        if (!IsSwitchChar(argv[i][0]))
+            vFiles.push_back(argv[i]);
+
+    if (!mapArgs.count("-datadir") || vFiles.empty())
+    {
+        fprintf(stderr, "Usage: bench_replay -datadir=<empty dir> [-testnet|-regtest] [-maxblocks=<n>] [-checkallsigs] [-json] <blk0001.dat> [blk0002.dat ...]\n");
+        return 1;
+    }
+
+    // Replaying into a directory that already has a chain would only
+    // measure the duplicate check
+    boost::filesystem::path pathDataDir = boost::filesystem::system_complete(mapArgs["-datadir"]);
+    boost::filesystem::create_directories(pathDataDir);
+    strlcpy(pszSetDataDir, pathDataDir.string().c_str(), sizeof(pszSetDataDir));
+    if (boost::filesystem::exists(boost::filesystem::path(GetDataDir()) / "blkindex.dat"))
+    {
+        fprintf(stderr, "Error: %s already has a block index, use a fresh -datadir\n", GetDataDir().c_str());
+        return 1;
+    }
+
+    if (!LoadBlockIndex())
+    {
+        fprintf(stderr, "Error: LoadBlockIndex failed\n");
+        return 1;
+    }
+
+    CRITICAL_BLOCK(cs_main)
+        blockprocesstimes.SetNull();
+    uint64 nSigChecksStart = nSigChecks;
+
+    int nRead = 0;
+    int nRejected = 0;
+    int64 nElapsed = 0;
+    bool fOk = true;
+    BOOST_FOREACH(const char* pszFile, vFiles)
+    {
+        if (!ReplayFile(pszFile, nMaxBlocks, nRead, nRejected, nElapsed))
+        {
+            fOk = false;
+            break;
+        }
+    }
+
+    // Flushing the databases is part of what a real import pays for
+    int64 nStart = GetTimeMicros();
+    DBFlush(false);
+    int64 nFlush = GetTimeMicros() - nStart;
+    nElapsed += nFlush;
+
+    CBlockProcessTimes times;
+    CRITICAL_BLOCK(cs_main)
+        times = blockprocesstimes;
+    times.nCommit += nFlush;
+    int64 nSigChecksDone = nSigChecks - nSigChecksStart;
+    int64 nOther = nElapsed - times.nCheckBlock - times.nFetchInputs - times.nConnectInputs - times.nCommit;
+
+    // The replay starts from genesis, so every block connected below the
+    // last checkpoint had its signatures skipped
+    int nSkippedSigsTo = 0;
+    if (fSkipSigsBeforeCheckpoint && times.nBlocks > 0)
+        nSkippedSigsTo = min(nBestHeight, Checkpoints::GetTotalBlocksEstimate());
+    if (nSkippedSigsTo > 0)
+        fprintf(stderr, "Warning: signatures of blocks up to height %d were not checked (last checkpoint); use -checkallsigs to verify them\n", nSkippedSigsTo);
+
+    if (fJSON)
+    {
+        Object result;
+        result.push_back(Pair("blocksread", nRead));
+        result.push_back(Pair("blocks", times.nBlocks));
+        result.push_back(Pair("rejected", nRejected));
+        result.push_back(Pair("transactions", (boost::int64_t)times.nTransactions));
+        result.push_back(Pair("sigchecks", (boost::int64_t)nSigChecksDone));
+        result.push_back(Pair("sigsskippedtoheight", nSkippedSigsTo));
+        result.push_back(Pair("height", nBestHeight));
+        result.push_back(Pair("elapsedusec", (boost::int64_t)nElapsed));
+        result.push_back(Pair("blockspersec", PerSecond(times.nBlocks, nElapsed)));
+        result.push_back(Pair("txpersec", PerSecond(times.nTransactions, nElapsed)));
+        result.push_back(Pair("sigcheckspersec", PerSecond(nSigChecksDone, nElapsed)));
+        Object breakdown;
+        breakdown.push_back(Pair("checkblock", (boost::int64_t)times.nCheckBlock));
+        breakdown.push_back(Pair("fetchinputs", (boost::int64_t)times.nFetchInputs));
+        breakdown.push_back(Pair("connectinputs", (boost::int64_t)times.nConnectInputs));
+        breakdown.push_back(Pair("commit", (boost::int64_t)times.nCommit));
+        breakdown.push_back(Pair("other", (boost::int64_t)nOther));
+        result.push_back(Pair("usec", breakdown));
+        fprintf(stdout, "%s\n", write_string(Value(result), true).c_str());
+    }
+    else
+    {
+        fprintf(stdout, "%d blocks read, %d connected, %d rejected, height %d\n", nRead, times.nBlocks, nRejected, nBestHeight);
+        fprintf(stdout, "%.3fs: %.1f blocks/s, %.1f tx/s, %.1f sigchecks/s\n", nElapsed * 0.000001,
+                PerSecond(times.nBlocks, nElapsed), PerSecond(times.nTransactions, nElapsed), PerSecond(nSigChecksDone, nElapsed));
+        fprintf(stdout, "  CheckBlock     %10.3fs\n", times.nCheckBlock * 0.000001);
+        fprintf(stdout, "  FetchInputs    %10.3fs\n", times.nFetchInputs * 0.000001);
+        fprintf(stdout, "  ConnectInputs  %10.3fs\n", times.nConnectInputs * 0.000001);
+        fprintf(stdout, "  DB commit      %10.3fs\n", times.nCommit * 0.000001);
+        fprintf(stdout, "  other          %10.3fs\n", nOther * 0.000001);
+    }
+
+    DBFlush(true);
+    return fOk ? 0 : 1;
+}
@@ -0,0 +1,100 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+#include "headers.h"
+#include "bench.h"
+
+using namespace std;
+
+// A typical pay-to-pubkey-hash spend: one input, two outputs
+static CTransaction MakeTransaction(int n)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(uint256(n + 1), 0);
+    tx.vin[0].scriptSig = CScript() << vector<unsigned char>(72, 0x30) << vector<unsigned char>(33, 0x02);
+    tx.vout.resize(2);
+    tx.vout[0].nValue = n * CENT;
+    tx.vout[0].scriptPubKey.SetBitcoinAddress(uint160(n));
+    tx.vout[1].nValue = COIN;
+    tx.vout[1].scriptPubKey.SetBitcoinAddress(uint160(n + 1));
+    return tx;
+}
+
+// About 130k, with 500 transactions
+static void MakeBlock(CBlock& block)
+{
+    block.SetNull();
+    block.vtx.resize(500);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].scriptSig = CScript() << 0x1d00ffff << CBigNum(4);
+    block.vtx[0].vout.resize(1);
+    block.vtx[0].vout[0].nValue = 50 * COIN;
+    block.vtx[0].vout[0].scriptPubKey << vector<unsigned char>(65, 0x04) << OP_CHECKSIG;
+    for (int i = 1; i < block.vtx.size(); i++)
+        block.vtx[i] = MakeTransaction(i);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+}
+
+static void Serialize_CTransaction(CBenchState& state)
+{
+    CTransaction tx = MakeTransaction(1);
+    CDataStream ss;
+    while (state.KeepRunning())
+    {
+        ss.clear();
+        ss << tx;
+    }
+}
+BENCHMARK(Serialize_CTransaction);
+
+static void Deserialize_CTransaction(CBenchState& state)
+{
+    CDataStream ssTx;
+    ssTx << MakeTransaction(1);
+    CTransaction tx;
+    while (state.KeepRunning())
+    {
+        CDataStream ss(ssTx.begin(), ssTx.end());
+        ss >> tx;
+    }
+}
+BENCHMARK(Deserialize_CTransaction);
+
+static void Serialize_CBlock(CBenchState& state)
+{
+    CBlock block;
+    MakeBlock(block);
+    CDataStream ss;
+    while (state.KeepRunning())
+    {
+        ss.clear();
+        ss << block;
+    }
+}
+BENCHMARK(Serialize_CBlock);
+
+static void Deserialize_CBlock(CBenchState& state)
+{
+    CBlock blockIn;
+    MakeBlock(blockIn);
+    CDataStream ssBlock;
+    ssBlock << blockIn;
+    CBlock block;
+    while (state.KeepRunning())
+    {
+        CDataStream ss(ssBlock.begin(), ssBlock.end());
+        ss >> block;
+    }
+}
+BENCHMARK(Deserialize_CBlock);
+
+// Includes hashing each transaction, as it does when checking a new block
+static void BuildMerkleTree_500Tx(CBenchState& state)
+{
+    CBlock block;
+    MakeBlock(block);
+    while (state.KeepRunning())
+        block.BuildMerkleTree();
+}
+BENCHMARK(BuildMerkleTree_500Tx);
@@ -0,0 +1,136 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+#include "headers.h"
+#include "bench.h"
+
+using namespace std;
+
+extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+extern bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                         bool fValidatePayToScriptHash, int nHashType);
+
+enum
+{
+    TEMPLATE_PUBKEY,
+    TEMPLATE_PUBKEYHASH,
+    TEMPLATE_MULTISIG,
+    TEMPLATE_SCRIPTHASH,
+};
+
+// Spends one output of the given standard form, signed with fresh keys
+static void MakeSpend(int nTemplate, CTransaction& txFrom, CTransaction& txTo)
+{
+    CBasicKeyStore keystore;
+    vector<CKey> keys(3);
+    for (int i = 0; i < keys.size(); i++)
+    {
+        keys[i].MakeNewKey(true);
+        keystore.AddKey(keys[i]);
+    }
+
+    CScript scriptPubKey;
+    switch (nTemplate)
+    {
+    case TEMPLATE_PUBKEY:
+        scriptPubKey << keys[0].GetPubKey() << OP_CHECKSIG;
+        break;
+    case TEMPLATE_PUBKEYHASH:
+        scriptPubKey.SetBitcoinAddress(keys[0].GetPubKey());
+        break;
+    case TEMPLATE_MULTISIG:
+        scriptPubKey.SetMultisig(2, keys);
+        break;
+    case TEMPLATE_SCRIPTHASH:
+        {
+            CScript redeemScript;
+            redeemScript.SetMultisig(2, keys);
+            keystore.AddCScript(redeemScript);
+            scriptPubKey.SetPayToScriptHash(redeemScript);
+        }
+        break;
+    }
+
+    txFrom.vout.resize(1);
+    txFrom.vout[0].nValue = COIN;
+    txFrom.vout[0].scriptPubKey = scriptPubKey;
+
+    txTo.vin.resize(1);
+    txTo.vin[0].prevout = COutPoint(txFrom.GetHash(), 0);
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = COIN;
+    txTo.vout[0].scriptPubKey.SetBitcoinAddress(keys[1].GetPubKey());
+    if (!SignSignature(keystore, txFrom, txTo, 0))
+        throw runtime_error("MakeSpend() : SignSignature failed");
+}
+
+// VerifyScript runs EvalScript over the scriptSig and then the scriptPubKey,
+// and over the redeem script for pay-to-script-hash
+static void EvalTemplate(CBenchState& state, int nTemplate)
+{
+    CTransaction txFrom, txTo;
+    MakeSpend(nTemplate, txFrom, txTo);
+    const CScript& scriptSig = txTo.vin[0].scriptSig;
+    const CScript& scriptPubKey = txFrom.vout[0].scriptPubKey;
+    while (state.KeepRunning())
+        if (!VerifyScript(scriptSig, scriptPubKey, txTo, 0, true, 0))
+            throw runtime_error("EvalTemplate() : VerifyScript failed");
+}
+
+static void EvalScript_PubKey(CBenchState& state) { EvalTemplate(state, TEMPLATE_PUBKEY); }
+static void EvalScript_PubKeyHash(CBenchState& state) { EvalTemplate(state, TEMPLATE_PUBKEYHASH); }
+static void EvalScript_Multisig2of3(CBenchState& state) { EvalTemplate(state, TEMPLATE_MULTISIG); }
+static void EvalScript_ScriptHash2of3(CBenchState& state) { EvalTemplate(state, TEMPLATE_SCRIPTHASH); }
+BENCHMARK(EvalScript_PubKey);
+BENCHMARK(EvalScript_PubKeyHash);
+BENCHMARK(EvalScript_Multisig2of3);
+BENCHMARK(EvalScript_ScriptHash2of3);
+
+// A transaction with nInputs signed inputs and two outputs
+static CTransaction ManyInputTx(const CScript& scriptCode, int nInputs)
+{
+    CTransaction tx;
+    tx.vin.resize(nInputs);
+    for (int i = 0; i < nInputs; i++)
+    {
+        tx.vin[i].prevout = COutPoint(uint256(i + 1), 0);
+        tx.vin[i].scriptSig = CScript() << vector<unsigned char>(72, 0x30) << vector<unsigned char>(33, 0x02);
+    }
+    tx.vout.resize(2);
+    tx.vout[0].scriptPubKey = scriptCode;
+    tx.vout[1].scriptPubKey = scriptCode;
+    return tx;
+}
+
+// The last input on its own, which is the most there is to hash
+static void SignatureHashInputs(CBenchState& state, int nInputs)
+{
+    CScript scriptCode;
+    scriptCode.SetBitcoinAddress(uint160(1));
+    CTransaction tx = ManyInputTx(scriptCode, nInputs);
+
+    while (state.KeepRunning())
+        SignatureHash(scriptCode, tx, nInputs - 1, SIGHASH_ALL);
+}
+
+// Every input, sharing one hasher the way ConnectInputs and signing do
+static void SignatureHashAllInputs(CBenchState& state, int nInputs)
+{
+    CScript scriptCode;
+    scriptCode.SetBitcoinAddress(uint160(1));
+    CTransaction tx = ManyInputTx(scriptCode, nInputs);
+
+    while (state.KeepRunning())
+    {
+        CSignatureHasher hasher(tx);
+        for (int i = 0; i < nInputs; i++)
+            hasher.SignatureHash(scriptCode, i, SIGHASH_ALL);
+    }
+}
+
+static void SignatureHash_1Input(CBenchState& state) { SignatureHashInputs(state, 1); }
+static void SignatureHash_100Inputs(CBenchState& state) { SignatureHashInputs(state, 100); }
+static void SignatureHash_Every100Inputs(CBenchState& state) { SignatureHashAllInputs(state, 100); }
+BENCHMARK(SignatureHash_1Input);
+BENCHMARK(SignatureHash_100Inputs);
+BENCHMARK(SignatureHash_Every100Inputs);
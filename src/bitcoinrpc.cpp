@@ -265,6 +265,166 @@ Value getconnectioncount(const Array& params, bool fHelp)
 }
 
 
+static Object CommandMapToJSON(const map<string, uint64>& mapBytes)
+{
+    Object obj;
+    for (map<string, uint64>::const_iterator mi = mapBytes.begin(); mi != mapBytes.end(); ++mi)
+        obj.push_back(Pair((*mi).first, (boost::uint64_t)(*mi).second));
+    return obj;
+}
+
+Value getpeerinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getpeerinfo\n"
+            "Returns data about each connected network node, including bytes\n"
+            "sent and received per command and ping round trip time.");
+
+    vector<CNodeStats> vstats;
+    CRITICAL_BLOCK(cs_vNodes)
+    {
+        vstats.resize(vNodes.size());
+        for (unsigned int i = 0; i < vNodes.size(); i++)
+            vNodes[i]->CopyStats(vstats[i]);
+    }
+
+    Array ret;
+    BOOST_FOREACH(const CNodeStats& stats, vstats)
+    {
+        Object obj;
+        obj.push_back(Pair("addr",          stats.strAddr));
+        obj.push_back(Pair("services",      strprintf("%08"PRI64x, stats.nServices)));
+        obj.push_back(Pair("lastsend",      (boost::int64_t)stats.nLastSend));
+        obj.push_back(Pair("lastrecv",      (boost::int64_t)stats.nLastRecv));
+        obj.push_back(Pair("bytessent",     (boost::uint64_t)stats.nSendBytes));
+        obj.push_back(Pair("bytesrecv",     (boost::uint64_t)stats.nRecvBytes));
+        obj.push_back(Pair("conntime",      (boost::int64_t)stats.nTimeConnected));
+        if (stats.nPingUsecTime > 0)
+            obj.push_back(Pair("pingtime",  stats.nPingUsecTime / 1e6));
+        if (stats.nPingUsecWait > 0)
+            obj.push_back(Pair("pingwait",  stats.nPingUsecWait / 1e6));
+        obj.push_back(Pair("version",       stats.nVersion));
+        obj.push_back(Pair("subver",        stats.strSubVer));
+        obj.push_back(Pair("inbound",       stats.fInbound));
+        obj.push_back(Pair("startingheight",stats.nStartingHeight));
+        obj.push_back(Pair("banscore",      stats.nMisbehavior));
+        obj.push_back(Pair("bytessent_per_msg", CommandMapToJSON(stats.mapSendBytesPerCommand)));
+        obj.push_back(Pair("bytesrecv_per_msg", CommandMapToJSON(stats.mapRecvBytesPerCommand)));
+
+        // In milliseconds
+        Object objTime;
+        for (map<string, int64>::const_iterator mi = stats.mapProcessTimePerCommand.begin(); mi != stats.mapProcessTimePerCommand.end(); ++mi)
+            objTime.push_back(Pair((*mi).first, (*mi).second / 1000.0));
+        obj.push_back(Pair("processtime_per_msg", objTime));
+
+        ret.push_back(obj);
+    }
+    return ret;
+}
+
+
+Value getnettotals(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getnettotals\n"
+            "Returns the total bytes sent and received over all connections since startup.");
+
+    Object obj;
+    obj.push_back(Pair("totalbytesrecv", (boost::uint64_t)CNode::GetTotalBytesRecv()));
+    obj.push_back(Pair("totalbytessent", (boost::uint64_t)CNode::GetTotalBytesSent()));
+    obj.push_back(Pair("timemillis",     (boost::int64_t)GetTimeMillis()));
+    if (MaxUploadTarget() > 0)
+    {
+        Object objTarget;
+        objTarget.push_back(Pair("target",        (boost::uint64_t)MaxUploadTarget()));
+        objTarget.push_back(Pair("target_reached",CNode::OutboundTargetReached()));
+        objTarget.push_back(Pair("bytes_left_in_cycle", (boost::uint64_t)CNode::GetOutboundTargetBytesLeft()));
+        obj.push_back(Pair("uploadtarget", objTarget));
+    }
+    return obj;
+}
+
+
+Value setban(const Array& params, bool fHelp)
+{
+    string strCommand;
+    if (params.size() >= 2)
+        strCommand = params[1].get_str();
+    if (fHelp || params.size() < 2 || params.size() > 4 ||
+        (strCommand != "add" && strCommand != "remove"))
+        throw runtime_error(
+            "setban <ip[/prefix]> <add|remove> [bantime] [absolute]\n"
+            "Adds or removes an IP address or subnet, like 1.2.3.0/24, from the ban list.\n"
+            "[bantime] is in seconds, default -bantime.  If [absolute] is true it is a unix time instead.");
+
+    CSubNet subnet(params[0].get_str());
+    if (!subnet.IsValid())
+        throw JSONRPCError(-3, "Invalid IP address or subnet");
+
+    if (strCommand == "add")
+    {
+        int64 nNow = GetTime();
+        int64 nBanTime = GetArg("-bantime", 60*60*24);
+        if (params.size() > 2 && params[2].get_int64() > 0)
+            nBanTime = params[2].get_int64();
+        bool fAbsolute = (params.size() > 3 && params[3].get_bool());
+        banlist.Ban(subnet, fAbsolute ? nBanTime : nNow + nBanTime, nNow);
+
+        CRITICAL_BLOCK(cs_vNodes)
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                if (subnet.Match(pnode->addr))
+                    pnode->fDisconnect = true;
+    }
+    else if (!banlist.Unban(subnet))
+        throw JSONRPCError(-5, "Subnet was not banned");
+
+    // Save right away, a ban put in place during an attack has to survive a restart
+    DumpBanlist();
+    return Value::null;
+}
+
+
+Value listbanned(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "listbanned\n"
+            "Lists the banned IP addresses and subnets.");
+
+    map<CSubNet, CBanEntry> mapBanned;
+    banlist.GetBanned(mapBanned);
+    int64 nNow = GetTime();
+
+    Array ret;
+    for (map<CSubNet, CBanEntry>::iterator mi = mapBanned.begin(); mi != mapBanned.end(); ++mi)
+    {
+        if ((*mi).second.nBanUntil <= nNow)
+            continue;
+        Object obj;
+        obj.push_back(Pair("address",       (*mi).first.ToString()));
+        obj.push_back(Pair("banned_until",  (boost::int64_t)(*mi).second.nBanUntil));
+        obj.push_back(Pair("ban_created",   (boost::int64_t)(*mi).second.nCreateTime));
+        ret.push_back(obj);
+    }
+    return ret;
+}
+
+
+Value clearbanned(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "clearbanned\n"
+            "Removes all bans.");
+
+    banlist.Clear();
+    DumpBanlist();
+    return Value::null;
+}
+
+
 Value getdifficulty(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -313,6 +473,45 @@ Value setgenerate(const Array& params, bool fHelp)
 }
 
 
+Value generatecmd(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "generate <nblocks>\n"
+            "Mine <nblocks> blocks right away, each paying to a new key from the wallet.\n"
+            "Only available with -regtest.  Returns the hashes of the new blocks.");
+
+    if (!fRegTest)
+        throw runtime_error("generate is only available with -regtest");
+
+    int nGenerate = params[0].get_int();
+    if (nGenerate < 0)
+        throw runtime_error("Invalid number of blocks");
+
+    Array ret;
+    CReserveKey reservekey(pwalletMain);
+    unsigned int nExtraNonce = 0;
+    for (int i = 0; i < nGenerate; i++)
+    {
+        CBlockIndex* pindexPrev = pindexBest;
+        auto_ptr<CBlock> pblock(CreateNewBlock(reservekey));
+        if (!pblock.get())
+            throw JSONRPCError(-7, "Out of memory");
+        IncrementExtraNonce(pblock.get(), pindexPrev, nExtraNonce);
+
+        // At regtest difficulty half of all hashes qualify
+        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        while (pblock->GetHash() > hashTarget)
+            pblock->nNonce++;
+
+        if (!CheckWork(pblock.get(), *pwalletMain, reservekey))
+            throw JSONRPCError(-4, "Generated block was not accepted");
+        ret.push_back(pblock->GetHash().GetHex());
+    }
+    return ret;
+}
+
+
 Value gethashespersec(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -1769,7 +1968,7 @@ Value getwork(const Array& params, bool fHelp)
             "  \"target\" : little endian hash target\n"
             "If [data] is specified, tries to solve the block and returns true if it was successful.");
 
-    if (vNodes.empty())
+    if (vNodes.empty() && !fRegTest)
         throw JSONRPCError(-9, "Bitcoin is not connected!");
 
     if (IsInitialBlockDownload())
@@ -1881,7 +2080,7 @@ Value getmemorypool(const Array& params, bool fHelp)
 
     if (params.size() == 0)
     {
-        if (vNodes.empty())
+        if (vNodes.empty() && !fRegTest)
             throw JSONRPCError(-9, "Bitcoin is not connected!");
 
         if (IsInitialBlockDownload())
@@ -1966,6 +2165,22 @@ Value getblockhash(const Array& params, bool fHelp)
     return pblockindex->phashBlock->GetHex();
 }
 
+Value getrawmempool(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrawmempool\n"
+            "Returns the ids of the transactions in the memory pool.");
+
+    vector<uint256> vtxid;
+    GetMemPoolTxids(vtxid);
+
+    Array ret;
+    BOOST_FOREACH(const uint256& hash, vtxid)
+        ret.push_back(hash.GetHex());
+    return ret;
+}
+
 Value getblock(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -2007,9 +2222,15 @@ pair<string, rpcfn_type> pCallTable[] =
     make_pair("getblockcount",          &getblockcount),
     make_pair("getblocknumber",         &getblocknumber),
     make_pair("getconnectioncount",     &getconnectioncount),
+    make_pair("getpeerinfo",            &getpeerinfo),
+    make_pair("getnettotals",           &getnettotals),
+    make_pair("setban",                 &setban),
+    make_pair("listbanned",             &listbanned),
+    make_pair("clearbanned",            &clearbanned),
     make_pair("getdifficulty",          &getdifficulty),
     make_pair("getgenerate",            &getgenerate),
     make_pair("setgenerate",            &setgenerate),
+    make_pair("generate",               &generatecmd),
     make_pair("gethashespersec",        &gethashespersec),
     make_pair("getinfo",                &getinfo),
     make_pair("getmininginfo",          &getmininginfo),
@@ -2037,6 +2258,7 @@ pair<string, rpcfn_type> pCallTable[] =
     make_pair("addmultisigaddress",     &addmultisigaddress),
     make_pair("getblock",               &getblock),
     make_pair("getblockhash",           &getblockhash),
+    make_pair("getrawmempool",          &getrawmempool),
     make_pair("gettransaction",         &gettransaction),
     make_pair("listtransactions",       &listtransactions),
     make_pair("signmessage",            &signmessage),
@@ -2058,6 +2280,11 @@ string pAllowInSafeMode[] =
     "getblockcount",
     "getblocknumber",  // deprecated
     "getconnectioncount",
+    "getpeerinfo",
+    "getnettotals",
+    "setban",
+    "listbanned",
+    "clearbanned",
     "getdifficulty",
     "getgenerate",
     "setgenerate",
@@ -2075,6 +2302,7 @@ string pAllowInSafeMode[] =
     "validateaddress",
     "getwork",
     "getmemorypool",
+    "getrawmempool",
 };
 set<string> setAllowInSafeMode(pAllowInSafeMode, pAllowInSafeMode + sizeof(pAllowInSafeMode)/sizeof(pAllowInSafeMode[0]));
 
@@ -2661,7 +2889,10 @@ int CommandLineRPC(int argc, char *argv[])
         //
         // Special case non-string parameter types
         //
+        if (strMethod == "setban"                 && n > 2) ConvertTo<boost::int64_t>(params[2]);
+        if (strMethod == "setban"                 && n > 3) ConvertTo<bool>(params[3]);
         if (strMethod == "setgenerate"            && n > 0) ConvertTo<bool>(params[0]);
+        if (strMethod == "generate"               && n > 0) ConvertTo<boost::int64_t>(params[0]);
         if (strMethod == "setgenerate"            && n > 1) ConvertTo<boost::int64_t>(params[1]);
         if (strMethod == "sendtoaddress"          && n > 1) ConvertTo<double>(params[1]);
         if (strMethod == "settxfee"               && n > 0) ConvertTo<double>(params[0]);
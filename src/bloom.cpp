@@ -0,0 +1,79 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+#include <math.h>
+#include <algorithm>
+#include <limits>
+
+#include "bloom.h"
+#include "util.h"
+
+#define LN2SQUARED 0.4804530139182014246671025263266649717305529515945455
+#define LN2 0.6931471805599453094172321214581765680755001343602552
+
+static const unsigned int MAX_BLOOM_FILTER_BYTES = 1 << 20;
+static const unsigned int MAX_HASH_FUNCS = 50;
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElementsIn, double fpRate) :
+    nCurrent(0), nInsertions(0), nElements(std::max(nElementsIn, 1u))
+{
+    // Each generation gets half the error budget since lookups check both.
+    // The optimal size and number of hash functions for a bloom filter of
+    // n elements and false positive rate p are
+    //   bits = -1/ln(2)^2 * n * ln(p),  hashes = bits/n * ln(2)
+    double p = std::min(std::max(fpRate / 2, 1e-12), 0.5);
+    unsigned int nBytes = std::min((unsigned int)(-1 / LN2SQUARED * nElements * log(p)) / 8 + 1, MAX_BLOOM_FILTER_BYTES);
+    nBits = nBytes * 8;
+    nHashFuncs = std::max(std::min((unsigned int)((double)nBits / nElements * LN2), MAX_HASH_FUNCS), 1u);
+    vData[0].resize(nBytes);
+    vData[1].resize(nBytes);
+    nTweak = GetRand(std::numeric_limits<unsigned int>::max());
+}
+
+inline unsigned int CRollingBloomFilter::Hash(unsigned int nHashNum, const unsigned char* pch, unsigned int nSize) const
+{
+    // 0xFBA4C795 chosen as it guarantees a reasonable bit difference between nHashNum values.
+    return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, pch, nSize) % nBits;
+}
+
+void CRollingBloomFilter::insert(const unsigned char* pch, unsigned int nSize)
+{
+    if (nInsertions == nElements)
+    {
+        // Start a new generation, forgetting the oldest one
+        nCurrent ^= 1;
+        std::fill(vData[nCurrent].begin(), vData[nCurrent].end(), 0);
+        nInsertions = 0;
+    }
+
+    std::vector<unsigned char>& vCurrent = vData[nCurrent];
+    for (unsigned int i = 0; i < nHashFuncs; i++)
+    {
+        unsigned int nIndex = Hash(i, pch, nSize);
+        vCurrent[nIndex >> 3] |= (1 << (7 & nIndex));
+    }
+    nInsertions++;
+}
+
+bool CRollingBloomFilter::contains(const unsigned char* pch, unsigned int nSize) const
+{
+    bool fCurrent = true;
+    bool fPrevious = true;
+    for (unsigned int i = 0; i < nHashFuncs && (fCurrent || fPrevious); i++)
+    {
+        unsigned int nIndex = Hash(i, pch, nSize);
+        unsigned char nMask = (1 << (7 & nIndex));
+        fCurrent = fCurrent && (vData[nCurrent][nIndex >> 3] & nMask);
+        fPrevious = fPrevious && (vData[nCurrent ^ 1][nIndex >> 3] & nMask);
+    }
+    return fCurrent || fPrevious;
+}
+
+void CRollingBloomFilter::reset()
+{
+    std::fill(vData[0].begin(), vData[0].end(), 0);
+    std::fill(vData[1].begin(), vData[1].end(), 0);
+    nCurrent = 0;
+    nInsertions = 0;
+    nTweak = GetRand(std::numeric_limits<unsigned int>::max());
+}
@@ -0,0 +1,48 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOOM_H
+#define BITCOIN_BLOOM_H
+
+#include <vector>
+
+#include "uint256.h"
+
+/** Probabilistic set of fixed size that remembers at least the last
+ * nElements items inserted, with a false positive rate of about fpRate.
+ *
+ * Two generations of bloom filters are kept.  Inserts go to the current one,
+ * and once it holds nElements items it becomes the previous generation and
+ * the old previous generation is cleared to become the current one.
+ * Lookups check both generations.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElementsIn, double fpRate);
+
+    void insert(const unsigned char* pch, unsigned int nSize);
+    void insert(const std::vector<unsigned char>& vKey) { insert(vKey.empty() ? NULL : &vKey[0], vKey.size()); }
+    void insert(const uint256& hash) { insert((const unsigned char*)&hash, sizeof(hash)); }
+
+    bool contains(const unsigned char* pch, unsigned int nSize) const;
+    bool contains(const std::vector<unsigned char>& vKey) const { return contains(vKey.empty() ? NULL : &vKey[0], vKey.size()); }
+    bool contains(const uint256& hash) const { return contains((const unsigned char*)&hash, sizeof(hash)); }
+
+    void reset();
+
+    unsigned int GetMemoryUsage() const { return 2 * vData[0].size(); }
+
+private:
+    unsigned int Hash(unsigned int nHashNum, const unsigned char* pch, unsigned int nSize) const;
+
+    std::vector<unsigned char> vData[2];
+    unsigned int nCurrent;
+    unsigned int nInsertions;
+    unsigned int nElements;
+    unsigned int nBits;
+    unsigned int nHashFuncs;
+    unsigned int nTweak;
+};
+
+#endif
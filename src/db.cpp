@@ -721,23 +721,138 @@ bool CTxDB::LoadBlockIndex()
 
 
 
+// peers.dat and banlist.dat hold the network magic, the serialized data
+// and a hash of both.  They are written to a temporary file that is then
+// renamed over the old one, so a crash leaves either the old or the new
+// file, never half of one.
+
+static bool WriteFlatFile(const string& strPath, const CDataStream& ssData)
+{
+    // Serialize to memory first, the whole thing is hashed
+    CDataStream ssFile(SER_DISK);
+    ssFile << FLATDATA(pchMessageStart);
+    ssFile.write(&ssData[0], ssData.size());
+    uint256 hash = Hash(ssFile.begin(), ssFile.end());
+    ssFile << hash;
+
+    unsigned short nRand = 0;
+    RAND_bytes((unsigned char*)&nRand, sizeof(nRand));
+    string strPathTmp = strprintf("%s.%04x", strPath.c_str(), nRand);
+    CAutoFile fileout(fopen(strPathTmp.c_str(), "wb"), SER_DISK);
+    if (!fileout)
+        return error("WriteFlatFile() : open %s failed", strPathTmp.c_str());
+    try
+    {
+        fileout << ssFile;
+    }
+    catch (std::exception &e)
+    {
+        fileout.fclose();
+        remove(strPathTmp.c_str());
+        return error("WriteFlatFile() : I/O error writing %s", strPathTmp.c_str());
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    if (!RenameOver(strPathTmp, strPath))
+    {
+        remove(strPathTmp.c_str());
+        return error("WriteFlatFile() : rename to %s failed", strPath.c_str());
+    }
+    return true;
+}
+
+static bool ReadFlatFile(const string& strPath, CDataStream& ssRet)
+{
+    CAutoFile filein(fopen(strPath.c_str(), "rb"), SER_DISK);
+    if (!filein)
+        return false;
+
+    // One read for the whole file
+    int nFileSize = GetFilesize(filein);
+    int nDataSize = nFileSize - (int)sizeof(uint256);
+    if (nDataSize < (int)sizeof(pchMessageStart))
+        return error("ReadFlatFile() : %s is truncated", strPath.c_str());
+    vector<char> vchData(nDataSize);
+    uint256 hashIn;
+    try
+    {
+        filein.read(&vchData[0], nDataSize);
+        filein >> hashIn;
+    }
+    catch (std::exception &e)
+    {
+        return error("ReadFlatFile() : I/O error reading %s", strPath.c_str());
+    }
+    filein.fclose();
+
+    if (Hash(vchData.begin(), vchData.end()) != hashIn)
+        return error("ReadFlatFile() : checksum mismatch, %s is corrupt", strPath.c_str());
+
+    // Don't load the data of another network (testnet)
+    if (memcmp(&vchData[0], pchMessageStart, sizeof(pchMessageStart)) != 0)
+        return error("ReadFlatFile() : %s is for a different network", strPath.c_str());
+
+    ssRet.clear();
+    ssRet.write(&vchData[sizeof(pchMessageStart)], nDataSize - sizeof(pchMessageStart));
+    return true;
+}
+
+
 //
 // CAddrDB
 //
 
-bool CAddrDB::WriteAddrman(const CAddrMan& addrman)
+CAddrDB::CAddrDB()
+{
+    strPath = GetDataDir() + "/peers.dat";
+}
+
+bool CAddrDB::Write(const CAddrMan& addr)
 {
-    return Write(string("addrman"), addrman);
+    CDataStream ssPeers(SER_DISK);
+    ssPeers << addr;
+    return WriteFlatFile(strPath, ssPeers);
+}
+
+bool CAddrDB::Read(CAddrMan& addr)
+{
+    CDataStream ssPeers(SER_DISK);
+    if (!ReadFlatFile(strPath, ssPeers))
+        return false;
+    try
+    {
+        ssPeers >> addr;
+    }
+    catch (std::exception &e)
+    {
+        return error("CAddrDB::Read() : deserialize failed");
+    }
+    return true;
 }
 
-bool CAddrDB::LoadAddresses()
+
+// addr.dat, where the addresses were kept in the BDB environment before
+// peers.dat.  Only read once, to carry the table over after an upgrade.
+class CLegacyAddrDB : public CDB
+{
+public:
+    CLegacyAddrDB(const char* pszMode="r") : CDB("addr.dat", pszMode) { }
+private:
+    CLegacyAddrDB(const CLegacyAddrDB&);
+    void operator=(const CLegacyAddrDB&);
+public:
+    bool LoadAddresses();
+};
+
+bool CLegacyAddrDB::LoadAddresses()
 {
     if (Read(string("addrman"), addrman))
     {
-        printf("Loaded %i addresses\n", addrman.size());
+        printf("Loaded %i addresses from addr.dat\n", addrman.size());
         return true;
     }
-    
+
     // Read pre-0.6 addr records
 
     vector<CAddress> vAddr;
@@ -783,7 +898,66 @@ bool CAddrDB::LoadAddresses()
 
 bool LoadAddresses()
 {
-    return CAddrDB("cr+").LoadAddresses();
+    CAddrDB adb;
+    if (adb.Read(addrman))
+    {
+        printf("Loaded %i addresses from peers.dat\n", addrman.size());
+        return true;
+    }
+
+    if (filesystem::exists(GetDataDir() + "/addr.dat"))
+        return CLegacyAddrDB().LoadAddresses();
+
+    printf("Invalid or missing peers.dat, starting with an empty address table\n");
+    return true;
+}
+
+
+
+//
+// CBanDB
+//
+
+CBanDB::CBanDB()
+{
+    strPath = GetDataDir() + "/banlist.dat";
+}
+
+bool CBanDB::Write(const CBanList& banlistIn)
+{
+    CDataStream ssBanned(SER_DISK);
+    ssBanned << banlistIn;
+    return WriteFlatFile(strPath, ssBanned);
+}
+
+bool CBanDB::Read(CBanList& banlistIn)
+{
+    CDataStream ssBanned(SER_DISK);
+    if (!ReadFlatFile(strPath, ssBanned))
+        return false;
+    try
+    {
+        ssBanned >> banlistIn;
+    }
+    catch (std::exception &e)
+    {
+        return error("CBanDB::Read() : deserialize failed");
+    }
+    return true;
+}
+
+bool LoadBanlist()
+{
+    CBanDB bandb;
+    if (!bandb.Read(banlist))
+    {
+        printf("Invalid or missing banlist.dat, starting with no bans\n");
+        return true;
+    }
+    banlist.SweepExpired(GetTime());
+    banlist.SetDirty(false);
+    printf("Loaded %d banned subnets from banlist.dat\n", banlist.size());
+    return true;
 }
 
 
@@ -17,6 +17,7 @@ class CAccount;
 class CAccountingEntry;
 class CAddress;
 class CAddrMan;
+class CBanList;
 class CBlockLocator;
 class CDiskBlockIndex;
 class CDiskTxPos;
@@ -297,22 +298,37 @@ public:
 
 
 
-/** Access to the (IP) address database (addr.dat) */
-class CAddrDB : public CDB
+/** Access to the (IP) address table (peers.dat).  This is a flat file, not
+ * part of the BDB environment: the serialized CAddrMan followed by its hash,
+ * replaced as a whole by writing a temporary file and renaming it over.
+ */
+class CAddrDB
 {
-public:
-    CAddrDB(const char* pszMode="r+") : CDB("addr.dat", pszMode) { }
 private:
-    CAddrDB(const CAddrDB&);
-    void operator=(const CAddrDB&);
+    std::string strPath;
 public:
-    bool WriteAddrman(const CAddrMan& addr);
-    bool LoadAddresses();
+    CAddrDB();
+    bool Write(const CAddrMan& addr);
+    bool Read(CAddrMan& addr);
 };
 
 bool LoadAddresses();
 
 
+/** Access to the banned subnets (banlist.dat), stored like peers.dat */
+class CBanDB
+{
+private:
+    std::string strPath;
+public:
+    CBanDB();
+    bool Write(const CBanList& banlist);
+    bool Read(CBanList& banlist);
+};
+
+bool LoadBanlist();
+
+
 /** A key pool entry */
 class CKeyPool
 {
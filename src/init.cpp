@@ -181,7 +181,7 @@ bool AppInit2(int argc, char* argv[])
             "  -timeout=<n>     \t  "   + _("Specify connection timeout (in milliseconds)") + "\n" +
             "  -proxy=<ip:port> \t  "   + _("Connect through socks4 proxy") + "\n" +
             "  -dns             \t  "   + _("Allow DNS lookups for addnode and connect") + "\n" +
-            "  -port=<port>     \t\t  " + _("Listen for connections on <port> (default: 8333 or testnet: 18333)") + "\n" +
+            "  -port=<port>     \t\t  " + _("Listen for connections on <port> (default: 8333 or testnet: 18333 or regtest: 18444)") + "\n" +
             "  -maxconnections=<n>\t  " + _("Maintain at most <n> connections to peers (default: 125)") + "\n" +
             "  -addnode=<ip>    \t  "   + _("Add a node to connect to and attempt to keep the connection open") + "\n" +
             "  -connect=<ip>    \t\t  " + _("Connect only to the specified node") + "\n" +
@@ -195,6 +195,9 @@ bool AppInit2(int argc, char* argv[])
             "  -bantime=<n>     \t  "   + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
             "  -maxreceivebuffer=<n>\t  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 10000)") + "\n" +
             "  -maxsendbuffer=<n>\t  "   + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 10000)") + "\n" +
+            "  -maxuploadrate=<n>\t  "   + _("Limit total upload to <n> kB (<n>*1000 bytes) per second (default: 0 = unlimited)") + "\n" +
+            "  -maxpeeruploadrate=<n>\t  " + _("Limit upload to each peer to <n> kB (<n>*1000 bytes) per second (default: 0 = unlimited)") + "\n" +
+            "  -maxuploadtarget=<n>\t  " + _("Stop serving blocks older than a week after uploading <n> MB in a day (default: 0 = no limit)") + "\n" +
 #ifdef USE_UPNP
 #if USE_UPNP
             "  -upnp            \t  "   + _("Use Universal Plug and Play to map the listening port (default: 1)") + "\n" +
@@ -210,6 +213,7 @@ bool AppInit2(int argc, char* argv[])
             "  -daemon          \t\t  " + _("Run in the background as a daemon and accept commands") + "\n" +
 #endif
             "  -testnet         \t\t  " + _("Use the test network") + "\n" +
+            "  -regtest         \t\t  " + _("Use a private regression test chain, where the generate command mines blocks instantly") + "\n" +
             "  -debug           \t\t  " + _("Output extra debugging information") + "\n" +
             "  -logtimestamps   \t  "   + _("Prepend debug output with timestamp") + "\n" +
             "  -printtoconsole  \t  "   + _("Send trace/debug info to console instead of debug.log file") + "\n" +
@@ -252,7 +256,17 @@ bool AppInit2(int argc, char* argv[])
     }
 
     fTestNet = GetBoolArg("-testnet");
-    if (fTestNet)
+    fRegTest = GetBoolArg("-regtest");
+    if (fRegTest)
+    {
+        // A private chain that uses the testnet rules and addresses,
+        // with no outside peers to find
+        fTestNet = true;
+        SoftSetBoolArg("-irc", false);
+        SoftSetBoolArg("-dnsseed", false);
+        SoftSetBoolArg("-upnp", false);
+    }
+    else if (fTestNet)
     {
         SoftSetBoolArg("-irc", true);
     }
@@ -352,6 +366,12 @@ bool AppInit2(int argc, char* argv[])
         strErrors << _("Error loading addr.dat") << "\n";
     printf(" addresses   %15"PRI64d"ms\n", GetTimeMillis() - nStart);
 
+    printf("Loading banlist...\n");
+    nStart = GetTimeMillis();
+    if (!LoadBanlist())
+        strErrors << _("Error loading banlist.dat") << "\n";
+    printf(" banlist     %15"PRI64d"ms\n", GetTimeMillis() - nStart);
+
     InitMessage(_("Loading block index..."));
     printf("Loading block index...\n");
     nStart = GetTimeMillis();
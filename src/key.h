@@ -14,6 +14,7 @@
 
 #include "serialize.h"
 #include "uint256.h"
+#include "secp256k1.h"
 
 // secp160k1
 // const unsigned int PRIVATE_KEY_SIZE = 192;
@@ -183,17 +184,21 @@ public:
         return vchPrivKey;
     }
 
-    bool SetPubKey(const std::vector<unsigned char>& vchPubKey)
+    bool SetPubKey(const unsigned char* pchPubKey, unsigned int nSize)
     {
-        const unsigned char* pbegin = &vchPubKey[0];
-        if (!o2i_ECPublicKey(&pkey, &pbegin, vchPubKey.size()))
+        if (!o2i_ECPublicKey(&pkey, &pchPubKey, nSize))
             return false;
         fSet = true;
-        if (vchPubKey.size() == 33)
+        if (nSize == 33)
             SetCompressedPubKey();
         return true;
     }
 
+    bool SetPubKey(const std::vector<unsigned char>& vchPubKey)
+    {
+        return SetPubKey(&vchPubKey[0], vchPubKey.size());
+    }
+
     std::vector<unsigned char> GetPubKey() const
     {
         unsigned int nSize = i2o_ECPublicKey(pkey, NULL);
@@ -293,14 +298,34 @@ public:
         return false;
     }
 
-    bool Verify(uint256 hash, const std::vector<unsigned char>& vchSig)
+    bool Verify(uint256 hash, const unsigned char* pchSig, unsigned int nSize)
+    {
+        // secp256k1.cpp does the work; OpenSSL only if the key won't export,
+        // or for a signature encoding secp256k1.cpp doesn't read
+        unsigned char pchPubKey[65];
+        CSecp256k1PubKey pubkey;
+        const EC_POINT* point = EC_KEY_get0_public_key(pkey);
+        if (point != NULL &&
+            EC_POINT_point2oct(EC_KEY_get0_group(pkey), point, POINT_CONVERSION_UNCOMPRESSED, pchPubKey, sizeof(pchPubKey), NULL) == sizeof(pchPubKey) &&
+            pubkey.SetPubKey(pchPubKey, sizeof(pchPubKey)) &&
+            Secp256k1IsLaxSignature(pchSig, nSize))
+            return Secp256k1Verify((unsigned char*)&hash, pchSig, nSize, pubkey);
+        return VerifyOpenSSL(hash, pchSig, nSize);
+    }
+
+    bool VerifyOpenSSL(uint256 hash, const unsigned char* pchSig, unsigned int nSize)
     {
         // -1 = error, 0 = bad sig, 1 = good
-        if (ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), pkey) != 1)
+        if (ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), pchSig, nSize, pkey) != 1)
             return false;
         return true;
     }
 
+    bool Verify(uint256 hash, const std::vector<unsigned char>& vchSig)
+    {
+        return Verify(hash, &vchSig[0], vchSig.size());
+    }
+
     // Verify a compact signature
     bool VerifyCompact(uint256 hash, const std::vector<unsigned char>& vchSig)
     {
@@ -30,6 +30,17 @@ CCriticalSection cs_main;
 
 static map<uint256, CTransaction> mapTransactions;
 CCriticalSection cs_mapTransactions;
+// Sigops of each transaction in mapTransactions, counted once when it was
+// accepted so CreateNewBlock doesn't walk its scripts again.  nP2SHSigOps
+// is -1 if its inputs weren't looked at.
+struct CTxPoolSigOps
+{
+    int nLegacySigOps;
+    int nP2SHSigOps;
+
+    CTxPoolSigOps() : nLegacySigOps(-1), nP2SHSigOps(-1) { }
+};
+static map<uint256, CTxPoolSigOps> mapTxPoolSigOps;
 unsigned int nTransactionsUpdated = 0;
 map<COutPoint, CInPoint> mapNextTx;
 
@@ -43,6 +54,7 @@ CBigNum bnBestInvalidWork = 0;
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
 int64 nTimeBestReceived = 0;
+CBlockProcessTimes blockprocesstimes;
 
 CMedianFilter<int> cPeerBlockCounts(5, 0); // Amount of blocks that other nodes claim to have
 
@@ -62,6 +74,7 @@ int64 nHPSTimerStart;
 
 // Settings
 int64 nTransactionFee = 0;
+bool fSkipSigsBeforeCheckpoint = true;
 
 
 
@@ -167,7 +180,10 @@ void static ResendWalletTransactions()
 // mapOrphanTransactions
 //
 
-void AddOrphanTx(const CDataStream& vMsg)
+// Which peer each orphan came from, to charge its memory to them
+map<uint256, int> mapOrphanTransactionsFrom;
+
+void AddOrphanTx(const CDataStream& vMsg, CNode* pfrom)
 {
     CTransaction tx;
     CDataStream(vMsg) >> tx;
@@ -178,6 +194,12 @@ void AddOrphanTx(const CDataStream& vMsg)
     CDataStream* pvMsg = mapOrphanTransactions[hash] = new CDataStream(vMsg);
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
         mapOrphanTransactionsByPrev.insert(make_pair(txin.prevout.hash, pvMsg));
+
+    if (pfrom)
+    {
+        mapOrphanTransactionsFrom[hash] = pfrom->id;
+        pfrom->nOrphanBytes += pvMsg->size();
+    }
 }
 
 void static EraseOrphanTx(uint256 hash)
@@ -198,6 +220,17 @@ void static EraseOrphanTx(uint256 hash)
                 mi++;
         }
     }
+
+    map<uint256, int>::iterator mi = mapOrphanTransactionsFrom.find(hash);
+    if (mi != mapOrphanTransactionsFrom.end())
+    {
+        CRITICAL_BLOCK(cs_vNodes)
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                if (pnode->id == (*mi).second)
+                    pnode->nOrphanBytes -= pvMsg->size();
+        mapOrphanTransactionsFrom.erase(mi);
+    }
+
     delete pvMsg;
     mapOrphanTransactions.erase(hash);
 }
@@ -461,6 +494,14 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
     if (pfMissingInputs)
         *pfMissingInputs = false;
 
+    // Do we already have it?  Asked first, because transactions are offered
+    // again (wallet resends, orphans) after they are already in the pool, and
+    // there's no need to check them again
+    uint256 hash = GetHash();
+    CRITICAL_BLOCK(cs_mapTransactions)
+        if (mapTransactions.count(hash))
+            return false;
+
     if (!CheckTransaction())
         return error("AcceptToMemoryPool() : CheckTransaction failed");
 
@@ -476,17 +517,13 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
     if (!fTestNet && !IsStandard())
         return error("AcceptToMemoryPool() : nonstandard transaction type");
 
-    // Do we already have it?
-    uint256 hash = GetHash();
-    CRITICAL_BLOCK(cs_mapTransactions)
-        if (mapTransactions.count(hash))
-            return false;
     if (fCheckInputs)
         if (txdb.ContainsTx(hash))
             return false;
 
     // Check for conflicts with in-memory transactions
     CTransaction* ptxOld = NULL;
+    int nP2SHSigOps = -1;
     for (int i = 0; i < vin.size(); i++)
     {
         COutPoint outpoint = vin[i].prevout;
@@ -534,6 +571,7 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
         // Note: if you modify this code to accept non-standard transactions, then
         // you should add code here to check that the transaction does a
         // reasonable number of ECDSA signature verifications.
+        nP2SHSigOps = GetP2SHSigOpCount(mapInputs);
 
         int64 nFees = GetValueIn(mapInputs)-GetValueOut();
         unsigned int nSize = ::GetSerializeSize(*this, SER_NETWORK);
@@ -573,6 +611,11 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
         {
             return error("AcceptToMemoryPool() : ConnectInputs failed %s", hash.ToString().substr(0,10).c_str());
         }
+
+        // Every input passed, so a block with this transaction in it can
+        // skip its scripts
+        for (int i = 0; i < vin.size(); i++)
+            scriptcheckcache.Insert(hash, i, true);
     }
 
     // Store transaction in memory
@@ -584,6 +627,7 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
             ptxOld->RemoveFromMemoryPool();
         }
         AddToMemoryPoolUnchecked();
+        mapTxPoolSigOps[hash].nP2SHSigOps = nP2SHSigOps;
     }
 
     ///// are we sure this is ok when loading transactions or restoring block txes
@@ -614,6 +658,9 @@ bool CTransaction::AddToMemoryPoolUnchecked()
         mapTransactions[hash] = *this;
         for (int i = 0; i < vin.size(); i++)
             mapNextTx[vin[i].prevout] = CInPoint(&mapTransactions[hash], i);
+        CTxPoolSigOps& sigops = mapTxPoolSigOps[hash];
+        sigops.nLegacySigOps = GetLegacySigOpCount();
+        sigops.nP2SHSigOps = -1;
         nTransactionsUpdated++;
         ++nPooledTx;
     }
@@ -631,7 +678,10 @@ bool CTransaction::RemoveFromMemoryPool()
         {
             BOOST_FOREACH(const CTxIn& txin, vin)
                 mapNextTx.erase(txin.prevout);
+            for (int i = 0; i < vin.size(); i++)
+                scriptcheckcache.Erase(hash, i, true);
             mapTransactions.erase(hash);
+            mapTxPoolSigOps.erase(hash);
             nTransactionsUpdated++;
             --nPooledTx;
         }
@@ -639,6 +689,17 @@ bool CTransaction::RemoveFromMemoryPool()
     return true;
 }
 
+void GetMemPoolTxids(vector<uint256>& vtxid)
+{
+    vtxid.clear();
+    CRITICAL_BLOCK(cs_mapTransactions)
+    {
+        vtxid.reserve(mapTransactions.size());
+        for (map<uint256, CTransaction>::iterator mi = mapTransactions.begin(); mi != mapTransactions.end(); ++mi)
+            vtxid.push_back((*mi).first);
+    }
+}
+
 
 
 
@@ -824,6 +885,10 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBl
     if (pindexLast == NULL)
         return nProofOfWorkLimit;
 
+    // Regtest never retargets, every block is a minimum difficulty one
+    if (fRegTest)
+        return nProofOfWorkLimit;
+
     // Only change once per interval
     if ((pindexLast->nHeight+1) % nInterval != 0)
     {
@@ -1104,7 +1169,8 @@ int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
 
 bool CTransaction::ConnectInputs(MapPrevTx inputs,
                                  map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                                 const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash)
+                                 const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash,
+                                 CSignatureBatch* pbatch)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1114,6 +1180,8 @@ bool CTransaction::ConnectInputs(MapPrevTx inputs,
     {
         int64 nValueIn = 0;
         int64 nFees = 0;
+        uint256 hashTx = GetHash();
+        CSignatureHasher hasher(*this);
         for (int i = 0; i < vin.size(); i++)
         {
             COutPoint prevout = vin[i].prevout;
@@ -1144,14 +1212,19 @@ bool CTransaction::ConnectInputs(MapPrevTx inputs,
             // Skip ECDSA signature verification when connecting blocks (fBlock=true)
             // before the last blockchain checkpoint. This is safe because block merkle hashes are
             // still computed and checked, and any change will be caught at the next checkpoint.
-            if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
+            // Inputs already checked when the transaction entered the memory
+            // pool aren't checked again.
+            if (!(fBlock && fSkipSigsBeforeCheckpoint && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())) &&
+                !scriptcheckcache.Contains(hashTx, i, fStrictPayToScriptHash))
             {
                 // Verify signature
-                if (!VerifySignature(txPrev, *this, i, fStrictPayToScriptHash, 0))
+                if (pbatch)
+                    pbatch->SetInput(hashTx, i);
+                if (!VerifySignature(txPrev, hasher, i, fStrictPayToScriptHash, 0, pbatch))
                 {
                     // only during transition phase for P2SH: do not invoke anti-DoS code for
                     // potentially old clients relaying bad P2SH transactions
-                    if (fStrictPayToScriptHash && VerifySignature(txPrev, *this, i, false, 0))
+                    if (fStrictPayToScriptHash && VerifySignature(txPrev, hasher, i, false, 0))
                         return error("ConnectInputs() : %s P2SH VerifySignature failed", GetHash().ToString().substr(0,10).c_str());
 
                     return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,10).c_str()));
@@ -1255,8 +1328,10 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
     // Check it again in case a previous version let a bad block in
+    int64 nTimeStart = GetTimeMicros();
     if (!CheckBlock())
         return false;
+    blockprocesstimes.nCheckBlock += GetTimeMicros() - nTimeStart;
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
@@ -1286,11 +1361,14 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     unsigned int nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK) - 1 + GetSizeOfCompactSize(vtx.size());
 
     map<uint256, CTxIndex> mapQueuedChanges;
+    CSignatureBatch batch;
     int64 nFees = 0;
     int nSigOps = 0;
-    BOOST_FOREACH(CTransaction& tx, vtx)
+    const vector<int>& vTxSigOpCounts = GetTxSigOpCounts();
+    for (unsigned int i = 0; i < vtx.size(); i++)
     {
-        nSigOps += tx.GetLegacySigOpCount();
+        CTransaction& tx = vtx[i];
+        nSigOps += vTxSigOpCounts[i];
         if (nSigOps > MAX_BLOCK_SIGOPS)
             return DoS(100, error("ConnectBlock() : too many sigops"));
 
@@ -1301,8 +1379,10 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
         if (!tx.IsCoinBase())
         {
             bool fInvalid;
+            nTimeStart = GetTimeMicros();
             if (!tx.FetchInputs(txdb, mapQueuedChanges, true, false, mapInputs, fInvalid))
                 return false;
+            blockprocesstimes.nFetchInputs += GetTimeMicros() - nTimeStart;
 
             if (fStrictPayToScriptHash)
             {
@@ -1316,19 +1396,31 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 
             nFees += tx.GetValueIn(mapInputs)-tx.GetValueOut();
 
-            if (!tx.ConnectInputs(mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, fStrictPayToScriptHash))
+            nTimeStart = GetTimeMicros();
+            if (!tx.ConnectInputs(mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, fStrictPayToScriptHash, &batch))
                 return false;
+            blockprocesstimes.nConnectInputs += GetTimeMicros() - nTimeStart;
         }
 
         mapQueuedChanges[tx.GetHash()] = CTxIndex(posThisTx, tx.vout.size());
     }
 
+    // The signatures ConnectInputs put off
+    nTimeStart = GetTimeMicros();
+    uint256 hashTxBad;
+    unsigned int nInBad;
+    if (!batch.Verify(hashTxBad, nInBad))
+        return DoS(100, error("ConnectBlock() : %s input %u VerifySignature failed", hashTxBad.ToString().substr(0,10).c_str(), nInBad));
+    blockprocesstimes.nConnectInputs += GetTimeMicros() - nTimeStart;
+
     // Write queued txindex changes
+    nTimeStart = GetTimeMicros();
     for (map<uint256, CTxIndex>::iterator mi = mapQueuedChanges.begin(); mi != mapQueuedChanges.end(); ++mi)
     {
         if (!txdb.UpdateTxIndex((*mi).first, (*mi).second))
             return error("ConnectBlock() : UpdateTxIndex failed");
     }
+    blockprocesstimes.nCommit += GetTimeMicros() - nTimeStart;
 
     if (vtx[0].GetValueOut() > GetBlockValue(pindex->nHeight, nFees))
         return false;
@@ -1468,8 +1560,12 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
         InvalidChainFound(pindexNew);
         return false;
     }
+    int64 nTimeStart = GetTimeMicros();
     if (!txdb.TxnCommit())
         return error("SetBestChain() : TxnCommit failed");
+    blockprocesstimes.nCommit += GetTimeMicros() - nTimeStart;
+    blockprocesstimes.nBlocks++;
+    blockprocesstimes.nTransactions += vtx.size();
 
     // Add to current best branch
     pindexNew->pprev->pnext = pindexNew;
@@ -1648,11 +1744,12 @@ bool CBlock::CheckBlock() const
         if (!tx.CheckTransaction())
             return DoS(tx.nDoS, error("CheckBlock() : CheckTransaction failed"));
 
+    // Counted afresh, then kept for ConnectBlock
+    vTxSigOps.clear();
+    const vector<int>& vSigOps = GetTxSigOpCounts();
     int nSigOps = 0;
-    BOOST_FOREACH(const CTransaction& tx, vtx)
-    {
-        nSigOps += tx.GetLegacySigOpCount();
-    }
+    BOOST_FOREACH(int nTxSigOps, vSigOps)
+        nSigOps += nTxSigOps;
     if (nSigOps > MAX_BLOCK_SIGOPS)
         return DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"));
 
@@ -1725,8 +1822,10 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
         return error("ProcessBlock() : already have block (orphan) %s", hash.ToString().substr(0,20).c_str());
 
     // Preliminary checks
+    int64 nTimeStart = GetTimeMicros();
     if (!pblock->CheckBlock())
         return error("ProcessBlock() : CheckBlock FAILED");
+    blockprocesstimes.nCheckBlock += GetTimeMicros() - nTimeStart;
 
     CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
     if (pcheckpoint && pblock->hashPrevBlock != hashBestChain)
@@ -1769,6 +1868,11 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     // Store to disk
     if (!pblock->AcceptBlock())
         return error("ProcessBlock() : AcceptBlock FAILED");
+    if (pfrom)
+    {
+        pfrom->nBlocksDelivered++;
+        pfrom->nLastBlockTime = GetTime();
+    }
 
     // Recursively process any orphan blocks that depended on this one
     vector<uint256> vWorkQueue;
@@ -1870,6 +1974,15 @@ bool LoadBlockIndex(bool fAllowNew)
         pchMessageStart[2] = 0xb5;
         pchMessageStart[3] = 0xda;
     }
+    if (fRegTest)
+    {
+        hashGenesisBlock = uint256("0x0f9188f13cb7b2c71f2a335e3a4fc328bf5beb436012afca590b1a11466e2206");
+        bnProofOfWorkLimit = CBigNum(~uint256(0) >> 1);
+        pchMessageStart[0] = 0xfb;
+        pchMessageStart[1] = 0xc0;
+        pchMessageStart[2] = 0xb6;
+        pchMessageStart[3] = 0xdb;
+    }
 
     //
     // Load block index
@@ -1917,6 +2030,11 @@ bool LoadBlockIndex(bool fAllowNew)
             block.nBits    = 0x1d07fff8;
             block.nNonce   = 384568319;
         }
+        if (fRegTest)
+        {
+            block.nBits    = 0x207fffff;
+            block.nNonce   = 2;
+        }
 
         //// debug print
         printf("%s\n", block.GetHash().ToString().c_str());
@@ -2138,7 +2256,8 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
     switch (inv.type)
     {
     case MSG_TX:    return mapTransactions.count(inv.hash) || mapOrphanTransactions.count(inv.hash) || txdb.ContainsTx(inv.hash);
-    case MSG_BLOCK: return mapBlockIndex.count(inv.hash) || mapOrphanBlocks.count(inv.hash);
+    case MSG_BLOCK:
+    case MSG_CMPCT_BLOCK: return mapBlockIndex.count(inv.hash) || mapOrphanBlocks.count(inv.hash);
     }
     // Don't know what it is, just say we already got one
     return true;
@@ -2147,6 +2266,137 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 
 
 
+CCompactBlock::CCompactBlock(const CBlock& block)
+{
+    header.nVersion       = block.nVersion;
+    header.hashPrevBlock  = block.hashPrevBlock;
+    header.hashMerkleRoot = block.hashMerkleRoot;
+    header.nTime          = block.nTime;
+    header.nBits          = block.nBits;
+    header.nNonce         = block.nNonce;
+    RAND_bytes((unsigned char*)&nSalt, sizeof(nSalt));
+    txCoinbase = block.vtx[0];
+    vShortTxId.reserve(block.vtx.size() - 1);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        vShortTxId.push_back(GetShortTxId(block.vtx[i].GetHash()));
+}
+
+// Compact blocks waiting for the "blocktxn" that completes them, with the
+// indexes of the transactions that are still missing.  Kept by the id of
+// the peer they were asked of, as only that peer may complete them.
+class CPartialBlock
+{
+public:
+    CBlock block;
+    vector<unsigned int> vMissing;
+    uint64 nSequence; // order of arrival, the lowest is evicted first
+};
+typedef map<pair<int, uint256>, CPartialBlock> MapPartialBlock;
+static MapPartialBlock mapPartialBlocks;
+static uint64 nPartialBlockSequence = 0;
+
+void static AddPartialBlock(int nNodeId, const CBlock& block, const vector<unsigned int>& vMissing)
+{
+    if (mapPartialBlocks.size() >= 16)
+    {
+        MapPartialBlock::iterator miOldest = mapPartialBlocks.begin();
+        for (MapPartialBlock::iterator mi = mapPartialBlocks.begin(); mi != mapPartialBlocks.end(); ++mi)
+            if ((*mi).second.nSequence < (*miOldest).second.nSequence)
+                miOldest = mi;
+        mapPartialBlocks.erase(miOldest);
+    }
+    CPartialBlock& partial = mapPartialBlocks[make_pair(nNodeId, block.GetHash())];
+    partial.block = block;
+    partial.vMissing = vMissing;
+    partial.nSequence = nPartialBlockSequence++;
+}
+
+bool static ReconstructCompactBlock(const CCompactBlock& cmpctblock, CBlock& block, vector<unsigned int>& vMissing)
+{
+    block = cmpctblock.header;
+    block.vtx.resize(cmpctblock.vShortTxId.size() + 1);
+    block.vtx[0] = cmpctblock.txCoinbase;
+
+    map<uint64, unsigned int> mapIndex;
+    for (unsigned int i = 0; i < cmpctblock.vShortTxId.size(); i++)
+        if (!mapIndex.insert(make_pair(cmpctblock.vShortTxId[i], i + 1)).second)
+            return false;
+
+    CRITICAL_BLOCK(cs_mapTransactions)
+    {
+        for (map<uint256, CTransaction>::iterator mi = mapTransactions.begin(); mi != mapTransactions.end(); ++mi)
+        {
+            map<uint64, unsigned int>::iterator it = mapIndex.find(cmpctblock.GetShortTxId((*mi).first));
+            if (it == mapIndex.end())
+                continue;
+            // Two of our transactions share a short id, can't tell which one is meant
+            if (!block.vtx[(*it).second].IsNull())
+                return false;
+            block.vtx[(*it).second] = (*mi).second;
+        }
+    }
+
+    vMissing.clear();
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        if (block.vtx[i].IsNull())
+            vMissing.push_back(i);
+    return true;
+}
+
+// Drop what a peer that is about to be deleted still has pending; requires cs_main
+void FinalizeNode(CNode* pnode)
+{
+    MapPartialBlock::iterator mi = mapPartialBlocks.lower_bound(make_pair(pnode->id, uint256(0)));
+    while (mi != mapPartialBlocks.end() && (*mi).first.first == pnode->id)
+        mapPartialBlocks.erase(mi++);
+}
+
+bool static ProcessCompactBlock(CNode* pfrom, CBlock& block)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    mapPartialBlocks.erase(make_pair(pfrom->id, inv.hash));
+    pfrom->mapCompactAsked.erase(inv.hash);
+
+    // A short id collision can put the wrong transaction in, which the
+    // merkle root catches.  That isn't the peer's fault, so just fetch
+    // the whole block instead.
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+    {
+        printf("compact block %s did not reconstruct, requesting full block\n", inv.hash.ToString().substr(0,20).c_str());
+        pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+        return false;
+    }
+
+    bool fRet = ProcessBlock(pfrom, &block);
+    if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+    return fRet;
+}
+
+bool static GetBlockMessage(CBlockIndex* pindex, bool fCompact, CSharedMessage& msgRet)
+{
+    // At a new tip every peer asks for the same block, so serialize it once
+    // and queue the same buffer to all of them
+    static uint256 hashLastBlock[2];
+    static CSharedMessage msgLastBlock[2];
+    uint256 hash = pindex->GetBlockHash();
+    if (!msgLastBlock[fCompact] || hashLastBlock[fCompact] != hash)
+    {
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+            return false;
+        if (fCompact)
+            msgLastBlock[fCompact] = MakeSharedMessage("cmpctblock", CCompactBlock(block));
+        else
+            msgLastBlock[fCompact] = MakeSharedMessage("block", block);
+        hashLastBlock[fCompact] = hash;
+    }
+    msgRet = msgLastBlock[fCompact];
+    return true;
+}
+
+
+
+
 // The message start string is designed to be unlikely to occur in normal data.
 // The characters are rarely used upper ascii, not valid as UTF-8, and produce
 // a large 4-byte int at any alignment.
@@ -2223,6 +2473,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         pfrom->PushMessage("verack");
         pfrom->vSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
 
+        // Offer compact blocks; older peers ignore the unknown message
+        if (pfrom->nVersion >= COMPACT_BLOCKS_VERSION)
+            pfrom->PushMessage("usecmpct", COMPACT_BLOCKS_FORMAT);
+
         if (!pfrom->fInbound)
         {
             // Advertise our address
@@ -2299,6 +2553,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             pfrom->Misbehaving(20);
             return error("message addr size() = %d", vAddr.size());
         }
+        bool fFullAddr = (vAddr.size() >= 1000);
+
+        // Neither store nor relay addresses in banned subnets
+        vector<CAddress> vAddrOk;
+        vAddrOk.reserve(vAddr.size());
+        BOOST_FOREACH(const CAddress& addr, vAddr)
+            if (!CNode::IsBanned(addr))
+                vAddrOk.push_back(addr);
+        vAddr.swap(vAddrOk);
 
         // Store the new addresses
         int64 nNow = GetAdjustedTime();
@@ -2319,7 +2582,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 CRITICAL_BLOCK(cs_vNodes)
                 {
                     // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                    // at a time so the addrKnown filters of the chosen nodes prevent repeats
                     static uint256 hashSalt;
                     if (hashSalt == 0)
                         RAND_bytes((unsigned char*)&hashSalt, sizeof(hashSalt));
@@ -2344,7 +2607,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             }
         }
         addrman.Add(vAddr, pfrom->addr, 2 * 60 * 60);
-        if (vAddr.size() < 1000)
+        if (!fFullAddr)
             pfrom->fGetAddr = false;
     }
 
@@ -2402,15 +2665,30 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 return true;
             printf("received getdata for: %s\n", inv.ToString().c_str());
 
-            if (inv.type == MSG_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 // Send block from disk
                 map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    CBlockIndex* pindex = (*mi).second;
+
+                    // Past the -maxuploadtarget only blocks from the last week
+                    // are served.  Disconnect rather than leave the peer
+                    // waiting for a block that isn't coming.
+                    if (CNode::OutboundTargetReached() && pindex->GetBlockTime() < GetAdjustedTime() - 7 * 24 * 60 * 60)
+                    {
+                        printf("historical block serving limit reached, disconnecting %s\n", pfrom->addr.ToString().c_str());
+                        pfrom->fDisconnect = true;
+                        break;
+                    }
+
+                    // Anything a few blocks below the tip is someone catching
+                    // up and can wait behind relay traffic
+                    bool fBulk = (pindex->nHeight < nBestHeight - 6);
+                    CSharedMessage msg;
+                    if (GetBlockMessage(pindex, inv.type == MSG_CMPCT_BLOCK, msg))
+                        pfrom->PushSharedMessage(msg, fBulk);
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -2420,7 +2698,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                         // wait for other stuff first.
                         vector<CInv> vInv;
                         vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
-                        pfrom->PushMessage("inv", vInv);
+                        pfrom->PushSharedMessage(MakeSharedMessage("inv", vInv), fBulk);
                         pfrom->hashContinue = 0;
                     }
                 }
@@ -2430,9 +2708,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 // Send stream from relay memory
                 CRITICAL_BLOCK(cs_mapRelay)
                 {
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSharedMessage>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end())
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushSharedMessage((*mi).second);
                 }
             }
 
@@ -2525,13 +2803,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
+        downloadscheduler.Received(inv);
 
         bool fMissingInputs = false;
         if (tx.AcceptToMemoryPool(true, &fMissingInputs))
         {
+            pfrom->nTxDelivered++;
+            pfrom->nLastTxTime = GetTime();
             SyncWithWallets(tx, NULL, true);
             RelayMessage(inv, vMsg);
-            mapAlreadyAskedFor.erase(inv);
             vWorkQueue.push_back(inv.hash);
 
             // Recursively process any orphan transactions that depended on this one
@@ -2552,7 +2832,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                         printf("   accepted orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
                         SyncWithWallets(tx, NULL, true);
                         RelayMessage(inv, vMsg);
-                        mapAlreadyAskedFor.erase(inv);
+                        downloadscheduler.Received(inv);
                         vWorkQueue.push_back(inv.hash);
                     }
                 }
@@ -2564,7 +2844,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         else if (fMissingInputs)
         {
             printf("storing orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
-            AddOrphanTx(vMsg);
+            AddOrphanTx(vMsg, pfrom);
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
@@ -2585,13 +2865,139 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         CInv inv(MSG_BLOCK, block.GetHash());
         pfrom->AddInventoryKnown(inv);
+        downloadscheduler.Received(inv);
+        pfrom->mapCompactAsked.erase(inv.hash);
 
-        if (ProcessBlock(pfrom, &block))
-            mapAlreadyAskedFor.erase(inv);
+        ProcessBlock(pfrom, &block);
         if (block.nDoS) pfrom->Misbehaving(block.nDoS);
     }
 
 
+    else if (strCommand == "usecmpct")
+    {
+        int nFormat;
+        vRecv >> nFormat;
+        pfrom->fCompactBlocks = (nFormat == COMPACT_BLOCKS_FORMAT);
+    }
+
+
+    else if (strCommand == "cmpctblock")
+    {
+        CCompactBlock cmpctblock;
+        vRecv >> cmpctblock;
+
+        uint256 hashBlock = cmpctblock.GetHash();
+        printf("received compact block %s (%d short ids)\n", hashBlock.ToString().substr(0,20).c_str(), cmpctblock.vShortTxId.size());
+
+        // Check before ReconstructCompactBlock sizes a block for it
+        if (cmpctblock.vShortTxId.size() > MAX_COMPACT_BLOCK_TXS)
+        {
+            pfrom->Misbehaving(100);
+            return error("message cmpctblock : %d short ids is more than a block can hold", cmpctblock.vShortTxId.size());
+        }
+
+        CInv inv(MSG_BLOCK, hashBlock);
+        pfrom->AddInventoryKnown(inv);
+
+        // Only rebuild what we asked this peer for; a header with the
+        // minimum proof of work is cheap enough to make up
+        if (!pfrom->mapCompactAsked.count(hashBlock))
+            return true;
+
+        // Don't go through the memory pool for a header that isn't even valid
+        if (!CheckProofOfWork(hashBlock, cmpctblock.header.nBits))
+        {
+            pfrom->Misbehaving(50);
+            return error("message cmpctblock : proof of work failed");
+        }
+        // Any missing transactions are asked of this same peer directly,
+        // and SendMessages asks it for the full block if they don't come
+        downloadscheduler.Received(inv);
+        if (mapBlockIndex.count(hashBlock) || mapOrphanBlocks.count(hashBlock))
+        {
+            pfrom->mapCompactAsked.erase(hashBlock);
+            return true;
+        }
+
+        CBlock block;
+        vector<unsigned int> vMissing;
+        if (!ReconstructCompactBlock(cmpctblock, block, vMissing))
+        {
+            // Ambiguous short ids, fall back to the full block
+            pfrom->mapCompactAsked.erase(hashBlock);
+            pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+        }
+        else if (vMissing.empty())
+        {
+            ProcessCompactBlock(pfrom, block);
+        }
+        else
+        {
+            printf("compact block %s missing %d of %d transactions\n", hashBlock.ToString().substr(0,20).c_str(), vMissing.size(), block.vtx.size());
+            AddPartialBlock(pfrom->id, block, vMissing);
+            pfrom->PushMessage("getblocktxn", hashBlock, vMissing);
+        }
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        uint256 hashBlock;
+        vector<unsigned int> vIndexes;
+        vRecv >> hashBlock >> vIndexes;
+
+        // Compact blocks are only asked for near the tip.  Anything older
+        // has to come through getdata, which keeps to -maxuploadtarget and
+        // the bulk queue.
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi == mapBlockIndex.end() || (*mi).second->nHeight < nBestHeight - 6)
+            return true;
+        CBlock block;
+        if (!block.ReadFromDisk((*mi).second))
+            return true;
+
+        vector<CTransaction> vtx;
+        vtx.reserve(vIndexes.size());
+        BOOST_FOREACH(unsigned int nIndex, vIndexes)
+        {
+            if (nIndex >= block.vtx.size())
+            {
+                pfrom->Misbehaving(20);
+                return error("message getblocktxn : index %u out of range", nIndex);
+            }
+            vtx.push_back(block.vtx[nIndex]);
+        }
+        pfrom->PushMessage("blocktxn", hashBlock, vtx);
+    }
+
+
+    else if (strCommand == "blocktxn")
+    {
+        uint256 hashBlock;
+        vector<CTransaction> vtx;
+        vRecv >> hashBlock >> vtx;
+
+        // Only what was asked of this peer; anyone else's blocktxn is ignored
+        MapPartialBlock::iterator mi = mapPartialBlocks.find(make_pair(pfrom->id, hashBlock));
+        if (mi == mapPartialBlocks.end())
+            return true;
+        CBlock& block = (*mi).second.block;
+        const vector<unsigned int>& vMissing = (*mi).second.vMissing;
+        if (vtx.size() != vMissing.size())
+        {
+            mapPartialBlocks.erase(mi);
+            pfrom->mapCompactAsked.erase(hashBlock);
+            pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, hashBlock)));
+            return error("message blocktxn : got %d transactions, asked for %d", vtx.size(), vMissing.size());
+        }
+        for (unsigned int i = 0; i < vMissing.size(); i++)
+            block.vtx[vMissing[i]] = vtx[i];
+
+        CBlock blockComplete = block;
+        ProcessCompactBlock(pfrom, blockComplete);
+    }
+
+
     else if (strCommand == "getaddr")
     {
         pfrom->vAddrToSend.clear();
@@ -2650,6 +3056,27 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "ping")
     {
+        if (pfrom->nVersion >= PING_NONCE_VERSION)
+        {
+            // Echo the nonce so the other side can match it to its ping
+            uint64 nonce = 0;
+            vRecv >> nonce;
+            pfrom->PushMessage("pong", nonce);
+        }
+    }
+
+
+    else if (strCommand == "pong")
+    {
+        uint64 nonce = 0;
+        vRecv >> nonce;
+        if (nonce != 0 && nonce == pfrom->nPingNonceSent)
+        {
+            pfrom->nPingUsecTime = GetTimeMicros() - pfrom->nPingUsecStart;
+            pfrom->nPingNonceSent = 0;
+            if (!pfrom->fInbound)
+                addrman.UpdateLatency(pfrom->addr, 0, max((int64)1, pfrom->nPingUsecTime / 1000));
+        }
     }
 
 
@@ -2744,6 +3171,14 @@ bool ProcessMessages(CNode* pfrom)
             break;
         }
 
+        // Don't answer requests for data while the answers to earlier ones
+        // are still queued beyond the limit; wait for them to drain
+        if ((strCommand == "getdata" || strCommand == "getblocks") && pfrom->SendQueueFull())
+        {
+            vRecv.insert(vRecv.begin(), vHeaderSave.begin(), vHeaderSave.end());
+            break;
+        }
+
         // Checksum
         uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
         unsigned int nChecksum = 0;
@@ -2759,12 +3194,31 @@ bool ProcessMessages(CNode* pfrom)
         CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
         vRecv.ignore(nMessageSize);
 
+        // Peers choose the command names, so don't let them add
+        // entries to the per command statistics without limit
+        string strStatsCommand = strCommand;
+        CRITICAL_BLOCK(pfrom->cs_stats)
+        {
+            if (pfrom->mapRecvBytesPerCommand.size() >= 64 && !pfrom->mapRecvBytesPerCommand.count(strCommand))
+                strStatsCommand = "*other*";
+            pfrom->mapRecvBytesPerCommand[strStatsCommand] += nHeaderSize + nMessageSize;
+        }
+
         // Process message
         bool fRet = false;
+        int64 nTimeStart = 0;
         try
         {
             CRITICAL_BLOCK(cs_main)
+            {
+                nTimeStart = GetTimeMicros();
                 fRet = ProcessMessage(pfrom, strCommand, vMsg);
+                int64 nElapsed = GetTimeMicros() - nTimeStart;
+                pfrom->nProcessUsec += nElapsed;
+                CRITICAL_BLOCK(pfrom->cs_stats)
+                    pfrom->mapProcessTimePerCommand[strStatsCommand] += nElapsed;
+                nTimeStart = 0;
+            }
             if (fShutdown)
                 return true;
         }
@@ -2791,11 +3245,21 @@ bool ProcessMessages(CNode* pfrom)
             PrintExceptionContinue(NULL, "ProcessMessage()");
         }
 
+        // Charge the time of messages that threw as well
+        if (nTimeStart != 0)
+        {
+            int64 nElapsed = GetTimeMicros() - nTimeStart;
+            pfrom->nProcessUsec += nElapsed;
+            CRITICAL_BLOCK(pfrom->cs_stats)
+                pfrom->mapProcessTimePerCommand[strStatsCommand] += nElapsed;
+        }
+
         if (!fRet)
             printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
     }
 
     vRecv.Compact();
+    pfrom->nRecvBufferBytes = vRecv.size();
     return true;
 }
 
@@ -2808,8 +3272,22 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (pto->nVersion == 0)
             return true;
 
-        // Keep-alive ping
-        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSend.empty())
+        // Peers that answer with a pong are pinged every couple of minutes to
+        // keep their round trip time current, older ones only for keep-alive
+        if (pto->nVersion >= PING_NONCE_VERSION)
+        {
+            int64 nSincePing = GetTimeMicros() - pto->nPingUsecStart;
+            if ((pto->nPingNonceSent == 0 && nSincePing > 2 * 60 * 1000000) || nSincePing > 30 * 60 * 1000000LL)
+            {
+                uint64 nonce = 0;
+                while (nonce == 0)
+                    RAND_bytes((unsigned char*)&nonce, sizeof(nonce));
+                pto->nPingNonceSent = nonce;
+                pto->nPingUsecStart = GetTimeMicros();
+                pto->PushMessage("ping", nonce);
+            }
+        }
+        else if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->nSendSize == 0)
             pto->PushMessage("ping");
 
         // Resend wallet transactions that haven't gotten in a block yet
@@ -2823,9 +3301,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             {
                 BOOST_FOREACH(CNode* pnode, vNodes)
                 {
-                    // Periodically clear setAddrKnown to allow refresh broadcasts
+                    // Periodically clear addrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
-                        pnode->setAddrKnown.clear();
+                        pnode->addrKnown.reset();
 
                     // Rebroadcast our address
                     if (!fNoListen && !fUseProxy && addrLocalHost.IsRoutable())
@@ -2848,9 +3326,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                if (!pto->addrKnown.contains(addr.GetKey()))
                 {
+                    pto->addrKnown.insert(addr.GetKey());
                     vAddr.push_back(addr);
                     // receiver rejects addr messages larger than 1000
                     if (vAddr.size() >= 1000)
@@ -2877,7 +3355,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -2907,9 +3385,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                if (!pto->filterInventoryKnown.contains(inv.hash))
                 {
+                    pto->filterInventoryKnown.insert(inv.hash);
                     vInv.push_back(inv);
                     if (vInv.size() >= 1000)
                     {
@@ -2928,23 +3406,51 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata
         //
         vector<CInv> vGetData;
-        int64 nNow = GetTime() * 1000000;
+        vector<CInv> vRequest;
+        int64 nNow = GetTime();
+        downloadscheduler.GetRequests(pto, nNow, vRequest);
         CTxDB txdb("r");
-        while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
+
+        // Compact blocks the peer hasn't completed in time are asked for whole
+        for (map<uint256, int64>::iterator mi = pto->mapCompactAsked.begin(); mi != pto->mapCompactAsked.end();)
         {
-            const CInv& inv = (*pto->mapAskFor.begin()).second;
+            if (nNow - (*mi).second < COMPACT_BLOCK_TIMEOUT)
+            {
+                ++mi;
+                continue;
+            }
+            CInv inv(MSG_BLOCK, (*mi).first);
+            pto->mapCompactAsked.erase(mi++);
+            mapPartialBlocks.erase(make_pair(pto->id, inv.hash));
             if (!AlreadyHave(txdb, inv))
             {
-                printf("sending getdata: %s\n", inv.ToString().c_str());
+                printf("compact block %s timed out, requesting full block\n", inv.hash.ToString().substr(0,20).c_str());
                 vGetData.push_back(inv);
-                if (vGetData.size() >= 1000)
-                {
-                    pto->PushMessage("getdata", vGetData);
-                    vGetData.clear();
-                }
             }
-            mapAlreadyAskedFor[inv] = nNow;
-            pto->mapAskFor.erase(pto->mapAskFor.begin());
+        }
+
+        BOOST_FOREACH(const CInv& inv, vRequest)
+        {
+            if (AlreadyHave(txdb, inv))
+            {
+                downloadscheduler.Received(inv);
+                continue;
+            }
+            printf("sending getdata: %s\n", inv.ToString().c_str());
+            // Once we're caught up, peers that said they know compact blocks
+            // only need to send what isn't already in our memory pool
+            if (inv.type == MSG_BLOCK && pto->fCompactBlocks && !IsInitialBlockDownload())
+            {
+                vGetData.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                pto->mapCompactAsked[inv.hash] = nNow;
+            }
+            else
+                vGetData.push_back(inv);
+            if (vGetData.size() >= 1000)
+            {
+                pto->PushMessage("getdata", vGetData);
+                vGetData.clear();
+            }
         }
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
@@ -3161,6 +3667,7 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
             double dPriority = -(*mapPriority.begin()).first;
             CTransaction& tx = *(*mapPriority.begin()).second;
             mapPriority.erase(mapPriority.begin());
+            uint256 hash = tx.GetHash();
 
             // Size limits
             unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK);
@@ -3168,7 +3675,8 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
                 continue;
 
             // Legacy limits on sigOps:
-            int nTxSigOps = tx.GetLegacySigOpCount();
+            const CTxPoolSigOps& sigops = mapTxPoolSigOps[hash];
+            int nTxSigOps = (sigops.nLegacySigOps >= 0 ? sigops.nLegacySigOps : tx.GetLegacySigOpCount());
             if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
                 continue;
 
@@ -3188,13 +3696,13 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
             if (nTxFees < nMinFee)
                 continue;
 
-            nTxSigOps += tx.GetP2SHSigOpCount(mapInputs);
+            nTxSigOps += (sigops.nP2SHSigOps >= 0 ? sigops.nP2SHSigOps : tx.GetP2SHSigOpCount(mapInputs));
             if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
                 continue;
 
             if (!tx.ConnectInputs(mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true))
                 continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
+            mapTestPoolTmp[hash] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
             swap(mapTestPool, mapTestPoolTmp);
 
             // Added
@@ -3205,7 +3713,6 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
             nFees += nTxFees;
 
             // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
             if (mapDependers.count(hash))
             {
                 BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
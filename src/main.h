@@ -52,6 +52,35 @@ static const int fHaveUPnP = false;
 
 extern CScript COINBASE_FLAGS;
 
+/** Time spent connecting blocks to the best chain, in microseconds, for
+ * benchmarking.  Guarded by cs_main.
+ */
+class CBlockProcessTimes
+{
+public:
+    int64 nCheckBlock;
+    int64 nFetchInputs;
+    int64 nConnectInputs;
+    int64 nCommit; // txindex writes and the TxnCommit
+    int nBlocks;
+    int64 nTransactions;
+
+    CBlockProcessTimes()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        nCheckBlock = 0;
+        nFetchInputs = 0;
+        nConnectInputs = 0;
+        nCommit = 0;
+        nBlocks = 0;
+        nTransactions = 0;
+    }
+};
+
 
 
 
@@ -76,9 +105,11 @@ extern int64 nHPSTimerStart;
 extern int64 nTimeBestReceived;
 extern CCriticalSection cs_setpwalletRegistered;
 extern std::set<CWallet*> setpwalletRegistered;
+extern CBlockProcessTimes blockprocesstimes;
 
 // Settings
 extern int64 nTransactionFee;
+extern bool fSkipSigsBeforeCheckpoint;
 
 
 
@@ -98,6 +129,7 @@ bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
+void FinalizeNode(CNode* pnode);
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
 CBlock* CreateNewBlock(CReserveKey& reservekey);
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
@@ -107,6 +139,7 @@ bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int ComputeMinWork(unsigned int nBase, int64 nTime);
 int GetNumBlocksOfPeers();
 bool IsInitialBlockDownload();
+void GetMemPoolTxids(std::vector<uint256>& vtxid);
 std::string GetWarnings(std::string strFor);
 
 
@@ -675,11 +708,13 @@ public:
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
         @param[in] fStrictPayToScriptHash	true if fully validating p2sh transactions
+        @param[in,out] pbatch	if given, signature checks that can wait are added to it, and pass only once it verifies
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash=true);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash=true,
+                       CSignatureBatch* pbatch=NULL);
     bool ClientConnectInputs();
     bool CheckTransaction() const;
     bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
@@ -832,6 +867,7 @@ public:
 
     // memory only
     mutable std::vector<uint256> vMerkleTree;
+    mutable std::vector<int> vTxSigOps;
 
     // Denial-of-service detection:
     mutable int nDoS;
@@ -869,6 +905,7 @@ public:
         nNonce = 0;
         vtx.clear();
         vMerkleTree.clear();
+        vTxSigOps.clear();
         nDoS = 0;
     }
 
@@ -890,6 +927,20 @@ public:
     void UpdateTime(const CBlockIndex* pindexPrev);
 
 
+    // Legacy sigop count of each transaction in vtx.  CheckBlock counts
+    // them and ConnectBlock reuses its counts for the same block.
+    const std::vector<int>& GetTxSigOpCounts() const
+    {
+        if (vTxSigOps.size() != vtx.size())
+        {
+            vTxSigOps.clear();
+            vTxSigOps.reserve(vtx.size());
+            BOOST_FOREACH(const CTransaction& tx, vtx)
+                vTxSigOps.push_back(tx.GetLegacySigOpCount());
+        }
+        return vTxSigOps;
+    }
+
     uint256 BuildMerkleTree() const
     {
         vMerkleTree.clear();
@@ -1033,6 +1084,76 @@ private:
 
 
 
+// The compact block messages as this client speaks them, sent in "usecmpct".
+// A peer sending any other number is treated as not knowing them.
+static const int COMPACT_BLOCKS_FORMAT = 1;
+
+// How long a peer gets to complete a compact block, before it is asked for
+// the full block instead
+static const int COMPACT_BLOCK_TIMEOUT = 10;
+
+// The most short ids a compact block can carry.  The smallest transaction
+// is 60 bytes: one input and one output, both with empty scripts.
+static const unsigned int MAX_COMPACT_BLOCK_TXS = MAX_BLOCK_SIZE / 60;
+
+/** Compact form of a block for peers that already hold most of its
+ * transactions in their memory pool: the header, the coinbase and a short
+ * salted id for every other transaction.  The receiver rebuilds the block
+ * from mapTransactions and asks for whatever it lacks with "getblocktxn".
+ */
+class CCompactBlock
+{
+public:
+    CBlock header;
+    uint64 nSalt;
+    CTransaction txCoinbase;
+    std::vector<uint64> vShortTxId;
+
+    CCompactBlock()
+    {
+        SetNull();
+    }
+
+    explicit CCompactBlock(const CBlock& block);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header.nVersion);
+        READWRITE(header.hashPrevBlock);
+        READWRITE(header.hashMerkleRoot);
+        READWRITE(header.nTime);
+        READWRITE(header.nBits);
+        READWRITE(header.nNonce);
+        READWRITE(nSalt);
+        READWRITE(txCoinbase);
+        READWRITE(vShortTxId);
+    )
+
+    void SetNull()
+    {
+        header.SetNull();
+        nSalt = 0;
+        txCoinbase.SetNull();
+        vShortTxId.clear();
+    }
+
+    uint256 GetHash() const
+    {
+        return header.GetHash();
+    }
+
+    uint64 GetShortTxId(const uint256& hashTx) const
+    {
+        uint256 hash = Hash(BEGIN(nSalt), END(nSalt), BEGIN(hashTx), END(hashTx));
+        return hash.Get64();
+    }
+};
+
+
+
+
+
+
 /** The block chain is a tree shaped structure starting with the
  * genesis block at the root, with each block potentially having multiple
  * candidates to be the next block.  pprev and pnext link a path through the
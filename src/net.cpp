@@ -35,7 +35,7 @@ void ThreadOpenAddedConnections2(void* parg);
 void ThreadMapPort2(void* parg);
 #endif
 void ThreadDNSAddressSeed2(void* parg);
-bool OpenNetworkConnection(const CAddress& addrConnect);
+bool OpenNetworkConnection(const CAddress& addrConnect, bool fExplicit=false);
 
 
 
@@ -52,13 +52,14 @@ uint64 nLocalHostNonce = 0;
 array<int, THREAD_MAX> vnThreadsRunning;
 static SOCKET hListenSocket = INVALID_SOCKET;
 CAddrMan addrman;
+CBanList banlist;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSharedMessage> mapRelay;
 deque<pair<int64, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
-map<CInv, int64> mapAlreadyAskedFor;
+CDownloadScheduler downloadscheduler;
 
 
 set<CNetAddr> setservAddNodeAddresses;
@@ -71,6 +72,39 @@ unsigned short GetListenPort()
     return (unsigned short)(GetArg("-port", GetDefaultPort()));
 }
 
+void SetMessageHeader(CDataStream& ss, unsigned int nHeaderStart, unsigned int nMessageStart)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - nMessageStart;
+    memcpy((char*)&ss[nHeaderStart] + offsetof(CMessageHeader, nMessageSize), &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + nMessageStart, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(nMessageStart - nHeaderStart >= offsetof(CMessageHeader, nChecksum) + sizeof(nChecksum));
+    memcpy((char*)&ss[nHeaderStart] + offsetof(CMessageHeader, nChecksum), &nChecksum, sizeof(nChecksum));
+}
+
+void RelayMessage(const CInv& inv, const CSharedMessage& msg)
+{
+    CRITICAL_BLOCK(cs_mapRelay)
+    {
+        // Expire old relay messages
+        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
+        {
+            mapRelay.erase(vRelayExpiration.front().second);
+            vRelayExpiration.pop_front();
+        }
+
+        // Save original serialized message so newer versions are preserved
+        mapRelay[inv] = msg;
+        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
+    }
+
+    RelayInventory(inv);
+}
+
 void CNode::PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd)
 {
     // Filter out duplicate requests
@@ -266,7 +300,7 @@ void ThreadGetMyExternalIP(void* parg)
         if (addrLocalHost.IsRoutable())
         {
             // If we already connected to a few before we had our IP, go back and addr them.
-            // setAddrKnown automatically filters any duplicate sends.
+            // addrKnown automatically filters any duplicate sends.
             CAddress addr(addrLocalHost);
             addr.nTime = GetAdjustedTime();
             CRITICAL_BLOCK(cs_vNodes)
@@ -435,12 +469,16 @@ CNode* ConnectNode(CAddress addrConnect, int64 nTimeout)
 
     addrman.Attempt(addrConnect);
 
-    // Connect
+    // Connect.  Going through a proxy needs the SOCKS handshake, which
+    // ConnectSocket does blocking.  Direct connections are only started here
+    // and finished by ThreadSocketHandler2, so several can be in flight.
     SOCKET hSocket;
-    if (ConnectSocket(addrConnect, hSocket))
+    bool fConnecting = false;
+    bool fProxy = (fUseProxy && addrConnect.IsRoutable());
+    if (fProxy ? ConnectSocket(addrConnect, hSocket) : StartConnectSocket(addrConnect, hSocket, fConnecting))
     {
         /// debug print
-        printf("connected %s\n", addrConnect.ToString().c_str());
+        printf("%s %s\n", fConnecting ? "connecting" : "connected", addrConnect.ToString().c_str());
 
         // Set to nonblocking
 #ifdef WIN32
@@ -454,6 +492,8 @@ CNode* ConnectNode(CAddress addrConnect, int64 nTimeout)
 
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, false);
+        pnode->fConnecting = fConnecting;
+        pnode->nConnectStart = GetTimeMicros();
         if (nTimeout != 0)
             pnode->AddRef(nTimeout);
         else
@@ -493,6 +533,212 @@ void CNode::Cleanup()
     for (unsigned int nChannel = 0; nChannel < vfSubscribe.size(); nChannel++)
         if (vfSubscribe[nChannel])
             CancelSubscribe(nChannel);
+
+    // Anything still requested from us has to come from someone else
+    downloadscheduler.RemovePeer(this);
+}
+
+
+void CDownloadScheduler::AskFor(CNode* pnode, const CInv& inv, int64 nNow)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        // Don't recreate state for a peer RemovePeer has already dropped
+        if (pnode->fDisconnect)
+            return;
+
+        map<CInv, CDownloadItem>::iterator mi = mapItems.find(inv);
+        if (mi == mapItems.end())
+        {
+            if (mapItems.size() >= MAX_ITEMS)
+                return;
+            mi = mapItems.insert(make_pair(inv, CDownloadItem())).first;
+            (*mi).second.nFirstSeen = nNow;
+        }
+        CDownloadItem& item = (*mi).second;
+        if (find(item.vAnnouncers.begin(), item.vAnnouncers.end(), pnode) != item.vAnnouncers.end())
+            return;
+
+        CDownloadPeer& peer = mapPeers[pnode];
+        if (item.vAnnouncers.size() >= MAX_ANNOUNCERS || peer.vQueue.size() >= MAX_PEER_QUEUE)
+        {
+            if (item.vAnnouncers.empty())
+                mapItems.erase(mi);
+            return;
+        }
+        item.vAnnouncers.push_back(pnode);
+
+        // While it's in flight elsewhere this peer is only a fallback,
+        // Requeue puts it in the queue if it's needed
+        if (item.pnodeInFlight == NULL)
+            peer.vQueue.push_back(inv);
+    }
+}
+
+void CDownloadScheduler::GetRequests(CNode* pnode, int64 nNow, vector<CInv>& vRequestRet)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        ExpireRequests(nNow);
+
+        if (pnode->fDisconnect)
+            return;
+        map<CNode*, CDownloadPeer>::iterator pi = mapPeers.find(pnode);
+        if (pi == mapPeers.end())
+            return;
+        CDownloadPeer& peer = (*pi).second;
+
+        // Deferred entries go to the back, so look at each one at most once
+        unsigned int nEntries = peer.vQueue.size();
+        while (nEntries-- > 0 && !peer.vQueue.empty() && peer.nInFlight < MAX_PEER_IN_FLIGHT)
+        {
+            CInv inv = peer.vQueue.front();
+            peer.vQueue.pop_front();
+
+            // Entries go stale when the item arrives or the request times out,
+            // they're cheaper to skip here than to search for
+            map<CInv, CDownloadItem>::iterator mi = mapItems.find(inv);
+            if (mi == mapItems.end())
+                continue;
+            CDownloadItem& item = (*mi).second;
+            if (item.pnodeInFlight != NULL)
+                continue;
+            if (find(item.vAnnouncers.begin(), item.vAnnouncers.end(), pnode) == item.vAnnouncers.end())
+                continue;
+
+            // Give the best peer the first chance at a new block
+            if (inv.type != MSG_TX && nNow - item.nFirstSeen < BLOCK_PREFER_WAIT && GetBestAnnouncer(item) != pnode)
+            {
+                peer.vQueue.push_back(inv);
+                continue;
+            }
+
+            item.pnodeInFlight = pnode;
+            item.nTimeout = nNow + (inv.type == MSG_TX ? TX_TIMEOUT : BLOCK_TIMEOUT);
+            item.nRequestMicros = GetTimeMicros();
+            setTimeouts.insert(make_pair(item.nTimeout, inv));
+            peer.nInFlight++;
+            vRequestRet.push_back(inv);
+        }
+    }
+}
+
+void CDownloadScheduler::Received(const CInv& inv)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        map<CInv, CDownloadItem>::iterator mi = mapItems.find(inv);
+        if (mi == mapItems.end())
+            return;
+        CDownloadItem& item = (*mi).second;
+        if (item.pnodeInFlight != NULL)
+        {
+            CDownloadPeer& peer = mapPeers[item.pnodeInFlight];
+            peer.nInFlight--;
+            setTimeouts.erase(make_pair(item.nTimeout, inv));
+
+            if (inv.type != MSG_TX)
+            {
+                int64 nResponseTime = GetTimeMicros() - item.nRequestMicros;
+                peer.nBlockResponseTime = peer.nBlockResponseTime ? (3 * peer.nBlockResponseTime + nResponseTime) / 4 : nResponseTime;
+            }
+        }
+        mapItems.erase(mi);
+    }
+}
+
+void CDownloadScheduler::RemovePeer(CNode* pnode)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        mapPeers.erase(pnode);
+
+        map<CInv, CDownloadItem>::iterator mi = mapItems.begin();
+        while (mi != mapItems.end())
+        {
+            map<CInv, CDownloadItem>::iterator miCur = mi++;
+            CDownloadItem& item = (*miCur).second;
+            item.vAnnouncers.erase(remove(item.vAnnouncers.begin(), item.vAnnouncers.end(), pnode), item.vAnnouncers.end());
+            if (item.pnodeInFlight == pnode)
+            {
+                setTimeouts.erase(make_pair(item.nTimeout, (*miCur).first));
+                item.pnodeInFlight = NULL;
+                Requeue(miCur);
+            }
+            else if (item.pnodeInFlight == NULL && item.vAnnouncers.empty())
+                mapItems.erase(miCur);
+        }
+    }
+}
+
+int CDownloadScheduler::size() const
+{
+    CRITICAL_BLOCK(cs)
+        return mapItems.size();
+    return 0;
+}
+
+// Lower is better.  Caller holds cs.
+int64 CDownloadScheduler::GetPeerScore(CNode* pnode)
+{
+    int64 nScore = (pnode->nPingUsecTime > 0 ? pnode->nPingUsecTime : 1000000);
+    map<CNode*, CDownloadPeer>::iterator pi = mapPeers.find(pnode);
+    if (pi != mapPeers.end())
+        nScore += (*pi).second.nBlockResponseTime;
+    return nScore;
+}
+
+// Caller holds cs
+CNode* CDownloadScheduler::GetBestAnnouncer(const CDownloadItem& item)
+{
+    CNode* pnodeBest = NULL;
+    int64 nBestScore = 0;
+    BOOST_FOREACH(CNode* pnode, item.vAnnouncers)
+    {
+        int64 nScore = GetPeerScore(pnode);
+        if (pnodeBest == NULL || nScore < nBestScore)
+        {
+            pnodeBest = pnode;
+            nBestScore = nScore;
+        }
+    }
+    return pnodeBest;
+}
+
+// Give an item that is no longer in flight to the remaining announcers,
+// or drop it if nobody else has it.  Caller holds cs.
+void CDownloadScheduler::Requeue(map<CInv, CDownloadItem>::iterator mi)
+{
+    CDownloadItem& item = (*mi).second;
+    if (item.vAnnouncers.empty())
+    {
+        mapItems.erase(mi);
+        return;
+    }
+    BOOST_FOREACH(CNode* pnode, item.vAnnouncers)
+        mapPeers[pnode].vQueue.push_front((*mi).first);
+}
+
+// Caller holds cs
+void CDownloadScheduler::ExpireRequests(int64 nNow)
+{
+    while (!setTimeouts.empty() && (*setTimeouts.begin()).first <= nNow)
+    {
+        CInv inv = (*setTimeouts.begin()).second;
+        setTimeouts.erase(setTimeouts.begin());
+
+        map<CInv, CDownloadItem>::iterator mi = mapItems.find(inv);
+        if (mi == mapItems.end())
+            continue;
+        CDownloadItem& item = (*mi).second;
+        CNode* pnode = item.pnodeInFlight;
+        printf("request for %s from %s timed out\n", inv.ToString().c_str(), pnode->addr.ToString().c_str());
+
+        mapPeers[pnode].nInFlight--;
+        item.vAnnouncers.erase(remove(item.vAnnouncers.begin(), item.vAnnouncers.end(), pnode), item.vAnnouncers.end());
+        item.pnodeInFlight = NULL;
+        Requeue(mi);
+    }
 }
 
 
@@ -511,28 +757,17 @@ void CNode::PushVersion()
 
 
 
-std::map<CNetAddr, int64> CNode::setBanned;
-CCriticalSection CNode::cs_setBanned;
+int CNode::nLastNodeId = 0;
+CCriticalSection CNode::cs_nLastNodeId;
 
 void CNode::ClearBanned()
 {
-    setBanned.clear();
+    banlist.Clear();
 }
 
 bool CNode::IsBanned(CNetAddr ip)
 {
-    bool fResult = false;
-    CRITICAL_BLOCK(cs_setBanned)
-    {
-        std::map<CNetAddr, int64>::iterator i = setBanned.find(ip);
-        if (i != setBanned.end())
-        {
-            int64 t = (*i).second;
-            if (GetTime() < t)
-                fResult = true;
-        }
-    }
-    return fResult;
+    return banlist.IsBanned(ip, GetTime());
 }
 
 bool CNode::Misbehaving(int howmuch)
@@ -547,9 +782,7 @@ bool CNode::Misbehaving(int howmuch)
     if (nMisbehavior >= GetArg("-banscore", 100))
     {
         int64 banTime = GetTime()+GetArg("-bantime", 60*60*24);  // Default 24-hour ban
-        CRITICAL_BLOCK(cs_setBanned)
-            if (setBanned[addr] < banTime)
-                setBanned[addr] = banTime;
+        banlist.Ban(CSubNet(addr), banTime, GetTime());
         CloseSocketDisconnect();
         printf("Disconnected %s for misbehavior (score=%d)\n", addr.ToString().c_str(), nMisbehavior);
         return true;
@@ -557,6 +790,101 @@ bool CNode::Misbehaving(int howmuch)
     return false;
 }
 
+void CNode::RecordSendMessage(const CSerializeData& msg)
+{
+    // Everything we send is built by BeginMessage, so the header is ours
+    const char* pszCommand = &msg[sizeof(pchMessageStart)];
+    string strCommand(pszCommand, pszCommand + strnlen(pszCommand, CMessageHeader::COMMAND_SIZE));
+    CRITICAL_BLOCK(cs_stats)
+        mapSendBytesPerCommand[strCommand] += msg.size();
+}
+
+void CNode::CopyStats(CNodeStats& stats)
+{
+    stats.strAddr = addr.ToString();
+    stats.nServices = nServices;
+    stats.nLastSend = nLastSend;
+    stats.nLastRecv = nLastRecv;
+    stats.nTimeConnected = nTimeConnected;
+    stats.nVersion = nVersion;
+    stats.strSubVer = strSubVer;
+    stats.fInbound = fInbound;
+    stats.nStartingHeight = nStartingHeight;
+    stats.nMisbehavior = nMisbehavior;
+    stats.nSendBytes = nSendBytes;
+    stats.nRecvBytes = nRecvBytes;
+    CRITICAL_BLOCK(cs_stats)
+    {
+        stats.mapSendBytesPerCommand = mapSendBytesPerCommand;
+        stats.mapRecvBytesPerCommand = mapRecvBytesPerCommand;
+        stats.mapProcessTimePerCommand = mapProcessTimePerCommand;
+    }
+    stats.nPingUsecTime = nPingUsecTime;
+    stats.nPingUsecWait = (nPingNonceSent != 0 ? GetTimeMicros() - nPingUsecStart : 0);
+}
+
+uint64 CNode::nTotalBytesSent = 0;
+uint64 CNode::nTotalBytesRecv = 0;
+CCriticalSection CNode::cs_totalBytes;
+
+// Bytes sent in the current -maxuploadtarget cycle, guarded by cs_totalBytes
+static uint64 nTargetCycleBytesSent = 0;
+static int64 nTargetCycleStart = 0;
+static const int64 UPLOAD_TARGET_TIMEFRAME = 24 * 60 * 60;
+
+void CNode::RecordBytesSent(uint64 nBytes)
+{
+    CRITICAL_BLOCK(cs_totalBytes)
+    {
+        nTotalBytesSent += nBytes;
+
+        int64 nNow = GetTime();
+        if (nTargetCycleStart + UPLOAD_TARGET_TIMEFRAME < nNow)
+        {
+            nTargetCycleStart = nNow;
+            nTargetCycleBytesSent = 0;
+        }
+        nTargetCycleBytesSent += nBytes;
+    }
+}
+
+void CNode::RecordBytesRecv(uint64 nBytes)
+{
+    CRITICAL_BLOCK(cs_totalBytes)
+        nTotalBytesRecv += nBytes;
+}
+
+uint64 CNode::GetTotalBytesSent()
+{
+    CRITICAL_BLOCK(cs_totalBytes)
+        return nTotalBytesSent;
+    return 0;
+}
+
+uint64 CNode::GetTotalBytesRecv()
+{
+    CRITICAL_BLOCK(cs_totalBytes)
+        return nTotalBytesRecv;
+    return 0;
+}
+
+bool CNode::OutboundTargetReached()
+{
+    return MaxUploadTarget() > 0 && GetOutboundTargetBytesLeft() == 0;
+}
+
+uint64 CNode::GetOutboundTargetBytesLeft()
+{
+    uint64 nTarget = MaxUploadTarget();
+    if (nTarget == 0)
+        return std::numeric_limits<uint64>::max();
+    CRITICAL_BLOCK(cs_totalBytes)
+        return (nTargetCycleBytesSent >= nTarget ? 0 : nTarget - nTargetCycleBytesSent);
+    return 0;
+}
+
+
+
 
 
 
@@ -566,7 +894,264 @@ bool CNode::Misbehaving(int howmuch)
 
 
 
+// Upload limit over all peers, only touched by the socket handler thread
+static CTokenBucket bucketUpload;
 
+// Requires cs_vSend
+static int64 SendAllowance(CNode* pnode, int64 nNow)
+{
+    return min(bucketUpload.Available(nNow), pnode->bucketSend.Available(nNow));
+}
+
+// Called once the socket of a pending outbound connection is writable
+// or has an error
+static void FinishConnect(CNode* pnode)
+{
+    int nErr = GetSocketConnectError(pnode->hSocket);
+    if (nErr != 0)
+    {
+        printf("connect() to %s failed after select(): %s\n", pnode->addr.ToString().c_str(), strerror(nErr));
+        pnode->CloseSocketDisconnect();
+        return;
+    }
+    printf("connected %s\n", pnode->addr.ToString().c_str());
+    pnode->fConnecting = false;
+    pnode->nTimeConnected = GetTime();
+    addrman.UpdateLatency(pnode->addr, max((int64)1, (GetTimeMicros() - pnode->nConnectStart) / 1000), 0);
+}
+
+// Requires cs_vSend
+void SocketSendData(CNode* pnode)
+{
+    // Hand as many queued messages to the kernel as it will take.  Messages
+    // may be shared with other peers, so they're only ever read from here.
+    while (!pnode->vSendMsg.empty() || !pnode->vSendMsgBulk.empty())
+    {
+        // Bulk messages are moved over one at a time once the rest is out,
+        // and never while a partly sent message is at the front
+        if (pnode->vSendMsg.empty())
+        {
+            pnode->vSendMsg.push_back(pnode->vSendMsgBulk.front());
+            pnode->nSendSizeBulk -= pnode->vSendMsgBulk.front()->size();
+            pnode->vSendMsgBulk.pop_front();
+        }
+
+        int64 nAllowed = SendAllowance(pnode, GetTimeMicros());
+        if (nAllowed <= 0)
+            break;
+
+        size_t nRequested = 0;
+#ifdef WIN32
+        const CSerializeData& data = *pnode->vSendMsg.front();
+        nRequested = min((int64)(data.size() - pnode->nSendOffset), nAllowed);
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nRequested, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Gather the front of the queue into a single sendmsg call
+        struct iovec iov[64];
+        int nIov = 0;
+        for (deque<CSharedMessage>::iterator it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end() && nIov < ARRAYLEN(iov) && (int64)nRequested < nAllowed; ++it, ++nIov)
+        {
+            const CSerializeData& data = **it;
+            size_t nOffset = (nIov == 0 ? pnode->nSendOffset : 0);
+            iov[nIov].iov_base = (void*)&data[nOffset];
+            iov[nIov].iov_len = min((int64)(data.size() - nOffset), nAllowed - (int64)nRequested);
+            nRequested += iov[nIov].iov_len;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+        if (nBytes > 0)
+        {
+            pnode->nLastSend = GetTime();
+            pnode->nSendSize -= nBytes;
+            pnode->nSendBytes += nBytes;
+            pnode->bucketSend.Consume(nBytes);
+            bucketUpload.Consume(nBytes);
+            CNode::RecordBytesSent(nBytes);
+
+            // Drop the messages that went out completely
+            size_t nSent = pnode->nSendOffset + nBytes;
+            while (!pnode->vSendMsg.empty() && nSent >= pnode->vSendMsg.front()->size())
+            {
+                nSent -= pnode->vSendMsg.front()->size();
+                pnode->vSendMsg.pop_front();
+            }
+            pnode->nSendOffset = nSent;
+
+            // Socket buffer is full, try again later
+            if (nBytes < nRequested)
+                break;
+        }
+        else
+        {
+            if (nBytes < 0)
+            {
+                // error
+                int nErr = WSAGetLastError();
+                if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                {
+                    printf("socket send error %d\n", nErr);
+                    pnode->CloseSocketDisconnect();
+                }
+            }
+            break;
+        }
+    }
+}
+
+
+
+//
+// Inbound eviction
+//
+// When all inbound slots are taken, a new connection may replace the
+// inbound peer that is costing us the most for the least in return.
+// Peers that are hard to fake are protected first: a few address groups
+// chosen with a secret key, the lowest ping times, the peers that most
+// recently gave us new blocks and transactions, and the longest
+// connected.  Of the rest, a peer is taken from the address group with
+// the most connections, so an attacker who controls a few address
+// ranges can only ever displace their own peers.
+//
+
+static uint64 GetKeyedNetGroup(const CNode* pnode)
+{
+    static uint256 hashKey = 0;
+    if (hashKey == 0)
+        RAND_bytes((unsigned char*)&hashKey, sizeof(hashKey));
+    std::vector<unsigned char> vchGroup = pnode->addr.GetGroup();
+    vchGroup.insert(vchGroup.begin(), hashKey.begin(), hashKey.end());
+    return Hash(vchGroup.begin(), vchGroup.end()).Get64();
+}
+
+// Memory held on the peer's behalf plus CPU time, a microsecond counted
+// as a byte
+static int64 GetResourceUsage(const CNode* pnode)
+{
+    return pnode->nRecvBufferBytes + pnode->nOrphanBytes + pnode->nProcessUsec;
+}
+
+// Usage per useful thing delivered, a block counting as 100 transactions
+static double GetUsageScore(const CNode* pnode)
+{
+    return (double)GetResourceUsage(pnode) / (1 + pnode->nTxDelivered + 100 * pnode->nBlocksDelivered);
+}
+
+static bool CompareNetGroupKeyed(const CNode* a, const CNode* b)
+{
+    return GetKeyedNetGroup(a) < GetKeyedNetGroup(b);
+}
+
+static bool ComparePingTime(const CNode* a, const CNode* b)
+{
+    // Not measured yet sorts last
+    if ((a->nPingUsecTime == 0) != (b->nPingUsecTime == 0))
+        return b->nPingUsecTime == 0;
+    return a->nPingUsecTime < b->nPingUsecTime;
+}
+
+static bool CompareLastBlockTime(const CNode* a, const CNode* b)
+{
+    if (a->nLastBlockTime != b->nLastBlockTime)
+        return a->nLastBlockTime > b->nLastBlockTime;
+    return a->nTimeConnected < b->nTimeConnected;
+}
+
+static bool CompareLastTxTime(const CNode* a, const CNode* b)
+{
+    if (a->nLastTxTime != b->nLastTxTime)
+        return a->nLastTxTime > b->nLastTxTime;
+    return a->nTimeConnected < b->nTimeConnected;
+}
+
+static bool CompareTimeConnected(const CNode* a, const CNode* b)
+{
+    return a->nTimeConnected < b->nTimeConnected;
+}
+
+// Removes the nCount best candidates by fnCompare
+static void ProtectCandidates(std::vector<CNode*>& vCandidates, bool (*fnCompare)(const CNode*, const CNode*), unsigned int nCount)
+{
+    std::sort(vCandidates.begin(), vCandidates.end(), fnCompare);
+    vCandidates.erase(vCandidates.begin(), vCandidates.begin() + std::min(nCount, (unsigned int)vCandidates.size()));
+}
+
+CNode* SelectNodeToEvict(const std::vector<CNode*>& vNodesIn)
+{
+    vector<CNode*> vCandidates;
+    BOOST_FOREACH(CNode* pnode, vNodesIn)
+        if (pnode->fInbound && !pnode->fDisconnect)
+            vCandidates.push_back(pnode);
+
+    ProtectCandidates(vCandidates, CompareNetGroupKeyed, 4);
+    ProtectCandidates(vCandidates, ComparePingTime, 8);
+    ProtectCandidates(vCandidates, CompareLastBlockTime, 4);
+    ProtectCandidates(vCandidates, CompareLastTxTime, 4);
+    ProtectCandidates(vCandidates, CompareTimeConnected, vCandidates.size() / 2);
+    if (vCandidates.empty())
+        return NULL;
+
+    // Find the most crowded address group, on a tie the one using the
+    // most resources
+    map<vector<unsigned char>, pair<int, int64> > mapGroups;
+    BOOST_FOREACH(CNode* pnode, vCandidates)
+    {
+        pair<int, int64>& group = mapGroups[pnode->addr.GetGroup()];
+        group.first++;
+        group.second += GetResourceUsage(pnode);
+    }
+    vector<unsigned char> vchBestGroup;
+    pair<int, int64> best(0, 0);
+    for (map<vector<unsigned char>, pair<int, int64> >::iterator mi = mapGroups.begin(); mi != mapGroups.end(); ++mi)
+    {
+        if ((*mi).second > best)
+        {
+            best = (*mi).second;
+            vchBestGroup = (*mi).first;
+        }
+    }
+
+    // Within it, the worst usage score goes, on a tie the youngest
+    CNode* pnodeEvict = NULL;
+    BOOST_FOREACH(CNode* pnode, vCandidates)
+    {
+        if (pnode->addr.GetGroup() != vchBestGroup)
+            continue;
+        if (pnodeEvict == NULL ||
+            GetUsageScore(pnode) > GetUsageScore(pnodeEvict) ||
+            (GetUsageScore(pnode) == GetUsageScore(pnodeEvict) && pnode->nTimeConnected > pnodeEvict->nTimeConnected))
+            pnodeEvict = pnode;
+    }
+    return pnodeEvict;
+}
+
+static bool AttemptToEvictConnection()
+{
+    set<CNetAddr> setAddNode;
+    CRITICAL_BLOCK(cs_setservAddNodeAddresses)
+        setAddNode = setservAddNodeAddresses;
+
+    CRITICAL_BLOCK(cs_vNodes)
+    {
+        // Peers we were told to keep with -addnode are never evicted
+        vector<CNode*> vCandidates;
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (!setAddNode.count(pnode->addr))
+                vCandidates.push_back(pnode);
+
+        CNode* pnodeEvict = SelectNodeToEvict(vCandidates);
+        if (pnodeEvict == NULL)
+            return false;
+        printf("evicting inbound peer %s (usage %"PRI64d", %d blocks, %d txes)\n",
+               pnodeEvict->addr.ToString().c_str(), GetResourceUsage(pnodeEvict),
+               pnodeEvict->nBlocksDelivered, pnodeEvict->nTxDelivered);
+        pnodeEvict->fDisconnect = true;
+    }
+    return true;
+}
 
 void ThreadSocketHandler(void* parg)
 {
@@ -591,6 +1176,7 @@ void ThreadSocketHandler2(void* parg)
 {
     printf("ThreadSocketHandler started\n");
     list<CNode*> vNodesDisconnected;
+    bucketUpload.SetRate(MaxUploadRate());
     int nPrevNodeCount = 0;
 
     loop
@@ -605,7 +1191,7 @@ void ThreadSocketHandler2(void* parg)
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
             {
                 if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->vSend.empty()))
+                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->nSendSize == 0))
                 {
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
@@ -634,7 +1220,11 @@ void ThreadSocketHandler2(void* parg)
                      TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
                       TRY_CRITICAL_BLOCK(pnode->cs_mapRequests)
                        TRY_CRITICAL_BLOCK(pnode->cs_inventory)
-                        fDelete = true;
+                        TRY_CRITICAL_BLOCK(cs_main)
+                        {
+                            FinalizeNode(pnode);
+                            fDelete = true;
+                        }
                     if (fDelete)
                     {
                         vNodesDisconnected.remove(pnode);
@@ -655,7 +1245,7 @@ void ThreadSocketHandler2(void* parg)
         //
         struct timeval timeout;
         timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+        timeout.tv_usec = 50000; // frequency to poll pnode->vSendMsg
 
         fd_set fdsetRecv;
         fd_set fdsetSend;
@@ -677,8 +1267,18 @@ void ThreadSocketHandler2(void* parg)
                 FD_SET(pnode->hSocket, &fdsetRecv);
                 FD_SET(pnode->hSocket, &fdsetError);
                 hSocketMax = max(hSocketMax, pnode->hSocket);
+
+                // Writable is also how a non-blocking connect reports it's done
+                if (pnode->fConnecting)
+                {
+                    FD_SET(pnode->hSocket, &fdsetSend);
+                    continue;
+                }
+
+                // A peer that is over its upload rate would only make select
+                // return straight away, the 50ms timeout brings it back
                 TRY_CRITICAL_BLOCK(pnode->cs_vSend)
-                    if (!pnode->vSend.empty())
+                    if (pnode->nSendSize > 0 && SendAllowance(pnode, GetTimeMicros()) > 0)
                         FD_SET(pnode->hSocket, &fdsetSend);
             }
         }
@@ -727,17 +1327,17 @@ void ThreadSocketHandler2(void* parg)
                 if (WSAGetLastError() != WSAEWOULDBLOCK)
                     printf("socket error accept failed: %d\n", WSAGetLastError());
             }
-            else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
-            {
-                CRITICAL_BLOCK(cs_setservAddNodeAddresses)
-                    if (!setservAddNodeAddresses.count(addr))
-                        closesocket(hSocket);
-            }
             else if (CNode::IsBanned(addr))
             {
                 printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
                 closesocket(hSocket);
             }
+            else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS && !AttemptToEvictConnection())
+            {
+                CRITICAL_BLOCK(cs_setservAddNodeAddresses)
+                    if (!setservAddNodeAddresses.count(addr))
+                        closesocket(hSocket);
+            }
             else
             {
                 printf("accepted connection %s\n", addr.ToString().c_str());
@@ -765,10 +1365,25 @@ void ThreadSocketHandler2(void* parg)
                 return;
 
             //
-            // Receive
+            // Pending outbound connect
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
+            if (pnode->fConnecting)
+            {
+                if (FD_ISSET(pnode->hSocket, &fdsetSend) || FD_ISSET(pnode->hSocket, &fdsetError))
+                    FinishConnect(pnode);
+                else if (GetTimeMicros() - pnode->nConnectStart > nConnectTimeout * (int64)1000)
+                {
+                    printf("connection timeout %s\n", pnode->addr.ToString().c_str());
+                    pnode->CloseSocketDisconnect();
+                }
+                continue;
+            }
+
+            //
+            // Receive
+            //
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
             {
                 TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
@@ -790,6 +1405,9 @@ void ThreadSocketHandler2(void* parg)
                             vRecv.resize(nPos + nBytes);
                             memcpy(&vRecv[nPos], pchBuf, nBytes);
                             pnode->nLastRecv = GetTime();
+                            pnode->nRecvBytes += nBytes;
+                            pnode->nRecvBufferBytes = vRecv.size();
+                            CNode::RecordBytesRecv(nBytes);
                         }
                         else if (nBytes == 0)
                         {
@@ -822,30 +1440,15 @@ void ThreadSocketHandler2(void* parg)
             {
                 TRY_CRITICAL_BLOCK(pnode->cs_vSend)
                 {
-                    CDataStream& vSend = pnode->vSend;
-                    if (!vSend.empty())
-                    {
-                        int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
-                            pnode->nLastSend = GetTime();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                printf("socket send error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                        if (vSend.size() > SendBufferSize()) {
-                            if (!pnode->fDisconnect)
-                                printf("socket send flood control disconnect (%d bytes)\n", vSend.size());
-                            pnode->CloseSocketDisconnect();
-                        }
+                    SocketSendData(pnode);
+                    // Only the peer's doing if it isn't reading what the
+                    // kernel would send: bytes our own upload limits hold
+                    // back, or that wait in the bulk queue, don't count
+                    if (pnode->nSendSize - pnode->nSendSizeBulk > SendBufferSize() &&
+                        SendAllowance(pnode, GetTimeMicros()) > 0) {
+                        if (!pnode->fDisconnect)
+                            printf("socket send flood control disconnect (%"PRI64u" bytes)\n", pnode->nSendSize);
+                        pnode->CloseSocketDisconnect();
                     }
                 }
             }
@@ -853,7 +1456,7 @@ void ThreadSocketHandler2(void* parg)
             //
             // Inactivity checking
             //
-            if (pnode->vSend.empty())
+            if (pnode->nSendSize == 0)
                 pnode->nLastSendEmpty = GetTime();
             if (GetTime() - pnode->nTimeConnected > 60)
             {
@@ -1201,8 +1804,32 @@ unsigned int pnSeed[] =
 
 void DumpAddresses()
 {
+    int64 nStart = GetTimeMillis();
+
     CAddrDB adb;
-    adb.WriteAddrman(addrman);
+    adb.Write(addrman);
+
+    printf("Flushed %d addresses to peers.dat  %"PRI64d"ms\n",
+           addrman.size(), GetTimeMillis() - nStart);
+}
+
+void DumpBanlist()
+{
+    int64 nStart = GetTimeMillis();
+
+    banlist.SweepExpired(GetTime());
+    if (!banlist.IsDirty())
+        return;
+    banlist.SetDirty(false);
+    CBanDB bandb;
+    if (!bandb.Write(banlist))
+    {
+        banlist.SetDirty(true);
+        return;
+    }
+
+    printf("Flushed %d banned subnets to banlist.dat  %"PRI64d"ms\n",
+           banlist.size(), GetTimeMillis() - nStart);
 }
 
 void ThreadDumpAddress2(void* parg)
@@ -1211,6 +1838,7 @@ void ThreadDumpAddress2(void* parg)
     while (!fShutdown)
     {
         DumpAddresses();
+        DumpBanlist();
         vnThreadsRunning[THREAD_DUMPADDRESS]--;
         Sleep(100000);
         vnThreadsRunning[THREAD_DUMPADDRESS]++;
@@ -1263,7 +1891,7 @@ void ThreadOpenConnections2(void* parg)
             {
                 CAddress addr(CService(strAddr, GetDefaultPort(), fAllowDNS));
                 if (addr.IsValid())
-                    OpenNetworkConnection(addr);
+                    OpenNetworkConnection(addr, true);
                 for (int i = 0; i < 10 && i < nLoop; i++)
                 {
                     Sleep(500);
@@ -1279,6 +1907,8 @@ void ThreadOpenConnections2(void* parg)
     loop
     {
         int nOutbound = 0;
+        int nMaxOutboundConnections = MAX_OUTBOUND_CONNECTIONS;
+        nMaxOutboundConnections = min(nMaxOutboundConnections, (int)GetArg("-maxconnections", 125));
 
         vnThreadsRunning[THREAD_OPENCONNECTIONS]--;
         Sleep(500);
@@ -1286,7 +1916,7 @@ void ThreadOpenConnections2(void* parg)
         if (fShutdown)
             return;
 
-        // Limit outbound connections
+        // Limit outbound connections, connects still in progress count too
         loop
         {
             nOutbound = 0;
@@ -1294,8 +1924,6 @@ void ThreadOpenConnections2(void* parg)
                 BOOST_FOREACH(CNode* pnode, vNodes)
                     if (!pnode->fInbound)
                         nOutbound++;
-            int nMaxOutboundConnections = MAX_OUTBOUND_CONNECTIONS;
-            nMaxOutboundConnections = min(nMaxOutboundConnections, (int)GetArg("-maxconnections", 125));
             if (nOutbound < nMaxOutboundConnections)
                 break;
             vnThreadsRunning[THREAD_OPENCONNECTIONS]--;
@@ -1329,10 +1957,10 @@ void ThreadOpenConnections2(void* parg)
         }
 
         //
-        // Choose an address to connect to based on most recently seen
+        // Choose addresses to connect to.  Connects don't block this thread,
+        // so start one for every free outbound slot at once; dead addrman
+        // entries then cost one connect timeout per round instead of each.
         //
-        CAddress addrConnect;
-        int64 nBest = std::numeric_limits<int64>::min();
 
         // Only connect to one address per a.b.?.? range.
         // Do this here so we don't have to critsect vNodes inside mapAddresses critsect.
@@ -1343,32 +1971,38 @@ void ThreadOpenConnections2(void* parg)
 
         int64 nANow = GetAdjustedTime();
 
-        int nTries = 0;
-        loop
+        for (int nNew = nOutbound; nNew < nMaxOutboundConnections && !fShutdown; nNew++)
         {
-            // use an nUnkBias between 10 (no outgoing connections) and 90 (8 outgoing connections)
-            CAddress addr = addrman.Select(10 + min(nOutbound,8)*10);
+            CAddress addrConnect;
+            int nTries = 0;
+            loop
+            {
+                // use an nUnkBias between 10 (no outgoing connections) and 90 (8 outgoing connections)
+                CAddress addr = addrman.Select(10 + min(nOutbound,8)*10);
 
-            // if we selected an invalid address, restart
-            if (!addr.IsIPv4() || !addr.IsValid() || setConnected.count(addr.GetGroup()) || addr == addrLocalHost)
-                break;
+                // if we selected an invalid address, restart
+                if (!addr.IsIPv4() || !addr.IsValid() || setConnected.count(addr.GetGroup()) || addr == addrLocalHost)
+                    break;
 
-            nTries++;
+                nTries++;
 
-            // only consider very recently tried nodes after 30 failed attempts
-            if (nANow - addr.nLastTry < 600 && nTries < 30)
-                continue;
+                // only consider very recently tried nodes after 30 failed attempts
+                if (nANow - addr.nLastTry < 600 && nTries < 30)
+                    continue;
 
-            // do not allow non-default ports, unless after 50 invalid addresses selected already
-            if (addr.GetPort() != GetDefaultPort() && nTries < 50)
-                continue;
+                // do not allow non-default ports, unless after 50 invalid addresses selected already
+                if (addr.GetPort() != GetDefaultPort() && nTries < 50)
+                    continue;
 
-            addrConnect = addr;
-            break;
-        }
+                addrConnect = addr;
+                break;
+            }
 
-        if (addrConnect.IsValid())
+            if (!addrConnect.IsValid())
+                break;
+            setConnected.insert(addrConnect.GetGroup());
             OpenNetworkConnection(addrConnect);
+        }
     }
 }
 
@@ -1427,7 +2061,7 @@ void ThreadOpenAddedConnections2(void* parg)
                         }
         BOOST_FOREACH(vector<CService>& vserv, vservConnectAddresses)
         {
-            OpenNetworkConnection(CAddress(*(vserv.begin())));
+            OpenNetworkConnection(CAddress(*(vserv.begin())), true);
             Sleep(500);
             if (fShutdown)
                 return;
@@ -1442,7 +2076,7 @@ void ThreadOpenAddedConnections2(void* parg)
     }
 }
 
-bool OpenNetworkConnection(const CAddress& addrConnect)
+bool OpenNetworkConnection(const CAddress& addrConnect, bool fExplicit)
 {
     //
     // Initiate outbound network connection
@@ -1450,7 +2084,11 @@ bool OpenNetworkConnection(const CAddress& addrConnect)
     if (fShutdown)
         return false;
     if ((CNetAddr)addrConnect == (CNetAddr)addrLocalHost || !addrConnect.IsIPv4() ||
-        FindNode((CNetAddr)addrConnect) || CNode::IsBanned(addrConnect))
+        CNode::IsBanned(addrConnect))
+        return false;
+    // One connection per IP, except that peers named with -connect or
+    // -addnode may share their IP with others, like several nodes on one host
+    if (fExplicit ? FindNode((CService)addrConnect) != NULL : FindNode((CNetAddr)addrConnect) != NULL)
         return false;
 
     vnThreadsRunning[THREAD_OPENCONNECTIONS]--;
@@ -1699,7 +2337,7 @@ void StartNode(void* parg)
         addrLocalHost.SetIP(CNetAddr("0.0.0.0"));
         printf("addrLocalHost = %s\n", addrLocalHost.ToString().c_str());
     }
-    else
+    else if (!fRegTest)
     {
         CreateThread(ThreadGetMyExternalIP, NULL);
     }
@@ -1776,6 +2414,7 @@ bool StopNode()
         Sleep(20);
     Sleep(50);
     DumpAddresses();
+    DumpBanlist();
     return true;
 }
 
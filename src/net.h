@@ -8,16 +8,18 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 #ifndef WIN32
 #include <arpa/inet.h>
 #endif
 
-#include "mruset.h"
+#include "bloom.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "addrman.h"
+#include "banlist.h"
 
 class CAddrDB;
 class CRequestTracker;
@@ -25,10 +27,18 @@ class CNode;
 class CBlockIndex;
 extern int nBestHeight;
 
+/** A fully framed network message (header and payload).  It is never modified
+ * once built, so a single copy can sit in the send queues of many peers. */
+typedef boost::shared_ptr<const CSerializeData> CSharedMessage;
+
 
 
 inline unsigned int ReceiveBufferSize() { return 1000*GetArg("-maxreceivebuffer", 10*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 10*1000); }
+// Upload limits in bytes per second; the options are in units of 1000 bytes
+inline int64 MaxUploadRate() { return 1000*GetArg("-maxuploadrate", 0); }
+inline int64 MaxPeerUploadRate() { return 1000*GetArg("-maxpeeruploadrate", 0); }
+inline uint64 MaxUploadTarget() { return 1000000*GetArg("-maxuploadtarget", 0); }
 static const unsigned int PUBLISH_HOPS = 5;
 
 bool RecvLine(SOCKET hSocket, std::string& strLine);
@@ -37,17 +47,39 @@ void AddressCurrentlyConnected(const CService& addr);
 CNode* FindNode(const CNetAddr& ip);
 CNode* FindNode(const CService& ip);
 CNode* ConnectNode(CAddress addrConnect, int64 nTimeout=0);
+CNode* SelectNodeToEvict(const std::vector<CNode*>& vNodesIn);
+void DumpBanlist();
 void AbandonRequests(void (*fn)(void*, CDataStream&), void* param1);
 bool AnySubscribed(unsigned int nChannel);
 void MapPort(bool fMapPort);
 bool BindListenPort(std::string& strError=REF(std::string()));
 void StartNode(void* parg);
 bool StopNode();
+void SetMessageHeader(CDataStream& ss, unsigned int nHeaderStart, unsigned int nMessageStart);
+void SocketSendData(CNode* pnode);
+
+/** Serialize obj as the payload of a pszCommand message, ready to be queued
+ * with CNode::PushSharedMessage.  Only use this for payloads whose encoding
+ * does not depend on the peer's version (transactions and blocks). */
+template<typename T>
+CSharedMessage MakeSharedMessage(const char* pszCommand, const T& obj)
+{
+    CDataStream ss(SER_NETWORK);
+    ss << CMessageHeader(pszCommand, 0);
+    unsigned int nMessageStart = ss.size();
+    ss << obj;
+    SetMessageHeader(ss, 0, nMessageStart);
+
+    CSerializeData* pdata = new CSerializeData();
+    ss.GetAndClear(*pdata);
+    return CSharedMessage(pdata);
+}
 
 enum
 {
     MSG_TX = 1,
     MSG_BLOCK,
+    MSG_CMPCT_BLOCK,
 };
 
 class CRequestTracker
@@ -92,15 +124,164 @@ extern CAddress addrLocalHost;
 extern uint64 nLocalHostNonce;
 extern boost::array<int, THREAD_MAX> vnThreadsRunning;
 extern CAddrMan addrman;
+extern CBanList banlist;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSharedMessage> mapRelay;
 extern std::deque<std::pair<int64, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
-extern std::map<CInv, int64> mapAlreadyAskedFor;
 
 
+/** Decides which peer each announced inventory item is requested from.
+ *
+ * An item is in flight from at most one peer at a time.  If that peer
+ * doesn't deliver before the timeout, or disconnects, the item is handed to
+ * the next peer that announced it.  The number of tracked items, queued
+ * announcements per peer and requests in flight per peer are all capped, so
+ * a peer spamming inv can't make this grow without bound.
+ *
+ * Newly announced blocks are held for a moment for the announcer with the
+ * best score, which is its ping time plus how long it has been taking to
+ * deliver the blocks we asked it for.
+ */
+class CDownloadScheduler
+{
+private:
+    class CDownloadItem
+    {
+    public:
+        CNode* pnodeInFlight;
+        int64 nTimeout;
+        int64 nFirstSeen;
+        int64 nRequestMicros;
+        std::vector<CNode*> vAnnouncers;
+
+        CDownloadItem() : pnodeInFlight(NULL), nTimeout(0), nFirstSeen(0), nRequestMicros(0) { }
+    };
+
+    class CDownloadPeer
+    {
+    public:
+        std::deque<CInv> vQueue;
+        int nInFlight;
+        int64 nBlockResponseTime; // microseconds, moving average
+
+        CDownloadPeer() : nInFlight(0), nBlockResponseTime(0) { }
+    };
+
+    std::map<CInv, CDownloadItem> mapItems;
+    std::map<CNode*, CDownloadPeer> mapPeers;
+    std::set<std::pair<int64, CInv> > setTimeouts;
+    mutable CCriticalSection cs;
+
+    void Requeue(std::map<CInv, CDownloadItem>::iterator mi);
+    void ExpireRequests(int64 nNow);
+    int64 GetPeerScore(CNode* pnode);
+    CNode* GetBestAnnouncer(const CDownloadItem& item);
+
+public:
+    enum
+    {
+        MAX_ITEMS = 50000,
+        MAX_ANNOUNCERS = 8,
+        MAX_PEER_QUEUE = 5000,
+        MAX_PEER_IN_FLIGHT = 500,
+        TX_TIMEOUT = 60,
+        BLOCK_TIMEOUT = 5 * 60,
+        BLOCK_PREFER_WAIT = 2,
+    };
+
+    // Record that pnode announced inv
+    void AskFor(CNode* pnode, const CInv& inv, int64 nNow);
+
+    // Move up to MAX_PEER_IN_FLIGHT of pnode's queued announcements in flight
+    void GetRequests(CNode* pnode, int64 nNow, std::vector<CInv>& vRequestRet);
+
+    // The item arrived (from anyone) or turned out not to be needed
+    void Received(const CInv& inv);
+
+    // Forget a disconnected peer and retry whatever it still owed us elsewhere
+    void RemovePeer(CNode* pnode);
+
+    int size() const;
+};
+
+extern CDownloadScheduler downloadscheduler;
+
+
+
+
+
+
+/** Token bucket rate limiter.  Refills nRate tokens (bytes) per second, up
+ * to one second's worth.  A rate of 0 means unlimited.
+ */
+class CTokenBucket
+{
+private:
+    int64 nRate;
+    int64 nTokens;
+    int64 nLastRefill; // microseconds
+
+public:
+    CTokenBucket(int64 nRateIn=0)
+    {
+        SetRate(nRateIn);
+    }
+
+    void SetRate(int64 nRateIn)
+    {
+        nRate = nRateIn;
+        nTokens = nRateIn;
+        nLastRefill = GetTimeMicros();
+    }
+
+    int64 Available(int64 nNow)
+    {
+        if (nRate <= 0)
+            return std::numeric_limits<int64>::max();
+        int64 nElapsed = std::min(nNow - nLastRefill, (int64)1000000);
+        if (nElapsed > 0)
+        {
+            nTokens = std::min(nRate, nTokens + nElapsed * nRate / 1000000);
+            nLastRefill = nNow;
+        }
+        return nTokens;
+    }
+
+    void Consume(int64 nBytes)
+    {
+        if (nRate > 0)
+            nTokens -= nBytes;
+    }
+};
+
+
+
+
+/** Snapshot of a peer's traffic counters and state, for getpeerinfo */
+class CNodeStats
+{
+public:
+    std::string strAddr;
+    uint64 nServices;
+    int64 nLastSend;
+    int64 nLastRecv;
+    int64 nTimeConnected;
+    int nVersion;
+    std::string strSubVer;
+    bool fInbound;
+    int nStartingHeight;
+    int nMisbehavior;
+    uint64 nSendBytes;
+    uint64 nRecvBytes;
+    std::map<std::string, uint64> mapSendBytesPerCommand;
+    std::map<std::string, uint64> mapRecvBytesPerCommand;
+    std::map<std::string, int64> mapProcessTimePerCommand;
+    int64 nPingUsecTime;
+    int64 nPingUsecWait;
+};
 
 
 
@@ -112,7 +293,13 @@ public:
     // socket
     uint64 nServices;
     SOCKET hSocket;
-    CDataStream vSend;
+    CDataStream vSend; // message currently being built by BeginMessage/EndMessage
+    std::deque<CSharedMessage> vSendMsg;
+    std::deque<CSharedMessage> vSendMsgBulk; // historical blocks, only sent when vSendMsg is empty
+    CTokenBucket bucketSend;
+    unsigned int nSendOffset; // bytes of vSendMsg.front() already sent
+    uint64 nSendSize; // total bytes waiting in vSendMsg and vSendMsgBulk
+    uint64 nSendSizeBulk; // the part of nSendSize still in vSendMsgBulk
     CDataStream vRecv;
     CCriticalSection cs_vSend;
     CCriticalSection cs_vRecv;
@@ -130,13 +317,46 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    bool fConnecting; // outbound connect() not finished yet, see ThreadSocketHandler2
+    int64 nConnectStart; // microseconds
+
+    // traffic accounting
+    uint64 nSendBytes;
+    uint64 nRecvBytes;
+    std::map<std::string, uint64> mapSendBytesPerCommand;
+    std::map<std::string, uint64> mapRecvBytesPerCommand;
+    std::map<std::string, int64> mapProcessTimePerCommand; // microseconds
+    CCriticalSection cs_stats; // only for the maps, never hold another lock inside it
+
+    // round trip time measured with ping/pong
+    uint64 nPingNonceSent; // 0 when no ping is outstanding
+    int64 nPingUsecStart;
+    int64 nPingUsecTime;
+
+    // resource use and usefulness, for picking an inbound peer to evict
+    int id;
+    unsigned int nRecvBufferBytes; // vRecv.size() after the last recv or ProcessMessages
+    uint64 nOrphanBytes; // orphan transactions from this peer still held, guarded by cs_main
+    int64 nProcessUsec; // total time spent in ProcessMessage
+    int nBlocksDelivered; // new blocks accepted from this peer
+    int nTxDelivered; // new transactions accepted into the memory pool
+    int64 nLastBlockTime;
+    int64 nLastTxTime;
+
+    // compact blocks
+    bool fCompactBlocks; // peer sent "usecmpct", so getdata may ask it for MSG_CMPCT_BLOCK
+    std::map<uint256, int64> mapCompactAsked; // compact blocks asked of it not yet complete, and when, guarded by cs_main
 protected:
     int nRefCount;
+    static int nLastNodeId;
+    static CCriticalSection cs_nLastNodeId;
+
+    // Totals over all peers
+    static uint64 nTotalBytesSent;
+    static uint64 nTotalBytesRecv;
+    static CCriticalSection cs_totalBytes;
 
     // Denial-of-service detection/prevention
-    // Key is ip address, value is banned-until-time
-    static std::map<CNetAddr, int64> setBanned;
-    static CCriticalSection cs_setBanned;
     int nMisbehavior;
 
 public:
@@ -150,20 +370,21 @@ public:
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
-    std::set<CAddress> setAddrKnown;
+    CRollingBloomFilter addrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
-    std::multimap<int64, CInv> mapAskFor;
 
     // publish and subscription
     std::vector<char> vfSubscribe;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, bool fInboundIn=false)
+    CNode(SOCKET hSocketIn, CAddress addrIn, bool fInboundIn=false) :
+        addrKnown(5000, 0.001),
+        filterInventoryKnown(SendBufferSize() / 1000, 0.000001)
     {
         nServices = 0;
         hSocket = hSocketIn;
@@ -171,6 +392,10 @@ public:
         vRecv.SetType(SER_NETWORK);
         vSend.SetVersion(209);
         vRecv.SetVersion(209);
+        nSendOffset = 0;
+        nSendSize = 0;
+        nSendSizeBulk = 0;
+        bucketSend.SetRate(MaxPeerUploadRate());
         nLastSend = 0;
         nLastRecv = 0;
         nLastSendEmpty = GetTime();
@@ -185,6 +410,23 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fConnecting = false;
+        nConnectStart = 0;
+        nSendBytes = 0;
+        nRecvBytes = 0;
+        nPingNonceSent = 0;
+        nPingUsecStart = 0;
+        nPingUsecTime = 0;
+        CRITICAL_BLOCK(cs_nLastNodeId)
+            id = nLastNodeId++;
+        nRecvBufferBytes = 0;
+        nOrphanBytes = 0;
+        nProcessUsec = 0;
+        nBlocksDelivered = 0;
+        nTxDelivered = 0;
+        nLastBlockTime = 0;
+        nLastTxTime = 0;
+        fCompactBlocks = false;
         nRefCount = 0;
         nReleaseTime = 0;
         hashContinue = 0;
@@ -194,7 +436,6 @@ public:
         fGetAddr = false;
         vfSubscribe.assign(256, false);
         nMisbehavior = 0;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
 
         // Be shy and don't send version until we hear
         if (!fInbound)
@@ -239,7 +480,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        addrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
@@ -247,7 +488,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr))
+        if (addr.IsValid() && !addrKnown.contains(addr.GetKey()))
             vAddrToSend.push_back(addr);
     }
 
@@ -255,33 +496,21 @@ public:
     void AddInventoryKnown(const CInv& inv)
     {
         CRITICAL_BLOCK(cs_inventory)
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
     }
 
     void PushInventory(const CInv& inv)
     {
         CRITICAL_BLOCK(cs_inventory)
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash))
                 vInventoryToSend.push_back(inv);
     }
 
     void AskFor(const CInv& inv)
     {
-        // We're using mapAskFor as a priority queue,
-        // the key is the earliest time the request can be sent
-        int64& nRequestTime = mapAlreadyAskedFor[inv];
-        printf("askfor %s   %"PRI64d"\n", inv.ToString().c_str(), nRequestTime);
-
-        // Make sure not to reuse time indexes to keep things in the same order
-        int64 nNow = (GetTime() - 1) * 1000000;
-        static int64 nLastTime;
-        ++nLastTime;
-        nNow = std::max(nNow, nLastTime);
-        nLastTime = nNow;
-
-        // Each retry is 2 minutes after the last
-        nRequestTime = std::max(nRequestTime + 2 * 60 * 1000000, nNow);
-        mapAskFor.insert(std::make_pair(nRequestTime, inv));
+        if (fDebug)
+            printf("askfor %s\n", inv.ToString().c_str());
+        downloadscheduler.AskFor(this, inv, GetTime());
     }
 
 
@@ -325,21 +554,22 @@ public:
         if (nHeaderStart == -1)
             return;
 
-        // Set the size
+        // Set the size and checksum
         unsigned int nSize = vSend.size() - nMessageStart;
-        memcpy((char*)&vSend[nHeaderStart] + offsetof(CMessageHeader, nMessageSize), &nSize, sizeof(nSize));
-
-        // Set the checksum
-        uint256 hash = Hash(vSend.begin() + nMessageStart, vSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(nMessageStart - nHeaderStart >= offsetof(CMessageHeader, nChecksum) + sizeof(nChecksum));
-        memcpy((char*)&vSend[nHeaderStart] + offsetof(CMessageHeader, nChecksum), &nChecksum, sizeof(nChecksum));
+        SetMessageHeader(vSend, nHeaderStart, nMessageStart);
 
         if (fDebug) {
             printf("(%d bytes)\n", nSize);
         }
 
+        // Move the finished message onto the send queue
+        assert(nHeaderStart == 0);
+        CSerializeData* pdata = new CSerializeData();
+        vSend.GetAndClear(*pdata);
+        RecordSendMessage(*pdata);
+        vSendMsg.push_back(CSharedMessage(pdata));
+        nSendSize += pdata->size();
+
         nHeaderStart = -1;
         nMessageStart = -1;
         LEAVE_CRITICAL_SECTION(cs_vSend);
@@ -359,7 +589,41 @@ public:
 
 
     void PushVersion();
+    void RecordSendMessage(const CSerializeData& msg);
 
+    // More queued than -maxsendbuffer allows.  Requests for data from the
+    // peer wait until it drains, rather than queueing more.
+    bool SendQueueFull()
+    {
+        bool fFull;
+        CRITICAL_BLOCK(cs_vSend)
+            fFull = (nSendSize >= SendBufferSize());
+        return fFull;
+    }
+
+
+    // Bulk messages wait until everything else queued has gone out, so
+    // relay of new transactions and blocks isn't stuck behind a peer's
+    // initial block download
+    void PushSharedMessage(const CSharedMessage& msg, bool fBulk=false)
+    {
+        CRITICAL_BLOCK(cs_vSend)
+        {
+            RecordSendMessage(*msg);
+            if (fBulk)
+            {
+                vSendMsgBulk.push_back(msg);
+                nSendSizeBulk += msg->size();
+            }
+            else
+                vSendMsg.push_back(msg);
+            nSendSize += msg->size();
+        }
+        if (fDebug) {
+            printf("%s ", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
+            printf("sending: shared message (%d bytes)\n", (int)msg->size());
+        }
+    }
 
     void PushMessage(const char* pszCommand)
     {
@@ -585,6 +849,14 @@ public:
     static void ClearBanned(); // needed for unit testing
     static bool IsBanned(CNetAddr ip);
     bool Misbehaving(int howmuch); // 1 == a little, 100 == a lot
+
+    void CopyStats(CNodeStats& stats);
+    static void RecordBytesSent(uint64 nBytes);
+    static void RecordBytesRecv(uint64 nBytes);
+    static uint64 GetTotalBytesSent();
+    static uint64 GetTotalBytesRecv();
+    static bool OutboundTargetReached();
+    static uint64 GetOutboundTargetBytesLeft();
 };
 
 
@@ -604,33 +876,12 @@ inline void RelayInventory(const CInv& inv)
             pnode->PushInventory(inv);
 }
 
+void RelayMessage(const CInv& inv, const CSharedMessage& msg);
+
 template<typename T>
 void RelayMessage(const CInv& inv, const T& a)
 {
-    CDataStream ss(SER_NETWORK);
-    ss.reserve(10000);
-    ss << a;
-    RelayMessage(inv, ss);
-}
-
-template<>
-inline void RelayMessage<>(const CInv& inv, const CDataStream& ss)
-{
-    CRITICAL_BLOCK(cs_mapRelay)
-    {
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
-        {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
-        }
-
-        // Save original serialized message so newer versions are preserved
-        mapRelay[inv] = ss;
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
-    }
-
-    RelayInventory(inv);
+    RelayMessage(inv, MakeSharedMessage(inv.GetCommand(), a));
 }
 
 
@@ -295,6 +295,72 @@ bool ConnectSocket(const CService &addrDest, SOCKET& hSocketRet, int nTimeout)
     return true;
 }
 
+// Begin a direct (non-proxied) connect without waiting for it.  The socket is
+// left non-blocking.  If fInProgressRet is set, the caller has to wait for it
+// to become writable and check GetSocketConnectError.
+bool StartConnectSocket(const CService &addrDest, SOCKET& hSocketRet, bool& fInProgressRet)
+{
+    hSocketRet = INVALID_SOCKET;
+    fInProgressRet = false;
+
+    SOCKET hSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (hSocket == INVALID_SOCKET)
+        return false;
+#ifdef SO_NOSIGPIPE
+    int set = 1;
+    setsockopt(hSocket, SOL_SOCKET, SO_NOSIGPIPE, (void*)&set, sizeof(int));
+#endif
+
+    struct sockaddr_in sockaddr;
+    addrDest.GetSockAddr(&sockaddr);
+
+#ifdef WIN32
+    u_long fNonblock = 1;
+    if (ioctlsocket(hSocket, FIONBIO, &fNonblock) == SOCKET_ERROR)
+#else
+    int fFlags = fcntl(hSocket, F_GETFL, 0);
+    if (fcntl(hSocket, F_SETFL, fFlags | O_NONBLOCK) == -1)
+#endif
+    {
+        closesocket(hSocket);
+        return false;
+    }
+
+    if (connect(hSocket, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) == SOCKET_ERROR)
+    {
+        // WSAEINVAL is here because some legacy version of winsock uses it
+        if (WSAGetLastError() == WSAEINPROGRESS || WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAEINVAL)
+            fInProgressRet = true;
+#ifdef WIN32
+        else if (WSAGetLastError() != WSAEISCONN)
+#else
+        else
+#endif
+        {
+            printf("connect() failed: %i\n",WSAGetLastError());
+            closesocket(hSocket);
+            return false;
+        }
+    }
+
+    hSocketRet = hSocket;
+    return true;
+}
+
+// Result of a connect started by StartConnectSocket, 0 on success
+int GetSocketConnectError(SOCKET hSocket)
+{
+    int nRet = 0;
+    socklen_t nRetSize = sizeof(nRet);
+#ifdef WIN32
+    if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, (char*)(&nRet), &nRetSize) == SOCKET_ERROR)
+#else
+    if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, &nRet, &nRetSize) == SOCKET_ERROR)
+#endif
+        return WSAGetLastError();
+    return nRet;
+}
+
 void CNetAddr::Init()
 {
     memset(ip, 0, 16);
@@ -736,3 +802,76 @@ void CService::SetPort(unsigned short portIn)
 {
     port = portIn;
 }
+
+CSubNet::CSubNet() : nBits(0), fValid(false)
+{
+}
+
+CSubNet::CSubNet(const std::string& strSubNet)
+{
+    nBits = 0;
+    fValid = false;
+
+    size_t slash = strSubNet.find_last_of('/');
+    std::vector<CNetAddr> vIP;
+    if (!LookupHostNumeric(strSubNet.substr(0, slash).c_str(), vIP, 1))
+        return;
+    network = vIP[0];
+
+    int nMaxBits = network.IsIPv4() ? 32 : 128;
+    int nPrefix = nMaxBits;
+    if (slash != strSubNet.npos)
+    {
+        std::string strPrefix = strSubNet.substr(slash + 1);
+        if (strPrefix.empty() || strPrefix.size() > 3 || strPrefix.find_first_not_of("0123456789") != strPrefix.npos)
+            return;
+        nPrefix = atoi(strPrefix.c_str());
+        if (nPrefix > nMaxBits)
+            return;
+    }
+    nBits = nPrefix + (128 - nMaxBits);
+
+    // Clear the host bits so equal ranges compare equal
+    for (int n = nBits; n < 128; n++)
+        network.ip[n / 8] &= ~(1 << (7 - n % 8));
+    fValid = true;
+}
+
+CSubNet::CSubNet(const CNetAddr& addr) : network(addr), nBits(128), fValid(addr.IsValid())
+{
+}
+
+bool CSubNet::IsValid() const
+{
+    return fValid;
+}
+
+bool CSubNet::Match(const CNetAddr& addr) const
+{
+    if (!fValid || !addr.IsValid())
+        return false;
+    for (int n = 0; n < nBits; n++)
+        if (((addr.ip[n / 8] >> (7 - n % 8)) & 1) != GetBit(n))
+            return false;
+    return true;
+}
+
+std::string CSubNet::ToString() const
+{
+    return strprintf("%s/%d", network.ToStringIP().c_str(), network.IsIPv4() ? nBits - 96 : nBits);
+}
+
+bool operator==(const CSubNet& a, const CSubNet& b)
+{
+    return a.fValid == b.fValid && a.network == b.network && a.nBits == b.nBits;
+}
+
+bool operator!=(const CSubNet& a, const CSubNet& b)
+{
+    return !(a == b);
+}
+
+bool operator<(const CSubNet& a, const CSubNet& b)
+{
+    return a.network < b.network || (a.network == b.network && a.nBits < b.nBits);
+}
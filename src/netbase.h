@@ -74,6 +74,7 @@ class CNetAddr
         friend bool operator==(const CNetAddr& a, const CNetAddr& b);
         friend bool operator!=(const CNetAddr& a, const CNetAddr& b);
         friend bool operator<(const CNetAddr& a, const CNetAddr& b);
+        friend class CSubNet;
 
         IMPLEMENT_SERIALIZE
             (
@@ -81,6 +82,36 @@ class CNetAddr
             )
 };
 
+/** A range of addresses, written as address/prefix length */
+class CSubNet
+{
+    protected:
+        CNetAddr network; // host bits are zero
+        int nBits; // prefix length counted on the 16 byte form, so 96 + n for an IPv4 /n
+        bool fValid;
+
+    public:
+        CSubNet();
+        explicit CSubNet(const std::string& strSubNet);
+        CSubNet(const CNetAddr& addr); // just that one address
+        bool IsValid() const;
+        bool Match(const CNetAddr& addr) const;
+        int GetBit(int n) const { return (network.ip[n / 8] >> (7 - n % 8)) & 1; }
+        int GetPrefixLength() const { return nBits; }
+        std::string ToString() const;
+
+        friend bool operator==(const CSubNet& a, const CSubNet& b);
+        friend bool operator!=(const CSubNet& a, const CSubNet& b);
+        friend bool operator<(const CSubNet& a, const CSubNet& b);
+
+        IMPLEMENT_SERIALIZE
+            (
+             READWRITE(network);
+             READWRITE(nBits);
+             READWRITE(fValid);
+            )
+};
+
 /** A combnation of a network address (CNetAddr) and a (TCP) port */
 class CService : public CNetAddr
 {
@@ -132,6 +163,8 @@ bool Lookup(const char *pszName, CService& addr, int portDefault = 0, bool fAllo
 bool Lookup(const char *pszName, std::vector<CService>& vAddr, int portDefault = 0, bool fAllowLookup = true, int nMaxSolutions = 0);
 bool LookupNumeric(const char *pszName, CService& addr, int portDefault = 0);
 bool ConnectSocket(const CService &addr, SOCKET& hSocketRet, int nTimeout = nConnectTimeout);
+bool StartConnectSocket(const CService &addr, SOCKET& hSocketRet, bool& fInProgressRet);
+int GetSocketConnectError(SOCKET hSocket);
 
 // Settings
 extern int fUseProxy;
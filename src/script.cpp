@@ -7,32 +7,233 @@
 using namespace std;
 using namespace boost;
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
-
 
 
 typedef vector<unsigned char> valtype;
-static const valtype vchFalse(0);
-static const valtype vchZero(0);
-static const valtype vchTrue(1, 1);
-static const CBigNum bnZero(0);
-static const CBigNum bnOne(1);
-static const CBigNum bnFalse(0);
-static const CBigNum bnTrue(1);
-static const size_t nMaxNumSize = 4;
+static const CScriptNum bnZero(0);
+static const CScriptNum bnOne(1);
+
+uint64 nSigChecks = 0;
+
+
+
+//
+// Stack values are held inline up to the largest direct push, which covers
+// signatures, public keys and hashes.  Anything longer borrows a block from
+// the thread's script arena, so the interpreter doesn't touch the heap once
+// the arena has warmed up.
+//
+static unsigned char* AllocScriptBlock();
+static void FreeScriptBlock(unsigned char* pch);
+
+class CScriptValue
+{
+public:
+    enum
+    {
+        INLINE_SIZE = 75,
+        MAX_SIZE = 520,
+    };
+
+private:
+    unsigned int nSize;
+    unsigned char* pchBlock;
+    unsigned char pchInline[INLINE_SIZE];
+
+    void Reserve(unsigned int n)
+    {
+        if (n > MAX_SIZE)
+            throw runtime_error("CScriptValue::Reserve() : value too large");
+        if (n > INLINE_SIZE && pchBlock == NULL)
+        {
+            pchBlock = AllocScriptBlock();
+            memcpy(pchBlock, pchInline, nSize);
+        }
+    }
+
+public:
+    CScriptValue() : nSize(0), pchBlock(NULL) { }
+    CScriptValue(const unsigned char* pbegin, const unsigned char* pend) : nSize(0), pchBlock(NULL) { assign(pbegin, pend); }
+    explicit CScriptValue(const valtype& vch) : nSize(0), pchBlock(NULL) { if (!vch.empty()) assign(&vch[0], &vch[0] + vch.size()); }
+    CScriptValue(const CScriptValue& b) : nSize(0), pchBlock(NULL) { assign(b.begin(), b.end()); }
+
+    ~CScriptValue()
+    {
+        if (pchBlock)
+            FreeScriptBlock(pchBlock);
+    }
+
+    CScriptValue& operator=(const CScriptValue& b)
+    {
+        if (this != &b)
+            assign(b.begin(), b.end());
+        return *this;
+    }
+
+    void assign(const unsigned char* pbegin, const unsigned char* pend)
+    {
+        unsigned int n = pend - pbegin;
+        Reserve(n);
+        if (n)
+            memmove(data(), pbegin, n);
+        nSize = n;
+    }
+
+    void append(const unsigned char* pbegin, const unsigned char* pend)
+    {
+        unsigned int n = pend - pbegin;
+        Reserve(nSize + n);
+        if (n)
+            memmove(data() + nSize, pbegin, n);
+        nSize += n;
+    }
+
+    void erase(unsigned char* pbegin, unsigned char* pend)
+    {
+        memmove(pbegin, pend, end() - pend);
+        nSize -= pend - pbegin;
+    }
+
+    void resize(unsigned int n, unsigned char c = 0)
+    {
+        Reserve(n);
+        if (n > nSize)
+            memset(data() + nSize, c, n - nSize);
+        nSize = n;
+    }
+
+    unsigned char* data()                           { return pchBlock ? pchBlock : pchInline; }
+    const unsigned char* data() const               { return pchBlock ? pchBlock : pchInline; }
+    unsigned char* begin()                          { return data(); }
+    const unsigned char* begin() const              { return data(); }
+    unsigned char* end()                            { return data() + nSize; }
+    const unsigned char* end() const                { return data() + nSize; }
+    unsigned int size() const                       { return nSize; }
+    bool empty() const                              { return nSize == 0; }
+    unsigned char& operator[](unsigned int i)       { return data()[i]; }
+    unsigned char operator[](unsigned int i) const  { return data()[i]; }
+    unsigned char back() const                      { return data()[nSize - 1]; }
+
+    valtype getvch() const
+    {
+        return valtype(begin(), end());
+    }
+
+    friend bool operator==(const CScriptValue& a, const CScriptValue& b)
+    {
+        return a.nSize == b.nSize && memcmp(a.data(), b.data(), a.nSize) == 0;
+    }
+};
+
+typedef vector<CScriptValue> CScriptStack;
+
+// Buffers the interpreter reuses from one script to the next.  There's one
+// arena per thread, so scripts can be checked on several threads at once.
+class CScriptArena
+{
+public:
+    vector<unsigned char*> vFreeBlocks;
+    vector<CScriptStack*> vFreeStacks;
+    vector<CScriptOp> vOpsEval; // the script EvalScript is running
+    vector<CScriptOp> vOps;     // sigop counting and template matching
+    CScript scriptCode;         // signature checks
+    CScript scriptRedeem;       // pay-to-script-hash subscripts
+
+    ~CScriptArena()
+    {
+        BOOST_FOREACH(CScriptStack* pstack, vFreeStacks)
+            delete pstack;
+        BOOST_FOREACH(unsigned char* pch, vFreeBlocks)
+            delete[] pch;
+    }
+};
+
+static boost::thread_specific_ptr<CScriptArena> scriptarena;
+
+static CScriptArena& GetScriptArena()
+{
+    CScriptArena* parena = scriptarena.get();
+    if (parena == NULL)
+    {
+        parena = new CScriptArena();
+        scriptarena.reset(parena);
+    }
+    return *parena;
+}
 
+static unsigned char* AllocScriptBlock()
+{
+    CScriptArena& arena = GetScriptArena();
+    if (arena.vFreeBlocks.empty())
+        return new unsigned char[CScriptValue::MAX_SIZE];
+    unsigned char* pch = arena.vFreeBlocks.back();
+    arena.vFreeBlocks.pop_back();
+    return pch;
+}
 
-CBigNum CastToBigNum(const valtype& vch)
+static void FreeScriptBlock(unsigned char* pch)
 {
-    if (vch.size() > nMaxNumSize)
-        throw runtime_error("CastToBigNum() : overflow");
-    // Get rid of extra leading zeros
-    return CBigNum(CBigNum(vch).getvch());
+    GetScriptArena().vFreeBlocks.push_back(pch);
 }
 
-bool CastToBool(const valtype& vch)
+// A stack borrowed from the thread's arena, handed back empty (but with its
+// capacity intact) when it goes out of scope
+class CScriptStackLease
 {
-    for (int i = 0; i < vch.size(); i++)
+private:
+    CScriptStack* pstack;
+
+    CScriptStackLease(const CScriptStackLease&);
+    CScriptStackLease& operator=(const CScriptStackLease&);
+
+public:
+    CScriptStackLease()
+    {
+        CScriptArena& arena = GetScriptArena();
+        if (arena.vFreeStacks.empty())
+        {
+            pstack = new CScriptStack();
+        }
+        else
+        {
+            pstack = arena.vFreeStacks.back();
+            arena.vFreeStacks.pop_back();
+        }
+    }
+
+    ~CScriptStackLease()
+    {
+        pstack->clear();
+        GetScriptArena().vFreeStacks.push_back(pstack);
+    }
+
+    CScriptStack& operator*() { return *pstack; }
+};
+
+
+
+static const unsigned char pchTrue[] = { 1 };
+static const CScriptValue valFalse;
+static const CScriptValue valTrue(pchTrue, pchTrue + 1);
+
+static bool CheckSig(const CScriptValue& vchSig, const CScriptValue& vchPubKey, const CScript& scriptCode, CSignatureHasher& hasher, unsigned int nIn, int nHashType,
+                     CSignatureBatch* pbatch=NULL);
+
+
+static CScriptNum CastToNum(const CScriptValue& vch)
+{
+    return CScriptNum(vch.begin(), vch.end());
+}
+
+static CScriptValue ValueFromNum(const CScriptNum& bn)
+{
+    unsigned char pch[CScriptNum::nMaxEncodedSize];
+    return CScriptValue(pch, pch + bn.Encode(pch));
+}
+
+static bool CastToBool(const CScriptValue& vch)
+{
+    for (unsigned int i = 0; i < vch.size(); i++)
     {
         if (vch[i] != 0)
         {
@@ -45,7 +246,7 @@ bool CastToBool(const valtype& vch)
     return false;
 }
 
-void MakeSameSize(valtype& vch1, valtype& vch2)
+static void MakeSameSize(CScriptValue& vch1, CScriptValue& vch2)
 {
     // Lengthen the shorter one
     if (vch1.size() < vch2.size())
@@ -54,6 +255,35 @@ void MakeSameSize(valtype& vch1, valtype& vch2)
         vch2.resize(vch1.size(), 0);
 }
 
+// Deletes every push of vchSig from scriptCode.  The pattern is encoded
+// exactly as CScript() << vchSig would encode it.
+static void DeleteSigPush(CScript& scriptCode, const CScriptValue& vchSig)
+{
+    unsigned char pch[3 + CScriptValue::MAX_SIZE];
+    unsigned int nSize = vchSig.size();
+    unsigned int nHeader;
+    if (nSize < OP_PUSHDATA1)
+    {
+        pch[0] = nSize;
+        nHeader = 1;
+    }
+    else if (nSize <= 0xff)
+    {
+        pch[0] = OP_PUSHDATA1;
+        pch[1] = nSize;
+        nHeader = 2;
+    }
+    else
+    {
+        pch[0] = OP_PUSHDATA2;
+        pch[1] = nSize & 0xff;
+        pch[2] = nSize >> 8;
+        nHeader = 3;
+    }
+    memcpy(pch + nHeader, vchSig.begin(), nSize);
+    scriptCode.FindAndDelete(pch, nHeader + nSize);
+}
+
 
 
 //
@@ -62,7 +292,7 @@ void MakeSameSize(valtype& vch1, valtype& vch2)
 //
 #define stacktop(i)  (stack.at(stack.size()+(i)))
 #define altstacktop(i)  (altstack.at(altstack.size()+(i)))
-static inline void popstack(vector<valtype>& stack)
+static inline void popstack(CScriptStack& stack)
 {
     if (stack.empty())
         throw runtime_error("popstack() : stack empty");
@@ -227,16 +457,14 @@ const char* GetOpName(opcodetype opcode)
     }
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType)
+static bool EvalScript(CScriptStack& stack, const CScript& script, CSignatureHasher& hasher, unsigned int nIn, int nHashType,
+                       CSignatureBatch* pbatch=NULL)
 {
-    CAutoBN_CTX pctx;
-    CScript::const_iterator pc = script.begin();
-    CScript::const_iterator pend = script.end();
-    CScript::const_iterator pbegincodehash = script.begin();
-    opcodetype opcode;
-    valtype vchPushValue;
+    CScriptArena& arena = GetScriptArena();
+    unsigned int nBeginCodeHash = 0;
     vector<bool> vfExec;
-    vector<valtype> altstack;
+    CScriptStackLease altstackLease;
+    CScriptStack& altstack = *altstackLease;
     if (script.size() > 10000)
         return false;
     int nOpCount = 0;
@@ -244,16 +472,21 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
     try
     {
-        while (pc < pend)
+        // A script that can't be decoded all the way through fails
+        vector<CScriptOp>& vOps = arena.vOpsEval;
+        if (!script.Decode(vOps))
+            return false;
+
+        for (unsigned int iOp = 0; iOp < vOps.size(); iOp++)
         {
             bool fExec = !count(vfExec.begin(), vfExec.end(), false);
 
             //
             // Read instruction
             //
-            if (!script.GetOp(pc, opcode, vchPushValue))
-                return false;
-            if (vchPushValue.size() > 520)
+            const CScriptOp& op = vOps[iOp];
+            opcodetype opcode = op.opcode;
+            if (op.nDataSize > 520)
                 return false;
             if (opcode > OP_16 && ++nOpCount > 201)
                 return false;
@@ -276,7 +509,10 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 return false;
 
             if (fExec && 0 <= opcode && opcode <= OP_PUSHDATA4)
-                stack.push_back(vchPushValue);
+                {
+                const unsigned char* pchData = &script[0] + op.nDataOffset;
+                stack.push_back(CScriptValue(pchData, pchData + op.nDataSize));
+            }
             else if (fExec || (OP_IF <= opcode && opcode <= OP_ENDIF))
             switch (opcode)
             {
@@ -302,8 +538,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_16:
                 {
                     // ( -- value)
-                    CBigNum bn((int)opcode - (int)(OP_1 - 1));
-                    stack.push_back(bn.getvch());
+                    stack.push_back(ValueFromNum(CScriptNum((int)opcode - (int)(OP_1 - 1))));
                 }
                 break;
 
@@ -325,7 +560,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     {
                         if (stack.size() < 1)
                             return false;
-                        valtype& vch = stacktop(-1);
+                        CScriptValue& vch = stacktop(-1);
                         fValue = CastToBool(vch);
                         if (opcode == OP_NOTIF)
                             fValue = !fValue;
@@ -408,8 +643,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch1 = stacktop(-2);
-                    valtype vch2 = stacktop(-1);
+                    CScriptValue vch1 = stacktop(-2);
+                    CScriptValue vch2 = stacktop(-1);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
                 }
@@ -420,9 +655,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 -- x1 x2 x3 x1 x2 x3)
                     if (stack.size() < 3)
                         return false;
-                    valtype vch1 = stacktop(-3);
-                    valtype vch2 = stacktop(-2);
-                    valtype vch3 = stacktop(-1);
+                    CScriptValue vch1 = stacktop(-3);
+                    CScriptValue vch2 = stacktop(-2);
+                    CScriptValue vch3 = stacktop(-1);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
                     stack.push_back(vch3);
@@ -434,8 +669,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 -- x1 x2 x3 x4 x1 x2)
                     if (stack.size() < 4)
                         return false;
-                    valtype vch1 = stacktop(-4);
-                    valtype vch2 = stacktop(-3);
+                    CScriptValue vch1 = stacktop(-4);
+                    CScriptValue vch2 = stacktop(-3);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
                 }
@@ -446,8 +681,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 x5 x6 -- x3 x4 x5 x6 x1 x2)
                     if (stack.size() < 6)
                         return false;
-                    valtype vch1 = stacktop(-6);
-                    valtype vch2 = stacktop(-5);
+                    CScriptValue vch1 = stacktop(-6);
+                    CScriptValue vch2 = stacktop(-5);
                     stack.erase(stack.end()-6, stack.end()-4);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
@@ -469,7 +704,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x - 0 | x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
+                    CScriptValue vch = stacktop(-1);
                     if (CastToBool(vch))
                         stack.push_back(vch);
                 }
@@ -478,8 +713,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_DEPTH:
                 {
                     // -- stacksize
-                    CBigNum bn(stack.size());
-                    stack.push_back(bn.getvch());
+                    stack.push_back(ValueFromNum(CScriptNum(stack.size())));
                 }
                 break;
 
@@ -497,7 +731,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x -- x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
+                    CScriptValue vch = stacktop(-1);
                     stack.push_back(vch);
                 }
                 break;
@@ -516,7 +750,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-2);
+                    CScriptValue vch = stacktop(-2);
                     stack.push_back(vch);
                 }
                 break;
@@ -528,11 +762,11 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
                     if (stack.size() < 2)
                         return false;
-                    int n = CastToBigNum(stacktop(-1)).getint();
+                    int n = CastToNum(stacktop(-1)).getint();
                     popstack(stack);
                     if (n < 0 || n >= stack.size())
                         return false;
-                    valtype vch = stacktop(-n-1);
+                    CScriptValue vch = stacktop(-n-1);
                     if (opcode == OP_ROLL)
                         stack.erase(stack.end()-n-1);
                     stack.push_back(vch);
@@ -565,7 +799,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-1);
+                    CScriptValue vch = stacktop(-1);
                     stack.insert(stack.end()-2, vch);
                 }
                 break;
@@ -579,9 +813,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- out)
                     if (stack.size() < 2)
                         return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
-                    vch1.insert(vch1.end(), vch2.begin(), vch2.end());
+                    CScriptValue& vch1 = stacktop(-2);
+                    CScriptValue& vch2 = stacktop(-1);
+                    vch1.append(vch2.begin(), vch2.end());
                     popstack(stack);
                     if (stacktop(-1).size() > 520)
                         return false;
@@ -593,9 +827,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in begin size -- out)
                     if (stack.size() < 3)
                         return false;
-                    valtype& vch = stacktop(-3);
-                    int nBegin = CastToBigNum(stacktop(-2)).getint();
-                    int nEnd = nBegin + CastToBigNum(stacktop(-1)).getint();
+                    CScriptValue& vch = stacktop(-3);
+                    int nBegin = CastToNum(stacktop(-2)).getint();
+                    int nEnd = nBegin + CastToNum(stacktop(-1)).getint();
                     if (nBegin < 0 || nEnd < nBegin)
                         return false;
                     if (nBegin > vch.size())
@@ -615,8 +849,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in size -- out)
                     if (stack.size() < 2)
                         return false;
-                    valtype& vch = stacktop(-2);
-                    int nSize = CastToBigNum(stacktop(-1)).getint();
+                    CScriptValue& vch = stacktop(-2);
+                    int nSize = CastToNum(stacktop(-1)).getint();
                     if (nSize < 0)
                         return false;
                     if (nSize > vch.size())
@@ -634,8 +868,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- in size)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn(stacktop(-1).size());
-                    stack.push_back(bn.getvch());
+                    stack.push_back(ValueFromNum(CScriptNum(stacktop(-1).size())));
                 }
                 break;
 
@@ -648,7 +881,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in - out)
                     if (stack.size() < 1)
                         return false;
-                    valtype& vch = stacktop(-1);
+                    CScriptValue& vch = stacktop(-1);
                     for (int i = 0; i < vch.size(); i++)
                         vch[i] = ~vch[i];
                 }
@@ -661,8 +894,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 - out)
                     if (stack.size() < 2)
                         return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
+                    CScriptValue& vch1 = stacktop(-2);
+                    CScriptValue& vch2 = stacktop(-1);
                     MakeSameSize(vch1, vch2);
                     if (opcode == OP_AND)
                     {
@@ -690,8 +923,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 - bool)
                     if (stack.size() < 2)
                         return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
+                    CScriptValue& vch1 = stacktop(-2);
+                    CScriptValue& vch2 = stacktop(-1);
                     bool fEqual = (vch1 == vch2);
                     // OP_NOTEQUAL is disabled because it would be too easy to say
                     // something like n != 1 and have some wiseguy pass in 1 with extra
@@ -700,7 +933,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     //    fEqual = !fEqual;
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(fEqual ? vchTrue : vchFalse);
+                    stack.push_back(fEqual ? valTrue : valFalse);
                     if (opcode == OP_EQUALVERIFY)
                     {
                         if (fEqual)
@@ -717,8 +950,6 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 //
                 case OP_1ADD:
                 case OP_1SUB:
-                case OP_2MUL:
-                case OP_2DIV:
                 case OP_NEGATE:
                 case OP_ABS:
                 case OP_NOT:
@@ -727,31 +958,24 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- out)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn = CastToBigNum(stacktop(-1));
+                    CScriptNum bn = CastToNum(stacktop(-1));
                     switch (opcode)
                     {
                     case OP_1ADD:       bn += bnOne; break;
                     case OP_1SUB:       bn -= bnOne; break;
-                    case OP_2MUL:       bn <<= 1; break;
-                    case OP_2DIV:       bn >>= 1; break;
                     case OP_NEGATE:     bn = -bn; break;
                     case OP_ABS:        if (bn < bnZero) bn = -bn; break;
-                    case OP_NOT:        bn = (bn == bnZero); break;
-                    case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    case OP_NOT:        bn = CScriptNum(bn == bnZero); break;
+                    case OP_0NOTEQUAL:  bn = CScriptNum(bn != bnZero); break;
                     default:            assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    stack.push_back(ValueFromNum(bn));
                 }
                 break;
 
                 case OP_ADD:
                 case OP_SUB:
-                case OP_MUL:
-                case OP_DIV:
-                case OP_MOD:
-                case OP_LSHIFT:
-                case OP_RSHIFT:
                 case OP_BOOLAND:
                 case OP_BOOLOR:
                 case OP_NUMEQUAL:
@@ -767,9 +991,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- out)
                     if (stack.size() < 2)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-2));
-                    CBigNum bn2 = CastToBigNum(stacktop(-1));
-                    CBigNum bn;
+                    CScriptNum bn1 = CastToNum(stacktop(-2));
+                    CScriptNum bn2 = CastToNum(stacktop(-1));
+                    CScriptNum bn(0);
                     switch (opcode)
                     {
                     case OP_ADD:
@@ -780,49 +1004,22 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         bn = bn1 - bn2;
                         break;
 
-                    case OP_MUL:
-                        if (!BN_mul(&bn, &bn1, &bn2, pctx))
-                            return false;
-                        break;
-
-                    case OP_DIV:
-                        if (!BN_div(&bn, NULL, &bn1, &bn2, pctx))
-                            return false;
-                        break;
-
-                    case OP_MOD:
-                        if (!BN_mod(&bn, &bn1, &bn2, pctx))
-                            return false;
-                        break;
-
-                    case OP_LSHIFT:
-                        if (bn2 < bnZero || bn2 > CBigNum(2048))
-                            return false;
-                        bn = bn1 << bn2.getulong();
-                        break;
-
-                    case OP_RSHIFT:
-                        if (bn2 < bnZero || bn2 > CBigNum(2048))
-                            return false;
-                        bn = bn1 >> bn2.getulong();
-                        break;
-
-                    case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
-                    case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
-                    case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
-                    case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
-                    case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
-                    case OP_LESSTHAN:            bn = (bn1 < bn2); break;
-                    case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
-                    case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
-                    case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
+                    case OP_BOOLAND:             bn = CScriptNum(bn1 != bnZero && bn2 != bnZero); break;
+                    case OP_BOOLOR:              bn = CScriptNum(bn1 != bnZero || bn2 != bnZero); break;
+                    case OP_NUMEQUAL:            bn = CScriptNum(bn1 == bn2); break;
+                    case OP_NUMEQUALVERIFY:      bn = CScriptNum(bn1 == bn2); break;
+                    case OP_NUMNOTEQUAL:         bn = CScriptNum(bn1 != bn2); break;
+                    case OP_LESSTHAN:            bn = CScriptNum(bn1 < bn2); break;
+                    case OP_GREATERTHAN:         bn = CScriptNum(bn1 > bn2); break;
+                    case OP_LESSTHANOREQUAL:     bn = CScriptNum(bn1 <= bn2); break;
+                    case OP_GREATERTHANOREQUAL:  bn = CScriptNum(bn1 >= bn2); break;
                     case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
                     case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
                     default:                     assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    stack.push_back(ValueFromNum(bn));
 
                     if (opcode == OP_NUMEQUALVERIFY)
                     {
@@ -839,14 +1036,14 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x min max -- out)
                     if (stack.size() < 3)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-3));
-                    CBigNum bn2 = CastToBigNum(stacktop(-2));
-                    CBigNum bn3 = CastToBigNum(stacktop(-1));
+                    CScriptNum bn1 = CastToNum(stacktop(-3));
+                    CScriptNum bn2 = CastToNum(stacktop(-2));
+                    CScriptNum bn3 = CastToNum(stacktop(-1));
                     bool fValue = (bn2 <= bn1 && bn1 < bn3);
                     popstack(stack);
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(fValue ? vchTrue : vchFalse);
+                    stack.push_back(fValue ? valTrue : valFalse);
                 }
                 break;
 
@@ -863,33 +1060,34 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- hash)
                     if (stack.size() < 1)
                         return false;
-                    valtype& vch = stacktop(-1);
-                    valtype vchHash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
+                    CScriptValue& vch = stacktop(-1);
+                    unsigned char pchHash[32];
+                    unsigned int nHashSize = (opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32;
                     if (opcode == OP_RIPEMD160)
-                        RIPEMD160(&vch[0], vch.size(), &vchHash[0]);
+                        RIPEMD160(vch.begin(), vch.size(), pchHash);
                     else if (opcode == OP_SHA1)
-                        SHA1(&vch[0], vch.size(), &vchHash[0]);
+                        SHA1(vch.begin(), vch.size(), pchHash);
                     else if (opcode == OP_SHA256)
-                        SHA256(&vch[0], vch.size(), &vchHash[0]);
+                        SHA256(vch.begin(), vch.size(), pchHash);
                     else if (opcode == OP_HASH160)
                     {
-                        uint160 hash160 = Hash160(vch);
-                        memcpy(&vchHash[0], &hash160, sizeof(hash160));
+                        uint256 hash1;
+                        SHA256(vch.begin(), vch.size(), (unsigned char*)&hash1);
+                        RIPEMD160((unsigned char*)&hash1, sizeof(hash1), pchHash);
                     }
                     else if (opcode == OP_HASH256)
                     {
                         uint256 hash = Hash(vch.begin(), vch.end());
-                        memcpy(&vchHash[0], &hash, sizeof(hash));
+                        memcpy(pchHash, &hash, sizeof(hash));
                     }
-                    popstack(stack);
-                    stack.push_back(vchHash);
+                    vch.assign(pchHash, pchHash + nHashSize);
                 }
                 break;
 
                 case OP_CODESEPARATOR:
                 {
                     // Hash starts after the code separator
-                    pbegincodehash = pc;
+                    nBeginCodeHash = op.End();
                 }
                 break;
 
@@ -900,24 +1098,27 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < 2)
                         return false;
 
-                    valtype& vchSig    = stacktop(-2);
-                    valtype& vchPubKey = stacktop(-1);
+                    CScriptValue& vchSig    = stacktop(-2);
+                    CScriptValue& vchPubKey = stacktop(-1);
 
                     ////// debug print
                     //PrintHex(vchSig.begin(), vchSig.end(), "sig: %s\n");
                     //PrintHex(vchPubKey.begin(), vchPubKey.end(), "pubkey: %s\n");
 
                     // Subset of script starting at the most recent codeseparator
-                    CScript scriptCode(pbegincodehash, pend);
+                    CScript& scriptCode = arena.scriptCode;
+                    scriptCode.assign(script.begin() + nBeginCodeHash, script.end());
 
                     // Drop the signature, since there's no way for a signature to sign itself
-                    scriptCode.FindAndDelete(CScript(vchSig));
+                    DeleteSigPush(scriptCode, vchSig);
 
-                    bool fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
+                    // Only the last op's check can be put off; see CSignatureBatch
+                    bool fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, hasher, nIn, nHashType,
+                                             iOp + 1 == vOps.size() ? pbatch : NULL);
 
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(fSuccess ? vchTrue : vchFalse);
+                    stack.push_back(fSuccess ? valTrue : valFalse);
                     if (opcode == OP_CHECKSIGVERIFY)
                     {
                         if (fSuccess)
@@ -937,7 +1138,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < i)
                         return false;
 
-                    int nKeysCount = CastToBigNum(stacktop(-i)).getint();
+                    int nKeysCount = CastToNum(stacktop(-i)).getint();
                     if (nKeysCount < 0 || nKeysCount > 20)
                         return false;
                     nOpCount += nKeysCount;
@@ -948,7 +1149,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < i)
                         return false;
 
-                    int nSigsCount = CastToBigNum(stacktop(-i)).getint();
+                    int nSigsCount = CastToNum(stacktop(-i)).getint();
                     if (nSigsCount < 0 || nSigsCount > nKeysCount)
                         return false;
                     int isig = ++i;
@@ -957,23 +1158,24 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         return false;
 
                     // Subset of script starting at the most recent codeseparator
-                    CScript scriptCode(pbegincodehash, pend);
+                    CScript& scriptCode = arena.scriptCode;
+                    scriptCode.assign(script.begin() + nBeginCodeHash, script.end());
 
                     // Drop the signatures, since there's no way for a signature to sign itself
                     for (int k = 0; k < nSigsCount; k++)
                     {
-                        valtype& vchSig = stacktop(-isig-k);
-                        scriptCode.FindAndDelete(CScript(vchSig));
+                        CScriptValue& vchSig = stacktop(-isig-k);
+                        DeleteSigPush(scriptCode, vchSig);
                     }
 
                     bool fSuccess = true;
                     while (fSuccess && nSigsCount > 0)
                     {
-                        valtype& vchSig    = stacktop(-isig);
-                        valtype& vchPubKey = stacktop(-ikey);
+                        CScriptValue& vchSig    = stacktop(-isig);
+                        CScriptValue& vchPubKey = stacktop(-ikey);
 
                         // Check signature
-                        if (CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType))
+                        if (CheckSig(vchSig, vchPubKey, scriptCode, hasher, nIn, nHashType))
                         {
                             isig++;
                             nSigsCount--;
@@ -989,7 +1191,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                     while (i-- > 0)
                         popstack(stack);
-                    stack.push_back(fSuccess ? vchTrue : vchFalse);
+                    stack.push_back(fSuccess ? valTrue : valFalse);
 
                     if (opcode == OP_CHECKMULTISIGVERIFY)
                     {
@@ -1022,6 +1224,19 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
     return true;
 }
 
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    CScriptStackLease stackLease;
+    CScriptStack& stackValues = *stackLease;
+    BOOST_FOREACH(const valtype& vch, stack)
+        stackValues.push_back(CScriptValue(vch));
+    CSignatureHasher hasher(txTo);
+    bool fResult = EvalScript(stackValues, script, hasher, nIn, nHashType);
+    stack.clear();
+    BOOST_FOREACH(const CScriptValue& val, stackValues)
+        stack.push_back(val.getvch());
+    return fResult;
+}
 
 
 
@@ -1030,76 +1245,208 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
 
 
-uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+
+// A serialized CTxIn with an empty scriptSig: prevout, one length byte, nSequence
+static const unsigned int BLANK_INPUT_SIZE = 32 + 4 + 1 + 4;
+
+// What a null CTxOut serializes to: nValue of -1 and an empty scriptPubKey
+static const unsigned char pchNullOutput[9] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00 };
+
+static const unsigned char pchZero[4] = { 0, 0, 0, 0 };
+
+// Same encoding as WriteCompactSize(), into a buffer of at least 9 bytes
+static unsigned int EncodeCompactSize(unsigned char* pch, uint64 nSize)
+{
+    if (nSize < 253)
+    {
+        pch[0] = nSize;
+        return 1;
+    }
+    else if (nSize <= std::numeric_limits<unsigned short>::max())
+    {
+        unsigned short xSize = nSize;
+        pch[0] = 253;
+        memcpy(&pch[1], &xSize, sizeof(xSize));
+        return 1 + sizeof(xSize);
+    }
+    else if (nSize <= std::numeric_limits<unsigned int>::max())
+    {
+        unsigned int xSize = nSize;
+        pch[0] = 254;
+        memcpy(&pch[1], &xSize, sizeof(xSize));
+        return 1 + sizeof(xSize);
+    }
+    pch[0] = 255;
+    memcpy(&pch[1], &nSize, sizeof(nSize));
+    return 1 + sizeof(nSize);
+}
+
+void CSignatureHasher::Init()
 {
+    CDataStream ss(SER_GETHASH);
+    ss << txTo.nVersion;
+    WriteCompactSize(ss, txTo.vin.size());
+    vchPrefix.assign(ss.begin(), ss.end());
+
+    ss.clear();
+    ss.reserve(txTo.vin.size() * BLANK_INPUT_SIZE);
+    BOOST_FOREACH(const CTxIn& txin, txTo.vin)
+        ss << txin.prevout << CScript() << txin.nSequence;
+    assert(ss.size() == txTo.vin.size() * BLANK_INPUT_SIZE);
+    vchInputs.assign(ss.begin(), ss.end());
+
+    ss.clear();
+    WriteCompactSize(ss, txTo.vout.size());
+    vOutputPos.reserve(txTo.vout.size() + 1);
+    BOOST_FOREACH(const CTxOut& txout, txTo.vout)
+    {
+        vOutputPos.push_back(ss.size());
+        ss << txout;
+    }
+    vOutputPos.push_back(ss.size());
+    ss << txTo.nLockTime;
+    vchOutputs.assign(ss.begin(), ss.end());
+
+    fInit = true;
+}
+
+uint256 CSignatureHasher::SignatureHash(const CScript& scriptCodeIn, unsigned int nIn, int nHashType)
+{
+    // Builds the same preimage as serializing a copy of txTo that has been
+    // blanked out according to nHashType, followed by nHashType
     if (nIn >= txTo.vin.size())
     {
         printf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
         return 1;
     }
-    CTransaction txTmp(txTo);
+    int nType = nHashType & 0x1f;
+    if (nType == SIGHASH_SINGLE && nIn >= txTo.vout.size())
+    {
+        printf("ERROR: SignatureHash() : nOut=%d out of range\n", nIn);
+        return 1;
+    }
+    if (!fInit)
+        Init();
 
     // In case concatenating two scripts ends up with two codeseparators,
     // or an extra one at the end, this prevents all those possible incompatibilities.
-    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+    const CScript* pscriptCode = &scriptCodeIn;
+    CScript scriptCodeStripped;
+    if (scriptCodeIn.Find(OP_CODESEPARATOR) > 0)
+    {
+        scriptCodeStripped = scriptCodeIn;
+        scriptCodeStripped.FindAndDelete(CScript(OP_CODESEPARATOR));
+        pscriptCode = &scriptCodeStripped;
+    }
+    const CScript& scriptCode = *pscriptCode;
+
+    // SIGHASH_NONE and SIGHASH_SINGLE let the others update at will, and
+    // SIGHASH_ANYONECANPAY blanks out the other inputs completely
+    bool fOthersSequence = (nType != SIGHASH_NONE && nType != SIGHASH_SINGLE);
+    bool fAnyoneCanPay = (nHashType & SIGHASH_ANYONECANPAY);
+    unsigned int nInputs = txTo.vin.size();
+    const unsigned char* pchInput = &vchInputs[nIn * BLANK_INPUT_SIZE];
+    unsigned char pchSize[9];
+
+    SHA256_CTX ctx;
+    if (fAnyoneCanPay)
+    {
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, &vchPrefix[0], sizeof(txTo.nVersion));
+        SHA256_Update(&ctx, pchSize, EncodeCompactSize(pchSize, 1));
+    }
+    else if (fOthersSequence)
+    {
+        // Everything before this input is the same for every input
+        if (vMidstate.empty())
+        {
+            vMidstate.reserve(nInputs);
+            SHA256_Init(&ctx);
+            SHA256_Update(&ctx, &vchPrefix[0], vchPrefix.size());
+            vMidstate.push_back(ctx);
+        }
+        while (vMidstate.size() <= nIn)
+        {
+            ctx = vMidstate.back();
+            SHA256_Update(&ctx, &vchInputs[(vMidstate.size() - 1) * BLANK_INPUT_SIZE], BLANK_INPUT_SIZE);
+            vMidstate.push_back(ctx);
+        }
+        ctx = vMidstate[nIn];
+    }
+    else
+    {
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, &vchPrefix[0], vchPrefix.size());
+        for (unsigned int i = 0; i < nIn; i++)
+        {
+            SHA256_Update(&ctx, &vchInputs[i * BLANK_INPUT_SIZE], BLANK_INPUT_SIZE - 4);
+            SHA256_Update(&ctx, pchZero, 4);
+        }
+    }
 
-    // Blank out other inputs' signatures
-    for (int i = 0; i < txTmp.vin.size(); i++)
-        txTmp.vin[i].scriptSig = CScript();
-    txTmp.vin[nIn].scriptSig = scriptCode;
+    // This input, with scriptCode in place of its scriptSig
+    SHA256_Update(&ctx, pchInput, BLANK_INPUT_SIZE - 5);
+    SHA256_Update(&ctx, pchSize, EncodeCompactSize(pchSize, scriptCode.size()));
+    if (!scriptCode.empty())
+        SHA256_Update(&ctx, &scriptCode[0], scriptCode.size());
+    SHA256_Update(&ctx, pchInput + BLANK_INPUT_SIZE - 4, 4);
 
-    // Blank out some of the outputs
-    if ((nHashType & 0x1f) == SIGHASH_NONE)
+    if (!fAnyoneCanPay)
     {
-        // Wildcard payee
-        txTmp.vout.clear();
+        if (fOthersSequence)
+        {
+            if (nIn + 1 < nInputs)
+                SHA256_Update(&ctx, pchInput + BLANK_INPUT_SIZE, (nInputs - nIn - 1) * BLANK_INPUT_SIZE);
+        }
+        else
+        {
+            for (unsigned int i = nIn + 1; i < nInputs; i++)
+            {
+                SHA256_Update(&ctx, &vchInputs[i * BLANK_INPUT_SIZE], BLANK_INPUT_SIZE - 4);
+                SHA256_Update(&ctx, pchZero, 4);
+            }
+        }
+    }
 
-        // Let the others update at will
-        for (int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
+    const unsigned char* pchLockTime = &vchOutputs[vchOutputs.size() - sizeof(txTo.nLockTime)];
+    if (nType == SIGHASH_NONE)
+    {
+        // Wildcard payee
+        SHA256_Update(&ctx, pchSize, EncodeCompactSize(pchSize, 0));
+        SHA256_Update(&ctx, pchLockTime, sizeof(txTo.nLockTime));
     }
-    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+    else if (nType == SIGHASH_SINGLE)
     {
         // Only lockin the txout payee at same index as txin
-        unsigned int nOut = nIn;
-        if (nOut >= txTmp.vout.size())
-        {
-            printf("ERROR: SignatureHash() : nOut=%d out of range\n", nOut);
-            return 1;
-        }
-        txTmp.vout.resize(nOut+1);
-        for (int i = 0; i < nOut; i++)
-            txTmp.vout[i].SetNull();
-
-        // Let the others update at will
-        for (int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
+        SHA256_Update(&ctx, pchSize, EncodeCompactSize(pchSize, nIn + 1));
+        for (unsigned int i = 0; i < nIn; i++)
+            SHA256_Update(&ctx, pchNullOutput, sizeof(pchNullOutput));
+        SHA256_Update(&ctx, &vchOutputs[vOutputPos[nIn]], vOutputPos[nIn + 1] - vOutputPos[nIn]);
+        SHA256_Update(&ctx, pchLockTime, sizeof(txTo.nLockTime));
     }
-
-    // Blank out other inputs completely, not recommended for open transactions
-    if (nHashType & SIGHASH_ANYONECANPAY)
+    else
     {
-        txTmp.vin[0] = txTmp.vin[nIn];
-        txTmp.vin.resize(1);
+        SHA256_Update(&ctx, &vchOutputs[0], vchOutputs.size());
     }
+    SHA256_Update(&ctx, &nHashType, sizeof(nHashType));
 
-    // Serialize and hash
-    CDataStream ss(SER_GETHASH);
-    ss.reserve(10000);
-    ss << txTmp << nHashType;
-    return Hash(ss.begin(), ss.end());
+    uint256 hash1;
+    SHA256_Final((unsigned char*)&hash1, &ctx);
+    uint256 hash2;
+    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+    return hash2;
 }
 
-
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType)
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
 {
-    CKey key;
-    if (!key.SetPubKey(vchPubKey))
-        return false;
+    CSignatureHasher hasher(txTo);
+    return hasher.SignatureHash(scriptCode, nIn, nHashType);
+}
+
 
+static bool CheckSig(const CScriptValue& vchSig, const CScriptValue& vchPubKey, const CScript& scriptCode,
+                     CSignatureHasher& hasher, unsigned int nIn, int nHashType, CSignatureBatch* pbatch)
+{
     // Hash type is one byte tacked on to the end of the signature
     if (vchSig.empty())
         return false;
@@ -1107,9 +1454,193 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
         nHashType = vchSig.back();
     else if (nHashType != vchSig.back())
         return false;
-    vchSig.pop_back();
 
-    return key.Verify(SignatureHash(scriptCode, txTo, nIn, nHashType), vchSig);
+    // Signatures secp256k1.cpp can read are checked there, against the key
+    // from the cache
+    CSecp256k1PubKey pubkey;
+    if (Secp256k1IsLaxSignature(vchSig.begin(), vchSig.size() - 1) &&
+        pubkeycache.Get(vchPubKey.begin(), vchPubKey.size(), pubkey))
+    {
+        nSigChecks++;
+        uint256 hash = hasher.SignatureHash(scriptCode, nIn, nHashType);
+        // Only strict DER is put off; the batch reads nothing else
+        if (pbatch && Secp256k1IsStrictSignature(vchSig.begin(), vchSig.size() - 1))
+        {
+            pbatch->Add(hash, vchSig.begin(), vchSig.size() - 1, pubkey);
+            return true;
+        }
+        return Secp256k1Verify((unsigned char*)&hash, vchSig.begin(), vchSig.size() - 1, pubkey);
+    }
+
+    // Any other signature or key goes through CKey, which leaves it to
+    // OpenSSL as it always has
+    CKey key;
+    if (!key.SetPubKey(vchPubKey.begin(), vchPubKey.size()))
+        return false;
+
+    nSigChecks++;
+    return key.Verify(hasher.SignatureHash(scriptCode, nIn, nHashType), vchSig.begin(), vchSig.size() - 1);
+}
+
+void CSignatureBatch::Add(const uint256& hash, const unsigned char* pchSig, unsigned int nSigSize, const CSecp256k1PubKey& pubkey)
+{
+    vEntries.push_back(CSecp256k1BatchEntry());
+    CSecp256k1BatchEntry& entry = vEntries.back();
+    memcpy(entry.pchHash, &hash, sizeof(entry.pchHash));
+    entry.vchSig.assign(pchSig, pchSig + nSigSize);
+    entry.pubkey = pubkey;
+    vInputs.push_back(make_pair(hashTx, nIn));
+}
+
+// Around 200 bytes an entry
+CPubKeyCache pubkeycache(20000);
+
+bool CPubKeyCache::Get(const unsigned char* pch, unsigned int nSize, CSecp256k1PubKey& pubkeyRet)
+{
+    CKeyBytes key;
+    if (nSize > sizeof(key.pch))
+        return false;
+    key.nSize = nSize;
+    memcpy(key.pch, pch, nSize);
+
+    CRITICAL_BLOCK(cs)
+    {
+        std::map<CKeyBytes, list_type::iterator>::iterator mi = mapEntries.find(key);
+        if (mi != mapEntries.end())
+        {
+            listEntries.splice(listEntries.begin(), listEntries, mi->second);
+            pubkeyRet = mi->second->second;
+            return true;
+        }
+    }
+
+    // Parse outside the lock; if two threads both miss on a key, the second
+    // finds it already there
+    CSecp256k1PubKey pubkey;
+    if (!pubkey.SetPubKey(pch, nSize))
+        return false;
+
+    CRITICAL_BLOCK(cs)
+    {
+        if (!mapEntries.count(key))
+        {
+            listEntries.push_front(make_pair(key, pubkey));
+            mapEntries[key] = listEntries.begin();
+            if (listEntries.size() > nMaxSize)
+            {
+                mapEntries.erase(listEntries.back().first);
+                listEntries.pop_back();
+            }
+        }
+    }
+    pubkeyRet = pubkey;
+    return true;
+}
+
+unsigned int CPubKeyCache::size()
+{
+    unsigned int nSize;
+    CRITICAL_BLOCK(cs)
+        nSize = mapEntries.size();
+    return nSize;
+}
+
+void CPubKeyCache::clear()
+{
+    CRITICAL_BLOCK(cs)
+    {
+        mapEntries.clear();
+        listEntries.clear();
+    }
+}
+
+// Around 100 bytes an entry
+CScriptCheckCache scriptcheckcache(200000);
+
+CScriptCheckCache::CScriptCheckCache(unsigned int nMaxSizeIn) : nMaxSize(nMaxSizeIn)
+{
+    RAND_bytes(pchSalt, sizeof(pchSalt));
+}
+
+uint256 CScriptCheckCache::GetKey(const uint256& hashTx, unsigned int nIn, bool fStrictPayToScriptHash) const
+{
+    unsigned char pch[sizeof(pchSalt) + 32 + 5];
+    memcpy(pch, pchSalt, sizeof(pchSalt));
+    memcpy(pch + sizeof(pchSalt), BEGIN(hashTx), 32);
+    for (int i = 0; i < 4; i++)
+        pch[sizeof(pchSalt) + 32 + i] = (nIn >> (8 * i)) & 0xff;
+    pch[sizeof(pchSalt) + 36] = fStrictPayToScriptHash;
+    return Hash(pch, pch + sizeof(pch));
+}
+
+bool CScriptCheckCache::Contains(const uint256& hashTx, unsigned int nIn, bool fStrictPayToScriptHash)
+{
+    uint256 key = GetKey(hashTx, nIn, fStrictPayToScriptHash);
+    bool fFound;
+    CRITICAL_BLOCK(cs)
+        fFound = setValid.count(key);
+    return fFound;
+}
+
+void CScriptCheckCache::Insert(const uint256& hashTx, unsigned int nIn, bool fStrictPayToScriptHash)
+{
+    if (nMaxSize == 0)
+        return;
+    uint256 key = GetKey(hashTx, nIn, fStrictPayToScriptHash);
+    CRITICAL_BLOCK(cs)
+    {
+        while (setValid.size() >= nMaxSize)
+        {
+            // Keys are salted hashes, so the one after a random value is a
+            // random entry
+            uint256 hashRand;
+            RAND_bytes(hashRand.begin(), 32);
+            std::set<uint256>::iterator it = setValid.lower_bound(hashRand);
+            if (it == setValid.end())
+                it = setValid.begin();
+            setValid.erase(it);
+        }
+        setValid.insert(key);
+    }
+}
+
+void CScriptCheckCache::Erase(const uint256& hashTx, unsigned int nIn, bool fStrictPayToScriptHash)
+{
+    uint256 key = GetKey(hashTx, nIn, fStrictPayToScriptHash);
+    CRITICAL_BLOCK(cs)
+        setValid.erase(key);
+}
+
+unsigned int CScriptCheckCache::size()
+{
+    unsigned int nSize;
+    CRITICAL_BLOCK(cs)
+        nSize = setValid.size();
+    return nSize;
+}
+
+void CScriptCheckCache::clear()
+{
+    CRITICAL_BLOCK(cs)
+        setValid.clear();
+}
+
+bool CSignatureBatch::Verify(uint256& hashTxRet, unsigned int& nInRet) const
+{
+    if (Secp256k1VerifyBatch(vEntries))
+        return true;
+
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+    {
+        const CSecp256k1BatchEntry& entry = vEntries[i];
+        if (!Secp256k1Verify(entry.pchHash, entry.vchSig.empty() ? NULL : &entry.vchSig[0], entry.vchSig.size(), entry.pubkey))
+        {
+            hashTxRet = vInputs[i].first;
+            nInRet = vInputs[i].second;
+            return false;
+        }
+    }
+    return true;
 }
 
 
@@ -1123,117 +1654,216 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
 //
 // Return public keys or hashes from scriptPubKey, for 'standard' transaction types.
 //
-bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, vector<vector<unsigned char> >& vSolutionsRet)
+// The usual encodings of the standard templates, recognized from the bytes
+// alone.  Anything these don't match is left to the template scan, which
+// accepts any encoding of the pushes.
+static bool MatchTemplateBytes(const CScript& script, CScriptSolution& solutionRet)
+{
+    unsigned int nSize = script.size();
+    if (nSize < 3)
+        return false;
+    const unsigned char* pch = &script[0];
+
+    // OP_DUP OP_HASH160 20 [20 byte hash] OP_EQUALVERIFY OP_CHECKSIG
+    if (nSize == 25 && pch[0] == OP_DUP && pch[1] == OP_HASH160 && pch[2] == 20 &&
+        pch[23] == OP_EQUALVERIFY && pch[24] == OP_CHECKSIG)
+    {
+        solutionRet.type = TX_PUBKEYHASH;
+        solutionRet.nRequired = solutionRet.nKeys = 1;
+        solutionRet.Add(&pch[3], 20);
+        return true;
+    }
+
+    // [33 to 75 byte pubkey] OP_CHECKSIG
+    if (pch[0] >= 33 && pch[0] <= 75 && nSize == pch[0] + 2 && pch[nSize-1] == OP_CHECKSIG)
+    {
+        solutionRet.type = TX_PUBKEY;
+        solutionRet.nRequired = solutionRet.nKeys = 1;
+        solutionRet.Add(&pch[1], pch[0]);
+        return true;
+    }
+
+    // OP_m [33 to 75 byte pubkey]... OP_n OP_CHECKMULTISIG
+    if (pch[0] >= OP_1 && pch[0] <= OP_16 && pch[nSize-1] == OP_CHECKMULTISIG &&
+        pch[nSize-2] >= OP_1 && pch[nSize-2] <= OP_16)
+    {
+        unsigned int nEnd = nSize - 2;
+        unsigned int i = 1;
+        int nPushes = 0;
+        while (i < nEnd && pch[i] >= 33 && pch[i] <= 75 && pch[i] < nEnd - i)
+        {
+            solutionRet.Add(&pch[i+1], pch[i]);
+            nPushes++;
+            i += 1 + pch[i];
+        }
+        int m = CScript::DecodeOP_N((opcodetype)pch[0]);
+        int n = CScript::DecodeOP_N((opcodetype)pch[nEnd]);
+        if (i == nEnd && m <= n && nPushes == n)
+        {
+            solutionRet.type = TX_MULTISIG;
+            solutionRet.nRequired = m;
+            solutionRet.nKeys = n;
+            return true;
+        }
+        solutionRet.SetNull();
+    }
+    return false;
+}
+
+bool Solver(const CScript& scriptPubKey, CScriptSolution& solutionRet)
 {
+    solutionRet.SetNull();
+
     // Templates
-    static map<txnouttype, CScript> mTemplates;
+    static map<txnouttype, vector<CScriptOp> > mTemplates;
     if (mTemplates.empty())
     {
         // Standard tx, sender provides pubkey, receiver adds signature
-        mTemplates.insert(make_pair(TX_PUBKEY, CScript() << OP_PUBKEY << OP_CHECKSIG));
+        (CScript() << OP_PUBKEY << OP_CHECKSIG).Decode(mTemplates[TX_PUBKEY]);
 
         // Bitcoin address tx, sender provides hash of pubkey, receiver provides signature and pubkey
-        mTemplates.insert(make_pair(TX_PUBKEYHASH, CScript() << OP_DUP << OP_HASH160 << OP_PUBKEYHASH << OP_EQUALVERIFY << OP_CHECKSIG));
+        (CScript() << OP_DUP << OP_HASH160 << OP_PUBKEYHASH << OP_EQUALVERIFY << OP_CHECKSIG).Decode(mTemplates[TX_PUBKEYHASH]);
 
         // Sender provides N pubkeys, receivers provides M signatures
-        mTemplates.insert(make_pair(TX_MULTISIG, CScript() << OP_SMALLINTEGER << OP_PUBKEYS << OP_SMALLINTEGER << OP_CHECKMULTISIG));
+        (CScript() << OP_SMALLINTEGER << OP_PUBKEYS << OP_SMALLINTEGER << OP_CHECKMULTISIG).Decode(mTemplates[TX_MULTISIG]);
     }
 
     // Shortcut for pay-to-script-hash, which are more constrained than the other types:
     // it is always OP_HASH160 20 [20 byte hash] OP_EQUAL
     if (scriptPubKey.IsPayToScriptHash())
     {
-        typeRet = TX_SCRIPTHASH;
-        vector<unsigned char> hashBytes(scriptPubKey.begin()+2, scriptPubKey.begin()+22);
-        vSolutionsRet.push_back(hashBytes);
+        solutionRet.type = TX_SCRIPTHASH;
+        solutionRet.nRequired = solutionRet.nKeys = 1;
+        solutionRet.Add(&scriptPubKey[2], 20);
         return true;
     }
 
-    // Scan templates
+    if (MatchTemplateBytes(scriptPubKey, solutionRet))
+        return true;
+
+    // Scan templates.  Running off the end of the decoded instructions is
+    // where GetOp() would have failed; opInvalid stands in for what it
+    // returned then.
     const CScript& script1 = scriptPubKey;
-    BOOST_FOREACH(const PAIRTYPE(txnouttype, CScript)& tplate, mTemplates)
+    vector<CScriptOp>& vOps1 = GetScriptArena().vOps;
+    bool fComplete1 = script1.Decode(vOps1);
+    CScriptOp opInvalid;
+    opInvalid.opcode = OP_INVALIDOPCODE;
+    opInvalid.nDataOffset = 0;
+    opInvalid.nDataSize = 0;
+    BOOST_FOREACH(const PAIRTYPE(txnouttype, vector<CScriptOp>)& tplate, mTemplates)
     {
-        const CScript& script2 = tplate.second;
-        vSolutionsRet.clear();
-
-        opcodetype opcode1, opcode2;
-        vector<unsigned char> vch1, vch2;
+        const vector<CScriptOp>& vOps2 = tplate.second;
+        solutionRet.SetNull();
+        unsigned int nPushes = 0;
+        int nSmallIntegers = 0;
 
         // Compare
-        CScript::const_iterator pc1 = script1.begin();
-        CScript::const_iterator pc2 = script2.begin();
+        unsigned int i1 = 0;
+        unsigned int i2 = 0;
         loop
         {
-            if (pc1 == script1.end() && pc2 == script2.end())
+            if (i1 == vOps1.size() && fComplete1 && i2 == vOps2.size())
             {
                 // Found a match
-                typeRet = tplate.first;
-                if (typeRet == TX_MULTISIG)
+                solutionRet.type = tplate.first;
+                if (solutionRet.type == TX_MULTISIG)
                 {
                     // Additional checks for TX_MULTISIG:
-                    unsigned char m = vSolutionsRet.front()[0];
-                    unsigned char n = vSolutionsRet.back()[0];
-                    if (m < 1 || n < 1 || m > n || vSolutionsRet.size()-2 != n)
+                    int m = solutionRet.nRequired;
+                    int n = solutionRet.nKeys;
+                    if (m < 1 || n < 1 || m > n || nPushes != (unsigned int)n)
                         return false;
                 }
+                else
+                    solutionRet.nRequired = solutionRet.nKeys = 1;
                 return true;
             }
-            if (!script1.GetOp(pc1, opcode1, vch1))
+            if (i1 == vOps1.size())
                 break;
-            if (!script2.GetOp(pc2, opcode2, vch2))
+            if (i2 == vOps2.size())
                 break;
+            const CScriptOp* pop1 = &vOps1[i1++];
+            const CScriptOp* pop2 = &vOps2[i2++];
 
             // Template matching opcodes:
-            if (opcode2 == OP_PUBKEYS)
+            if (pop2->opcode == OP_PUBKEYS)
             {
-                while (vch1.size() >= 33 && vch1.size() <= 120)
+                while (pop1->nDataSize >= 33 && pop1->nDataSize <= 120)
                 {
-                    vSolutionsRet.push_back(vch1);
-                    if (!script1.GetOp(pc1, opcode1, vch1))
+                    solutionRet.Add(&script1[pop1->nDataOffset], pop1->nDataSize);
+                    nPushes++;
+                    if (i1 == vOps1.size())
+                    {
+                        pop1 = &opInvalid;
                         break;
+                    }
+                    pop1 = &vOps1[i1++];
                 }
-                if (!script2.GetOp(pc2, opcode2, vch2))
+                if (i2 == vOps2.size())
                     break;
+                pop2 = &vOps2[i2++];
                 // Normal situation is to fall through
                 // to other if/else statments
             }
 
-            if (opcode2 == OP_PUBKEY)
+            if (pop2->opcode == OP_PUBKEY)
             {
-                if (vch1.size() < 33 || vch1.size() > 120)
+                if (pop1->nDataSize < 33 || pop1->nDataSize > 120)
                     break;
-                vSolutionsRet.push_back(vch1);
+                solutionRet.Add(&script1[pop1->nDataOffset], pop1->nDataSize);
+                nPushes++;
             }
-            else if (opcode2 == OP_PUBKEYHASH)
+            else if (pop2->opcode == OP_PUBKEYHASH)
             {
-                if (vch1.size() != sizeof(uint160))
+                if (pop1->nDataSize != sizeof(uint160))
                     break;
-                vSolutionsRet.push_back(vch1);
+                solutionRet.Add(&script1[pop1->nDataOffset], pop1->nDataSize);
+                nPushes++;
             }
-            else if (opcode2 == OP_SMALLINTEGER)
-            {   // Single-byte small integer pushed onto vSolutions
-                if (opcode1 == OP_0 ||
-                    (opcode1 >= OP_1 && opcode1 <= OP_16))
+            else if (pop2->opcode == OP_SMALLINTEGER)
+            {   // Single-byte small integer: m, then n
+                if (pop1->opcode == OP_0 ||
+                    (pop1->opcode >= OP_1 && pop1->opcode <= OP_16))
                 {
-                    char n = (char)CScript::DecodeOP_N(opcode1);
-                    vSolutionsRet.push_back(valtype(1, n));
+                    int n = CScript::DecodeOP_N(pop1->opcode);
+                    if (nSmallIntegers++ == 0)
+                        solutionRet.nRequired = n;
+                    else
+                        solutionRet.nKeys = n;
                 }
                 else
                     break;
             }
-            else if (opcode1 != opcode2 || vch1 != vch2)
+            else if (pop1->opcode != pop2->opcode || pop1->nDataSize != 0)
             {
-                // Others must match exactly
+                // Others must match exactly (no template instruction pushes data)
                 break;
             }
         }
     }
 
-    vSolutionsRet.clear();
-    typeRet = TX_NONSTANDARD;
+    solutionRet.SetNull();
     return false;
 }
 
+bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, vector<vector<unsigned char> >& vSolutionsRet)
+{
+    CScriptSolution solution;
+    bool fSolved = Solver(scriptPubKey, solution);
+
+    // A multisig that fails its m and n checks still reports what was found
+    typeRet = solution.type;
+    vSolutionsRet.clear();
+    if (solution.type == TX_MULTISIG)
+        vSolutionsRet.push_back(valtype(1, solution.nRequired));
+    for (unsigned int i = 0; i < solution.nSolutions; i++)
+        vSolutionsRet.push_back(solution.Get(i));
+    if (solution.type == TX_MULTISIG)
+        vSolutionsRet.push_back(valtype(1, solution.nKeys));
+    return fSolved;
+}
+
 
 bool Sign1(const CBitcoinAddress& address, const CKeyStore& keystore, uint256 hash, int nHashType, CScript& scriptSigRet)
 {
@@ -1334,15 +1964,14 @@ int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned c
 
 bool IsStandard(const CScript& scriptPubKey)
 {
-    vector<valtype> vSolutions;
-    txnouttype whichType;
-    if (!Solver(scriptPubKey, whichType, vSolutions))
+    CScriptSolution solution;
+    if (!Solver(scriptPubKey, solution))
         return false;
 
-    if (whichType == TX_MULTISIG)
+    if (solution.type == TX_MULTISIG)
     {
-        unsigned char m = vSolutions.front()[0];
-        unsigned char n = vSolutions.back()[0];
+        int m = solution.nRequired;
+        int n = solution.nKeys;
         // Support up to x-of-3 multisig txns as standard
         if (n < 1 || n > 3)
             return false;
@@ -1350,17 +1979,17 @@ bool IsStandard(const CScript& scriptPubKey)
             return false;
     }
 
-    return whichType != TX_NONSTANDARD;
+    return solution.type != TX_NONSTANDARD;
 }
 
 
-int HaveKeys(const vector<valtype>& pubkeys, const CKeyStore& keystore)
+int HaveKeys(const CScriptSolution& solution, const CKeyStore& keystore)
 {
     int nResult = 0;
-    BOOST_FOREACH(const valtype& pubkey, pubkeys)
+    for (unsigned int i = 0; i < solution.nSolutions; i++)
     {
         CBitcoinAddress address;
-        address.SetPubKey(pubkey);
+        address.SetHash160(solution.GetHash160(i));
         if (keystore.HaveKey(address))
             ++nResult;
     }
@@ -1369,26 +1998,23 @@ int HaveKeys(const vector<valtype>& pubkeys, const CKeyStore& keystore)
 
 bool IsMine(const CKeyStore &keystore, const CScript& scriptPubKey)
 {
-    vector<valtype> vSolutions;
-    txnouttype whichType;
-    if (!Solver(scriptPubKey, whichType, vSolutions))
+    CScriptSolution solution;
+    if (!Solver(scriptPubKey, solution))
         return false;
 
     CBitcoinAddress address;
-    switch (whichType)
+    switch (solution.type)
     {
     case TX_NONSTANDARD:
         return false;
     case TX_PUBKEY:
-        address.SetPubKey(vSolutions[0]);
-        return keystore.HaveKey(address);
     case TX_PUBKEYHASH:
-        address.SetHash160(uint160(vSolutions[0]));
+        address.SetHash160(solution.GetHash160(0));
         return keystore.HaveKey(address);
     case TX_SCRIPTHASH:
     {
         CScript subscript;
-        if (!keystore.GetCScript(uint160(vSolutions[0]), subscript))
+        if (!keystore.GetCScript(solution.GetHash160(0), subscript))
             return false;
         return IsMine(keystore, subscript);
     }
@@ -1399,8 +2025,7 @@ bool IsMine(const CKeyStore &keystore, const CScript& scriptPubKey)
         // partially owned (somebody else has a key that can spend
         // them) enable spend-out-from-under-you attacks, especially
         // in shared-wallet situations.
-        vector<valtype> keys(vSolutions.begin()+1, vSolutions.begin()+vSolutions.size()-1);
-        return HaveKeys(keys, keystore) == keys.size();
+        return HaveKeys(solution, keystore) == solution.nSolutions;
     }
     }
     return false;
@@ -1408,24 +2033,18 @@ bool IsMine(const CKeyStore &keystore, const CScript& scriptPubKey)
 
 bool ExtractAddress(const CScript& scriptPubKey, CBitcoinAddress& addressRet)
 {
-    vector<valtype> vSolutions;
-    txnouttype whichType;
-    if (!Solver(scriptPubKey, whichType, vSolutions))
+    CScriptSolution solution;
+    if (!Solver(scriptPubKey, solution))
         return false;
 
-    if (whichType == TX_PUBKEY)
-    {
-        addressRet.SetPubKey(vSolutions[0]);
-        return true;
-    }
-    else if (whichType == TX_PUBKEYHASH)
+    if (solution.type == TX_PUBKEY || solution.type == TX_PUBKEYHASH)
     {
-        addressRet.SetHash160(uint160(vSolutions[0]));
+        addressRet.SetHash160(solution.GetHash160(0));
         return true;
     }
-    else if (whichType == TX_SCRIPTHASH)
+    else if (solution.type == TX_SCRIPTHASH)
     {
-        addressRet.SetScriptHash160(uint160(vSolutions[0]));
+        addressRet.SetScriptHash160(solution.GetHash160(0));
         return true;
     }
     // Multisig txns have more than one address...
@@ -1435,47 +2054,40 @@ bool ExtractAddress(const CScript& scriptPubKey, CBitcoinAddress& addressRet)
 bool ExtractAddresses(const CScript& scriptPubKey, txnouttype& typeRet, vector<CBitcoinAddress>& addressRet, int& nRequiredRet)
 {
     addressRet.clear();
-    typeRet = TX_NONSTANDARD;
-    vector<valtype> vSolutions;
-    if (!Solver(scriptPubKey, typeRet, vSolutions))
+    CScriptSolution solution;
+    bool fSolved = Solver(scriptPubKey, solution);
+    typeRet = solution.type;
+    if (!fSolved)
         return false;
 
-    if (typeRet == TX_MULTISIG)
+    nRequiredRet = solution.nRequired;
+    for (unsigned int i = 0; i < solution.nSolutions; i++)
     {
-        nRequiredRet = vSolutions.front()[0];
-        int n = vSolutions.back()[0];
-        for (int i = 1; i < vSolutions.size()-1; i++)
-        {
-            CBitcoinAddress address;
-            address.SetPubKey(vSolutions[i]);
-            addressRet.push_back(address);
-        }
-    }
-    else
-    {
-        nRequiredRet = 1;
         CBitcoinAddress address;
-        if (typeRet == TX_PUBKEYHASH)
-            address.SetHash160(uint160(vSolutions.front()));
-        else if (typeRet == TX_SCRIPTHASH)
-            address.SetScriptHash160(uint160(vSolutions.front()));
-        else if (typeRet == TX_PUBKEY)
-            address.SetPubKey(vSolutions.front());
+        if (typeRet == TX_SCRIPTHASH)
+            address.SetScriptHash160(solution.GetHash160(i));
+        else
+            address.SetHash160(solution.GetHash160(i));
         addressRet.push_back(address);
     }
 
     return true;
 }
 
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  bool fValidatePayToScriptHash, int nHashType)
+static bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, CSignatureHasher& hasher, unsigned int nIn,
+                         bool fValidatePayToScriptHash, int nHashType, CSignatureBatch* pbatch=NULL)
 {
-    vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, nHashType))
+    CScriptStackLease stackLease, stackCopyLease;
+    CScriptStack& stack = *stackLease;
+    CScriptStack& stackCopy = *stackCopyLease;
+    if (!EvalScript(stack, scriptSig, hasher, nIn, nHashType))
         return false;
     if (fValidatePayToScriptHash)
         stackCopy = stack;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, nHashType))
+    // Nothing is put off for pay-to-script-hash inputs, where the
+    // scriptPubKey's result isn't the last word
+    bool fP2SH = fValidatePayToScriptHash && scriptPubKey.IsPayToScriptHash();
+    if (!EvalScript(stack, scriptPubKey, hasher, nIn, nHashType, fP2SH ? NULL : pbatch))
         return false;
     if (stack.empty())
         return false;
@@ -1484,16 +2096,17 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         return false;
 
     // Additional validation for spend-to-script-hash transactions:
-    if (fValidatePayToScriptHash && scriptPubKey.IsPayToScriptHash())
+    if (fP2SH)
     {
         if (!scriptSig.IsPushOnly()) // scriptSig must be literals-only
             return false;            // or validation fails
 
-        const valtype& pubKeySerialized = stackCopy.back();
-        CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
+        const CScriptValue& pubKeySerialized = stackCopy.back();
+        CScript& pubKey2 = GetScriptArena().scriptRedeem;
+        pubKey2.assign(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, hasher, nIn, nHashType))
             return false;
         if (stackCopy.empty())
             return false;
@@ -1503,9 +2116,23 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
     return true;
 }
 
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                  bool fValidatePayToScriptHash, int nHashType)
+{
+    CSignatureHasher hasher(txTo);
+    return VerifyScript(scriptSig, scriptPubKey, hasher, nIn, fValidatePayToScriptHash, nHashType);
+}
+
 
 bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType)
 {
+    CSignatureHasher hasher(txTo);
+    return SignSignature(keystore, txFrom, txTo, hasher, nIn, nHashType);
+}
+
+bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, CSignatureHasher& hasher, unsigned int nIn, int nHashType)
+{
+    assert(&hasher.txTo == &txTo);
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
     assert(txin.prevout.n < txFrom.vout.size());
@@ -1513,7 +2140,7 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
 
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
-    uint256 hash = SignatureHash(txout.scriptPubKey, txTo, nIn, nHashType);
+    uint256 hash = hasher.SignatureHash(txout.scriptPubKey, nIn, nHashType);
 
     txnouttype whichType;
     if (!Solver(keystore, txout.scriptPubKey, hash, nHashType, txin.scriptSig, whichType))
@@ -1527,7 +2154,7 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
         CScript subscript = txin.scriptSig;
 
         // Recompute txn hash using subscript in place of scriptPubKey:
-        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType);
+        uint256 hash2 = hasher.SignatureHash(subscript, nIn, nHashType);
         txnouttype subType;
         if (!Solver(keystore, subscript, hash2, nHashType, txin.scriptSig, subType))
             return false;
@@ -1537,7 +2164,7 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
     }
 
     // Test solution
-    if (!VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, true, 0))
+    if (!VerifyScript(txin.scriptSig, txout.scriptPubKey, hasher, nIn, true, 0))
         return false;
 
     return true;
@@ -1546,6 +2173,14 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
 
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType)
 {
+    CSignatureHasher hasher(txTo);
+    return VerifySignature(txFrom, hasher, nIn, fValidatePayToScriptHash, nHashType);
+}
+
+bool VerifySignature(const CTransaction& txFrom, CSignatureHasher& hasher, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType,
+                     CSignatureBatch* pbatch)
+{
+    const CTransaction& txTo = hasher.txTo;
     assert(nIn < txTo.vin.size());
     const CTxIn& txin = txTo.vin[nIn];
     if (txin.prevout.n >= txFrom.vout.size())
@@ -1555,22 +2190,85 @@ bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsig
     if (txin.prevout.hash != txFrom.GetHash())
         return false;
 
-    if (!VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, fValidatePayToScriptHash, nHashType))
+    if (!VerifyScript(txin.scriptSig, txout.scriptPubKey, hasher, nIn, fValidatePayToScriptHash, nHashType, pbatch))
         return false;
 
     return true;
 }
 
+bool CScript::Decode(vector<CScriptOp>& vOpsRet) const
+{
+    vOpsRet.clear();
+    const unsigned char* pch = empty() ? NULL : &(*this)[0];
+    unsigned int nScriptSize = size();
+    unsigned int i = 0;
+    while (i < nScriptSize)
+    {
+        CScriptOp op;
+        unsigned int opcode = pch[i++];
+        op.opcode = (opcodetype)opcode;
+        op.nDataSize = 0;
+
+        // Immediate operand, read the same way GetOp2 reads it
+        if (opcode <= OP_PUSHDATA4)
+        {
+            unsigned int nSize = 0;
+            if (opcode < OP_PUSHDATA1)
+            {
+                nSize = opcode;
+            }
+            else if (opcode == OP_PUSHDATA1)
+            {
+                if (nScriptSize - i < 1)
+                    return false;
+                nSize = pch[i++];
+            }
+            else if (opcode == OP_PUSHDATA2)
+            {
+                if (nScriptSize - i < 2)
+                    return false;
+                memcpy(&nSize, &pch[i], 2);
+                i += 2;
+            }
+            else if (opcode == OP_PUSHDATA4)
+            {
+                if (nScriptSize - i < 4)
+                    return false;
+                memcpy(&nSize, &pch[i], 4);
+                i += 4;
+            }
+            if (nScriptSize - i < nSize)
+                return false;
+            op.nDataSize = nSize;
+        }
+
+        op.nDataOffset = i;
+        i += op.nDataSize;
+        vOpsRet.push_back(op);
+    }
+    return true;
+}
+
+bool CScript::IsPushOnly() const
+{
+    vector<CScriptOp>& vOps = GetScriptArena().vOps;
+    if (!Decode(vOps))
+        return false;
+    BOOST_FOREACH(const CScriptOp& op, vOps)
+        if (op.opcode > OP_16)
+            return false;
+    return true;
+}
+
 int CScript::GetSigOpCount(bool fAccurate) const
 {
     int n = 0;
-    const_iterator pc = begin();
+    vector<CScriptOp>& vOps = GetScriptArena().vOps;
+    Decode(vOps); // counting stops where decoding does
     opcodetype lastOpcode = OP_INVALIDOPCODE;
-    while (pc < end())
+    BOOST_FOREACH(const CScriptOp& op, vOps)
     {
-        opcodetype opcode;
-        if (!GetOp(pc, opcode))
-            break;
+        opcodetype opcode = op.opcode;
         if (opcode == OP_CHECKSIG || opcode == OP_CHECKSIGVERIFY)
             n++;
         else if (opcode == OP_CHECKMULTISIG || opcode == OP_CHECKMULTISIGVERIFY)
@@ -1593,19 +2291,17 @@ int CScript::GetSigOpCount(const CScript& scriptSig) const
     // This is a pay-to-script-hash scriptPubKey;
     // get the last item that the scriptSig
     // pushes onto the stack:
-    const_iterator pc = scriptSig.begin();
-    vector<unsigned char> data;
-    while (pc < scriptSig.end())
-    {
-        opcodetype opcode;
-        if (!scriptSig.GetOp(pc, opcode, data))
+    vector<CScriptOp>& vOps = GetScriptArena().vOps;
+    if (!scriptSig.Decode(vOps))
+        return 0;
+    BOOST_FOREACH(const CScriptOp& op, vOps)
+        if (op.opcode > OP_16)
             return 0;
-        if (opcode > OP_16)
-            return 0;
-    }
 
     /// ... and return it's opcount:
-    CScript subscript(data.begin(), data.end());
+    CScript subscript;
+    if (!vOps.empty())
+        subscript.assign(scriptSig.begin() + vOps.back().nDataOffset, scriptSig.begin() + vOps.back().End());
     return subscript.GetSigOpCount(true);
 }
 
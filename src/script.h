@@ -7,6 +7,9 @@
 
 #include "base58.h"
 
+#include <list>
+#include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -187,10 +190,116 @@ const char* GetOpName(opcodetype opcode);
 
 
 
+class scriptnum_error : public std::runtime_error
+{
+public:
+    explicit scriptnum_error(const std::string& str) : std::runtime_error(str) {}
+};
+
+/** Number the script interpreter does arithmetic on.
+ *
+ * Numbers on the stack are little-endian with the sign in the top bit of the
+ * last byte, and at most nMaxNumSize bytes long when used as an operand.
+ * Results are always pushed in the shortest encoding, which can be one byte
+ * longer than an operand (0x7fffffff + 1 is five bytes), so they may not be
+ * usable as operands again.  This matches what CBigNum did bit for bit, but
+ * an int64 holds every value that can come up without touching the heap.
+ */
+class CScriptNum
+{
+public:
+    static const unsigned int nMaxNumSize = 4;
+    static const unsigned int nMaxEncodedSize = 9;
+
+    explicit CScriptNum(int64 n) : nValue(n) { }
+
+    CScriptNum(const unsigned char* pbegin, const unsigned char* pend)
+    {
+        if (pend - pbegin > nMaxNumSize)
+            throw scriptnum_error("CScriptNum::CScriptNum() : overflow");
+        nValue = Decode(pbegin, pend - pbegin);
+    }
+
+    explicit CScriptNum(const std::vector<unsigned char>& vch)
+    {
+        if (vch.size() > nMaxNumSize)
+            throw scriptnum_error("CScriptNum::CScriptNum() : overflow");
+        nValue = vch.empty() ? 0 : Decode(&vch[0], vch.size());
+    }
+
+    int getint() const
+    {
+        if (nValue > std::numeric_limits<int>::max())
+            return std::numeric_limits<int>::max();
+        if (nValue < std::numeric_limits<int>::min())
+            return std::numeric_limits<int>::min();
+        return (int)nValue;
+    }
+
+    int64 getint64() const { return nValue; }
+
+    // Writes the shortest encoding to pch, which must have room for
+    // nMaxEncodedSize bytes, and returns its length
+    unsigned int Encode(unsigned char* pch) const
+    {
+        unsigned int nSize = 0;
+        bool fNegative = (nValue < 0);
+        uint64 nAbs = fNegative ? -(uint64)nValue : (uint64)nValue;
+        while (nAbs)
+        {
+            pch[nSize++] = nAbs & 0xff;
+            nAbs >>= 8;
+        }
+        // An extra byte is needed if the top bit is taken
+        if (nSize > 0 && (pch[nSize-1] & 0x80))
+            pch[nSize++] = fNegative ? 0x80 : 0;
+        else if (fNegative)
+            pch[nSize-1] |= 0x80;
+        return nSize;
+    }
+
+    std::vector<unsigned char> getvch() const
+    {
+        unsigned char pch[nMaxEncodedSize];
+        return std::vector<unsigned char>(pch, pch + Encode(pch));
+    }
+
+    CScriptNum& operator+=(const CScriptNum& b) { nValue += b.nValue; return *this; }
+    CScriptNum& operator-=(const CScriptNum& b) { nValue -= b.nValue; return *this; }
+
+    friend CScriptNum operator+(const CScriptNum& a, const CScriptNum& b) { return CScriptNum(a.nValue + b.nValue); }
+    friend CScriptNum operator-(const CScriptNum& a, const CScriptNum& b) { return CScriptNum(a.nValue - b.nValue); }
+    friend CScriptNum operator-(const CScriptNum& a)                      { return CScriptNum(-a.nValue); }
+    friend bool operator==(const CScriptNum& a, const CScriptNum& b)      { return a.nValue == b.nValue; }
+    friend bool operator!=(const CScriptNum& a, const CScriptNum& b)      { return a.nValue != b.nValue; }
+    friend bool operator<(const CScriptNum& a, const CScriptNum& b)       { return a.nValue < b.nValue; }
+    friend bool operator>(const CScriptNum& a, const CScriptNum& b)       { return a.nValue > b.nValue; }
+    friend bool operator<=(const CScriptNum& a, const CScriptNum& b)      { return a.nValue <= b.nValue; }
+    friend bool operator>=(const CScriptNum& a, const CScriptNum& b)      { return a.nValue >= b.nValue; }
+
+private:
+    static int64 Decode(const unsigned char* pch, unsigned int nSize)
+    {
+        if (nSize == 0)
+            return 0;
+        int64 n = 0;
+        for (unsigned int i = 0; i < nSize; i++)
+            n |= (int64)pch[i] << (8 * i);
+        // Negative zero decodes to zero
+        if (pch[nSize-1] & 0x80)
+            return -(n & ~((int64)0x80 << (8 * (nSize - 1))));
+        return n;
+    }
+
+    int64 nValue;
+};
+
+
+
 inline std::string ValueString(const std::vector<unsigned char>& vch)
 {
     if (vch.size() <= 4)
-        return strprintf("%d", CBigNum(vch).getint());
+        return strprintf("%d", CScriptNum(vch).getint());
     else
         return HexStr(vch);
 }
@@ -214,6 +323,18 @@ inline std::string StackString(const std::vector<std::vector<unsigned char> >& v
 
 
 
+/** One instruction of a decoded script.  Pushed data isn't copied; it is
+ * given by its position in the script. */
+struct CScriptOp
+{
+    opcodetype opcode;
+    unsigned int nDataOffset; // just past the opcode and any length bytes
+    unsigned int nDataSize;   // zero for anything but a push
+
+    // Position of the next instruction
+    unsigned int End() const { return nDataOffset + nDataSize; }
+};
+
 /** Serialized script, used inside transaction inputs and outputs */
 class CScript : public std::vector<unsigned char>
 {
@@ -458,20 +579,34 @@ public:
 
     int FindAndDelete(const CScript& b)
     {
-        int nFound = 0;
         if (b.empty())
+            return 0;
+        return FindAndDelete(&b[0], b.size());
+    }
+    int FindAndDelete(const unsigned char* pb, unsigned int nSize)
+    {
+        int nFound = 0;
+        if (nSize == 0)
             return nFound;
+        // One pass, compacting in place: matches are only looked for at
+        // instruction boundaries, and whatever is kept is copied down to pcOut
         iterator pc = begin();
+        iterator pcOut = begin();
         opcodetype opcode;
         do
         {
-            while (end() - pc >= b.size() && memcmp(&pc[0], &b[0], b.size()) == 0)
+            while (end() - pc >= nSize && memcmp(&pc[0], pb, nSize) == 0)
             {
-                erase(pc, pc + b.size());
+                pc += nSize;
                 ++nFound;
             }
+            iterator pcOp = pc;
+            if (!GetOp(pc, opcode))
+                pc = end();
+            pcOut = std::copy(pcOp, pc, pcOut);
         }
-        while (GetOp(pc, opcode));
+        while (pc < end());
+        erase(pcOut, end());
         return nFound;
     }
     int Find(opcodetype op) const
@@ -484,6 +619,11 @@ public:
         return nFound;
     }
 
+    // Decodes the whole script in one pass, replacing the contents of
+    // vOpsRet.  Returns false if the script ends part way through an
+    // instruction; the instructions before it are still decoded.
+    bool Decode(std::vector<CScriptOp>& vOpsRet) const;
+
     // Pre-version-0.6, Bitcoin always counted CHECKMULTISIGs
     // as 20 sigops. With pay-to-script-hash, that changed:
     // CHECKMULTISIGs serialized in scriptSigs are
@@ -498,19 +638,7 @@ public:
     bool IsPayToScriptHash() const;
 
     // Called by CTransaction::IsStandard
-    bool IsPushOnly() const
-    {
-        const_iterator pc = begin();
-        while (pc < end())
-        {
-            opcodetype opcode;
-            if (!GetOp(pc, opcode))
-                return false;
-            if (opcode > OP_16)
-                return false;
-        }
-        return true;
-    }
+    bool IsPushOnly() const;
 
 
     void SetBitcoinAddress(const CBitcoinAddress& address);
@@ -560,7 +688,189 @@ public:
 
 
 
+// Signatures checked so far, for benchmarking
+extern uint64 nSigChecks;
+
+// Computes the signature hash for any input of one transaction without
+// copying it.  The transaction is serialized once with every scriptSig
+// blanked, and for SIGHASH_ALL the SHA-256 state after each input is kept, so
+// hashing input i resumes there instead of starting over.  Only the scriptSigs
+// may change while a hasher is in use; they aren't part of what is signed.
+class CSignatureHasher
+{
+public:
+    const CTransaction& txTo;
+
+    explicit CSignatureHasher(const CTransaction& txToIn) : txTo(txToIn), fInit(false) { }
+
+    uint256 SignatureHash(const CScript& scriptCode, unsigned int nIn, int nHashType);
+
+private:
+    bool fInit;
+    std::vector<unsigned char> vchPrefix;   // nVersion and the number of inputs
+    std::vector<unsigned char> vchInputs;   // every input with an empty scriptSig
+    std::vector<unsigned char> vchOutputs;  // the outputs with their count, then nLockTime
+    std::vector<unsigned int> vOutputPos;   // where each output starts in vchOutputs
+    std::vector<SHA256_CTX> vMidstate;      // after vchPrefix and the first i inputs
+
+    void Init();
+};
+
+// Signature checks put off so a whole block's worth can be verified
+// together.  Only a check whose failure fails its script anyway is put off:
+// an OP_CHECKSIG or OP_CHECKSIGVERIFY that is the last op of the
+// scriptPubKey, which the script goes on as if it passed.  Any other check,
+// a signature that isn't strict DER or a public key secp256k1.cpp can't
+// parse is done where it runs.
+class CSignatureBatch
+{
+public:
+    CSignatureBatch() : nIn(0) { }
+
+    // The input whose scripts are about to run, charged with what they add
+    void SetInput(const uint256& hashTxIn, unsigned int nInIn)
+    {
+        hashTx = hashTxIn;
+        nIn = nInIn;
+    }
+
+    void Add(const uint256& hash, const unsigned char* pchSig, unsigned int nSigSize, const CSecp256k1PubKey& pubkey);
+    unsigned int size() const { return vEntries.size(); }
+
+    // True if every signature is good.  Otherwise the batch is checked one
+    // signature at a time to find the input of the first bad one.
+    bool Verify(uint256& hashTxRet, unsigned int& nInRet) const;
+
+private:
+    uint256 hashTx;
+    unsigned int nIn;
+    std::vector<CSecp256k1BatchEntry> vEntries;
+    std::vector<std::pair<uint256, unsigned int> > vInputs;  // the input each entry came from
+};
+
+// Public keys as CheckSig parsed them, by their serialized bytes, keeping
+// the most recently used.  Keys that are paid to over and over are
+// decompressed and checked to be on the curve once, not at every signature.
+class CPubKeyCache
+{
+public:
+    explicit CPubKeyCache(unsigned int nMaxSizeIn) : nMaxSize(nMaxSizeIn) { }
+
+    // False if secp256k1.cpp can't parse the key; those aren't cached
+    bool Get(const unsigned char* pch, unsigned int nSize, CSecp256k1PubKey& pubkeyRet);
+    unsigned int size();
+    void clear();
+
+private:
+    struct CKeyBytes
+    {
+        unsigned int nSize;
+        unsigned char pch[65];
+
+        bool operator<(const CKeyBytes& b) const
+        {
+            if (nSize != b.nSize)
+                return nSize < b.nSize;
+            return memcmp(pch, b.pch, nSize) < 0;
+        }
+    };
+    typedef std::list<std::pair<CKeyBytes, CSecp256k1PubKey> > list_type;
+
+    CCriticalSection cs;
+    unsigned int nMaxSize;
+    list_type listEntries;  // most recently used first
+    std::map<CKeyBytes, list_type::iterator> mapEntries;
+};
+
+extern CPubKeyCache pubkeycache;
+
+// Inputs whose scripts have already run and passed, so ConnectInputs can
+// skip them when a block brings in transactions the memory pool checked.
+// An input is known by a hash of a random salt, its txid, its index and
+// fStrictPayToScriptHash; the txid covers the scriptSig and, through the
+// prevout, the scriptPubKey it is checked against.  When full, a random
+// entry makes room, and the salt keeps anyone from choosing which.
+class CScriptCheckCache
+{
+public:
+    explicit CScriptCheckCache(unsigned int nMaxSizeIn);
+
+    bool Contains(const uint256& hashTx, unsigned int nIn, bool fStrictPayToScriptHash);
+    void Insert(const uint256& hashTx, unsigned int nIn, bool fStrictPayToScriptHash);
+    void Erase(const uint256& hashTx, unsigned int nIn, bool fStrictPayToScriptHash);
+    unsigned int size();
+    void clear();
+
+private:
+    uint256 GetKey(const uint256& hashTx, unsigned int nIn, bool fStrictPayToScriptHash) const;
+
+    CCriticalSection cs;
+    unsigned int nMaxSize;
+    unsigned char pchSalt[32];
+    std::set<uint256> setValid;
+};
+
+extern CScriptCheckCache scriptcheckcache;
+
 bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType);
+/** What Solver() finds in a standard scriptPubKey: the pubkey or hash, or for
+ * TX_MULTISIG m, the pubkeys and n.  The pubkeys and hashes aren't copied
+ * out; they point into the script, which has to outlive the solution. */
+class CScriptSolution
+{
+public:
+    enum { MAX_PUBKEYS = 16 };
+
+    txnouttype type;
+    int nRequired;
+    int nKeys;
+    unsigned int nSolutions;
+    const unsigned char* pchSolution[MAX_PUBKEYS];
+    unsigned int nSolutionSize[MAX_PUBKEYS];
+
+    CScriptSolution()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        type = TX_NONSTANDARD;
+        nRequired = 0;
+        nKeys = 0;
+        nSolutions = 0;
+    }
+
+    void Add(const unsigned char* pch, unsigned int nSize)
+    {
+        // More pubkeys than any multisig can use only ever fail to match
+        if (nSolutions < MAX_PUBKEYS)
+        {
+            pchSolution[nSolutions] = pch;
+            nSolutionSize[nSolutions] = nSize;
+            nSolutions++;
+        }
+    }
+
+    std::vector<unsigned char> Get(unsigned int i) const
+    {
+        return std::vector<unsigned char>(pchSolution[i], pchSolution[i] + nSolutionSize[i]);
+    }
+
+    // The hash for TX_PUBKEYHASH and TX_SCRIPTHASH, otherwise the pubkey's hash
+    uint160 GetHash160(unsigned int i) const
+    {
+        if (type == TX_PUBKEYHASH || type == TX_SCRIPTHASH)
+        {
+            uint160 hash;
+            memcpy(&hash, pchSolution[i], sizeof(hash));
+            return hash;
+        }
+        return Hash160(pchSolution[i], pchSolution[i] + nSolutionSize[i]);
+    }
+};
+
+bool Solver(const CScript& scriptPubKey, CScriptSolution& solutionRet);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey);
@@ -568,6 +878,9 @@ bool IsMine(const CKeyStore& keystore, const CScript& scriptPubKey);
 bool ExtractAddress(const CScript& scriptPubKey, CBitcoinAddress& addressRet);
 bool ExtractAddresses(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CBitcoinAddress>& addressRet, int& nRequiredRet);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
+bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, CSignatureHasher& hasher, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType);
+bool VerifySignature(const CTransaction& txFrom, CSignatureHasher& hasher, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType,
+                     CSignatureBatch* pbatch=NULL);
 
 #endif
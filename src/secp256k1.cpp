@@ -0,0 +1,1097 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "secp256k1.h"
+
+
+//
+// Multi-precision helpers
+//
+
+#if defined(__SIZEOF_INT128__)
+typedef unsigned __int128 uint128;
+
+// Returns the low word of a * b + c + nCarry, leaving the high word in nCarry
+static inline uint64 MulAdd(uint64 a, uint64 b, uint64 c, uint64& nCarry)
+{
+    uint128 t = (uint128)a * b + c + nCarry;
+    nCarry = (uint64)(t >> 64);
+    return (uint64)t;
+}
+#else
+// Returns the low word of a * b + c + nCarry, leaving the high word in nCarry
+static inline uint64 MulAdd(uint64 a, uint64 b, uint64 c, uint64& nCarry)
+{
+    uint64 al = a & 0xffffffffULL, ah = a >> 32;
+    uint64 bl = b & 0xffffffffULL, bh = b >> 32;
+    uint64 ll = al * bl, lh = al * bh, hl = ah * bl, hh = ah * bh;
+    uint64 mid = (ll >> 32) + (lh & 0xffffffffULL) + (hl & 0xffffffffULL);
+    uint64 lo = (ll & 0xffffffffULL) | (mid << 32);
+    uint64 hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+    lo += c;
+    hi += (lo < c);
+    lo += nCarry;
+    hi += (lo < nCarry);
+    nCarry = hi;
+    return lo;
+}
+#endif
+
+// r[0..na+nb) = a[0..na) * b[0..nb), with the sizes fixed so the loops unroll
+template<int na, int nb>
+static inline void MulLimbs(uint64* r, const uint64* a, const uint64* b)
+{
+    uint64 nCarry = 0;
+    for (int j = 0; j < nb; j++)
+        r[j] = MulAdd(a[0], b[j], 0, nCarry);
+    r[nb] = nCarry;
+    for (int i = 1; i < na; i++)
+    {
+        nCarry = 0;
+        for (int j = 0; j < nb; j++)
+            r[i + j] = MulAdd(a[i], b[j], r[i + j], nCarry);
+        r[i + nb] = nCarry;
+    }
+}
+
+static void SetB32(uint64* r, const unsigned char* pch)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        r[i] = 0;
+        for (int j = 0; j < 8; j++)
+            r[i] |= (uint64)pch[31 - 8*i - j] << (8*j);
+    }
+}
+
+// a < b, for four limb numbers
+static bool LessThan(const uint64* a, const uint64* b)
+{
+    for (int i = 3; i >= 0; i--)
+        if (a[i] != b[i])
+            return a[i] < b[i];
+    return false;
+}
+
+
+// r = a + b, returning the carry out
+static inline uint64 AddLimbs(uint64* r, const uint64* a, const uint64* b)
+{
+    uint64 k = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        uint64 s = a[i] + k;
+        k = (s < k);
+        r[i] = s + b[i];
+        k += (r[i] < s);
+    }
+    return k;
+}
+
+// r = a - b, returning the borrow out
+static inline uint64 SubLimbs(uint64* r, const uint64* a, const uint64* b)
+{
+    uint64 k = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        uint64 d = a[i] - b[i];
+        uint64 k2 = (a[i] < b[i]) | (d < k);
+        r[i] = d - k;
+        k = k2;
+    }
+    return k;
+}
+
+// a = (a + nTop * 2^256) / 2
+static inline void HalveLimbs(uint64* a, uint64 nTop)
+{
+    for (int i = 0; i < 3; i++)
+        a[i] = (a[i] >> 1) | (a[i + 1] << 63);
+    a[3] = (a[3] >> 1) | (nTop << 63);
+}
+
+
+//
+// The field: integers mod p = 2^256 - 2^32 - 977, as four 64-bit limbs that
+// are always fully reduced
+//
+
+// 2^256 - p
+static const uint64 FIELD_C = 0x1000003d1ULL;
+
+static const unsigned char P_MINUS_2[32] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xfe, 0xff, 0xff, 0xfc, 0x2d,
+};
+
+static const unsigned char P_PLUS_1_DIV_4[32] = {
+    0x3f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xbf, 0xff, 0xff, 0x0c,
+};
+
+// Cube root of unity mod p: (x, y) -> (beta*x, y) multiplies a point by lambda
+static const uint64 BETA[4] = { 0xc1396c28719501eeULL, 0x9cf0497512f58995ULL, 0x6e64479eac3434e9ULL, 0x7ae96a2b657c0710ULL };
+
+// Reduces r + nCarry * 2^256 to below p, where r < 2^256 and nCarry < 2^64
+static inline void FieldReduce(uint64* r, uint64 nCarry)
+{
+    // 2^256 = FIELD_C (mod p)
+    uint64 k = nCarry;
+    nCarry = 0;
+    r[0] = MulAdd(k, FIELD_C, r[0], nCarry);
+    for (int i = 1; i < 4; i++)
+    {
+        r[i] += nCarry;
+        nCarry = (r[i] < nCarry);
+    }
+
+    // If that carried again r is now tiny, so folding once more can't
+    k = nCarry * FIELD_C;
+    for (int i = 0; i < 4; i++)
+    {
+        r[i] += k;
+        k = (r[i] < k);
+    }
+
+    // Subtract p when r >= p, which is exactly when r + FIELD_C overflows
+    uint64 t[4];
+    k = FIELD_C;
+    for (int i = 0; i < 4; i++)
+    {
+        t[i] = r[i] + k;
+        k = (t[i] < k);
+    }
+    uint64 mask = 0 - k;
+    for (int i = 0; i < 4; i++)
+        r[i] = (r[i] & ~mask) | (t[i] & mask);
+}
+
+static inline void FieldMul(uint64* r, const uint64* a, const uint64* b)
+{
+    uint64 t[8];
+    MulLimbs<4, 4>(t, a, b);
+
+    // r = low half + high half * FIELD_C
+    uint64 nCarry = 0;
+    for (int i = 0; i < 4; i++)
+        r[i] = MulAdd(t[4 + i], FIELD_C, t[i], nCarry);
+    FieldReduce(r, nCarry);
+}
+
+static inline void FieldSqr(uint64* r, const uint64* a)
+{
+    FieldMul(r, a, a);
+}
+
+static inline void FieldAdd(uint64* r, const uint64* a, const uint64* b)
+{
+    FieldReduce(r, AddLimbs(r, a, b));
+}
+
+static inline void FieldSub(uint64* r, const uint64* a, const uint64* b)
+{
+    // On a borrow add p back, which is subtracting FIELD_C mod 2^256
+    uint64 k = FIELD_C & (0 - SubLimbs(r, a, b));
+    for (int i = 0; i < 4; i++)
+    {
+        uint64 d = r[i] - k;
+        k = (r[i] < k);
+        r[i] = d;
+    }
+}
+
+static inline void FieldNeg(uint64* r, const uint64* a)
+{
+    static const uint64 ZERO[4] = { 0, 0, 0, 0 };
+    FieldSub(r, ZERO, a);
+}
+
+static inline void FieldMulInt(uint64* r, const uint64* a, uint64 n)
+{
+    uint64 nCarry = 0;
+    for (int i = 0; i < 4; i++)
+        r[i] = MulAdd(a[i], n, 0, nCarry);
+    FieldReduce(r, nCarry);
+}
+
+static inline bool FieldIsZero(const uint64* a)
+{
+    return (a[0] | a[1] | a[2] | a[3]) == 0;
+}
+
+static inline bool FieldEqual(const uint64* a, const uint64* b)
+{
+    return ((a[0] ^ b[0]) | (a[1] ^ b[1]) | (a[2] ^ b[2]) | (a[3] ^ b[3])) == 0;
+}
+
+static inline void FieldSetInt(uint64* r, uint64 n)
+{
+    r[0] = n;
+    r[1] = r[2] = r[3] = 0;
+}
+
+// Reads 32 big endian bytes, failing if they aren't below p
+static bool FieldSetB32(uint64* r, const unsigned char* pch)
+{
+    SetB32(r, pch);
+    uint64 t[4];
+    memcpy(t, r, sizeof(t));
+    FieldReduce(t, 0);
+    return FieldEqual(t, r);
+}
+
+// r = a^e, with e 32 big endian bytes, four bits at a time
+static void FieldPow(uint64* r, const uint64* a, const unsigned char* pchExp)
+{
+    uint64 table[16][4];
+    FieldSetInt(table[0], 1);
+    for (int i = 1; i < 16; i++)
+        FieldMul(table[i], table[i - 1], a);
+
+    uint64 t[4];
+    FieldSetInt(t, 1);
+    for (int i = 0; i < 64; i++)
+    {
+        for (int j = 0; j < 4; j++)
+            FieldSqr(t, t);
+        int nNibble = (i % 2 == 0) ? (pchExp[i/2] >> 4) : (pchExp[i/2] & 0x0f);
+        FieldMul(t, t, table[nNibble]);
+    }
+    memcpy(r, t, sizeof(t));
+}
+
+static void FieldInv(uint64* r, const uint64* a)
+{
+    FieldPow(r, a, P_MINUS_2);
+}
+
+// Fails if a has no square root
+static bool FieldSqrt(uint64* r, const uint64* a)
+{
+    uint64 t[4], t2[4];
+    FieldPow(t, a, P_PLUS_1_DIV_4);
+    FieldSqr(t2, t);
+    if (!FieldEqual(t2, a))
+        return false;
+    memcpy(r, t, sizeof(t));
+    return true;
+}
+
+
+//
+// Scalars: integers mod the group order n
+//
+
+static const uint64 ORDER[4] = { 0xbfd25e8cd0364141ULL, 0xbaaedce6af48a03bULL, 0xfffffffffffffffeULL, 0xffffffffffffffffULL };
+
+// 2^256 - n
+static const uint64 ORDER_C[3] = { 0x402da1732fc9bebfULL, 0x4551231950b75fc4ULL, 0x0000000000000001ULL };
+
+static const uint64 ORDER_HALF[4] = { 0xdfe92f46681b20a0ULL, 0x5d576e7357a4501dULL, 0xffffffffffffffffULL, 0x7fffffffffffffffULL };
+
+// Splitting k into k1 + k2*lambda with k1 and k2 around 128 bits, following
+// section 3.5 of "Guide to Elliptic Curve Cryptography" by Hankerson, Menezes
+// and Vanstone, with the rounded divisions done as multiplications by g1 and
+// g2 and a shift by 384 bits.
+static const uint64 MINUS_LAMBDA[4] = { 0xe0cfc810b51283cfULL, 0xa880b9fc8ec739c2ULL, 0x5ad9e3fd77ed9ba4ULL, 0xac9c52b33fa3cf1fULL };
+static const uint64 MINUS_B1[4] = { 0x6f547fa90abfe4c3ULL, 0xe4437ed6010e8828ULL, 0, 0 };
+static const uint64 MINUS_B2[4] = { 0xd765cda83db1562cULL, 0x8a280ac50774346dULL, 0xfffffffffffffffeULL, 0xffffffffffffffffULL };
+static const uint64 G1[4] = { 0xe893209a45dbb031ULL, 0x3daa8a1471e8ca7fULL, 0xe86c90e49284eb15ULL, 0x3086d221a7d46bcdULL };
+static const uint64 G2[4] = { 0x1571b4ae8ac47f71ULL, 0x221208ac9df506c6ULL, 0x6f547fa90abfe4c4ULL, 0xe4437ed6010e8828ULL };
+
+// r = t mod n, for an eight limb t
+static void ScalarReduce(uint64* r, const uint64* tIn)
+{
+    // Fold the high half back in with 2^256 = ORDER_C (mod n); each round
+    // takes about 127 bits off
+    uint64 t[8];
+    memcpy(t, tIn, sizeof(t));
+    while (t[4] | t[5] | t[6] | t[7])
+    {
+        uint64 m[8];
+        MulLimbs<4, 3>(m, &t[4], ORDER_C);
+        m[7] = 0;
+        uint64 k = 0;
+        for (int i = 0; i < 8; i++)
+        {
+            uint64 s = m[i] + k;
+            k = (s < k);
+            if (i < 4)
+            {
+                s += t[i];
+                k += (s < t[i]);
+            }
+            t[i] = s;
+        }
+    }
+
+    // t < 2^256 < 2n
+    if (!LessThan(t, ORDER))
+        SubLimbs(t, t, ORDER);
+    memcpy(r, t, 4 * sizeof(uint64));
+}
+
+static void ScalarMul(uint64* r, const uint64* a, const uint64* b)
+{
+    uint64 t[8];
+    MulLimbs<4, 4>(t, a, b);
+    ScalarReduce(r, t);
+}
+
+static void ScalarAdd(uint64* r, const uint64* a, const uint64* b)
+{
+    uint64 t[8] = { 0 };
+    t[4] = AddLimbs(t, a, b);
+    ScalarReduce(r, t);
+}
+
+static void ScalarNeg(uint64* r, const uint64* a)
+{
+    // n - 0 reduces to 0
+    uint64 t[8] = { 0 };
+    SubLimbs(t, ORDER, a);
+    ScalarReduce(r, t);
+}
+
+static inline bool ScalarIsZero(const uint64* a)
+{
+    return (a[0] | a[1] | a[2] | a[3]) == 0;
+}
+
+// x / 2 mod n
+static inline void ScalarHalve(uint64* x)
+{
+    uint64 nTop = 0;
+    if (x[0] & 1)
+        nTop = AddLimbs(x, x, ORDER);
+    HalveLimbs(x, nTop);
+}
+
+// a must be nonzero.  Binary extended Euclid, algorithm 2.22 of the Guide: it
+// branches on a, which is fine for the public s of a signature being checked.
+static void ScalarInv(uint64* r, const uint64* a)
+{
+    static const uint64 ONE[4] = { 1, 0, 0, 0 };
+    uint64 u[4], v[4], x1[4] = { 1, 0, 0, 0 }, x2[4] = { 0, 0, 0, 0 };
+    memcpy(u, a, sizeof(u));
+    memcpy(v, ORDER, sizeof(v));
+    while (memcmp(u, ONE, sizeof(u)) != 0 && memcmp(v, ONE, sizeof(v)) != 0)
+    {
+        while (!(u[0] & 1))
+        {
+            HalveLimbs(u, 0);
+            ScalarHalve(x1);
+        }
+        while (!(v[0] & 1))
+        {
+            HalveLimbs(v, 0);
+            ScalarHalve(x2);
+        }
+        if (!LessThan(u, v))
+        {
+            SubLimbs(u, u, v);
+            if (SubLimbs(x1, x1, x2))
+                AddLimbs(x1, x1, ORDER);
+        }
+        else
+        {
+            SubLimbs(v, v, u);
+            if (SubLimbs(x2, x2, x1))
+                AddLimbs(x2, x2, ORDER);
+        }
+    }
+    memcpy(r, memcmp(u, ONE, sizeof(u)) == 0 ? x1 : x2, 4 * sizeof(uint64));
+}
+
+// r = round(a * b / 2^384)
+static void MulShift384(uint64* r, const uint64* a, const uint64* b)
+{
+    uint64 t[8];
+    MulLimbs<4, 4>(t, a, b);
+    uint64 nRound = t[5] >> 63;
+    r[0] = t[6] + nRound;
+    r[1] = t[7] + (r[0] < nRound);
+    r[2] = r[3] = 0;
+}
+
+// k = k1 + k2*lambda (mod n), with k1 and k2 within 2^128 of zero
+static void ScalarSplitLambda(uint64* k1, uint64* k2, const uint64* k)
+{
+    uint64 c1[4], c2[4];
+    MulShift384(c1, k, G1);
+    MulShift384(c2, k, G2);
+    ScalarMul(c1, c1, MINUS_B1);
+    ScalarMul(c2, c2, MINUS_B2);
+    ScalarAdd(k2, c1, c2);
+    ScalarMul(k1, k2, MINUS_LAMBDA);
+    ScalarAdd(k1, k1, k);
+}
+
+
+//
+// Group elements.  Affine points are only used for the precomputed tables
+// and never hold the point at infinity.
+//
+
+struct CPointAffine
+{
+    uint64 x[4];
+    uint64 y[4];
+};
+
+// Jacobian coordinates: (x/z^2, y/z^3)
+struct CPointJacobian
+{
+    uint64 x[4];
+    uint64 y[4];
+    uint64 z[4];
+    bool fInfinity;
+};
+
+static void PointSetAffine(CPointJacobian& r, const uint64* x, const uint64* y)
+{
+    memcpy(r.x, x, sizeof(r.x));
+    memcpy(r.y, y, sizeof(r.y));
+    FieldSetInt(r.z, 1);
+    r.fInfinity = false;
+}
+
+// dbl-2009-l from the Explicit-Formulas Database, for a = 0
+static void PointDouble(CPointJacobian& r, const CPointJacobian& p)
+{
+    // secp256k1 has no point of order two, so y is never zero
+    if (p.fInfinity)
+    {
+        r.fInfinity = true;
+        return;
+    }
+    uint64 a[4], b[4], c[4], d[4], e[4], f[4], t[4];
+    FieldSqr(a, p.x);
+    FieldSqr(b, p.y);
+    FieldSqr(c, b);
+    FieldAdd(t, p.x, b);
+    FieldSqr(d, t);
+    FieldSub(d, d, a);
+    FieldSub(d, d, c);
+    FieldAdd(d, d, d);
+    FieldMulInt(e, a, 3);
+    FieldSqr(f, e);
+
+    FieldMul(r.z, p.y, p.z);
+    FieldAdd(r.z, r.z, r.z);
+    FieldSub(r.x, f, d);
+    FieldSub(r.x, r.x, d);
+    FieldSub(t, d, r.x);
+    FieldMul(r.y, e, t);
+    FieldMulInt(c, c, 8);
+    FieldSub(r.y, r.y, c);
+    r.fInfinity = false;
+}
+
+// r = p + (u2/z2^2, s2/z2^3), given u2 and s2 already scaled by p.z: shared
+// by both kinds of addition
+static void PointAddScaled(CPointJacobian& r, const CPointJacobian& p, const uint64* u1, const uint64* s1,
+                           const uint64* u2, const uint64* s2, const uint64* zOther, const CPointJacobian& pOther)
+{
+    uint64 h[4], rr[4];
+    FieldSub(h, u2, u1);
+    FieldSub(rr, s2, s1);
+    if (FieldIsZero(h))
+    {
+        if (FieldIsZero(rr))
+            PointDouble(r, pOther);
+        else
+            r.fInfinity = true;
+        return;
+    }
+    uint64 hh[4], hhh[4], v[4], t[4];
+    FieldSqr(hh, h);
+    FieldMul(hhh, h, hh);
+    FieldMul(v, u1, hh);
+
+    FieldMul(r.z, p.z, h);
+    if (zOther != NULL)
+        FieldMul(r.z, r.z, zOther);
+    FieldSqr(r.x, rr);
+    FieldSub(r.x, r.x, hhh);
+    FieldSub(r.x, r.x, v);
+    FieldSub(r.x, r.x, v);
+    FieldSub(t, v, r.x);
+    FieldMul(r.y, rr, t);
+    FieldMul(t, s1, hhh);
+    FieldSub(r.y, r.y, t);
+    r.fInfinity = false;
+}
+
+// r = p + q for an affine q; r may be p
+static void PointAdd(CPointJacobian& r, const CPointJacobian& p, const CPointAffine& q)
+{
+    if (p.fInfinity)
+    {
+        PointSetAffine(r, q.x, q.y);
+        return;
+    }
+    uint64 zz[4], zzz[4], u2[4], s2[4], u1[4], s1[4];
+    FieldSqr(zz, p.z);
+    FieldMul(zzz, zz, p.z);
+    FieldMul(u2, q.x, zz);
+    FieldMul(s2, q.y, zzz);
+    memcpy(u1, p.x, sizeof(u1));
+    memcpy(s1, p.y, sizeof(s1));
+    CPointJacobian pCopy = p;
+    PointAddScaled(r, pCopy, u1, s1, u2, s2, NULL, pCopy);
+}
+
+// r = p + q; r may be p
+static void PointAdd(CPointJacobian& r, const CPointJacobian& p, const CPointJacobian& q)
+{
+    if (p.fInfinity)
+    {
+        r = q;
+        return;
+    }
+    if (q.fInfinity)
+    {
+        r = p;
+        return;
+    }
+    uint64 z1z1[4], z2z2[4], u1[4], u2[4], s1[4], s2[4];
+    FieldSqr(z1z1, p.z);
+    FieldSqr(z2z2, q.z);
+    FieldMul(u1, p.x, z2z2);
+    FieldMul(u2, q.x, z1z1);
+    FieldMul(s1, p.y, q.z);
+    FieldMul(s1, s1, z2z2);
+    FieldMul(s2, q.y, p.z);
+    FieldMul(s2, s2, z1z1);
+    CPointJacobian pCopy = p;
+    uint64 zq[4];
+    memcpy(zq, q.z, sizeof(zq));
+    PointAddScaled(r, pCopy, u1, s1, u2, s2, zq, pCopy);
+}
+
+
+//
+// u1*G + u2*Q
+//
+
+// Odd multiples 1, 3, ..., 2^(w-1) - 1 are kept for a window of w bits
+static const int WINDOW_G = 8;
+static const int WINDOW_Q = 5;
+static const int TABLE_G = 1 << (WINDOW_G - 2);
+static const int TABLE_Q = 1 << (WINDOW_Q - 2);
+
+// Digits for a scalar of up to 128 bits, plus room for the final carry
+static const int WNAF_BITS = 136;
+
+static CPointAffine pointsG[TABLE_G];
+static CPointAffine pointsLambdaG[TABLE_G];
+
+// Converts n points, none at infinity, sharing one field inversion between them
+static void PointsToAffine(CPointAffine* pointsOut, const CPointJacobian* pointsIn, int n)
+{
+    // Invert the product of every z, then peel the individual inverses off it
+    std::vector<uint64> vProducts(4 * n);
+    uint64* pProducts = &vProducts[0];
+    memcpy(pProducts, pointsIn[0].z, 4 * sizeof(uint64));
+    for (int i = 1; i < n; i++)
+        FieldMul(&pProducts[4*i], &pProducts[4*(i-1)], pointsIn[i].z);
+    uint64 inv[4];
+    FieldInv(inv, &pProducts[4*(n-1)]);
+    for (int i = n - 1; i >= 0; i--)
+    {
+        uint64 zi[4], zi2[4], zi3[4];
+        if (i > 0)
+        {
+            FieldMul(zi, inv, &pProducts[4*(i-1)]);
+            FieldMul(inv, inv, pointsIn[i].z);
+        }
+        else
+            memcpy(zi, inv, sizeof(zi));
+        FieldSqr(zi2, zi);
+        FieldMul(zi3, zi2, zi);
+        FieldMul(pointsOut[i].x, pointsIn[i].x, zi2);
+        FieldMul(pointsOut[i].y, pointsIn[i].y, zi3);
+    }
+}
+
+// Odd multiples of q
+static void BuildTableQ(CPointJacobian* pointsQ, const CSecp256k1PubKey& pubkey)
+{
+    CPointJacobian q2;
+    PointSetAffine(pointsQ[0], pubkey.x, pubkey.y);
+    PointDouble(q2, pointsQ[0]);
+    for (int i = 1; i < TABLE_Q; i++)
+        PointAdd(pointsQ[i], pointsQ[i - 1], q2);
+}
+
+// The same multiples of lambda*q, in the same form
+template<typename T>
+static void BuildTableLambda(T* pointsLambda, const T* points, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        pointsLambda[i] = points[i];
+        FieldMul(pointsLambda[i].x, points[i].x, BETA);
+    }
+}
+
+static void InitTables()
+{
+    static const uint64 GX[4] = { 0x59f2815b16f81798ULL, 0x029bfcdb2dce28d9ULL, 0x55a06295ce870b07ULL, 0x79be667ef9dcbbacULL };
+    static const uint64 GY[4] = { 0x9c47d08ffb10d4b8ULL, 0xfd17b448a6855419ULL, 0x5da4fbfc0e1108a8ULL, 0x483ada7726a3c465ULL };
+
+    CPointJacobian points[TABLE_G], g2;
+    PointSetAffine(points[0], GX, GY);
+    PointDouble(g2, points[0]);
+    for (int i = 1; i < TABLE_G; i++)
+        PointAdd(points[i], points[i - 1], g2);
+    PointsToAffine(pointsG, points, TABLE_G);
+    BuildTableLambda(pointsLambdaG, pointsG, TABLE_G);
+}
+
+static class CSecp256k1Init
+{
+public:
+    CSecp256k1Init()
+    {
+        InitTables();
+    }
+}
+instance_of_csecp256k1init;
+
+static inline int GetBits(const uint64* a, int nBit, int nCount)
+{
+    int nLimb = nBit >> 6;
+    int nShift = nBit & 63;
+    uint64 v = a[nLimb] >> nShift;
+    if (nShift + nCount > 64 && nLimb < 3)
+        v |= a[nLimb + 1] << (64 - nShift);
+    return v & ((1 << nCount) - 1);
+}
+
+// Width w NAF of a scalar below 2^128, negated if fNegate: every nonzero
+// digit is odd and followed by at least w-1 zeros.  Returns the number of
+// digits up to the last nonzero one.
+static int BuildWNAF(int* wnaf, const uint64* a, int w, bool fNegate)
+{
+    memset(wnaf, 0, WNAF_BITS * sizeof(int));
+    int nSign = fNegate ? -1 : 1;
+    int nCarry = 0;
+    int nLast = -1;
+    int nBit = 0;
+    while (nBit < WNAF_BITS)
+    {
+        if (GetBits(a, nBit, 1) == nCarry)
+        {
+            nBit++;
+            continue;
+        }
+        int nNow = w;
+        if (nNow > WNAF_BITS - nBit)
+            nNow = WNAF_BITS - nBit;
+        int nWord = GetBits(a, nBit, nNow) + nCarry;
+        nCarry = (nWord >> (w - 1)) & 1;
+        nWord -= nCarry << w;
+        wnaf[nBit] = nSign * nWord;
+        nLast = nBit;
+        nBit += nNow;
+    }
+    return nLast + 1;
+}
+
+// Splits k into halves and writes their wNAFs, returning the longer length
+static int BuildSplitWNAF(int* wnaf1, int* wnafLambda, const uint64* k, int w)
+{
+    uint64 k1[4], k2[4];
+    ScalarSplitLambda(k1, k2, k);
+
+    // Negative halves come out near n; use their magnitude and flip the sign
+    bool fNeg1 = LessThan(ORDER_HALF, k1);
+    bool fNeg2 = LessThan(ORDER_HALF, k2);
+    if (fNeg1)
+        ScalarNeg(k1, k1);
+    if (fNeg2)
+        ScalarNeg(k2, k2);
+    int nLen1 = BuildWNAF(wnaf1, k1, w, fNeg1);
+    int nLen2 = BuildWNAF(wnafLambda, k2, w, fNeg2);
+    return nLen1 > nLen2 ? nLen1 : nLen2;
+}
+
+template<typename T>
+static inline void TableGet(T& r, const T* table, int n)
+{
+    r = table[(n < 0 ? -n : n) / 2];
+    if (n < 0)
+        FieldNeg(r.y, r.y);
+}
+
+// r = nq*q + ng*G, given q's tables in either form
+template<typename T>
+static void ECMult(CPointJacobian& r, const T* pointsQ, const T* pointsLambdaQ, const uint64* nq, const uint64* ng)
+{
+    int wnafQ[WNAF_BITS], wnafLambdaQ[WNAF_BITS], wnafG[WNAF_BITS], wnafLambdaG[WNAF_BITS];
+    int nBits = BuildSplitWNAF(wnafQ, wnafLambdaQ, nq, WINDOW_Q);
+    int nBitsG = BuildSplitWNAF(wnafG, wnafLambdaG, ng, WINDOW_G);
+    if (nBitsG > nBits)
+        nBits = nBitsG;
+
+    r.fInfinity = true;
+    T tq;
+    CPointAffine tg;
+    for (int i = nBits - 1; i >= 0; i--)
+    {
+        PointDouble(r, r);
+        if (wnafQ[i])
+        {
+            TableGet(tq, pointsQ, wnafQ[i]);
+            PointAdd(r, r, tq);
+        }
+        if (wnafLambdaQ[i])
+        {
+            TableGet(tq, pointsLambdaQ, wnafLambdaQ[i]);
+            PointAdd(r, r, tq);
+        }
+        if (wnafG[i])
+        {
+            TableGet(tg, pointsG, wnafG[i]);
+            PointAdd(r, r, tg);
+        }
+        if (wnafLambdaG[i])
+        {
+            TableGet(tg, pointsLambdaG, wnafLambdaG[i]);
+            PointAdd(r, r, tg);
+        }
+    }
+}
+
+
+//
+// ECDSA
+//
+
+bool CSecp256k1PubKey::SetPubKey(const unsigned char* pch, unsigned int nSize)
+{
+    static const uint64 SEVEN[4] = { 7, 0, 0, 0 };
+    uint64 x3[4];
+    if (nSize == 33 && (pch[0] == 0x02 || pch[0] == 0x03))
+    {
+        // y^2 = x^3 + 7, picking the root with the parity given
+        if (!FieldSetB32(x, &pch[1]))
+            return false;
+        FieldSqr(x3, x);
+        FieldMul(x3, x3, x);
+        FieldAdd(x3, x3, SEVEN);
+        if (!FieldSqrt(y, x3))
+            return false;
+        if ((y[0] & 1) != (pch[0] & 1))
+            FieldNeg(y, y);
+        return true;
+    }
+    if (nSize == 65 && (pch[0] == 0x04 || pch[0] == 0x06 || pch[0] == 0x07))
+    {
+        if (!FieldSetB32(x, &pch[1]) || !FieldSetB32(y, &pch[33]))
+            return false;
+        // Hybrid keys carry y's parity in the prefix as well
+        if (pch[0] != 0x04 && (y[0] & 1) != (pch[0] & 1))
+            return false;
+        uint64 y2[4];
+        FieldSqr(y2, y);
+        FieldSqr(x3, x);
+        FieldMul(x3, x3, x);
+        FieldAdd(x3, x3, SEVEN);
+        return FieldEqual(y2, x3);
+    }
+    return false;
+}
+
+// One DER INTEGER holding a value in [1, n-1].  Anything that isn't the
+// minimal encoding fails, as ECDSA_verify in OpenSSL 1.0.1k and later fails
+// signatures that don't re-encode to the same bytes.
+static bool ParseDERInteger(const unsigned char*& pch, const unsigned char* pend, uint64* r)
+{
+    if (pend - pch < 2 || pch[0] != 0x02)
+        return false;
+    unsigned int nLen = pch[1];
+    pch += 2;
+    // Lengths over 127 bytes would need the long form, and are too big anyway
+    if (nLen == 0 || nLen >= 0x80 || nLen > (unsigned int)(pend - pch))
+        return false;
+    const unsigned char* pchInt = pch;
+    pch += nLen;
+
+    // Negative, or padded with a zero that wasn't needed
+    if (pchInt[0] & 0x80)
+        return false;
+    if (nLen > 1 && pchInt[0] == 0 && !(pchInt[1] & 0x80))
+        return false;
+    if (pchInt[0] == 0 && nLen > 1)
+    {
+        pchInt++;
+        nLen--;
+    }
+    if (nLen > 32)
+        return false;
+
+    unsigned char pch32[32] = { 0 };
+    memcpy(&pch32[32 - nLen], pchInt, nLen);
+    SetB32(r, pch32);
+    return !ScalarIsZero(r) && LessThan(r, ORDER);
+}
+
+static bool ParseDERSignature(const unsigned char* pchSig, unsigned int nSize, uint64* r, uint64* s)
+{
+    if (nSize < 2 || pchSig[0] != 0x30 || pchSig[1] >= 0x80 || pchSig[1] != nSize - 2)
+        return false;
+    const unsigned char* pch = pchSig + 2;
+    const unsigned char* pend = pchSig + nSize;
+    if (!ParseDERInteger(pch, pend, r) || !ParseDERInteger(pch, pend, s))
+        return false;
+    return pch == pend;
+}
+
+// A BER identifier of the universal class, constructed or not as
+// fConstructed says, for tag number nTag.  As in OpenSSL's
+// ASN1_get_object, the number may also be spelled in the high tag number
+// form, leading zero digits and all.
+static bool ParseBERTag(const unsigned char*& pch, const unsigned char* pend, bool fConstructed, unsigned int nTag)
+{
+    if (pch == pend)
+        return false;
+    unsigned char c = *pch++;
+    if ((c & 0xe0) != (fConstructed ? 0x20 : 0))
+        return false;
+    unsigned int n = c & 0x1f;
+    if (n == 0x1f)
+    {
+        n = 0;
+        do
+        {
+            if (pch == pend || n > (0x7fffffffU >> 7))
+                return false;
+            c = *pch++;
+            n = (n << 7) | (c & 0x7f);
+        } while (c & 0x80);
+    }
+    return n == nTag;
+}
+
+// A BER length, as ASN1_get_length reads it: the long form may have
+// leading zero bytes, up to as many bytes as a long holds.  0x80, the
+// indefinite form, sets fIndefinite.  A definite length has to fit in
+// what's left.
+static bool ParseBERLength(const unsigned char*& pch, const unsigned char* pend, unsigned int& nLen, bool& fIndefinite)
+{
+    if (pch == pend)
+        return false;
+    unsigned char c = *pch++;
+    fIndefinite = (c == 0x80);
+    nLen = 0;
+    if (fIndefinite)
+        return true;
+    if (c < 0x80)
+        nLen = c;
+    else
+    {
+        unsigned int nBytes = c & 0x7f;
+        if (nBytes > sizeof(long) || nBytes > (unsigned int)(pend - pch))
+            return false;
+        uint64 n = 0;
+        while (nBytes-- > 0)
+        {
+            n = (n << 8) | *pch++;
+            if (n > (uint64)(pend - pch) + nBytes)
+                return false;
+        }
+        nLen = n;
+    }
+    return nLen <= (unsigned int)(pend - pch);
+}
+
+// An INTEGER the way OpenSSL before 1.0.1k read one into a BIGNUM
+// (bn_c2i): any BER length, the content taken as an unsigned big endian
+// number whatever its top bit, leading zeros and all.  ECDSA_do_verify then
+// fails anything outside [1, n-1].
+static bool ParseBERInteger(const unsigned char*& pch, const unsigned char* pend, uint64* r)
+{
+    unsigned int nLen;
+    bool fIndefinite;
+    if (!ParseBERTag(pch, pend, false, 0x02) || !ParseBERLength(pch, pend, nLen, fIndefinite) || fIndefinite)
+        return false;
+    const unsigned char* pchInt = pch;
+    pch += nLen;
+
+    while (nLen > 0 && pchInt[0] == 0)
+    {
+        pchInt++;
+        nLen--;
+    }
+    if (nLen > 32)
+        return false;
+
+    unsigned char pch32[32] = { 0 };
+    memcpy(&pch32[32 - nLen], pchInt, nLen);
+    SetB32(r, pch32);
+    return !ScalarIsZero(r) && LessThan(r, ORDER);
+}
+
+// What ECDSA_verify accepted before OpenSSL 1.0.1k, which just decoded the
+// signature with d2i_ECDSA_SIG.  That takes BER: a SEQUENCE of definite
+// length holding exactly the two INTEGERs, or of indefinite length ended by
+// two zero bytes.  Whatever follows the SEQUENCE is ignored.
+static bool ParseBERSignature(const unsigned char* pchSig, unsigned int nSize, uint64* r, uint64* s)
+{
+    const unsigned char* pch = pchSig;
+    const unsigned char* pend = pchSig + nSize;
+    unsigned int nLen;
+    bool fIndefinite;
+    if (!ParseBERTag(pch, pend, true, 0x10) || !ParseBERLength(pch, pend, nLen, fIndefinite))
+        return false;
+    if (!fIndefinite)
+        pend = pch + nLen;
+    if (!ParseBERInteger(pch, pend, r) || !ParseBERInteger(pch, pend, s))
+        return false;
+    if (fIndefinite)
+        return pend - pch >= 2 && pch[0] == 0 && pch[1] == 0;
+    return pch == pend;
+}
+
+bool Secp256k1IsStrictSignature(const unsigned char* pchSig, unsigned int nSize)
+{
+    uint64 r[4], s[4];
+    return ParseDERSignature(pchSig, nSize, r, s);
+}
+
+bool Secp256k1IsLaxSignature(const unsigned char* pchSig, unsigned int nSize)
+{
+    uint64 r[4], s[4];
+    return ParseBERSignature(pchSig, nSize, r, s);
+}
+
+// Everything before the point multiplication: r, u1 = m/s and u2 = r/s,
+// given w = 1/s
+static void ComputeU(const unsigned char* pchHash, const uint64* r, const uint64* w, uint64* u1, uint64* u2)
+{
+    // The hash is the same number of bits as n, so it's reduced rather than truncated
+    uint64 m[8] = { 0 };
+    SetB32(m, pchHash);
+    ScalarReduce(m, m);
+    ScalarMul(u1, m, w);
+    ScalarMul(u2, r, w);
+}
+
+// x(pt) mod n == r, without an inversion: x(pt) is one of r and r + n, the
+// second only possible when r + n < p
+static bool CheckR(const CPointJacobian& pt, const uint64* r)
+{
+    static const uint64 P_MINUS_N[4] = { 0x402da1722fc9baeeULL, 0x4551231950b75fc4ULL, 0x0000000000000001ULL, 0 };
+    if (pt.fInfinity)
+        return false;
+    uint64 zz[4], t[4];
+    FieldSqr(zz, pt.z);
+    FieldMul(t, r, zz);
+    if (FieldEqual(t, pt.x))
+        return true;
+    if (!LessThan(r, P_MINUS_N))
+        return false;
+    uint64 rn[4];
+    AddLimbs(rn, r, ORDER);
+    FieldMul(t, rn, zz);
+    return FieldEqual(t, pt.x);
+}
+
+bool Secp256k1Verify(const unsigned char* pchHash, const unsigned char* pchSig, unsigned int nSigSize,
+                     const CSecp256k1PubKey& pubkey)
+{
+    uint64 r[4], s[4];
+    if (!ParseBERSignature(pchSig, nSigSize, r, s))
+        return false;
+
+    uint64 w[4], u1[4], u2[4];
+    ScalarInv(w, s);
+    ComputeU(pchHash, r, w, u1, u2);
+
+    CPointJacobian pointsQ[TABLE_Q], pointsLambdaQ[TABLE_Q], pt;
+    BuildTableQ(pointsQ, pubkey);
+    BuildTableLambda(pointsLambdaQ, pointsQ, TABLE_Q);
+    ECMult(pt, pointsQ, pointsLambdaQ, u2, u1);
+    return CheckR(pt, r);
+}
+
+// Signatures are checked this many at a time, to bound the memory the
+// tables take
+static const int BATCH_CHUNK = 64;
+
+static bool VerifyBatchChunk(const CSecp256k1BatchEntry* pEntries, int nCount)
+{
+    std::vector<uint64> vScalars(4 * 4 * nCount);
+    uint64* r = &vScalars[0];
+    uint64* s = &vScalars[4 * nCount];
+    uint64* u1 = &vScalars[8 * nCount];
+    uint64* u2 = &vScalars[12 * nCount];
+    for (int i = 0; i < nCount; i++)
+    {
+        const std::vector<unsigned char>& vchSig = pEntries[i].vchSig;
+        if (vchSig.empty() || !ParseDERSignature(&vchSig[0], vchSig.size(), &r[4*i], &s[4*i]))
+            return false;
+    }
+
+    // One scalar inversion: invert the product of every s, then peel the
+    // individual inverses off it, keeping the partial products in u1
+    memcpy(&u1[0], &s[0], 4 * sizeof(uint64));
+    for (int i = 1; i < nCount; i++)
+        ScalarMul(&u1[4*i], &u1[4*(i-1)], &s[4*i]);
+    uint64 inv[4];
+    ScalarInv(inv, &u1[4*(nCount-1)]);
+    for (int i = nCount - 1; i >= 0; i--)
+    {
+        uint64 w[4];
+        if (i > 0)
+        {
+            ScalarMul(w, inv, &u1[4*(i-1)]);
+            ScalarMul(inv, inv, &s[4*i]);
+        }
+        else
+            memcpy(w, inv, sizeof(w));
+        ComputeU(pEntries[i].pchHash, &r[4*i], w, &u1[4*i], &u2[4*i]);
+    }
+
+    // One field inversion puts every public key's table in affine form, so
+    // the additions from them are the cheaper mixed kind
+    std::vector<CPointJacobian> vJacobian(TABLE_Q * nCount);
+    std::vector<CPointAffine> vAffine(TABLE_Q * nCount);
+    for (int i = 0; i < nCount; i++)
+        BuildTableQ(&vJacobian[TABLE_Q*i], pEntries[i].pubkey);
+    PointsToAffine(&vAffine[0], &vJacobian[0], vJacobian.size());
+
+    for (int i = 0; i < nCount; i++)
+    {
+        CPointAffine pointsLambdaQ[TABLE_Q];
+        BuildTableLambda(pointsLambdaQ, &vAffine[TABLE_Q*i], TABLE_Q);
+        CPointJacobian pt;
+        ECMult(pt, &vAffine[TABLE_Q*i], pointsLambdaQ, &u2[4*i], &u1[4*i]);
+        if (!CheckR(pt, &r[4*i]))
+            return false;
+    }
+    return true;
+}
+
+bool Secp256k1VerifyBatch(const std::vector<CSecp256k1BatchEntry>& vEntries)
+{
+    for (unsigned int i = 0; i < vEntries.size(); i += BATCH_CHUNK)
+    {
+        int nCount = std::min((int)(vEntries.size() - i), BATCH_CHUNK);
+        if (!VerifyBatchChunk(&vEntries[i], nCount))
+            return false;
+    }
+    return true;
+}
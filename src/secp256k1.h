@@ -0,0 +1,72 @@
+// Copyright (c) 2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SECP256K1_H
+#define BITCOIN_SECP256K1_H
+
+#include <vector>
+
+#include "uint256.h"
+
+/** ECDSA signature verification written for secp256k1 alone, instead of
+ * OpenSSL's code for arbitrary curves.
+ *
+ * Field elements are four 64-bit limbs, kept fully reduced using
+ * 2^256 = 2^32 + 977 (mod p), with no branches on their values.  Verifying
+ * computes u1*G + u2*Q in a single pass of doublings (Strauss-Shamir): the GLV
+ * endomorphism splits both scalars into halves of at most 128 bits, and the
+ * four halves are added in from wNAF tables, precomputed once for G and built
+ * for Q on each call.
+ *
+ * Public keys are accepted in compressed, uncompressed or hybrid form if
+ * they lie on the curve.  Signatures are read the way ECDSA_verify read them
+ * before OpenSSL 1.0.1k, the releases this tree is built with, which took
+ * BER rather than only DER; see Secp256k1IsLaxSignature.
+ */
+
+/** A public key that has been parsed and checked to be on the curve */
+class CSecp256k1PubKey
+{
+public:
+    // Affine coordinates, least significant limb first
+    uint64 x[4];
+    uint64 y[4];
+
+    bool SetPubKey(const unsigned char* pch, unsigned int nSize);
+};
+
+/** True if pchSig is DER with 0 < r, s < n: the only signatures OpenSSL
+ * 1.0.1k and later accept, and the only ones Secp256k1VerifyBatch takes */
+bool Secp256k1IsStrictSignature(const unsigned char* pchSig, unsigned int nSize);
+
+/** True if pchSig is a signature older OpenSSL accepts and Secp256k1Verify
+ * can decide: long form lengths, zero padded or negative looking integers
+ * and bytes after the SEQUENCE are all allowed, and 0 < r, s < n.  Blocks
+ * already hold such signatures.  Anything else should go to OpenSSL. */
+bool Secp256k1IsLaxSignature(const unsigned char* pchSig, unsigned int nSize);
+
+/** hash is the 32 bytes that were signed, most significant first, as passed to ECDSA_verify */
+bool Secp256k1Verify(const unsigned char* pchHash, const unsigned char* pchSig, unsigned int nSigSize,
+                     const CSecp256k1PubKey& pubkey);
+
+/** One signature waiting for Secp256k1VerifyBatch */
+class CSecp256k1BatchEntry
+{
+public:
+    unsigned char pchHash[32];
+    std::vector<unsigned char> vchSig;
+    CSecp256k1PubKey pubkey;
+};
+
+/** True if Secp256k1Verify would pass every entry, each of which has to
+ * have a strict signature; other encodings fail.  The scalar inversion
+ * and the inversion that puts each public key's table in affine form are
+ * shared across the batch.  A failure doesn't say which entry failed.
+ *
+ * The usual trick for batches, checking one random linear combination of
+ * the equations, needs each R = u1*G + u2*Q as a point.  An ECDSA signature
+ * only carries its x coordinate, so every R is still computed on its own.
+ */
+bool Secp256k1VerifyBatch(const std::vector<CSecp256k1BatchEntry>& vEntries);
+
+#endif
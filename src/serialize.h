@@ -53,7 +53,15 @@ class CDataStream;
 class CAutoFile;
 static const unsigned int MAX_SIZE = 0x02000000;
 
-static const int PROTOCOL_VERSION = 60000;
+static const int PROTOCOL_VERSION = 60001;
+
+// Peers from this version on are sent "usecmpct".  That alone doesn't mean
+// they know compact blocks: 60001 is also the version of every client with
+// ping nonces, so only a peer that sends "usecmpct" back is asked for them.
+static const int COMPACT_BLOCKS_VERSION = 60001;
+
+// "ping" carries a nonce that is echoed back in a "pong" from this version on
+static const int PING_NONCE_VERSION = 60001;
 
 // Used to bypass the rule against non-const reference to temporary
 // where it makes sense with wrappers such as CFlatData or CTxDB
@@ -852,6 +860,9 @@ struct zero_after_free_allocator : public std::allocator<T>
     }
 };
 
+/** Raw byte buffer in the format CDataStream stores its data in. */
+typedef std::vector<char, zero_after_free_allocator<char> > CSerializeData;
+
 
 
 /** Double ended buffer combining vector and stream-like interfaces.
@@ -862,7 +873,7 @@ struct zero_after_free_allocator : public std::allocator<T>
 class CDataStream
 {
 protected:
-    typedef std::vector<char, zero_after_free_allocator<char> > vector_type;
+    typedef CSerializeData vector_type;
     vector_type vch;
     unsigned int nReadPos;
     short state;
@@ -1039,6 +1050,14 @@ public:
         nReadPos = 0;
     }
 
+    void GetAndClear(CSerializeData& data)
+    {
+        // Hand over the underlying buffer without copying it
+        Compact();
+        data.clear();
+        vch.swap(data);
+    }
+
     bool Rewind(size_type n)
     {
         // Rewind by n characters if the buffer hasn't been compacted yet
@@ -13,7 +13,7 @@
 #include <stdint.h>
 
 // Tests this internal-to-main.cpp method:
-extern void AddOrphanTx(const CDataStream& vMsg);
+extern void AddOrphanTx(const CDataStream& vMsg, CNode* pfrom);
 extern int LimitOrphanTxSize(int nMaxOrphans);
 extern std::map<uint256, CDataStream*> mapOrphanTransactions;
 extern std::multimap<uint256, CDataStream*> mapOrphanTransactionsByPrev;
@@ -79,6 +79,54 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
     BOOST_CHECK(!CNode::IsBanned(addr));
 }
 
+BOOST_AUTO_TEST_CASE(DoS_subnetban)
+{
+    BOOST_CHECK(CSubNet("1.2.3.0/24").Match(CNetAddr("1.2.3.4")));
+    BOOST_CHECK(!CSubNet("1.2.3.0/24").Match(CNetAddr("1.2.4.4")));
+    BOOST_CHECK(CSubNet("1.2.3.77/24") == CSubNet("1.2.3.0/24")); // host bits don't matter
+    BOOST_CHECK_EQUAL(CSubNet("1.2.3.77/24").ToString(), "1.2.3.0/24");
+    BOOST_CHECK(CSubNet("1.2.3.4").Match(CNetAddr("1.2.3.4")));
+    BOOST_CHECK(!CSubNet("1.2.3.4").Match(CNetAddr("1.2.3.5")));
+    BOOST_CHECK(CSubNet("0.0.0.0/0").Match(CNetAddr("200.1.1.1")));
+    BOOST_CHECK(!CSubNet("1.2.3.0/33").IsValid());
+    BOOST_CHECK(!CSubNet("1.2.3.0/").IsValid());
+    BOOST_CHECK(!CSubNet("1.2.3.0/-1").IsValid());
+    BOOST_CHECK(!CSubNet("not an address").IsValid());
+
+    int64 nNow = GetTime();
+    CBanList bans;
+    bans.Ban(CSubNet("10.1.0.0/16"), nNow + 100, nNow);
+    bans.Ban(CSubNet("10.1.2.3"), nNow + 1000, nNow);
+    bans.Ban(CSubNet("192.168.0.0/24"), nNow - 1, nNow); // already over
+    BOOST_CHECK(bans.IsBanned(CNetAddr("10.1.200.1"), nNow));
+    BOOST_CHECK(!bans.IsBanned(CNetAddr("10.2.0.1"), nNow));
+    BOOST_CHECK(!bans.IsBanned(CNetAddr("192.168.0.1"), nNow));
+
+    // The /16 runs out first, the single address stays banned
+    BOOST_CHECK(!bans.IsBanned(CNetAddr("10.1.200.1"), nNow + 100));
+    BOOST_CHECK(bans.IsBanned(CNetAddr("10.1.2.3"), nNow + 100));
+
+    BOOST_CHECK(bans.Unban(CSubNet("10.1.0.0/16")));
+    BOOST_CHECK(!bans.Unban(CSubNet("10.1.0.0/16")));
+    BOOST_CHECK(!bans.IsBanned(CNetAddr("10.1.200.1"), nNow));
+    BOOST_CHECK(bans.IsBanned(CNetAddr("10.1.2.3"), nNow));
+
+    BOOST_CHECK_EQUAL(bans.SweepExpired(nNow), 1);
+    BOOST_CHECK_EQUAL(bans.size(), 1);
+
+    // Survives a round trip through the serialized form
+    CDataStream ss(SER_DISK);
+    ss << bans;
+    CBanList bans2;
+    ss >> bans2;
+    BOOST_CHECK_EQUAL(bans2.size(), 1);
+    BOOST_CHECK(bans2.IsBanned(CNetAddr("10.1.2.3"), nNow));
+    BOOST_CHECK(!bans2.IsBanned(CNetAddr("10.1.2.4"), nNow));
+
+    bans2.Clear();
+    BOOST_CHECK(!bans2.IsBanned(CNetAddr("10.1.2.3"), nNow));
+}
+
 static bool CheckNBits(unsigned int nbits1, int64 time1, unsigned int nbits2, int64 time2)\
 {
     if (time1 > time2)
@@ -151,6 +199,11 @@ CTransaction RandomOrphan()
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
 {
+    // Orphan memory is charged to the peer that sent it
+    CNode dummyNode(INVALID_SOCKET, CAddress(ip(0xa0b0c001)), true);
+    CRITICAL_BLOCK(cs_vNodes)
+        vNodes.push_back(&dummyNode);
+
     CKey key;
     key.MakeNewKey(true);
     CBasicKeyStore keystore;
@@ -170,8 +223,9 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
 
         CDataStream ds;
         ds << tx;
-        AddOrphanTx(ds);
+        AddOrphanTx(ds, &dummyNode);
     }
+    BOOST_CHECK(dummyNode.nOrphanBytes > 0);
 
     // ... and 50 that depend on other orphans:
     for (int i = 0; i < 50; i++)
@@ -189,7 +243,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
 
         CDataStream ds;
         ds << tx;
-        AddOrphanTx(ds);
+        AddOrphanTx(ds, NULL);
     }
 
     // Test LimitOrphanTxSize() function:
@@ -200,6 +254,63 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     LimitOrphanTxSize(0);
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK_EQUAL(dummyNode.nOrphanBytes, 0U);
+
+    CRITICAL_BLOCK(cs_vNodes)
+        vNodes.erase(std::find(vNodes.begin(), vNodes.end(), &dummyNode));
+}
+
+BOOST_AUTO_TEST_CASE(DoS_eviction)
+{
+    std::vector<CNode*> vPeers;
+    int64 nNow = GetTime();
+
+    // 40 useful peers, each in its own /16 ...
+    for (int i = 0; i < 40; i++)
+    {
+        CNode* pnode = new CNode(INVALID_SOCKET, CAddress(ip(0x00000005 + (i << 8))), true); // 5.i.0.0
+        pnode->nTimeConnected = nNow - 1000;
+        pnode->nPingUsecTime = 1000 * (i + 1);
+        pnode->nTxDelivered = 10;
+        pnode->nLastTxTime = nNow - 100 + i;
+        pnode->nProcessUsec = 1000;
+        vPeers.push_back(pnode);
+    }
+    // ... and 40 newer ones from a single /16 that only cost us
+    for (int i = 0; i < 40; i++)
+    {
+        CNode* pnode = new CNode(INVALID_SOCKET, CAddress(ip(0x00006306 + (i << 24))), true); // 6.99.0.i
+        pnode->nTimeConnected = nNow - 40 + i;
+        pnode->nRecvBufferBytes = 100000;
+        pnode->nOrphanBytes = 50000 * (i + 1);
+        vPeers.push_back(pnode);
+    }
+
+    CNode* pnodeEvict = SelectNodeToEvict(vPeers);
+    BOOST_REQUIRE(pnodeEvict != NULL);
+    BOOST_CHECK(pnodeEvict->addr.GetGroup() == vPeers[40]->addr.GetGroup());
+    BOOST_CHECK(pnodeEvict->nOrphanBytes >= 50000 * 30); // one of the most expensive ones
+
+    // A peer that just gave us a block is kept even when it is expensive
+    pnodeEvict->nBlocksDelivered = 1;
+    pnodeEvict->nLastBlockTime = GetTime();
+    CNode* pnodeEvict2 = SelectNodeToEvict(vPeers);
+    BOOST_CHECK(pnodeEvict2 != NULL && pnodeEvict2 != pnodeEvict);
+
+    // Outbound and already disconnecting peers are never picked
+    BOOST_FOREACH(CNode* pnode, vPeers)
+        if (pnode->addr.GetGroup() == vPeers[40]->addr.GetGroup())
+            pnode->fInbound = false;
+    vPeers[0]->fDisconnect = true;
+    pnodeEvict = SelectNodeToEvict(vPeers);
+    BOOST_CHECK(pnodeEvict != NULL && pnodeEvict->fInbound && pnodeEvict != vPeers[0]);
+
+    // Too few inbound peers left once the protected ones are taken out
+    std::vector<CNode*> vFew(vPeers.begin(), vPeers.begin() + 10);
+    BOOST_CHECK(SelectNodeToEvict(vFew) == NULL);
+
+    BOOST_FOREACH(CNode* pnode, vPeers)
+        delete pnode;
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,75 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bloom.h"
+#include "util.h"
+
+using namespace std;
+
+// Distinct, well mixed keys that are the same on every run
+static uint256 TestHash(unsigned int n)
+{
+    return Hash(BEGIN(n), END(n));
+}
+
+BOOST_AUTO_TEST_SUITE(bloom_tests)
+
+// The most recent nElements insertions must always be found
+BOOST_AUTO_TEST_CASE(rolling_bloom_no_false_negatives)
+{
+    CRollingBloomFilter filter(100, 0.01);
+    vector<uint256> vHash;
+    for (unsigned int i = 0; i < 1000; i++)
+    {
+        vHash.push_back(TestHash(i));
+        filter.insert(vHash.back());
+        for (unsigned int j = (i < 99 ? 0 : i - 99); j <= i; j++)
+            BOOST_CHECK(filter.contains(vHash[j]));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rolling_bloom_false_positive_rate)
+{
+    CRollingBloomFilter filter(1000, 0.01);
+    for (unsigned int i = 0; i < 5000; i++)
+        filter.insert(TestHash(i));
+
+    // The filter's hash tweak is still random, so the count varies
+    int nFalsePositives = 0;
+    for (unsigned int i = 5000; i < 15000; i++)
+        if (filter.contains(TestHash(i)))
+            nFalsePositives++;
+    // Expected about 100, allow plenty of slack for randomness
+    BOOST_CHECK(nFalsePositives < 300);
+}
+
+BOOST_AUTO_TEST_CASE(rolling_bloom_forgets)
+{
+    // Any single key can still be a false positive after it has been
+    // forgotten, so count over a full generation of them
+    CRollingBloomFilter filter(100, 0.001);
+    for (unsigned int n = 0; n < 100; n++)
+        filter.insert(TestHash(n));
+    for (unsigned int n = 0; n < 100; n++)
+        BOOST_CHECK(filter.contains(TestHash(n)));
+
+    // Two full generations later they have to be gone, barring about
+    // 0.1 false positives expected
+    for (unsigned int n = 100; n < 300; n++)
+        filter.insert(TestHash(n));
+    int nStillFound = 0;
+    for (unsigned int n = 0; n < 100; n++)
+        if (filter.contains(TestHash(n)))
+            nStillFound++;
+    BOOST_CHECK(nStillFound < 5);
+
+    // After reset() no bits are set, so nothing can be found
+    vector<unsigned char> vKey(20, 0x5a);
+    filter.insert(vKey);
+    BOOST_CHECK(filter.contains(vKey));
+    filter.reset();
+    BOOST_CHECK(!filter.contains(vKey));
+    for (unsigned int n = 0; n < 300; n++)
+        BOOST_CHECK(!filter.contains(TestHash(n)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
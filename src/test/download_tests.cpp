@@ -0,0 +1,181 @@
+//
+// Unit tests for the getdata request scheduler
+//
+#include <boost/test/unit_test.hpp>
+
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+static CAddress PeerAddress(unsigned int i)
+{
+    struct in_addr s;
+    s.s_addr = 0x0100000a + (i << 24); // 10.0.0.i
+    return CAddress(CService(CNetAddr(s), GetDefaultPort()));
+}
+
+static CInv TxInv(int n)
+{
+    return CInv(MSG_TX, uint256(n));
+}
+
+BOOST_AUTO_TEST_SUITE(download_tests)
+
+BOOST_AUTO_TEST_CASE(download_one_peer_at_a_time)
+{
+    CDownloadScheduler sched;
+    CNode node1(INVALID_SOCKET, PeerAddress(1), true);
+    CNode node2(INVALID_SOCKET, PeerAddress(2), true);
+
+    sched.AskFor(&node1, TxInv(1), 1000);
+    sched.AskFor(&node2, TxInv(1), 1000);
+    sched.AskFor(&node1, TxInv(1), 1000); // repeat announcement is ignored
+    BOOST_CHECK_EQUAL(sched.size(), 1);
+
+    vector<CInv> vRequest;
+    sched.GetRequests(&node1, 1000, vRequest);
+    BOOST_CHECK_EQUAL(vRequest.size(), 1U);
+
+    // Already in flight from node1
+    vRequest.clear();
+    sched.GetRequests(&node2, 1000, vRequest);
+    BOOST_CHECK(vRequest.empty());
+
+    sched.Received(TxInv(1));
+    BOOST_CHECK_EQUAL(sched.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(download_retry_after_timeout)
+{
+    CDownloadScheduler sched;
+    CNode node1(INVALID_SOCKET, PeerAddress(1), true);
+    CNode node2(INVALID_SOCKET, PeerAddress(2), true);
+
+    sched.AskFor(&node1, TxInv(1), 1000);
+    sched.AskFor(&node2, TxInv(1), 1000);
+
+    vector<CInv> vRequest;
+    sched.GetRequests(&node1, 1000, vRequest);
+    BOOST_CHECK_EQUAL(vRequest.size(), 1U);
+
+    // Not yet timed out
+    vRequest.clear();
+    sched.GetRequests(&node2, 1000 + CDownloadScheduler::TX_TIMEOUT - 1, vRequest);
+    BOOST_CHECK(vRequest.empty());
+
+    vRequest.clear();
+    sched.GetRequests(&node2, 1000 + CDownloadScheduler::TX_TIMEOUT, vRequest);
+    BOOST_CHECK_EQUAL(vRequest.size(), 1U);
+
+    // Nobody left to ask after the second timeout
+    vRequest.clear();
+    sched.GetRequests(&node1, 1000 + 2 * CDownloadScheduler::TX_TIMEOUT, vRequest);
+    BOOST_CHECK(vRequest.empty());
+    BOOST_CHECK_EQUAL(sched.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(download_retry_after_disconnect)
+{
+    CDownloadScheduler sched;
+    CNode node1(INVALID_SOCKET, PeerAddress(1), true);
+    CNode node2(INVALID_SOCKET, PeerAddress(2), true);
+
+    sched.AskFor(&node1, TxInv(1), 1000);
+    sched.AskFor(&node1, TxInv(2), 1000);
+    sched.AskFor(&node2, TxInv(1), 1000);
+
+    vector<CInv> vRequest;
+    sched.GetRequests(&node1, 1000, vRequest);
+    BOOST_CHECK_EQUAL(vRequest.size(), 2U);
+
+    // Only announced by node1, so it goes away with it
+    node1.fDisconnect = true;
+    sched.RemovePeer(&node1);
+    BOOST_CHECK_EQUAL(sched.size(), 1);
+
+    vRequest.clear();
+    sched.GetRequests(&node2, 1001, vRequest);
+    BOOST_CHECK_EQUAL(vRequest.size(), 1U);
+    BOOST_CHECK(vRequest[0].hash == TxInv(1).hash);
+
+    // A disconnected peer can't add anything back
+    sched.AskFor(&node1, TxInv(3), 1000);
+    BOOST_CHECK_EQUAL(sched.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(download_prefers_fast_peer_for_blocks)
+{
+    CDownloadScheduler sched;
+    CNode nodeSlow(INVALID_SOCKET, PeerAddress(1), true);
+    CNode nodeFast(INVALID_SOCKET, PeerAddress(2), true);
+    nodeSlow.nPingUsecTime = 800000;
+    nodeFast.nPingUsecTime = 50000;
+
+    CInv inv1(MSG_BLOCK, uint256(1));
+    CInv inv2(MSG_BLOCK, uint256(2));
+    sched.AskFor(&nodeSlow, inv1, 1000);
+    sched.AskFor(&nodeFast, inv1, 1000);
+    sched.AskFor(&nodeSlow, inv2, 1000);
+    sched.AskFor(&nodeFast, inv2, 1000);
+
+    // The slow peer asks first but the block is held for the fast one
+    vector<CInv> vRequest;
+    sched.GetRequests(&nodeSlow, 1000, vRequest);
+    BOOST_CHECK(vRequest.empty());
+    sched.GetRequests(&nodeFast, 1000, vRequest);
+    BOOST_CHECK_EQUAL(vRequest.size(), 2U);
+    sched.Received(inv1);
+    sched.Received(inv2);
+
+    // If the fast peer doesn't take it, the slow one gets it after a moment
+    CInv inv3(MSG_BLOCK, uint256(3));
+    sched.AskFor(&nodeSlow, inv3, 2000);
+    sched.AskFor(&nodeFast, inv3, 2000);
+    vRequest.clear();
+    sched.GetRequests(&nodeSlow, 2000, vRequest);
+    BOOST_CHECK(vRequest.empty());
+    sched.GetRequests(&nodeSlow, 2000 + CDownloadScheduler::BLOCK_PREFER_WAIT, vRequest);
+    BOOST_CHECK_EQUAL(vRequest.size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(download_limits)
+{
+    CDownloadScheduler sched;
+    CNode node1(INVALID_SOCKET, PeerAddress(1), true);
+
+    for (int i = 0; i < CDownloadScheduler::MAX_PEER_QUEUE + 100; i++)
+        sched.AskFor(&node1, TxInv(i + 1), 1000);
+    BOOST_CHECK_EQUAL(sched.size(), (int)CDownloadScheduler::MAX_PEER_QUEUE);
+
+    vector<CInv> vRequest;
+    sched.GetRequests(&node1, 1000, vRequest);
+    BOOST_CHECK_EQUAL(vRequest.size(), (size_t)CDownloadScheduler::MAX_PEER_IN_FLIGHT);
+
+    // Nothing more until some of those arrive
+    vRequest.clear();
+    sched.GetRequests(&node1, 1000, vRequest);
+    BOOST_CHECK(vRequest.empty());
+
+    sched.Received(TxInv(1));
+    sched.GetRequests(&node1, 1000, vRequest);
+    BOOST_CHECK_EQUAL(vRequest.size(), 1U);
+
+    // Every announcement beyond MAX_ANNOUNCERS is dropped
+    vector<CNode*> vPeers;
+    for (int i = 0; i < CDownloadScheduler::MAX_ANNOUNCERS + 2; i++)
+    {
+        vPeers.push_back(new CNode(INVALID_SOCKET, PeerAddress(10 + i), true));
+        sched.AskFor(vPeers.back(), TxInv(999999), 1000);
+    }
+    for (int i = 0; i < (int)vPeers.size(); i++)
+    {
+        vRequest.clear();
+        sched.GetRequests(vPeers[i], 1000 + i * CDownloadScheduler::TX_TIMEOUT, vRequest);
+        BOOST_CHECK_EQUAL(vRequest.size(), i < CDownloadScheduler::MAX_ANNOUNCERS ? 1U : 0U);
+    }
+    BOOST_FOREACH(CNode* pnode, vPeers)
+        delete pnode;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
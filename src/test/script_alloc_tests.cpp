@@ -0,0 +1,159 @@
+#include <boost/test/unit_test.hpp>
+
+#include <new>
+#include <cstdlib>
+
+#include "keystore.h"
+#include "main.h"
+#include "script.h"
+#include "wallet.h"
+
+using namespace std;
+
+extern bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                         bool fValidatePayToScriptHash, int nHashType);
+
+// Count every operator new made while fCountAllocs is set.  OpenSSL gets its
+// memory from malloc, so only the allocations our own code makes show up.
+static bool fCountAllocs = false;
+static int nAllocs = 0;
+
+// C++17 no longer allows dynamic exception specifications
+#if __cplusplus < 201103L
+#define NEW_THROWS throw(std::bad_alloc)
+#define DELETE_NOTHROW throw()
+#else
+#define NEW_THROWS
+#define DELETE_NOTHROW noexcept
+#endif
+
+void* operator new(size_t n) NEW_THROWS
+{
+    if (fCountAllocs)
+        nAllocs++;
+    void* p = malloc(n ? n : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t n) NEW_THROWS
+{
+    return operator new(n);
+}
+
+void operator delete(void* p) DELETE_NOTHROW
+{
+    free(p);
+}
+
+void operator delete[](void* p) DELETE_NOTHROW
+{
+    free(p);
+}
+
+static int CountVerifyAllocs(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, bool fExpected)
+{
+    // The first run warms up this thread's script arena
+    BOOST_CHECK(VerifyScript(scriptSig, scriptPubKey, txTo, 0, true, 0) == fExpected);
+
+    nAllocs = 0;
+    fCountAllocs = true;
+    bool fResult = VerifyScript(scriptSig, scriptPubKey, txTo, 0, true, 0);
+    fCountAllocs = false;
+    BOOST_CHECK(fResult == fExpected);
+    return nAllocs;
+}
+
+static int CountSignatureHashAllocs(const CScript& scriptCode, const CTransaction& txTo)
+{
+    nAllocs = 0;
+    fCountAllocs = true;
+    CSignatureHasher hasher(txTo);
+    hasher.SignatureHash(scriptCode, 0, SIGHASH_ALL);
+    fCountAllocs = false;
+    return nAllocs;
+}
+
+static CTransaction SpendingTx(const CTransaction& txFrom)
+{
+    CTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vin[0].prevout.hash = txFrom.GetHash();
+    txTo.vin[0].prevout.n = 0;
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = 1;
+    return txTo;
+}
+
+BOOST_AUTO_TEST_SUITE(script_alloc_tests)
+
+BOOST_AUTO_TEST_CASE(script_alloc_templates)
+{
+    // Empty signatures fail before any hashing, which leaves the interpreter
+    // itself: it must not allocate on any of the standard templates
+    CKey key[3];
+    vector<CKey> keys;
+    for (int i = 0; i < 3; i++)
+    {
+        key[i].MakeNewKey(true);
+        keys.push_back(key[i]);
+    }
+    CTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vout.resize(1);
+
+    CScript scriptPubKeyHash;
+    scriptPubKeyHash.SetBitcoinAddress(key[0].GetPubKey());
+    CScript scriptSig;
+    scriptSig << OP_0 << key[0].GetPubKey();
+    BOOST_CHECK_EQUAL(CountVerifyAllocs(scriptSig, scriptPubKeyHash, txTo, false), 0);
+
+    CScript scriptMultisig;
+    scriptMultisig.SetMultisig(2, keys);
+    scriptSig.clear();
+    scriptSig << OP_0 << OP_0 << OP_0;
+    BOOST_CHECK_EQUAL(CountVerifyAllocs(scriptSig, scriptMultisig, txTo, false), 0);
+
+    // The redeem script is too long to be held inline
+    CScript scriptHash;
+    scriptHash.SetPayToScriptHash(scriptMultisig);
+    scriptSig << static_cast<vector<unsigned char> >(scriptMultisig);
+    BOOST_CHECK(scriptMultisig.size() > 75);
+    BOOST_CHECK_EQUAL(CountVerifyAllocs(scriptSig, scriptHash, txTo, false), 0);
+}
+
+BOOST_AUTO_TEST_CASE(script_alloc_signed)
+{
+    // With real signatures the only allocations left are the signature
+    // hasher's, which are made once however many signatures get checked
+    CBasicKeyStore keystore;
+    CKey key[3];
+    vector<CKey> keys;
+    for (int i = 0; i < 3; i++)
+    {
+        key[i].MakeNewKey(true);
+        keystore.AddKey(key[i]);
+        keys.push_back(key[i]);
+    }
+
+    CTransaction txFrom;
+    txFrom.vout.resize(1);
+    txFrom.vout[0].scriptPubKey.SetBitcoinAddress(key[0].GetPubKey());
+    CTransaction txTo = SpendingTx(txFrom);
+    BOOST_CHECK(SignSignature(keystore, txFrom, txTo, 0));
+    const CScript& scriptPubKey = txFrom.vout[0].scriptPubKey;
+    BOOST_CHECK_EQUAL(CountVerifyAllocs(txTo.vin[0].scriptSig, scriptPubKey, txTo, true),
+                      CountSignatureHashAllocs(scriptPubKey, txTo));
+
+    txFrom.vout[0].scriptPubKey.SetMultisig(2, keys);
+    txTo = SpendingTx(txFrom);
+    BOOST_CHECK(SignSignature(keystore, txFrom, txTo, 0));
+    uint64 nSigChecksStart = nSigChecks;
+    int nVerifyAllocs = CountVerifyAllocs(txTo.vin[0].scriptSig, scriptPubKey, txTo, true);
+    int nChecks = (nSigChecks - nSigChecksStart) / 2;
+    BOOST_CHECK(nChecks >= 2);
+    BOOST_CHECK_EQUAL(nVerifyAllocs, CountSignatureHashAllocs(scriptPubKey, txTo));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
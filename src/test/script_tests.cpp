@@ -169,5 +169,335 @@ BOOST_AUTO_TEST_CASE(script_CHECKMULTISIG23)
     BOOST_CHECK(!VerifyScript(badsig6, scriptPubKey23, txTo23, 0, true, 0));
 }    
 
+BOOST_AUTO_TEST_CASE(script_Decode)
+{
+    // Decode() must agree with GetOp() on every instruction, including
+    // scripts cut off part way through a push
+    for (int i = 0; i < 2000; i++)
+    {
+        CScript script;
+        int nOps = GetRandInt(10);
+        for (int j = 0; j < nOps; j++)
+        {
+            switch (GetRandInt(4))
+            {
+            case 0: script << (opcodetype)GetRandInt(0x100); break;
+            case 1: script << vector<unsigned char>(GetRandInt(80), 0x5a); break;
+            case 2: script << vector<unsigned char>(GetRandInt(600), 0xa5); break;
+            case 3: script.insert(script.end(), OP_PUSHDATA4); break;
+            }
+        }
+        if (!script.empty() && GetRandInt(2))
+            script.resize(GetRandInt(script.size()));
+
+        vector<CScriptOp> vOps;
+        bool fComplete = script.Decode(vOps);
+        CScript::const_iterator pc = script.begin();
+        opcodetype opcode;
+        vector<unsigned char> vch;
+        unsigned int n = 0;
+        bool fGetOp = true;
+        while (pc < script.end() && (fGetOp = script.GetOp(pc, opcode, vch)))
+        {
+            BOOST_REQUIRE(n < vOps.size());
+            BOOST_CHECK_EQUAL(vOps[n].opcode, opcode);
+            BOOST_CHECK(vch == vector<unsigned char>(script.begin() + vOps[n].nDataOffset, script.begin() + vOps[n].End()));
+            BOOST_CHECK(script.begin() + vOps[n].End() == pc);
+            n++;
+        }
+        BOOST_CHECK_EQUAL(n, vOps.size());
+        BOOST_CHECK_EQUAL(fComplete, fGetOp);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(script_FindAndDelete)
+{
+    vector<unsigned char> vchSig(72, 0x30);
+    CScript scriptSig;
+    scriptSig << vchSig;
+
+    CScript script;
+    script << vchSig << OP_CHECKSIG << vchSig << vchSig << OP_1 << vchSig;
+    BOOST_CHECK_EQUAL(script.FindAndDelete(scriptSig), 4);
+    BOOST_CHECK(script == CScript() << OP_CHECKSIG << OP_1);
+
+    // Only whole instructions match, not the same bytes inside a push
+    CScript scriptInner;
+    scriptInner << static_cast<vector<unsigned char> >(scriptSig);
+    CScript scriptCopy = scriptInner;
+    BOOST_CHECK_EQUAL(scriptInner.FindAndDelete(scriptSig), 0);
+    BOOST_CHECK(scriptInner == scriptCopy);
+
+    // An unparseable tail is kept
+    script = CScript() << vchSig << OP_NOP;
+    script.insert(script.end(), OP_PUSHDATA1);
+    BOOST_CHECK_EQUAL(script.FindAndDelete(scriptSig), 1);
+    CScript scriptTail;
+    scriptTail << OP_NOP;
+    scriptTail.insert(scriptTail.end(), OP_PUSHDATA1);
+    BOOST_CHECK(script == scriptTail);
+}
+
+// The same script with every push spelled out with opPush instead of the
+// shortest encoding, which only the template scan in Solver() recognizes
+static CScript ReencodePushes(const CScript& script, opcodetype opPush)
+{
+    CScript scriptRet;
+    CScript::const_iterator pc = script.begin();
+    opcodetype opcode;
+    vector<unsigned char> vch;
+    while (script.GetOp(pc, opcode, vch))
+    {
+        if (opcode == 0 || opcode > OP_PUSHDATA4)
+        {
+            scriptRet << opcode;
+            continue;
+        }
+        unsigned int nSize = vch.size();
+        scriptRet.insert(scriptRet.end(), (unsigned char)opPush);
+        scriptRet.insert(scriptRet.end(), (unsigned char*)&nSize, (unsigned char*)&nSize + (opPush == OP_PUSHDATA1 ? 1 : opPush == OP_PUSHDATA2 ? 2 : 4));
+        scriptRet.insert(scriptRet.end(), vch.begin(), vch.end());
+    }
+    return scriptRet;
+}
+
+BOOST_AUTO_TEST_CASE(script_Solver)
+{
+    vector<CKey> keys(17);
+    for (int i = 0; i < 17; i++)
+        keys[i].MakeNewKey(i % 2);
+
+    vector<CScript> vScripts;
+    CScript script;
+    for (int i = 0; i < 2; i++)
+    {
+        vScripts.push_back(CScript() << keys[i].GetPubKey() << OP_CHECKSIG);
+        script.SetBitcoinAddress(keys[i].GetPubKey());
+        vScripts.push_back(script);
+    }
+    for (int n = 1; n <= 17; n++)
+    {
+        for (int m = 0; m <= n + 1; m += (n < 4 ? 1 : n))
+        {
+            script.clear();
+            script << CScript::EncodeOP_N(min(m, 16));
+            for (int i = 0; i < n; i++)
+                script << keys[i].GetPubKey();
+            script << CScript::EncodeOP_N(min(n, 16)) << OP_CHECKMULTISIG;
+            vScripts.push_back(script);
+        }
+    }
+    script.SetPayToScriptHash(vScripts.back());
+    vScripts.push_back(script);
+    vScripts.push_back(CScript() << OP_1 << keys[0].GetPubKey() << OP_1);
+    vScripts.push_back(CScript() << OP_1 << OP_CHECKMULTISIG);
+    vScripts.push_back(CScript() << vector<unsigned char>(20) << OP_CHECKSIG);
+
+    BOOST_FOREACH(const CScript& script, vScripts)
+    {
+        txnouttype whichType;
+        vector<vector<unsigned char> > vSolutions;
+        bool fSolved = Solver(script, whichType, vSolutions);
+        if (whichType == TX_SCRIPTHASH)
+            continue;
+
+        static const opcodetype opPush[] = { OP_PUSHDATA1, OP_PUSHDATA2, OP_PUSHDATA4 };
+        for (int i = 0; i < 3; i++)
+        {
+            CScript scriptLong = ReencodePushes(script, opPush[i]);
+            txnouttype whichType2;
+            vector<vector<unsigned char> > vSolutions2;
+            BOOST_CHECK_EQUAL(Solver(scriptLong, whichType2, vSolutions2), fSolved);
+            BOOST_CHECK_EQUAL(whichType2, whichType);
+            BOOST_CHECK(vSolutions2 == vSolutions);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(script_CSignatureBatch)
+{
+    CBasicKeyStore keystore;
+    CKey key[4];
+    for (int i = 0; i < 4; i++)
+    {
+        key[i].MakeNewKey(i % 2 == 0);
+        keystore.AddKey(key[i]);
+    }
+
+    // Pay to address and to pubkey end in OP_CHECKSIG and are put off;
+    // CHECKMULTISIG, and a CHECKSIG whose result is used, are not
+    CTransaction txFrom;
+    txFrom.vout.resize(4);
+    txFrom.vout[0].scriptPubKey.SetBitcoinAddress(key[0].GetPubKey());
+    txFrom.vout[1].scriptPubKey << key[1].GetPubKey() << OP_CHECKSIG;
+    txFrom.vout[2].scriptPubKey << OP_1 << key[2].GetPubKey() << key[3].GetPubKey() << OP_2 << OP_CHECKMULTISIG;
+    txFrom.vout[3].scriptPubKey << key[3].GetPubKey() << OP_CHECKSIG << OP_NOT;
+
+    CTransaction txTo;
+    txTo.vin.resize(4);
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = 1;
+    for (int i = 0; i < 4; i++)
+    {
+        txTo.vin[i].prevout.hash = txFrom.GetHash();
+        txTo.vin[i].prevout.n = i;
+    }
+    for (int i = 0; i < 3; i++)
+        BOOST_CHECK(SignSignature(keystore, txFrom, txTo, i));
+
+    // The last one passes with a good signature for some other hash
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(key[3].Sign(0, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    txTo.vin[3].scriptSig << vchSig;
+
+    CSignatureBatch batch;
+    CSignatureHasher hasher(txTo);
+    for (int i = 0; i < 4; i++)
+    {
+        batch.SetInput(txTo.GetHash(), i);
+        BOOST_CHECK(VerifySignature(txFrom, hasher, i, true, 0, &batch));
+    }
+    BOOST_CHECK_EQUAL(batch.size(), 2U);
+    uint256 hashTxBad;
+    unsigned int nInBad;
+    BOOST_CHECK(batch.Verify(hashTxBad, nInBad));
+
+    // Changing an output breaks every signature, but the ones put off only
+    // show up in the batch, charged to the first input that had one
+    txTo.vout[0].nValue = 2;
+    CSignatureBatch batch2;
+    CSignatureHasher hasher2(txTo);
+    for (int i = 0; i < 4; i++)
+    {
+        batch2.SetInput(txTo.GetHash(), i);
+        BOOST_CHECK_EQUAL(VerifySignature(txFrom, hasher2, i, true, 0, &batch2), i != 2);
+        BOOST_CHECK(VerifySignature(txFrom, hasher2, i, true, 0) == (i == 3));
+    }
+    BOOST_CHECK(!batch2.Verify(hashTxBad, nInBad));
+    BOOST_CHECK(hashTxBad == txTo.GetHash());
+    BOOST_CHECK_EQUAL(nInBad, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(script_CheckSig_BER)
+{
+    // Encodings older OpenSSL took pass, whether or not the key is cached
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+
+    CTransaction txFrom;
+    txFrom.vout.resize(1);
+    txFrom.vout[0].scriptPubKey << key.GetPubKey() << OP_CHECKSIG;
+    CTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vin[0].prevout.hash = txFrom.GetHash();
+    txTo.vin[0].prevout.n = 0;
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = 1;
+
+    uint256 hash = SignatureHash(txFrom.vout[0].scriptPubKey, txTo, 0, SIGHASH_ALL);
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back(0x00);
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    txTo.vin[0].scriptSig << vchSig;
+    pubkeycache.clear();
+    BOOST_CHECK(VerifySignature(txFrom, txTo, 0, true, 0));
+    BOOST_CHECK(VerifySignature(txFrom, txTo, 0, true, 0));
+
+    // and are checked where they run rather than put in a batch
+    CSignatureBatch batch;
+    CSignatureHasher hasher(txTo);
+    batch.SetInput(txTo.GetHash(), 0);
+    BOOST_CHECK(VerifySignature(txFrom, hasher, 0, true, 0, &batch));
+    BOOST_CHECK_EQUAL(batch.size(), 0U);
+    txTo.vout[0].nValue = 2;
+    CSignatureHasher hasher2(txTo);
+    BOOST_CHECK(!VerifySignature(txFrom, hasher2, 0, true, 0, &batch));
+    BOOST_CHECK_EQUAL(batch.size(), 0U);
+
+    // Nothing either of them reads fails
+    vector<unsigned char> vchBad(vchSig.size(), 0x30);
+    txTo.vin[0].scriptSig = CScript() << vchBad;
+    BOOST_CHECK(!VerifySignature(txFrom, txTo, 0, true, 0));
+}
+
+BOOST_AUTO_TEST_CASE(script_CPubKeyCache)
+{
+    CPubKeyCache cache(3);
+    vector<vector<unsigned char> > vPubKeys;
+    for (int i = 0; i < 5; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        vPubKeys.push_back(key.GetPubKey());
+    }
+
+    // Whatever comes out of the cache is what parsing gives
+    CSecp256k1PubKey pubkey, pubkeyParsed;
+    for (int i = 0; i < 3; i++)
+    {
+        BOOST_CHECK(cache.Get(&vPubKeys[i][0], vPubKeys[i].size(), pubkey));
+        BOOST_CHECK(pubkeyParsed.SetPubKey(&vPubKeys[i][0], vPubKeys[i].size()));
+        BOOST_CHECK(memcmp(&pubkey, &pubkeyParsed, sizeof(pubkey)) == 0);
+    }
+    BOOST_CHECK_EQUAL(cache.size(), 3U);
+    BOOST_CHECK(cache.Get(&vPubKeys[1][0], vPubKeys[1].size(), pubkey));
+    BOOST_CHECK(pubkeyParsed.SetPubKey(&vPubKeys[1][0], vPubKeys[1].size()));
+    BOOST_CHECK(memcmp(&pubkey, &pubkeyParsed, sizeof(pubkey)) == 0);
+    BOOST_CHECK_EQUAL(cache.size(), 3U);
+
+    // Keys that don't parse aren't kept
+    vector<unsigned char> vchBad(vPubKeys[0]);
+    vchBad[0] = 0x05;
+    BOOST_CHECK(!cache.Get(&vchBad[0], vchBad.size(), pubkey));
+    vchBad.push_back(0);
+    BOOST_CHECK(!cache.Get(&vchBad[0], vchBad.size(), pubkey));
+    BOOST_CHECK_EQUAL(cache.size(), 3U);
+
+    // New keys push old ones out rather than growing the cache
+    for (int i = 0; i < 5; i++)
+    {
+        BOOST_CHECK(cache.Get(&vPubKeys[i][0], vPubKeys[i].size(), pubkey));
+        BOOST_CHECK(pubkeyParsed.SetPubKey(&vPubKeys[i][0], vPubKeys[i].size()));
+        BOOST_CHECK(memcmp(&pubkey, &pubkeyParsed, sizeof(pubkey)) == 0);
+        BOOST_CHECK_EQUAL(cache.size(), 3U);
+    }
+
+    cache.clear();
+    BOOST_CHECK_EQUAL(cache.size(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(script_CScriptCheckCache)
+{
+    CScriptCheckCache cache(4);
+    uint256 hashTx1 = 1, hashTx2 = 2;
+
+    cache.Insert(hashTx1, 0, true);
+    BOOST_CHECK(cache.Contains(hashTx1, 0, true));
+    BOOST_CHECK(!cache.Contains(hashTx1, 0, false));
+    BOOST_CHECK(!cache.Contains(hashTx1, 1, true));
+    BOOST_CHECK(!cache.Contains(hashTx2, 0, true));
+
+    cache.Insert(hashTx1, 1, true);
+    cache.Erase(hashTx1, 0, true);
+    BOOST_CHECK(!cache.Contains(hashTx1, 0, true));
+    BOOST_CHECK(cache.Contains(hashTx1, 1, true));
+    BOOST_CHECK_EQUAL(cache.size(), 1U);
+
+    // Full, it drops an entry for each one it takes
+    for (unsigned int i = 0; i < 10; i++)
+    {
+        cache.Insert(hashTx2, i, true);
+        BOOST_CHECK(cache.Contains(hashTx2, i, true));
+        BOOST_CHECK(cache.size() <= 4);
+    }
+    BOOST_CHECK_EQUAL(cache.size(), 4U);
+
+    cache.clear();
+    BOOST_CHECK_EQUAL(cache.size(), 0U);
+}
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,223 @@
+#include <vector>
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "main.h"
+#include "wallet.h"
+
+using namespace std;
+
+typedef vector<unsigned char> valtype;
+
+// The interpreter used to do its arithmetic with CBigNum.  These tests check
+// CScriptNum against the old code: the same bytes in, the same bytes out.
+
+// What CastToBigNum() did: decode, dropping any extra leading zeros
+static CBigNum OldCast(const valtype& vch)
+{
+    return CBigNum(CBigNum(vch).getvch());
+}
+
+static valtype OldUnary(opcodetype opcode, const valtype& vch)
+{
+    static const CBigNum bnZero(0);
+    static const CBigNum bnOne(1);
+    CBigNum bn = OldCast(vch);
+    switch (opcode)
+    {
+    case OP_1ADD:       bn += bnOne; break;
+    case OP_1SUB:       bn -= bnOne; break;
+    case OP_NEGATE:     bn = -bn; break;
+    case OP_ABS:        if (bn < bnZero) bn = -bn; break;
+    case OP_NOT:        bn = (bn == bnZero); break;
+    case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+    default:            BOOST_ERROR("OldUnary() : invalid opcode"); break;
+    }
+    return bn.getvch();
+}
+
+static valtype OldBinary(opcodetype opcode, const valtype& vch1, const valtype& vch2)
+{
+    static const CBigNum bnZero(0);
+    CBigNum bn1 = OldCast(vch1);
+    CBigNum bn2 = OldCast(vch2);
+    CBigNum bn;
+    switch (opcode)
+    {
+    case OP_ADD:                 bn = bn1 + bn2; break;
+    case OP_SUB:                 bn = bn1 - bn2; break;
+    case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
+    case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
+    case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
+    case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
+    case OP_LESSTHAN:            bn = (bn1 < bn2); break;
+    case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
+    case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
+    case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
+    case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
+    case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
+    default:                     BOOST_ERROR("OldBinary() : invalid opcode"); break;
+    }
+    return bn.getvch();
+}
+
+// Runs the pushes followed by opcode, returning false if the script fails
+static bool Eval(const vector<valtype>& vArgs, opcodetype opcode, vector<valtype>& stack)
+{
+    CScript script;
+    BOOST_FOREACH(const valtype& vch, vArgs)
+        script << vch;
+    script << opcode;
+    stack.clear();
+    return EvalScript(stack, script, CTransaction(), 0, 0);
+}
+
+// Boundary values, plus encodings CBigNum accepted that aren't minimal:
+// negative zero and padding with zero bytes
+static vector<valtype> Operands()
+{
+    static const int64 values[] = {
+        0, 1, -1, 2, -2, 127, -127, 128, -128, 255, -255, 256, -256,
+        0x7fff, -0x7fff, 0x8000, -0x8000, 0xffff, -0xffff,
+        0x7fffff, -0x7fffff, 0x800000, -0x800000,
+        0x7fffffff, -0x7fffffff,
+    };
+    vector<valtype> vOperands;
+    for (unsigned int i = 0; i < sizeof(values)/sizeof(values[0]); i++)
+        vOperands.push_back(CBigNum(values[i]).getvch());
+
+    static const unsigned char pchOdd[][4] = {
+        { 0x80 }, { 0x00, 0x80 }, { 0x00, 0x00, 0x00, 0x80 },
+        { 0x00 }, { 0x01, 0x00 }, { 0x81, 0x00, 0x00, 0x80 }, { 0xff, 0x00, 0x00, 0x00 },
+    };
+    static const unsigned int nOddSize[] = { 1, 2, 4, 1, 2, 4, 4 };
+    for (unsigned int i = 0; i < sizeof(nOddSize)/sizeof(nOddSize[0]); i++)
+        vOperands.push_back(valtype(pchOdd[i], pchOdd[i] + nOddSize[i]));
+    return vOperands;
+}
+
+BOOST_AUTO_TEST_SUITE(scriptnum_tests)
+
+BOOST_AUTO_TEST_CASE(scriptnum_encoding)
+{
+    // Every one and two byte encoding, and a random sample of longer ones
+    vector<valtype> vTests;
+    vTests.push_back(valtype());
+    for (int i = 0; i < 0x100; i++)
+        vTests.push_back(valtype(1, i));
+    for (int i = 0; i < 0x10000; i++)
+    {
+        valtype vch(2);
+        vch[0] = i & 0xff;
+        vch[1] = i >> 8;
+        vTests.push_back(vch);
+    }
+    for (int i = 0; i < 100000; i++)
+    {
+        valtype vch(3 + i % 2);
+        for (unsigned int j = 0; j < vch.size(); j++)
+            vch[j] = GetRandInt(0x100);
+        vTests.push_back(vch);
+    }
+
+    BOOST_FOREACH(const valtype& vch, vTests)
+    {
+        CScriptNum num(vch);
+        CBigNum bn = OldCast(vch);
+        BOOST_CHECK(num.getvch() == bn.getvch());
+        BOOST_CHECK_EQUAL(num.getint(), bn.getint());
+        if (!vch.empty())
+            BOOST_CHECK(CScriptNum(&vch[0], &vch[0] + vch.size()).getvch() == bn.getvch());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(scriptnum_overflow)
+{
+    // Operands are limited to four bytes, however they're padded
+    BOOST_CHECK_NO_THROW(CScriptNum(valtype(4, 0xff)));
+    BOOST_CHECK_THROW(CScriptNum(valtype(5, 0)), scriptnum_error);
+    BOOST_CHECK_THROW(CScriptNum(CBigNum(0x80000000LL).getvch()), scriptnum_error);
+    BOOST_CHECK_THROW(CScriptNum(CBigNum(-0x80000000LL).getvch()), scriptnum_error);
+
+    // Results can be a byte longer, and encode the same as CBigNum
+    CScriptNum numMax(0x7fffffff);
+    CScriptNum numOne(1);
+    BOOST_CHECK((numMax + numOne).getvch() == CBigNum(0x80000000LL).getvch());
+    BOOST_CHECK((-numMax - numMax).getvch() == CBigNum(-0xfffffffeLL).getvch());
+    BOOST_CHECK_EQUAL((numMax + numOne).getint(), numeric_limits<int>::max());
+    BOOST_CHECK_EQUAL((-numMax - numMax).getint(), numeric_limits<int>::min());
+}
+
+BOOST_AUTO_TEST_CASE(scriptnum_eval)
+{
+    // Every numeric opcode over every operand (pair, triple) against what the
+    // CBigNum interpreter produced
+    static const opcodetype unary[] = { OP_1ADD, OP_1SUB, OP_NEGATE, OP_ABS, OP_NOT, OP_0NOTEQUAL };
+    static const opcodetype binary[] = {
+        OP_ADD, OP_SUB, OP_BOOLAND, OP_BOOLOR, OP_NUMEQUAL, OP_NUMNOTEQUAL, OP_LESSTHAN,
+        OP_GREATERTHAN, OP_LESSTHANOREQUAL, OP_GREATERTHANOREQUAL, OP_MIN, OP_MAX,
+    };
+    vector<valtype> vOperands = Operands();
+    vector<valtype> stack;
+
+    BOOST_FOREACH(const valtype& vch1, vOperands)
+    {
+        for (unsigned int i = 0; i < sizeof(unary)/sizeof(unary[0]); i++)
+        {
+            BOOST_CHECK(Eval(vector<valtype>(1, vch1), unary[i], stack));
+            BOOST_CHECK(stack == vector<valtype>(1, OldUnary(unary[i], vch1)));
+        }
+
+        BOOST_FOREACH(const valtype& vch2, vOperands)
+        {
+            vector<valtype> vArgs;
+            vArgs.push_back(vch1);
+            vArgs.push_back(vch2);
+            for (unsigned int i = 0; i < sizeof(binary)/sizeof(binary[0]); i++)
+            {
+                BOOST_CHECK(Eval(vArgs, binary[i], stack));
+                BOOST_CHECK(stack == vector<valtype>(1, OldBinary(binary[i], vch1, vch2)));
+            }
+
+            // NUMEQUALVERIFY leaves nothing behind, or fails
+            bool fEqual = (OldCast(vch1) == OldCast(vch2));
+            BOOST_CHECK(Eval(vArgs, OP_NUMEQUALVERIFY, stack) == fEqual);
+
+            BOOST_FOREACH(const valtype& vch3, vOperands)
+            {
+                vArgs.resize(2);
+                vArgs.push_back(vch3);
+                bool fWithin = (OldCast(vch2) <= OldCast(vch1) && OldCast(vch1) < OldCast(vch3));
+                BOOST_CHECK(Eval(vArgs, OP_WITHIN, stack));
+                BOOST_CHECK(stack == vector<valtype>(1, fWithin ? valtype(1, 1) : valtype()));
+            }
+        }
+    }
+
+    // Results that grew to five bytes can't be used as operands
+    vector<valtype> vArgs;
+    vArgs.push_back(CBigNum(0x7fffffff).getvch());
+    BOOST_CHECK(Eval(vArgs, OP_1ADD, stack));
+    BOOST_CHECK(stack[0] == CBigNum(0x80000000LL).getvch());
+    vArgs = stack;
+    BOOST_CHECK(!Eval(vArgs, OP_1ADD, stack));
+
+    // Small integer opcodes, OP_DEPTH and OP_SIZE push minimal encodings too
+    for (int n = -1; n <= 16; n++)
+    {
+        if (n == 0)
+            continue;
+        CScript script;
+        script << n;
+        BOOST_CHECK(EvalScript(stack, script, CTransaction(), 0, 0));
+        BOOST_CHECK(stack.back() == CBigNum(n).getvch());
+    }
+    vArgs.assign(200, valtype());
+    BOOST_CHECK(Eval(vArgs, OP_DEPTH, stack));
+    BOOST_CHECK(stack.back() == CBigNum(200).getvch());
+    vArgs.assign(1, valtype(200, 0x5a));
+    BOOST_CHECK(Eval(vArgs, OP_SIZE, stack));
+    BOOST_CHECK(stack.back() == CBigNum(200).getvch());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
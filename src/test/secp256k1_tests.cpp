@@ -0,0 +1,454 @@
+#include <vector>
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/rand.h>
+
+#include "key.h"
+#include "secp256k1.h"
+#include "util.h"
+
+using namespace std;
+
+// Big endian group order
+static const unsigned char pchOrder[32] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfe,
+    0xba, 0xae, 0xdc, 0xe6, 0xaf, 0x48, 0xa0, 0x3b,
+    0xbf, 0xd2, 0x5e, 0x8c, 0xd0, 0x36, 0x41, 0x41,
+};
+
+static uint256 RandomHash()
+{
+    uint256 hash;
+    RAND_bytes((unsigned char*)&hash, sizeof(hash));
+    return hash;
+}
+
+// Verify and VerifyOpenSSL must agree on strict DER signatures, the ones
+// every OpenSSL release reads the same way; returns Verify's answer
+static bool CheckBoth(CKey& key, uint256 hash, const vector<unsigned char>& vchSig)
+{
+    bool fSecp256k1 = key.Verify(hash, vchSig);
+    if (!vchSig.empty() && Secp256k1IsStrictSignature(&vchSig[0], vchSig.size()))
+    {
+        bool fOpenSSL = key.VerifyOpenSSL(hash, &vchSig[0], vchSig.size());
+        BOOST_CHECK_MESSAGE(fOpenSSL == fSecp256k1, HexStr(vchSig) + " " + hash.ToString());
+    }
+    return fSecp256k1;
+}
+
+// DER INTEGER from 32 big endian bytes, minimally encoded unless nPad extra
+// zero bytes are asked for
+static void PushInteger(vector<unsigned char>& vch, const unsigned char* pch32, int nPad = 0)
+{
+    int nSkip = 0;
+    while (nSkip < 31 && pch32[nSkip] == 0)
+        nSkip++;
+    vector<unsigned char> vchInt(nPad, 0);
+    if (pch32[nSkip] & 0x80)
+        vchInt.push_back(0);
+    vchInt.insert(vchInt.end(), pch32 + nSkip, pch32 + 32);
+    vch.push_back(0x02);
+    vch.push_back(vchInt.size());
+    vch.insert(vch.end(), vchInt.begin(), vchInt.end());
+}
+
+static vector<unsigned char> EncodeSig(const unsigned char* pchR, const unsigned char* pchS, int nPadR = 0, int nPadS = 0)
+{
+    vector<unsigned char> vchBody;
+    PushInteger(vchBody, pchR, nPadR);
+    PushInteger(vchBody, pchS, nPadS);
+    vector<unsigned char> vch;
+    vch.push_back(0x30);
+    vch.push_back(vchBody.size());
+    vch.insert(vch.end(), vchBody.begin(), vchBody.end());
+    return vch;
+}
+
+// Tag, length bytes and content
+static vector<unsigned char> BER(unsigned char chTag, const vector<unsigned char>& vchLen, const vector<unsigned char>& vchContent)
+{
+    vector<unsigned char> vch(1, chTag);
+    vch.insert(vch.end(), vchLen.begin(), vchLen.end());
+    vch.insert(vch.end(), vchContent.begin(), vchContent.end());
+    return vch;
+}
+
+// A length in the short form, or the long form in nBytes bytes
+static vector<unsigned char> Length(unsigned int nLen, int nBytes = 0)
+{
+    vector<unsigned char> vch;
+    if (nBytes == 0)
+        vch.push_back(nLen);
+    else
+    {
+        vch.push_back(0x80 | nBytes);
+        for (int i = nBytes - 1; i >= 0; i--)
+            vch.push_back(i < 4 ? (nLen >> (8 * i)) & 0xff : 0);
+    }
+    return vch;
+}
+
+static vector<unsigned char> operator+(vector<unsigned char> a, const vector<unsigned char>& b)
+{
+    a.insert(a.end(), b.begin(), b.end());
+    return a;
+}
+
+// Pulls r and s back out of a DER signature made by Sign()
+static void DecodeSig(const vector<unsigned char>& vchSig, unsigned char* pchR, unsigned char* pchS)
+{
+    unsigned int nLenR = vchSig[3];
+    unsigned int nLenS = vchSig[5 + nLenR];
+    const unsigned char* pR = &vchSig[4];
+    const unsigned char* pS = &vchSig[6 + nLenR];
+    if (nLenR == 33) { pR++; nLenR--; }
+    if (nLenS == 33) { pS++; nLenS--; }
+    memset(pchR, 0, 32);
+    memset(pchS, 0, 32);
+    memcpy(pchR + 32 - nLenR, pR, nLenR);
+    memcpy(pchS + 32 - nLenS, pS, nLenS);
+}
+
+// n - a, for big endian a
+static void NegateMod(unsigned char* pchOut, const unsigned char* pch)
+{
+    int nBorrow = 0;
+    for (int i = 31; i >= 0; i--)
+    {
+        int d = pchOrder[i] - pch[i] - nBorrow;
+        nBorrow = d < 0;
+        pchOut[i] = d & 0xff;
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(secp256k1_tests)
+
+BOOST_AUTO_TEST_CASE(secp256k1_random)
+{
+    for (int i = 0; i < 200; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        uint256 hash = RandomHash();
+        vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(hash, vchSig));
+        BOOST_CHECK(CheckBoth(key, hash, vchSig));
+
+        // A key that only has the public half
+        CKey keyPub;
+        BOOST_CHECK(keyPub.SetPubKey(key.GetPubKey()));
+        BOOST_CHECK(CheckBoth(keyPub, hash, vchSig));
+
+        // Another hash, another key
+        uint256 hash2 = hash;
+        ((unsigned char*)&hash2)[GetRandInt(32)] ^= 1 << GetRandInt(8);
+        BOOST_CHECK(!CheckBoth(keyPub, hash2, vchSig));
+        CKey key2;
+        key2.MakeNewKey(i % 3 == 0);
+        BOOST_CHECK(!CheckBoth(key2, hash, vchSig));
+
+        // Damaged signatures, mostly failing to parse
+        for (int j = 0; j < 10; j++)
+        {
+            vector<unsigned char> vchBad(vchSig);
+            vchBad[GetRandInt(vchBad.size())] ^= 1 << GetRandInt(8);
+            CheckBoth(keyPub, hash, vchBad);
+        }
+        vector<unsigned char> vchLong(vchSig);
+        vchLong.push_back(0);
+        BOOST_CHECK(CheckBoth(keyPub, hash, vchLong));
+        vector<unsigned char> vchShort(vchSig.begin(), vchSig.end() - 1);
+        BOOST_CHECK(!CheckBoth(keyPub, hash, vchShort));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_encoding)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    uint256 hash = RandomHash();
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(hash, vchSig));
+
+    unsigned char pchR[32], pchS[32];
+    DecodeSig(vchSig, pchR, pchS);
+    BOOST_CHECK(EncodeSig(pchR, pchS) == vchSig);
+
+    // s and n - s are both valid
+    unsigned char pchNegS[32];
+    NegateMod(pchNegS, pchS);
+    BOOST_CHECK(CheckBoth(key, hash, EncodeSig(pchR, pchNegS)));
+
+    // Padding with zeros isn't DER, but older OpenSSL took it
+    vector<unsigned char> vchPadded = EncodeSig(pchR, pchS, 1, 0);
+    BOOST_CHECK(!Secp256k1IsStrictSignature(&vchPadded[0], vchPadded.size()));
+    BOOST_CHECK(CheckBoth(key, hash, vchPadded));
+    BOOST_CHECK(CheckBoth(key, hash, EncodeSig(pchR, pchS, 0, 2)));
+
+    // Nor is a long form length
+    vector<unsigned char> vchLongForm;
+    vchLongForm.push_back(0x30);
+    vchLongForm.push_back(0x81);
+    vchLongForm.push_back(vchSig[1]);
+    vchLongForm.insert(vchLongForm.end(), vchSig.begin() + 2, vchSig.end());
+    BOOST_CHECK(!Secp256k1IsStrictSignature(&vchLongForm[0], vchLongForm.size()));
+    BOOST_CHECK(CheckBoth(key, hash, vchLongForm));
+
+    // r and s out of range
+    unsigned char pchZero[32] = { 0 };
+    unsigned char pchOne[32] = { 0 };
+    pchOne[31] = 1;
+    unsigned char pchMax[32];
+    memset(pchMax, 0xff, sizeof(pchMax));
+    BOOST_CHECK(!CheckBoth(key, hash, EncodeSig(pchZero, pchS)));
+    BOOST_CHECK(!CheckBoth(key, hash, EncodeSig(pchR, pchZero)));
+    BOOST_CHECK(!CheckBoth(key, hash, EncodeSig(pchOrder, pchS)));
+    BOOST_CHECK(!CheckBoth(key, hash, EncodeSig(pchR, pchOrder)));
+    BOOST_CHECK(!CheckBoth(key, hash, EncodeSig(pchMax, pchS)));
+    BOOST_CHECK(!CheckBoth(key, hash, EncodeSig(pchOne, pchOne)));
+
+    // Empty and truncated
+    BOOST_CHECK(!CheckBoth(key, hash, vector<unsigned char>()));
+    BOOST_CHECK(!CheckBoth(key, hash, vector<unsigned char>(vchSig.begin(), vchSig.begin() + 2)));
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_ber)
+{
+    // Signatures ECDSA_verify took before OpenSSL 1.0.1k, which blocks
+    // already hold; Verify has to pass them whatever OpenSSL is linked in
+    CKey key;
+    key.MakeNewKey(false);
+    uint256 hash = RandomHash();
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    unsigned char pchR[32], pchS[32];
+    DecodeSig(vchSig, pchR, pchS);
+
+    // Use whichever of s and n - s has its top bit set, so DER puts a zero
+    // in front of it
+    if (!(pchS[0] & 0x80))
+    {
+        unsigned char pchNegS[32];
+        NegateMod(pchNegS, pchS);
+        memcpy(pchS, pchNegS, 32);
+    }
+    vector<unsigned char> vchR, vchS;
+    PushInteger(vchR, pchR);
+    PushInteger(vchS, pchS);
+    vector<unsigned char> vchContentR(vchR.begin() + 2, vchR.end());
+    vector<unsigned char> vchContentS(vchS.begin() + 2, vchS.end());
+    BOOST_CHECK(vchContentS.size() == 33);
+    vector<unsigned char> vchBody = vchR + vchS;
+    BOOST_CHECK(CheckBoth(key, hash, BER(0x30, Length(vchBody.size()), vchBody)));
+
+    vector<unsigned char> vchEOC(2, 0);
+    vector<unsigned char> vchGarbage;
+    vchGarbage.push_back(0x01);
+    vchGarbage.push_back(0x30);
+
+    vector<vector<unsigned char> > vGood;
+    // Bytes after the SEQUENCE
+    vGood.push_back(BER(0x30, Length(vchBody.size()), vchBody) + vchGarbage);
+    vGood.push_back(BER(0x30, Length(vchBody.size()), vchBody) + vchEOC);
+    // Long form lengths, with leading zero bytes too
+    vGood.push_back(BER(0x30, Length(vchBody.size(), 1), vchBody));
+    vGood.push_back(BER(0x30, Length(vchBody.size(), 4), vchBody));
+    vector<unsigned char> vchLongR = BER(0x02, Length(vchContentR.size(), 1), vchContentR);
+    vector<unsigned char> vchLongS = BER(0x02, Length(vchContentS.size(), 3), vchContentS);
+    vGood.push_back(BER(0x30, Length(vchLongR.size() + vchLongS.size(), 2), vchLongR + vchLongS));
+    // Integers padded with zeros
+    vector<unsigned char> vchPaddedR = BER(0x02, Length(vchContentR.size() + 3), vector<unsigned char>(3, 0) + vchContentR);
+    vGood.push_back(BER(0x30, Length(vchPaddedR.size() + vchS.size()), vchPaddedR + vchS));
+    // s without the zero DER needs, which reads as negative, but older
+    // OpenSSL read it as a plain unsigned number
+    vector<unsigned char> vchNegS = BER(0x02, Length(32), vector<unsigned char>(vchContentS.begin() + 1, vchContentS.end()));
+    vGood.push_back(BER(0x30, Length(vchR.size() + vchNegS.size()), vchR + vchNegS));
+    // Indefinite length SEQUENCE, ended by two zero bytes
+    vGood.push_back(BER(0x30, vector<unsigned char>(1, 0x80), vchBody + vchEOC));
+    vGood.push_back(BER(0x30, vector<unsigned char>(1, 0x80), vchBody + vchEOC + vchGarbage));
+    // The INTEGER tag in the high tag number form
+    vector<unsigned char> vchTagR(1, 0x1f);
+    vchTagR.push_back(0x80);
+    vchTagR.push_back(0x02);
+    vchTagR = vchTagR + Length(vchContentR.size()) + vchContentR;
+    vGood.push_back(BER(0x30, Length(vchTagR.size() + vchS.size()), vchTagR + vchS));
+
+    BOOST_FOREACH(const vector<unsigned char>& vch, vGood)
+    {
+        BOOST_CHECK_MESSAGE(key.Verify(hash, vch), HexStr(vch));
+        BOOST_CHECK(!Secp256k1IsStrictSignature(&vch[0], vch.size()));
+        BOOST_CHECK(Secp256k1IsLaxSignature(&vch[0], vch.size()));
+        BOOST_CHECK(!key.Verify(RandomHash(), vch));
+    }
+
+    vector<vector<unsigned char> > vBad;
+    // Anything left inside a definite length SEQUENCE
+    vBad.push_back(BER(0x30, Length(vchBody.size() + 1), vchBody + vector<unsigned char>(1, 0)));
+    // Lengths running past the end, or with more bytes than a long
+    vBad.push_back(BER(0x30, Length(vchBody.size() + 1), vchBody));
+    vBad.push_back(BER(0x30, Length(vchBody.size(), 9), vchBody));
+    // Indefinite length SEQUENCE with no end, or INTEGER
+    vBad.push_back(BER(0x30, vector<unsigned char>(1, 0x80), vchBody));
+    vector<unsigned char> vchIndefR = BER(0x02, vector<unsigned char>(1, 0x80), vchContentR + vchEOC);
+    vBad.push_back(BER(0x30, Length(vchIndefR.size() + vchS.size()), vchIndefR + vchS));
+    // Constructed INTEGER
+    vector<unsigned char> vchConsR = BER(0x22, Length(vchContentR.size()), vchContentR);
+    vBad.push_back(BER(0x30, Length(vchConsR.size() + vchS.size()), vchConsR + vchS));
+    // r + 2^256, more than 32 bytes once the zeros are gone
+    vector<unsigned char> vchBigR = BER(0x02, Length(33), vector<unsigned char>(1, 0x01) + vector<unsigned char>(pchR, pchR + 32));
+    vBad.push_back(BER(0x30, Length(vchBigR.size() + vchS.size()), vchBigR + vchS));
+
+    BOOST_FOREACH(const vector<unsigned char>& vch, vBad)
+    {
+        BOOST_CHECK_MESSAGE(!key.Verify(hash, vch), HexStr(vch));
+        BOOST_CHECK(!Secp256k1IsLaxSignature(&vch[0], vch.size()));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_pubkey)
+{
+    for (int i = 0; i < 50; i++)
+    {
+        CKey key;
+        key.MakeNewKey(false);
+        vector<unsigned char> vchPubKey = key.GetPubKey();
+        BOOST_CHECK(vchPubKey.size() == 65);
+        CSecp256k1PubKey pubkey;
+        BOOST_CHECK(pubkey.SetPubKey(&vchPubKey[0], vchPubKey.size()));
+
+        // Compressed and hybrid forms give the same point
+        vector<unsigned char> vchCompressed(vchPubKey.begin(), vchPubKey.begin() + 33);
+        vchCompressed[0] = 0x02 | (vchPubKey[64] & 1);
+        CSecp256k1PubKey pubkeyCompressed;
+        BOOST_CHECK(pubkeyCompressed.SetPubKey(&vchCompressed[0], vchCompressed.size()));
+        BOOST_CHECK(memcmp(&pubkey, &pubkeyCompressed, sizeof(pubkey)) == 0);
+
+        vector<unsigned char> vchHybrid(vchPubKey);
+        vchHybrid[0] = 0x06 | (vchPubKey[64] & 1);
+        BOOST_CHECK(pubkeyCompressed.SetPubKey(&vchHybrid[0], vchHybrid.size()));
+        BOOST_CHECK(memcmp(&pubkey, &pubkeyCompressed, sizeof(pubkey)) == 0);
+        vchHybrid[0] ^= 1;
+        BOOST_CHECK(!pubkeyCompressed.SetPubKey(&vchHybrid[0], vchHybrid.size()));
+
+        // Off the curve, wrong sizes and prefixes
+        vector<unsigned char> vchBad(vchPubKey);
+        vchBad[1 + GetRandInt(64)] ^= 1 << GetRandInt(8);
+        BOOST_CHECK(!pubkeyCompressed.SetPubKey(&vchBad[0], vchBad.size()));
+        BOOST_CHECK(!pubkeyCompressed.SetPubKey(&vchPubKey[0], 64));
+        vchBad = vchCompressed;
+        vchBad[0] = 0x04;
+        BOOST_CHECK(!pubkeyCompressed.SetPubKey(&vchBad[0], vchBad.size()));
+    }
+
+    // x >= p
+    vector<unsigned char> vchHighX(33, 0xff);
+    vchHighX[0] = 0x02;
+    CSecp256k1PubKey pubkey;
+    BOOST_CHECK(!pubkey.SetPubKey(&vchHighX[0], vchHighX.size()));
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_r_above_order)
+{
+    // x(R) lands in [n, p) for about one signature in 2^128, so build one:
+    // choose R with x = n + c for some c > 0, then the public key Q = r^-1 (sR - mG) that
+    // makes (r, s) a signature of m, where r = x - n
+    EC_GROUP* group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+    BN_CTX* ctx = BN_CTX_new();
+    BIGNUM* order = BN_new();
+    BIGNUM* x = BN_new();
+    BIGNUM* r = BN_new();
+    BIGNUM* s = BN_new();
+    BIGNUM* m = BN_new();
+    BIGNUM* t = BN_new();
+    EC_POINT* R = EC_POINT_new(group);
+    EC_POINT* Q = EC_POINT_new(group);
+    EC_GROUP_get_order(group, order, ctx);
+
+    BN_copy(x, order);
+    BN_add_word(x, 1);
+    while (!EC_POINT_set_compressed_coordinates_GFp(group, R, x, 0, ctx))
+        BN_add_word(x, 1);
+    BN_sub(r, x, order);
+
+    uint256 hash = RandomHash();
+    unsigned char pchHash[32];
+    memcpy(pchHash, &hash, 32);
+    BN_bin2bn(pchHash, 32, m);
+    BN_set_word(s, 12345);
+
+    // Q = r^-1 (sR - mG)
+    BN_mod_sub(t, order, m, order, ctx);
+    EC_POINT_mul(group, Q, t, R, s, ctx);
+    BN_mod_inverse(t, r, order, ctx);
+    EC_POINT_mul(group, Q, NULL, Q, t, ctx);
+
+    unsigned char pchPubKey[65];
+    BOOST_CHECK(EC_POINT_point2oct(group, Q, POINT_CONVERSION_UNCOMPRESSED, pchPubKey, 65, ctx) == 65);
+    CKey key;
+    BOOST_CHECK(key.SetPubKey(vector<unsigned char>(pchPubKey, pchPubKey + 65)));
+
+    unsigned char pchR[32] = { 0 }, pchS[32] = { 0 };
+    BN_bn2bin(r, pchR + 32 - BN_num_bytes(r));
+    BN_bn2bin(s, pchS + 32 - BN_num_bytes(s));
+    BOOST_CHECK(CheckBoth(key, hash, EncodeSig(pchR, pchS)));
+
+    // and r + 1 must still fail
+    pchR[31]++;
+    BOOST_CHECK(!CheckBoth(key, hash, EncodeSig(pchR, pchS)));
+
+    EC_POINT_free(Q);
+    EC_POINT_free(R);
+    BN_free(t);
+    BN_free(m);
+    BN_free(s);
+    BN_free(r);
+    BN_free(x);
+    BN_free(order);
+    BN_CTX_free(ctx);
+    EC_GROUP_free(group);
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_batch)
+{
+    // More than one chunk, with keys repeating
+    vector<CKey> vKeys(20);
+    for (unsigned int i = 0; i < vKeys.size(); i++)
+        vKeys[i].MakeNewKey(i % 2 == 0);
+    vector<CSecp256k1BatchEntry> vEntries(150);
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+    {
+        CKey& key = vKeys[GetRandInt(vKeys.size())];
+        uint256 hash = RandomHash();
+        BOOST_CHECK(key.Sign(hash, vEntries[i].vchSig));
+        memcpy(vEntries[i].pchHash, &hash, 32);
+        vector<unsigned char> vchPubKey = key.GetPubKey();
+        BOOST_CHECK(vEntries[i].pubkey.SetPubKey(&vchPubKey[0], vchPubKey.size()));
+    }
+    BOOST_CHECK(Secp256k1VerifyBatch(vEntries));
+    BOOST_CHECK(Secp256k1VerifyBatch(vector<CSecp256k1BatchEntry>()));
+    BOOST_CHECK(Secp256k1VerifyBatch(vector<CSecp256k1BatchEntry>(vEntries.begin(), vEntries.begin() + 1)));
+
+    // Any one entry going bad fails the lot
+    for (int i = 0; i < 20; i++)
+    {
+        vector<CSecp256k1BatchEntry> vBad(vEntries);
+        CSecp256k1BatchEntry& entry = vBad[GetRandInt(vBad.size())];
+        switch (i % 4)
+        {
+        case 0: entry.pchHash[GetRandInt(32)] ^= 1 << GetRandInt(8); break;
+        case 1: entry.vchSig[GetRandInt(entry.vchSig.size())] ^= 1 << GetRandInt(8); break;
+        case 2: entry.vchSig.clear(); break;
+        case 3: entry.pubkey = vEntries[(&entry - &vBad[0] + 1) % vEntries.size()].pubkey; break;
+        }
+        bool fAll = true;
+        BOOST_FOREACH(const CSecp256k1BatchEntry& e, vBad)
+            fAll = fAll && Secp256k1Verify(e.pchHash, e.vchSig.empty() ? NULL : &e.vchSig[0], e.vchSig.size(), e.pubkey);
+        BOOST_CHECK_EQUAL(Secp256k1VerifyBatch(vBad), fAll);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
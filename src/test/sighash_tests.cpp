@@ -0,0 +1,147 @@
+#include <vector>
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "main.h"
+#include "wallet.h"
+
+using namespace std;
+
+extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+
+// SignatureHash() as it was before CSignatureHasher: copy the transaction,
+// blank it out and serialize the copy
+static uint256 SignatureHashOld(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    if (nIn >= txTo.vin.size())
+        return 1;
+    CTransaction txTmp(txTo);
+
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    for (int i = 0; i < txTmp.vin.size(); i++)
+        txTmp.vin[i].scriptSig = CScript();
+    txTmp.vin[nIn].scriptSig = scriptCode;
+
+    if ((nHashType & 0x1f) == SIGHASH_NONE)
+    {
+        txTmp.vout.clear();
+        for (int i = 0; i < txTmp.vin.size(); i++)
+            if (i != nIn)
+                txTmp.vin[i].nSequence = 0;
+    }
+    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+    {
+        unsigned int nOut = nIn;
+        if (nOut >= txTmp.vout.size())
+            return 1;
+        txTmp.vout.resize(nOut+1);
+        for (int i = 0; i < nOut; i++)
+            txTmp.vout[i].SetNull();
+        for (int i = 0; i < txTmp.vin.size(); i++)
+            if (i != nIn)
+                txTmp.vin[i].nSequence = 0;
+    }
+
+    if (nHashType & SIGHASH_ANYONECANPAY)
+    {
+        txTmp.vin[0] = txTmp.vin[nIn];
+        txTmp.vin.resize(1);
+    }
+
+    CDataStream ss(SER_GETHASH);
+    ss << txTmp << nHashType;
+    return Hash(ss.begin(), ss.end());
+}
+
+static CScript RandomScript()
+{
+    static const opcodetype ops[] = { OP_FALSE, OP_1, OP_2, OP_3, OP_CHECKSIG, OP_IF, OP_VERIF, OP_RETURN, OP_CODESEPARATOR };
+    CScript script;
+    int nOps = GetRandInt(10);
+    for (int i = 0; i < nOps; i++)
+    {
+        if (GetRandInt(3) == 0)
+            script << vector<unsigned char>(GetRandInt(80), GetRandInt(0x100));
+        else
+            script << ops[GetRandInt(sizeof(ops)/sizeof(ops[0]))];
+    }
+    return script;
+}
+
+static void RandomTransaction(CTransaction& tx, int nMaxInputs, int nMaxOutputs)
+{
+    tx.nVersion = GetRandInt(3);
+    tx.vin.clear();
+    tx.vout.clear();
+    tx.nLockTime = GetRandInt(2) ? GetRand(500000000) : 0;
+    int nInputs = GetRandInt(nMaxInputs) + 1;
+    int nOutputs = GetRandInt(nMaxOutputs) + 1;
+    for (int i = 0; i < nInputs; i++)
+    {
+        CTxIn txin;
+        for (unsigned char* pch = txin.prevout.hash.begin(); pch != txin.prevout.hash.end(); pch++)
+            *pch = GetRandInt(0x100);
+        txin.prevout.n = GetRandInt(4);
+        txin.scriptSig = RandomScript();
+        txin.nSequence = GetRandInt(2) ? GetRand(0x100000000LL) : numeric_limits<unsigned int>::max();
+        tx.vin.push_back(txin);
+    }
+    for (int i = 0; i < nOutputs; i++)
+    {
+        CTxOut txout;
+        txout.nValue = GetRand(100000000);
+        txout.scriptPubKey = RandomScript();
+        tx.vout.push_back(txout);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(sighash_tests)
+
+BOOST_AUTO_TEST_CASE(sighash_random)
+{
+    // Every hash type's low bits, with and without SIGHASH_ANYONECANPAY,
+    // over random transactions and scriptCodes
+    for (int i = 0; i < 500; i++)
+    {
+        CTransaction txTo;
+        RandomTransaction(txTo, 8, 8);
+        CScript scriptCode = RandomScript();
+        int nHashType = GetRandInt(4) | (GetRandInt(2) ? SIGHASH_ANYONECANPAY : 0);
+        if (GetRandInt(10) == 0)
+            nHashType = GetRandInt(0x100) | (GetRandInt(0x10000) << 8);
+        unsigned int nIn = GetRandInt(txTo.vin.size());
+
+        BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, nHashType) == SignatureHashOld(scriptCode, txTo, nIn, nHashType));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sighash_hasher)
+{
+    // One hasher answering for every input in a random order, including
+    // after the scriptSigs change the way they do while signing
+    for (int i = 0; i < 50; i++)
+    {
+        CTransaction txTo;
+        RandomTransaction(txTo, 300, 3);
+        CSignatureHasher hasher(txTo);
+        for (int j = 0; j < 40; j++)
+        {
+            CScript scriptCode = RandomScript();
+            int nHashType = GetRandInt(4) | (GetRandInt(4) == 0 ? SIGHASH_ANYONECANPAY : 0);
+            unsigned int nIn = GetRandInt(txTo.vin.size());
+            BOOST_CHECK(hasher.SignatureHash(scriptCode, nIn, nHashType) == SignatureHashOld(scriptCode, txTo, nIn, nHashType));
+            txTo.vin[GetRandInt(txTo.vin.size())].scriptSig = RandomScript();
+        }
+    }
+
+    // Out of range inputs, and SIGHASH_SINGLE without a matching output
+    CTransaction txTo;
+    RandomTransaction(txTo, 1, 1);
+    txTo.vin.resize(2);
+    CSignatureHasher hasher(txTo);
+    BOOST_CHECK(hasher.SignatureHash(CScript(), 2, SIGHASH_ALL) == 1);
+    BOOST_CHECK(hasher.SignatureHash(CScript(), 1, SIGHASH_SINGLE) == 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -2,6 +2,8 @@
 #include <boost/test/unit_test.hpp>
 #include <boost/foreach.hpp>
 
+#include "main.h"
+#include "wallet.h"
 #include "script.h"
 #include "key.h"
 
@@ -57,4 +59,28 @@ BOOST_AUTO_TEST_CASE(GetSigOpCount)
     BOOST_CHECK_EQUAL(p2sh.GetSigOpCount(scriptSig2), 3);
 }
 
+BOOST_AUTO_TEST_CASE(CBlock_GetTxSigOpCounts)
+{
+    CBlock block;
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey << OP_CHECKSIG << OP_CHECKSIG;
+    block.vtx.push_back(tx);
+    tx.vout[0].scriptPubKey << OP_CHECKMULTISIG;
+    block.vtx.push_back(tx);
+
+    const std::vector<int>& vSigOps = block.GetTxSigOpCounts();
+    BOOST_CHECK_EQUAL(vSigOps.size(), 2U);
+    BOOST_CHECK_EQUAL(vSigOps[0], 2);
+    BOOST_CHECK_EQUAL(vSigOps[1], 22);
+
+    // Recounted when the transactions change
+    block.vtx.push_back(CTransaction());
+    BOOST_CHECK_EQUAL(block.GetTxSigOpCounts().size(), 3U);
+    BOOST_CHECK_EQUAL(block.GetTxSigOpCounts()[2], 0);
+    block.SetNull();
+    BOOST_CHECK(block.GetTxSigOpCounts().empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -29,6 +29,7 @@ bool fServer = false;
 bool fCommandLine = false;
 string strMiscWarning;
 bool fTestNet = false;
+bool fRegTest = false;
 bool fNoListen = false;
 bool fLogTimestamps = false;
 CMedianFilter<int64> vTimeOffsets(200,0);
@@ -146,6 +147,64 @@ int GetRandInt(int nMax)
     return GetRand(nMax);
 }
 
+inline unsigned int ROTL32(unsigned int x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+unsigned int MurmurHash3(unsigned int nHashSeed, const unsigned char* pch, unsigned int nSize)
+{
+    // The following is MurmurHash3 (x86_32), see http://code.google.com/p/smhasher/source/browse/trunk/MurmurHash3.cpp
+    unsigned int h1 = nHashSeed;
+    const unsigned int c1 = 0xcc9e2d51;
+    const unsigned int c2 = 0x1b873593;
+
+    const int nblocks = nSize / 4;
+
+    //----------
+    // body
+    for (int i = 0; i < nblocks; i++)
+    {
+        unsigned int k1 = pch[4*i] | (pch[4*i+1] << 8) | (pch[4*i+2] << 16) | (pch[4*i+3] << 24);
+
+        k1 *= c1;
+        k1 = ROTL32(k1, 15);
+        k1 *= c2;
+
+        h1 ^= k1;
+        h1 = ROTL32(h1, 13);
+        h1 = h1*5+0xe6546b64;
+    }
+
+    //----------
+    // tail
+    const unsigned char* tail = pch + nblocks*4;
+
+    unsigned int k1 = 0;
+
+    switch (nSize & 3)
+    {
+        case 3: k1 ^= tail[2] << 16;
+        case 2: k1 ^= tail[1] << 8;
+        case 1: k1 ^= tail[0];
+                k1 *= c1;
+                k1 = ROTL32(k1, 15);
+                k1 *= c2;
+                h1 ^= k1;
+    };
+
+    //----------
+    // finalization
+    h1 ^= nSize;
+    h1 ^= h1 >> 16;
+    h1 *= 0x85ebca6b;
+    h1 ^= h1 >> 13;
+    h1 *= 0xc2b2ae35;
+    h1 ^= h1 >> 16;
+
+    return h1;
+}
+
 
 
 
@@ -847,10 +906,10 @@ void GetDataDir(char* pszDir)
         char* p = pszDir + strlen(pszDir);
         if (p > pszDir && p[-1] != '/' && p[-1] != '\\')
             *p++ = '/';
-        strcpy(p, "testnet");
-        nVariation += 2;
+        strcpy(p, fRegTest ? "regtest" : "testnet");
+        nVariation += fRegTest ? 4 : 2;
     }
-    static bool pfMkdir[4];
+    static bool pfMkdir[6];
     if (!pfMkdir[nVariation])
     {
         pfMkdir[nVariation] = true;
@@ -944,6 +1003,27 @@ int GetFilesize(FILE* file)
     return nFilesize;
 }
 
+// Flush a file all the way to the disk, not just to the OS
+void FileCommit(FILE* file)
+{
+    fflush(file);
+#ifdef WIN32
+    _commit(_fileno(file));
+#else
+    fsync(fileno(file));
+#endif
+}
+
+// Rename strSrc to strDest, replacing strDest if it exists
+bool RenameOver(const string& strSrc, const string& strDest)
+{
+#ifdef WIN32
+    return MoveFileExA(strSrc.c_str(), strDest.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(strSrc.c_str(), strDest.c_str()) == 0;
+#endif
+}
+
 void ShrinkDebugFile()
 {
     // Scroll debug.log if it's getting too big
@@ -121,6 +121,7 @@ extern bool fServer;
 extern bool fCommandLine;
 extern std::string strMiscWarning;
 extern bool fTestNet;
+extern bool fRegTest;
 extern bool fNoListen;
 extern bool fLogTimestamps;
 
@@ -148,6 +149,8 @@ void ParseParameters(int argc, const char*const argv[]);
 bool WildcardMatch(const char* psz, const char* mask);
 bool WildcardMatch(const std::string& str, const std::string& mask);
 int GetFilesize(FILE* file);
+void FileCommit(FILE* file);
+bool RenameOver(const std::string& strSrc, const std::string& strDest);
 void GetDataDir(char* pszDirRet);
 std::string GetConfigFile();
 std::string GetPidFile();
@@ -365,6 +368,12 @@ inline int64 GetTimeMillis()
             boost::posix_time::ptime(boost::gregorian::date(1970,1,1))).total_milliseconds();
 }
 
+inline int64 GetTimeMicros()
+{
+    return (boost::posix_time::ptime(boost::posix_time::microsec_clock::universal_time()) -
+            boost::posix_time::ptime(boost::gregorian::date(1970,1,1))).total_microseconds();
+}
+
 inline std::string DateTimeStrFormat(const char* pszFormat, int64 nTime)
 {
     time_t n = nTime;
@@ -514,15 +523,22 @@ uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL
     return Hash(ss.begin(), ss.end());
 }
 
-inline uint160 Hash160(const std::vector<unsigned char>& vch)
+inline uint160 Hash160(const unsigned char* pbegin, const unsigned char* pend)
 {
     uint256 hash1;
-    SHA256(&vch[0], vch.size(), (unsigned char*)&hash1);
+    SHA256(pbegin, pend - pbegin, (unsigned char*)&hash1);
     uint160 hash2;
     RIPEMD160((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
     return hash2;
 }
 
+inline uint160 Hash160(const std::vector<unsigned char>& vch)
+{
+    return Hash160(&vch[0], &vch[0] + vch.size());
+}
+
+unsigned int MurmurHash3(unsigned int nHashSeed, const unsigned char* pch, unsigned int nSize);
+
 
 /** Median filter over a stream of values. 
  * Returns the median of the last N numbers